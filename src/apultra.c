@@ -38,14 +38,24 @@
 #include <sys/timeb.h>
 #else
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #endif
 #include "libapultra.h"
+#include "dirlist.h"
+#include "emulate.h"
+#include "thread.h"
 
 #define OPT_VERBOSE 1
 #define OPT_STATS 2
 #define OPT_BACKWARD 4
+#define OPT_FAST 8
 
-#define TOOL_VERSION "1.4.0"
+#define MAX_WINDOW_SIZES 16 /* window sizes in one -wlist */
+
+#define TOOL_VERSION APULTRA_VERSION
 
 /*---------------------------------------------------------------------------*/
 
@@ -99,6 +109,191 @@ static void do_reverse_buffer(unsigned char *pBuffer, size_t nBufferSize) {
 
 /*---------------------------------------------------------------------------*/
 
+/** Dictionary index file, mapped in memory */
+typedef struct {
+    apultra_dictionary_index index;
+    void *data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE mapping;
+#endif
+} dictionary_index_file;
+
+static void do_close_dictionary_index(dictionary_index_file *pFile) {
+#ifdef _WIN32
+    if (pFile->data) UnmapViewOfFile(pFile->data);
+    if (pFile->mapping) CloseHandle(pFile->mapping);
+    pFile->mapping = NULL;
+#else
+    if (pFile->data) munmap(pFile->data, pFile->size);
+#endif
+    pFile->data = NULL;
+    pFile->size = 0;
+}
+
+static int do_open_dictionary_index(const char *pszFilename,
+    const unsigned int nOptions,
+    dictionary_index_file *pFile) {
+    pFile->data = NULL;
+    pFile->size = 0;
+
+#ifdef _WIN32
+    HANDLE hFile =
+        CreateFileA(pszFilename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER nFileSize;
+
+    pFile->mapping = NULL;
+    if (hFile == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "error opening dictionary index '%s' for reading\n", pszFilename);
+        return 100;
+    }
+
+    if (GetFileSizeEx(hFile, &nFileSize) && nFileSize.QuadPart > 0) {
+        pFile->size = (size_t)nFileSize.QuadPart;
+        pFile->mapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (pFile->mapping) pFile->data = MapViewOfFile(pFile->mapping, FILE_MAP_READ, 0, 0, 0);
+    }
+
+    CloseHandle(hFile);
+#else
+    int fd = open(pszFilename, O_RDONLY);
+    struct stat st;
+
+    if (fd < 0) {
+        fprintf(stderr, "error opening dictionary index '%s' for reading\n", pszFilename);
+        return 100;
+    }
+
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        pFile->size = (size_t)st.st_size;
+        pFile->data = mmap(NULL, pFile->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (pFile->data == MAP_FAILED) pFile->data = NULL;
+    }
+
+    close(fd);
+#endif
+
+    if (!pFile->data) {
+        do_close_dictionary_index(pFile);
+        fprintf(stderr, "error mapping dictionary index '%s'\n", pszFilename);
+        return 100;
+    }
+
+    if (apultra_open_dictionary_index((const unsigned char *)pFile->data, pFile->size, &pFile->index)) {
+        do_close_dictionary_index(pFile);
+        fprintf(stderr, "invalid dictionary index '%s'\n", pszFilename);
+        return 100;
+    }
+
+    if (((pFile->index.flags & APULTRA_DICTIONARY_INDEX_BACKWARD) != 0) != ((nOptions & OPT_BACKWARD) != 0)) {
+        fprintf(stderr,
+            "dictionary index '%s' was built %s -b\n",
+            pszFilename,
+            (pFile->index.flags & APULTRA_DICTIONARY_INDEX_BACKWARD) ? "with" : "without");
+        do_close_dictionary_index(pFile);
+        return 100;
+    }
+
+    return 0;
+}
+
+static int do_build_dictionary_index(const char *pszInFilename,
+    const char *pszOutFilename,
+    const unsigned int nOptions) {
+    long long nStartTime = 0LL, nEndTime = 0LL;
+    size_t nDictionarySize, nMaxIndexSize, nIndexSize;
+    unsigned char *pDictionaryData;
+    unsigned char *pIndexData;
+    FILE *f_in, *f_out;
+
+    if (nOptions & OPT_VERBOSE) { nStartTime = do_get_time(); }
+
+    /* Read the dictionary in memory, up to the size that -D uses */
+
+    f_in = fopen(pszInFilename, "rb");
+    if (!f_in) {
+        fprintf(stderr, "error opening dictionary '%s' for reading\n", pszInFilename);
+        return 100;
+    }
+
+    fseek(f_in, 0, SEEK_END);
+    nDictionarySize = (size_t)ftell(f_in);
+    fseek(f_in, 0, SEEK_SET);
+
+    if (nDictionarySize > BLOCK_SIZE) nDictionarySize = BLOCK_SIZE;
+    if (!nDictionarySize) {
+        fclose(f_in);
+        fprintf(stderr, "dictionary '%s' is empty\n", pszInFilename);
+        return 100;
+    }
+
+    pDictionaryData = (unsigned char *)malloc(nDictionarySize);
+    if (!pDictionaryData) {
+        fclose(f_in);
+        fprintf(stderr, "out of memory for reading '%s', %zd bytes needed\n", pszInFilename, nDictionarySize);
+        return 100;
+    }
+
+    if (fread(pDictionaryData, 1, nDictionarySize, f_in) != nDictionarySize) {
+        free(pDictionaryData);
+        fclose(f_in);
+        fprintf(stderr, "I/O error while reading dictionary '%s'\n", pszInFilename);
+        return 100;
+    }
+
+    fclose(f_in);
+
+    /* Backward compression reverses the input and the dictionary behind it together, which puts the reversed
+     * dictionary in front */
+    if (nOptions & OPT_BACKWARD) do_reverse_buffer(pDictionaryData, nDictionarySize);
+
+    nMaxIndexSize = apultra_get_max_dictionary_index_size(nDictionarySize);
+    pIndexData = (unsigned char *)malloc(nMaxIndexSize);
+    if (!pIndexData) {
+        free(pDictionaryData);
+        fprintf(stderr, "out of memory for indexing '%s', %zd bytes needed\n", pszInFilename, nMaxIndexSize);
+        return 100;
+    }
+
+    nIndexSize = apultra_build_dictionary_index(pDictionaryData,
+        nDictionarySize,
+        pIndexData,
+        nMaxIndexSize,
+        (nOptions & OPT_BACKWARD) ? APULTRA_DICTIONARY_INDEX_BACKWARD : 0);
+    free(pDictionaryData);
+
+    if (nIndexSize == -1) {
+        free(pIndexData);
+        fprintf(stderr, "error indexing dictionary '%s'\n", pszInFilename);
+        return 100;
+    }
+
+    f_out = fopen(pszOutFilename, "wb");
+    if (!f_out || fwrite(pIndexData, 1, nIndexSize, f_out) != nIndexSize) {
+        if (f_out) fclose(f_out);
+        free(pIndexData);
+        fprintf(stderr, "error writing dictionary index '%s'\n", pszOutFilename);
+        return 100;
+    }
+
+    fclose(f_out);
+    free(pIndexData);
+
+    if (nOptions & OPT_VERBOSE) {
+        nEndTime = do_get_time();
+        fprintf(stdout,
+            "Indexed dictionary '%s' in %g seconds, %zd bytes into %zd bytes\n",
+            pszInFilename,
+            ((double)(nEndTime - nStartTime)) / 1000000.0,
+            nDictionarySize,
+            nIndexSize);
+    }
+
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
 static void compression_progress(long long nOriginalSize, long long nCompressedSize) {
     if (nOriginalSize >= 512 * 1024) {
         fprintf(stdout,
@@ -113,13 +308,21 @@ static void compression_progress(long long nOriginalSize, long long nCompressedS
 static int do_compress(const char *pszInFilename,
     const char *pszOutFilename,
     const char *pszDictionaryFilename,
+    const apultra_dictionary_index *pDictionaryIndex,
+    apultra_cache *pCache,
     const unsigned int nOptions,
-    const unsigned int nMaxWindowSize) {
+    const unsigned int nMaxWindowSize,
+    const int nThreads) {
     long long nStartTime = 0LL, nEndTime = 0LL;
     size_t nOriginalSize = 0L, nCompressedSize = 0L, nMaxCompressedSize;
-    int nFlags = 0;
+    size_t nSequentialSize = 0L;
+    int nFlags = (nThreads & APULTRA_FLAG_THREADS_MASK) | ((nOptions & OPT_FAST) ? APULTRA_FLAG_FAST_PARSE : 0);
+    long long nCacheHits = pCache ? pCache->stats.num_hits : 0;
     apultra_stats stats;
+    apultra_input_segment segments[2];
     unsigned char *pDecompressedData;
+    unsigned char *pDictionaryData = NULL;
+    unsigned char *pInputData;
     unsigned char *pCompressedData;
 
     if (nOptions & OPT_VERBOSE) { nStartTime = do_get_time(); }
@@ -140,6 +343,8 @@ static int do_compress(const char *pszInFilename,
         fseek(f_dict, 0, SEEK_SET);
 
         if (nDictionarySize > BLOCK_SIZE) nDictionarySize = BLOCK_SIZE;
+    } else if (pDictionaryIndex) {
+        nDictionarySize = (size_t)pDictionaryIndex->size;
     }
 
     /* Read the whole original file in memory */
@@ -155,18 +360,29 @@ static int do_compress(const char *pszInFilename,
     nOriginalSize = (size_t)ftell(f_in);
     fseek(f_in, 0, SEEK_SET);
 
-    pDecompressedData = (unsigned char *)malloc(nDictionarySize + nOriginalSize);
-    if (!pDecompressedData) {
+    /* The dictionary and the input are compressed as separate segments, except for -Di and -cache, that compress
+     * them from one buffer; backward compression reverses each of them, and compresses the dictionary first too */
+    if (pDictionaryIndex || pCache) {
+        pDecompressedData = (unsigned char *)malloc(nDictionarySize + nOriginalSize);
+        pDictionaryData = pDecompressedData;
+    } else {
+        pDecompressedData = (unsigned char *)malloc(nOriginalSize ? nOriginalSize : 1);
+        pDictionaryData = nDictionarySize ? (unsigned char *)malloc(nDictionarySize) : NULL;
+    }
+    if (!pDecompressedData || (nDictionarySize && !pDictionaryData)) {
+        if (pDictionaryData && pDictionaryData != pDecompressedData) free(pDictionaryData);
+        if (pDecompressedData) free(pDecompressedData);
         fclose(f_in);
         if (f_dict) fclose(f_dict);
         fprintf(stderr, "out of memory for reading '%s', %zd bytes needed\n", pszInFilename, nOriginalSize);
         return 100;
     }
+    pInputData = (pDictionaryData == pDecompressedData) ? (pDecompressedData + nDictionarySize) : pDecompressedData;
 
     if (f_dict) {
         /* Read dictionary data */
-        if (fread(pDecompressedData + ((nOptions & OPT_BACKWARD) ? nOriginalSize : 0), 1, nDictionarySize, f_dict)
-            != nDictionarySize) {
+        if (fread(pDictionaryData, 1, nDictionarySize, f_dict) != nDictionarySize) {
+            if (pDictionaryData != pDecompressedData) free(pDictionaryData);
             free(pDecompressedData);
             fclose(f_in);
             fclose(f_dict);
@@ -176,11 +392,16 @@ static int do_compress(const char *pszInFilename,
 
         fclose(f_dict);
         f_dict = NULL;
+
+        if (nOptions & OPT_BACKWARD) do_reverse_buffer(pDictionaryData, nDictionarySize);
+    } else if (pDictionaryIndex) {
+        /* The index holds the dictionary as it is compressed against, already reversed for -b */
+        memcpy(pDictionaryData, pDictionaryIndex->dictionary, nDictionarySize);
     }
 
     /* Read input file data */
-    if (fread(pDecompressedData + ((nOptions & OPT_BACKWARD) ? 0 : nDictionarySize), 1, nOriginalSize, f_in)
-        != nOriginalSize) {
+    if (fread(pInputData, 1, nOriginalSize, f_in) != nOriginalSize) {
+        if (pDictionaryData && pDictionaryData != pDecompressedData) free(pDictionaryData);
         free(pDecompressedData);
         fclose(f_in);
         fprintf(stderr, "I/O error while reading '%s'\n", pszInFilename);
@@ -189,7 +410,12 @@ static int do_compress(const char *pszInFilename,
 
     fclose(f_in);
 
-    if (nOptions & OPT_BACKWARD) do_reverse_buffer(pDecompressedData, nDictionarySize + nOriginalSize);
+    if (nOptions & OPT_BACKWARD) do_reverse_buffer(pInputData, nOriginalSize);
+
+    segments[0].data = pDictionaryData;
+    segments[0].size = nDictionarySize;
+    segments[1].data = pInputData;
+    segments[1].size = nOriginalSize;
 
     /* Allocate max compressed size */
 
@@ -197,6 +423,7 @@ static int do_compress(const char *pszInFilename,
 
     pCompressedData = (unsigned char *)malloc(nMaxCompressedSize);
     if (!pCompressedData) {
+        if (pDictionaryData && pDictionaryData != pDecompressedData) free(pDictionaryData);
         free(pDecompressedData);
         fprintf(stderr, "out of memory for compressing '%s', %zd bytes needed\n", pszInFilename, nMaxCompressedSize);
         return 100;
@@ -204,25 +431,82 @@ static int do_compress(const char *pszInFilename,
 
     memset(pCompressedData, 0, nMaxCompressedSize);
 
-    nCompressedSize = apultra_compress(pDecompressedData,
-        pCompressedData,
-        nDictionarySize + nOriginalSize,
-        nMaxCompressedSize,
-        nFlags,
-        nMaxWindowSize,
-        nDictionarySize,
-        compression_progress,
-        &stats);
+    if (pDictionaryIndex) {
+        nCompressedSize = apultra_compress_indexed(pDecompressedData,
+            pCompressedData,
+            nDictionarySize + nOriginalSize,
+            nMaxCompressedSize,
+            nFlags,
+            nMaxWindowSize,
+            pDictionaryIndex,
+            compression_progress,
+            &stats);
+    } else if (pCache) {
+        nCompressedSize = apultra_compress_cached(pCache,
+            pDecompressedData,
+            pCompressedData,
+            nDictionarySize + nOriginalSize,
+            nMaxCompressedSize,
+            nFlags,
+            nMaxWindowSize,
+            nDictionarySize,
+            compression_progress,
+            &stats);
+    } else {
+        nCompressedSize = apultra_compress_iov(segments,
+            2,
+            pCompressedData,
+            nMaxCompressedSize,
+            nFlags,
+            nMaxWindowSize,
+            nDictionarySize,
+            compression_progress,
+            &stats);
+    }
 
     if ((nOptions & OPT_VERBOSE)) { nEndTime = do_get_time(); }
 
     if (nCompressedSize == -1) {
+        if (pDictionaryData && pDictionaryData != pDecompressedData) free(pDictionaryData);
         free(pCompressedData);
         free(pDecompressedData);
         fprintf(stderr, "compression error for '%s'\n", pszInFilename);
         return 100;
     }
 
+    if ((nOptions & OPT_STATS) && nThreads > 1) {
+        /* Compress again with a sequential parse and the same other settings, to report what splitting the parse
+         * into segments costs */
+        const int nSequentialFlags = nFlags & ~APULTRA_FLAG_THREADS_MASK;
+        unsigned char *pSequentialData = (unsigned char *)malloc(nMaxCompressedSize);
+
+        if (pSequentialData) {
+            if (pDictionaryIndex) {
+                nSequentialSize = apultra_compress_indexed(pDecompressedData,
+                    pSequentialData,
+                    nDictionarySize + nOriginalSize,
+                    nMaxCompressedSize,
+                    nSequentialFlags,
+                    nMaxWindowSize,
+                    pDictionaryIndex,
+                    NULL,
+                    NULL);
+            } else {
+                nSequentialSize = apultra_compress_iov(segments,
+                    2,
+                    pSequentialData,
+                    nMaxCompressedSize,
+                    nSequentialFlags,
+                    nMaxWindowSize,
+                    nDictionarySize,
+                    NULL,
+                    NULL);
+            }
+            if (nSequentialSize == -1) nSequentialSize = 0;
+            free(pSequentialData);
+        }
+    }
+
     if (nOptions & OPT_BACKWARD) do_reverse_buffer(pCompressedData, nCompressedSize);
 
     if (pszOutFilename) {
@@ -237,6 +521,7 @@ static int do_compress(const char *pszInFilename,
         }
     }
 
+    if (pDictionaryData && pDictionaryData != pDecompressedData) free(pDictionaryData);
     free(pCompressedData);
     free(pDecompressedData);
 
@@ -253,6 +538,12 @@ static int do_compress(const char *pszInFilename,
             (int)nOriginalSize,
             (int)nCompressedSize,
             (double)(nCompressedSize * 100.0 / nOriginalSize));
+        if (pCache) {
+            fprintf(stdout,
+                "Cache %s in '%s'\n",
+                (pCache->stats.num_hits != nCacheHits) ? "hit" : "miss",
+                pCache->directory);
+        }
     }
 
     if (nOptions & OPT_STATS) {
@@ -302,126 +593,556 @@ static int do_compress(const char *pszInFilename,
             fprintf(stdout, "RLE2 lens: none\n");
         }
         fprintf(stdout, "Safe distance: %d (0x%X)\n", stats.safe_dist, stats.safe_dist);
+        if (pCache) {
+            fprintf(stdout,
+                "Cache: hits: %lld misses: %lld saved: %lld bytes stored: %lld evicted: %lld size: %lld of %lld\n",
+                pCache->stats.num_hits,
+                pCache->stats.num_misses,
+                pCache->stats.bytes_saved,
+                pCache->stats.num_stores,
+                pCache->stats.num_evictions,
+                pCache->stats.size,
+                pCache->max_size);
+        }
+        if (nThreads > 1) {
+            fprintf(stdout,
+                "Parse segments: %d in %d block(s), %d match(es) fixed at segment starts\n",
+                stats.num_segments,
+                stats.num_blocks,
+                stats.num_segment_fixes);
+            if (nSequentialSize) {
+                fprintf(stdout,
+                    "Segmented parse: %zd bytes, sequential parse: %zd bytes (%+lld)\n",
+                    nCompressedSize,
+                    nSequentialSize,
+                    (long long)nCompressedSize - (long long)nSequentialSize);
+            }
+        }
+
+        if (stats.num_positions > 0) {
+            int nMaxArrivals = 0;
+            int i;
+
+            fprintf(stdout,
+                "Optimizer: positions: %lld candidates: %lld (%.2f per position) accepted: %lld (%.2f %%)\n",
+                stats.num_positions,
+                stats.num_insert_attempts,
+                (double)stats.num_insert_attempts / (double)stats.num_positions,
+                stats.num_insert_accepts,
+                (double)stats.num_insert_accepts * 100.0
+                    / (double)(stats.num_insert_attempts ? stats.num_insert_attempts : 1));
+            fprintf(stdout,
+                "Pruned arrivals: %lld (%.2f per position)\n",
+                stats.num_pruned_arrivals,
+                (double)stats.num_pruned_arrivals / (double)stats.num_positions);
+            fprintf(stdout, "Skipped positions in long repeats: %lld\n", stats.num_skipped_positions);
+            fprintf(stdout,
+                "Forward reps: calls: %lld inserted: %lld max depth: %d\n",
+                stats.num_forward_rep_calls,
+                stats.num_forward_rep_inserts,
+                stats.max_forward_rep_depth);
+            fprintf(stdout,
+                "Reduce passes: total: %d avg: %.2f max: %d\n",
+                stats.num_reduce_passes,
+                (double)stats.num_reduce_passes / (double)stats.num_blocks,
+                stats.max_reduce_passes);
+            fprintf(stdout, "Reduce revisits: %lld tokens\n", stats.num_reduce_revisits);
+
+            for (i = 0; i <= NARRIVALS_PER_POSITION_MAX; i++) {
+                if (stats.arrival_histogram[i]) nMaxArrivals = i;
+            }
+
+            fprintf(stdout, "Live arrivals per position:");
+            for (i = 0; i <= nMaxArrivals; i++) {
+                if ((i % 8) == 0) fprintf(stdout, "\n ");
+                fprintf(stdout, " %2d:%9lld", i, stats.arrival_histogram[i]);
+            }
+            fprintf(stdout, "\n");
+        }
+    }
+
+    if ((nOptions & (OPT_VERBOSE | OPT_STATS)) && stats.num_blocks > 0) {
+        static const char *pszPhaseNames[APULTRA_NUM_PHASES] = { "suffix array",
+            "intervals",
+            "find matches",
+            "supplement matches",
+            "forward pass 1",
+            "forward pass 2",
+            "reduce",
+            "write block" };
+        long long nTotalPhaseTime = 0;
+        int i;
+
+        for (i = 0; i < APULTRA_NUM_PHASES; i++) nTotalPhaseTime += stats.phase_time[i];
+        if (nTotalPhaseTime <= 0) nTotalPhaseTime = 1;
+
+        fprintf(stdout, "Time per phase, %d block(s):\n", stats.num_blocks);
+        for (i = 0; i < APULTRA_NUM_PHASES; i++) {
+            fprintf(stdout,
+                "  %-18s: %10.3f ms (%5.1f %%), %10.3f ms per block\n",
+                pszPhaseNames[i],
+                (double)stats.phase_time[i] / 1000000.0,
+                (double)stats.phase_time[i] * 100.0 / (double)nTotalPhaseTime,
+                (double)stats.phase_time[i] / 1000000.0 / (double)stats.num_blocks);
+        }
     }
     return 0;
 }
 
 /*---------------------------------------------------------------------------*/
 
-static int do_decompress(const char *pszInFilename,
-    const char *pszOutFilename,
-    const char *pszDictionaryFilename,
-    const unsigned int nOptions) {
-    long long nStartTime = 0LL, nEndTime = 0LL;
-    size_t nCompressedSize, nMaxDecompressedSize, nOriginalSize;
-    unsigned char *pCompressedData;
-    unsigned char *pDecompressedData;
-    int nFlags = 0;
-
-    /* Read the whole compressed file in memory */
+static unsigned char *do_read_file(const char *pszFilename, size_t *pFileSize) {
+    unsigned char *pData;
+    size_t nFileSize;
+    FILE *f_in = fopen(pszFilename, "rb");
 
-    FILE *f_in = fopen(pszInFilename, "rb");
     if (!f_in) {
-        fprintf(stderr, "error opening '%s' for reading\n", pszInFilename);
-        return 100;
+        fprintf(stderr, "error opening '%s' for reading\n", pszFilename);
+        return NULL;
     }
 
     fseek(f_in, 0, SEEK_END);
-    nCompressedSize = (size_t)ftell(f_in);
+    nFileSize = (size_t)ftell(f_in);
     fseek(f_in, 0, SEEK_SET);
 
-    pCompressedData = (unsigned char *)malloc(nCompressedSize);
-    if (!pCompressedData) {
+    pData = (unsigned char *)malloc(nFileSize ? nFileSize : 1);
+    if (!pData) {
         fclose(f_in);
-        fprintf(stderr, "out of memory for reading '%s', %zd bytes needed\n", pszInFilename, nCompressedSize);
-        return 100;
+        fprintf(stderr, "out of memory for reading '%s', %zd bytes needed\n", pszFilename, nFileSize);
+        return NULL;
     }
 
-    if (fread(pCompressedData, 1, nCompressedSize, f_in) != nCompressedSize) {
-        free(pCompressedData);
+    if (fread(pData, 1, nFileSize, f_in) != nFileSize) {
+        free(pData);
         fclose(f_in);
-        fprintf(stderr, "I/O error while reading '%s'\n", pszInFilename);
-        return 100;
+        fprintf(stderr, "I/O error while reading '%s'\n", pszFilename);
+        return NULL;
     }
 
     fclose(f_in);
+    *pFileSize = nFileSize;
+    return pData;
+}
 
-    if (nOptions & OPT_BACKWARD) do_reverse_buffer(pCompressedData, nCompressedSize);
+static int do_recompress(const char *pszInFilename,
+    const char *pszOutFilename,
+    const char *pszPreviousInFilename,
+    const char *pszPreviousOutFilename,
+    const unsigned int nOptions,
+    const unsigned int nMaxWindowSize,
+    const int nThreads) {
+    long long nStartTime = 0LL, nEndTime = 0LL;
+    size_t nOriginalSize = 0L, nCompressedSize = 0L, nMaxCompressedSize;
+    size_t nPreviousOriginalSize = 0L, nPreviousCompressedSize = 0L;
+    int nFlags = (nThreads & APULTRA_FLAG_THREADS_MASK) | ((nOptions & OPT_FAST) ? APULTRA_FLAG_FAST_PARSE : 0);
+    apultra_stats stats;
+    unsigned char *pDecompressedData;
+    unsigned char *pPreviousDecompressedData;
+    unsigned char *pPreviousCompressedData;
+    unsigned char *pCompressedData;
 
-    /* Get max decompressed size */
+    if (nOptions & OPT_VERBOSE) { nStartTime = do_get_time(); }
 
-    nMaxDecompressedSize = apultra_get_max_decompressed_size(pCompressedData, nCompressedSize, nFlags);
-    if (nMaxDecompressedSize == -1) {
-        free(pCompressedData);
-        fprintf(stderr, "invalid compressed format for file '%s'\n", pszInFilename);
+    /* Read the new file, and the previous version with what it was compressed to */
+
+    pDecompressedData = do_read_file(pszInFilename, &nOriginalSize);
+    if (!pDecompressedData) return 100;
+
+    pPreviousDecompressedData = do_read_file(pszPreviousInFilename, &nPreviousOriginalSize);
+    if (!pPreviousDecompressedData) {
+        free(pDecompressedData);
         return 100;
     }
 
-    FILE *f_dict = NULL;
-    size_t nDictionarySize = 0;
-    if (pszDictionaryFilename) {
-        /* Open the dictionary */
-        f_dict = fopen(pszDictionaryFilename, "rb");
-        if (!f_dict) {
-            fprintf(stderr, "error opening dictionary '%s' for reading\n", pszDictionaryFilename);
-            return 100;
-        }
-
-        /* Get dictionary size */
-        fseek(f_dict, 0, SEEK_END);
-        nDictionarySize = (size_t)ftell(f_dict);
-        fseek(f_dict, 0, SEEK_SET);
+    pPreviousCompressedData = do_read_file(pszPreviousOutFilename, &nPreviousCompressedSize);
+    if (!pPreviousCompressedData) {
+        free(pPreviousDecompressedData);
+        free(pDecompressedData);
+        return 100;
+    }
 
-        if (nDictionarySize > BLOCK_SIZE) nDictionarySize = BLOCK_SIZE;
+    if (nOptions & OPT_BACKWARD) {
+        do_reverse_buffer(pDecompressedData, nOriginalSize);
+        do_reverse_buffer(pPreviousDecompressedData, nPreviousOriginalSize);
+        do_reverse_buffer(pPreviousCompressedData, nPreviousCompressedSize);
     }
 
-    /* Allocate max decompressed size */
+    /* Allocate max compressed size */
 
-    pDecompressedData = (unsigned char *)malloc(nDictionarySize + nMaxDecompressedSize);
-    if (!pDecompressedData) {
-        free(pCompressedData);
-        if (f_dict) fclose(f_dict);
-        fprintf(
-            stderr, "out of memory for decompressing '%s', %zd bytes needed\n", pszInFilename, nMaxDecompressedSize);
+    nMaxCompressedSize = apultra_get_max_compressed_size(nOriginalSize);
+
+    pCompressedData = (unsigned char *)malloc(nMaxCompressedSize);
+    if (!pCompressedData) {
+        free(pPreviousCompressedData);
+        free(pPreviousDecompressedData);
+        free(pDecompressedData);
+        fprintf(stderr, "out of memory for compressing '%s', %zd bytes needed\n", pszInFilename, nMaxCompressedSize);
         return 100;
     }
 
-    memset(pDecompressedData, 0, nDictionarySize + nMaxDecompressedSize);
-
-    if (f_dict) {
-        /* Read dictionary data */
-        if (fread(pDecompressedData, 1, nDictionarySize, f_dict) != nDictionarySize) {
-            free(pDecompressedData);
-            fclose(f_in);
-            fclose(f_dict);
-            fprintf(stderr, "I/O error while reading dictionary '%s'\n", pszDictionaryFilename);
-            return 100;
-        }
+    memset(pCompressedData, 0, nMaxCompressedSize);
 
-        fclose(f_dict);
-        f_dict = NULL;
+    nCompressedSize = apultra_recompress(pPreviousDecompressedData,
+        nPreviousOriginalSize,
+        pPreviousCompressedData,
+        nPreviousCompressedSize,
+        pDecompressedData,
+        pCompressedData,
+        nOriginalSize,
+        nMaxCompressedSize,
+        nFlags,
+        nMaxWindowSize,
+        &stats);
 
-        if (nOptions & OPT_BACKWARD) do_reverse_buffer(pDecompressedData, nDictionarySize);
-    }
+    if ((nOptions & OPT_VERBOSE)) { nEndTime = do_get_time(); }
 
-    if (nOptions & OPT_VERBOSE) { nStartTime = do_get_time(); }
+    free(pPreviousCompressedData);
+    free(pPreviousDecompressedData);
 
-    nOriginalSize = apultra_decompress(
-        pCompressedData, pDecompressedData, nCompressedSize, nMaxDecompressedSize, nDictionarySize, nFlags);
-    if (nOriginalSize == -1) {
-        free(pDecompressedData);
+    if (nCompressedSize == -1) {
         free(pCompressedData);
-
-        fprintf(stderr, "decompression error for '%s'\n", pszInFilename);
+        free(pDecompressedData);
+        fprintf(stderr,
+            "compression error for '%s', or '%s' isn't '%s' compressed with the same options\n",
+            pszInFilename,
+            pszPreviousOutFilename,
+            pszPreviousInFilename);
         return 100;
     }
 
-    if (nOptions & OPT_BACKWARD) do_reverse_buffer(pDecompressedData + nDictionarySize, nOriginalSize);
+    if (nOptions & OPT_BACKWARD) do_reverse_buffer(pCompressedData, nCompressedSize);
 
     if (pszOutFilename) {
         FILE *f_out;
 
-        /* Write whole decompressed file out */
+        /* Write whole compressed file out */
+
+        f_out = fopen(pszOutFilename, "wb");
+        if (f_out) {
+            fwrite(pCompressedData, 1, nCompressedSize, f_out);
+            fclose(f_out);
+        }
+    }
+
+    free(pCompressedData);
+    free(pDecompressedData);
+
+    if ((nOptions & OPT_VERBOSE)) {
+        double fDelta = ((double)(nEndTime - nStartTime)) / 1000000.0;
+        double fSpeed = ((double)nOriginalSize / 1048576.0) / fDelta;
+        fprintf(stdout,
+"\rRecompressed '%s' in %g seconds, %.02g Mb/s, %d tokens (%g bytes/token), %d into %d bytes ==> %g %%, %lld bytes "
+            "parsed again\n",
+            pszInFilename,
+            fDelta,
+            fSpeed,
+            stats.commands_divisor,
+            (double)nOriginalSize / (double)stats.commands_divisor,
+            (int)nOriginalSize,
+            (int)nCompressedSize,
+            (double)(nCompressedSize * 100.0 / nOriginalSize),
+            stats.num_reparsed_bytes);
+    }
+
+    return 0;
+}
+
+static int do_compress_windows(const char *pszInFilename,
+    const char *pszOutFilename,
+    const char *pszDictionaryFilename,
+    const apultra_dictionary_index *pDictionaryIndex,
+    const unsigned int nOptions,
+    const size_t *nMaxWindowSizes,
+    const int nNumWindowSizes,
+    const int nThreads) {
+    long long nStartTime = 0LL, nEndTime = 0LL;
+    size_t nOriginalSize = 0L, nMaxCompressedSize;
+    size_t nMaxOutBufferSizes[MAX_WINDOW_SIZES];
+    size_t nCompressedSizes[MAX_WINDOW_SIZES];
+    unsigned char *pCompressedData[MAX_WINDOW_SIZES];
+    apultra_stats stats[MAX_WINDOW_SIZES];
+    int nFlags = (nThreads & APULTRA_FLAG_THREADS_MASK) | ((nOptions & OPT_FAST) ? APULTRA_FLAG_FAST_PARSE : 0);
+    unsigned char *pDecompressedData;
+    int nResult = 0;
+    int i;
+
+    if (nOptions & OPT_VERBOSE) { nStartTime = do_get_time(); }
+
+    FILE *f_dict = NULL;
+    size_t nDictionarySize = 0;
+    if (pszDictionaryFilename) {
+        /* Open the dictionary */
+        f_dict = fopen(pszDictionaryFilename, "rb");
+        if (!f_dict) {
+            fprintf(stderr, "error opening dictionary '%s' for reading\n", pszDictionaryFilename);
+            return 100;
+        }
+
+        /* Get dictionary size */
+        fseek(f_dict, 0, SEEK_END);
+        nDictionarySize = (size_t)ftell(f_dict);
+        fseek(f_dict, 0, SEEK_SET);
+
+        if (nDictionarySize > BLOCK_SIZE) nDictionarySize = BLOCK_SIZE;
+    } else if (pDictionaryIndex) {
+        nDictionarySize = (size_t)pDictionaryIndex->size;
+    }
+
+    /* Read the whole original file in memory */
+
+    FILE *f_in = fopen(pszInFilename, "rb");
+    if (!f_in) {
+        if (f_dict) fclose(f_dict);
+        fprintf(stderr, "error opening '%s' for reading\n", pszInFilename);
+        return 100;
+    }
+
+    fseek(f_in, 0, SEEK_END);
+    nOriginalSize = (size_t)ftell(f_in);
+    fseek(f_in, 0, SEEK_SET);
+
+    pDecompressedData = (unsigned char *)malloc(nDictionarySize + nOriginalSize);
+    if (!pDecompressedData) {
+        fclose(f_in);
+        if (f_dict) fclose(f_dict);
+        fprintf(stderr, "out of memory for reading '%s', %zd bytes needed\n", pszInFilename, nOriginalSize);
+        return 100;
+    }
+
+    if (f_dict) {
+        /* Read dictionary data */
+        if (fread(pDecompressedData + ((nOptions & OPT_BACKWARD) ? nOriginalSize : 0), 1, nDictionarySize, f_dict)
+            != nDictionarySize) {
+            free(pDecompressedData);
+            fclose(f_in);
+            fclose(f_dict);
+            fprintf(stderr, "I/O error while reading dictionary '%s'\n", pszDictionaryFilename);
+            return 100;
+        }
+
+        fclose(f_dict);
+        f_dict = NULL;
+    } else if (pDictionaryIndex) {
+        /* The index holds the dictionary as it is compressed against, already reversed for -b */
+        unsigned char *pDictionaryData = pDecompressedData + ((nOptions & OPT_BACKWARD) ? nOriginalSize : 0);
+
+        memcpy(pDictionaryData, pDictionaryIndex->dictionary, nDictionarySize);
+        if (nOptions & OPT_BACKWARD) do_reverse_buffer(pDictionaryData, nDictionarySize);
+    }
+
+    /* Read input file data */
+    if (fread(pDecompressedData + ((nOptions & OPT_BACKWARD) ? 0 : nDictionarySize), 1, nOriginalSize, f_in)
+        != nOriginalSize) {
+        free(pDecompressedData);
+        fclose(f_in);
+        fprintf(stderr, "I/O error while reading '%s'\n", pszInFilename);
+        return 100;
+    }
+
+    fclose(f_in);
+
+    if (nOptions & OPT_BACKWARD) do_reverse_buffer(pDecompressedData, nDictionarySize + nOriginalSize);
+
+    /* Allocate max compressed size, for each window size */
+
+    nMaxCompressedSize = apultra_get_max_compressed_size(nDictionarySize + nOriginalSize);
+
+    for (i = 0; i < nNumWindowSizes; i++) {
+        nMaxOutBufferSizes[i] = nMaxCompressedSize;
+        pCompressedData[i] = (unsigned char *)calloc(nMaxCompressedSize, 1);
+        if (!pCompressedData[i]) {
+            while (i > 0) free(pCompressedData[--i]);
+            free(pDecompressedData);
+            fprintf(stderr,
+                "out of memory for compressing '%s', %zd bytes needed\n",
+                pszInFilename,
+                nMaxCompressedSize * nNumWindowSizes);
+            return 100;
+        }
+    }
+
+    if (apultra_compress_multi(pDecompressedData,
+            pCompressedData,
+            nDictionarySize + nOriginalSize,
+            nMaxOutBufferSizes,
+            nCompressedSizes,
+            nFlags,
+            nMaxWindowSizes,
+            nNumWindowSizes,
+            nDictionarySize,
+            pDictionaryIndex,
+            compression_progress,
+            stats)) {
+        fprintf(stderr, "compression error for '%s'\n", pszInFilename);
+        nResult = 100;
+    }
+
+    if ((nOptions & OPT_VERBOSE)) { nEndTime = do_get_time(); }
+
+    for (i = 0; i < nNumWindowSizes && !nResult; i++) {
+        char szOutFilename[1024];
+        FILE *f_out;
+
+        if (nOptions & OPT_BACKWARD) do_reverse_buffer(pCompressedData[i], nCompressedSizes[i]);
+
+        /* Write each compressed file out, named after its window size */
+
+        snprintf(szOutFilename, sizeof(szOutFilename), "%s.%zd", pszOutFilename, nMaxWindowSizes[i]);
+        f_out = fopen(szOutFilename, "wb");
+        if (f_out) {
+            fwrite(pCompressedData[i], 1, nCompressedSizes[i], f_out);
+            fclose(f_out);
+        } else {
+            fprintf(stderr, "error opening '%s' for writing\n", szOutFilename);
+            nResult = 100;
+        }
+
+        if ((nOptions & OPT_VERBOSE) && !nResult) {
+            fprintf(stdout,
+                "\rWindow %zd: %d tokens (%g bytes/token), %d into %d bytes ==> %g %%, '%s'\n",
+                nMaxWindowSizes[i],
+                stats[i].commands_divisor,
+                (double)nOriginalSize / (double)stats[i].commands_divisor,
+                (int)nOriginalSize,
+                (int)nCompressedSizes[i],
+                (double)(nCompressedSizes[i] * 100.0 / nOriginalSize),
+                szOutFilename);
+        }
+    }
+
+    for (i = 0; i < nNumWindowSizes; i++) free(pCompressedData[i]);
+    free(pDecompressedData);
+
+    if ((nOptions & OPT_VERBOSE) && !nResult) {
+        double fDelta = ((double)(nEndTime - nStartTime)) / 1000000.0;
+        double fSpeed = ((double)nOriginalSize / 1048576.0) / fDelta;
+        fprintf(stdout,
+            "Compressed '%s' for %d window sizes in %g seconds, %.02g Mb/s\n",
+            pszInFilename,
+            nNumWindowSizes,
+            fDelta,
+            fSpeed);
+    }
+
+    return nResult;
+}
+
+/*---------------------------------------------------------------------------*/
+
+static int do_decompress(const char *pszInFilename,
+    const char *pszOutFilename,
+    const char *pszDictionaryFilename,
+    const unsigned int nOptions) {
+    long long nStartTime = 0LL, nEndTime = 0LL;
+    size_t nCompressedSize, nMaxDecompressedSize, nOriginalSize;
+    unsigned char *pCompressedData;
+    unsigned char *pDecompressedData;
+    int nFlags = 0;
+
+    /* Read the whole compressed file in memory */
+
+    FILE *f_in = fopen(pszInFilename, "rb");
+    if (!f_in) {
+        fprintf(stderr, "error opening '%s' for reading\n", pszInFilename);
+        return 100;
+    }
+
+    fseek(f_in, 0, SEEK_END);
+    nCompressedSize = (size_t)ftell(f_in);
+    fseek(f_in, 0, SEEK_SET);
+
+    pCompressedData = (unsigned char *)malloc(nCompressedSize);
+    if (!pCompressedData) {
+        fclose(f_in);
+        fprintf(stderr, "out of memory for reading '%s', %zd bytes needed\n", pszInFilename, nCompressedSize);
+        return 100;
+    }
+
+    if (fread(pCompressedData, 1, nCompressedSize, f_in) != nCompressedSize) {
+        free(pCompressedData);
+        fclose(f_in);
+        fprintf(stderr, "I/O error while reading '%s'\n", pszInFilename);
+        return 100;
+    }
+
+    fclose(f_in);
+
+    if (nOptions & OPT_BACKWARD) do_reverse_buffer(pCompressedData, nCompressedSize);
+
+    /* Get max decompressed size */
+
+    nMaxDecompressedSize = apultra_get_max_decompressed_size(pCompressedData, nCompressedSize, nFlags);
+    if (nMaxDecompressedSize == -1) {
+        free(pCompressedData);
+        fprintf(stderr, "invalid compressed format for file '%s'\n", pszInFilename);
+        return 100;
+    }
+
+    FILE *f_dict = NULL;
+    size_t nDictionarySize = 0;
+    if (pszDictionaryFilename) {
+        /* Open the dictionary */
+        f_dict = fopen(pszDictionaryFilename, "rb");
+        if (!f_dict) {
+            fprintf(stderr, "error opening dictionary '%s' for reading\n", pszDictionaryFilename);
+            return 100;
+        }
+
+        /* Get dictionary size */
+        fseek(f_dict, 0, SEEK_END);
+        nDictionarySize = (size_t)ftell(f_dict);
+        fseek(f_dict, 0, SEEK_SET);
+
+        if (nDictionarySize > BLOCK_SIZE) nDictionarySize = BLOCK_SIZE;
+    }
+
+    /* Allocate max decompressed size */
+
+    pDecompressedData = (unsigned char *)malloc(nDictionarySize + nMaxDecompressedSize);
+    if (!pDecompressedData) {
+        free(pCompressedData);
+        if (f_dict) fclose(f_dict);
+        fprintf(
+            stderr, "out of memory for decompressing '%s', %zd bytes needed\n", pszInFilename, nMaxDecompressedSize);
+        return 100;
+    }
+
+    memset(pDecompressedData, 0, nDictionarySize + nMaxDecompressedSize);
+
+    if (f_dict) {
+        /* Read dictionary data */
+        if (fread(pDecompressedData, 1, nDictionarySize, f_dict) != nDictionarySize) {
+            free(pDecompressedData);
+            fclose(f_in);
+            fclose(f_dict);
+            fprintf(stderr, "I/O error while reading dictionary '%s'\n", pszDictionaryFilename);
+            return 100;
+        }
+
+        fclose(f_dict);
+        f_dict = NULL;
+
+        if (nOptions & OPT_BACKWARD) do_reverse_buffer(pDecompressedData, nDictionarySize);
+    }
+
+    if (nOptions & OPT_VERBOSE) { nStartTime = do_get_time(); }
+
+    nOriginalSize = apultra_decompress(
+        pCompressedData, pDecompressedData, nCompressedSize, nMaxDecompressedSize, nDictionarySize, nFlags);
+    if (nOriginalSize == -1) {
+        free(pDecompressedData);
+        free(pCompressedData);
+
+        fprintf(stderr, "decompression error for '%s'\n", pszInFilename);
+        return 100;
+    }
+
+    if (nOptions & OPT_BACKWARD) do_reverse_buffer(pDecompressedData + nDictionarySize, nOriginalSize);
+
+    if (pszOutFilename) {
+        FILE *f_out;
+
+        /* Write whole decompressed file out */
 
         f_out = fopen(pszOutFilename, "wb");
         if (f_out) {
@@ -448,6 +1169,7 @@ static int do_decompress(const char *pszInFilename,
 static int do_compare(const char *pszInFilename,
     const char *pszOutFilename,
     const char *pszDictionaryFilename,
+    const apultra_dictionary_index *pDictionaryIndex,
     const unsigned int nOptions) {
     long long nStartTime = 0LL, nEndTime = 0LL;
     size_t nCompressedSize, nMaxDecompressedSize, nOriginalSize, nDecompressedSize;
@@ -515,154 +1237,996 @@ static int do_compare(const char *pszInFilename,
         return 100;
     }
 
-    fclose(f_in);
-
-    /* Get max decompressed size */
+    fclose(f_in);
+
+    /* Get max decompressed size */
+
+    nMaxDecompressedSize = apultra_get_max_decompressed_size(pCompressedData, nCompressedSize, nFlags);
+    if (nMaxDecompressedSize == -1) {
+        free(pOriginalData);
+        free(pCompressedData);
+        fprintf(stderr, "invalid compressed format for file '%s'\n", pszInFilename);
+        return 100;
+    }
+
+    FILE *f_dict = NULL;
+    size_t nDictionarySize = 0;
+    if (pszDictionaryFilename) {
+        /* Open the dictionary */
+        f_dict = fopen(pszDictionaryFilename, "rb");
+        if (!f_dict) {
+            fprintf(stderr, "error opening dictionary '%s' for reading\n", pszDictionaryFilename);
+            return 100;
+        }
+
+        /* Get dictionary size */
+        fseek(f_dict, 0, SEEK_END);
+        nDictionarySize = (size_t)ftell(f_dict);
+        fseek(f_dict, 0, SEEK_SET);
+
+        if (nDictionarySize > BLOCK_SIZE) nDictionarySize = BLOCK_SIZE;
+    } else if (pDictionaryIndex) {
+        nDictionarySize = (size_t)pDictionaryIndex->size;
+    }
+
+    /* Allocate max decompressed size */
+
+    pDecompressedData = (unsigned char *)malloc(nDictionarySize + nMaxDecompressedSize);
+    if (!pDecompressedData) {
+        free(pOriginalData);
+        free(pCompressedData);
+        if (f_dict) fclose(f_dict);
+        fprintf(
+            stderr, "out of memory for decompressing '%s', %zd bytes needed\n", pszInFilename, nMaxDecompressedSize);
+        return 100;
+    }
+
+    memset(pDecompressedData, 0, nDictionarySize + nMaxDecompressedSize);
+
+    if (f_dict) {
+        /* Read dictionary data */
+        if (fread(pDecompressedData, 1, nDictionarySize, f_dict) != nDictionarySize) {
+            free(pDecompressedData);
+            fclose(f_in);
+            fclose(f_dict);
+            fprintf(stderr, "I/O error while reading dictionary '%s'\n", pszDictionaryFilename);
+            return 100;
+        }
+
+        fclose(f_dict);
+        f_dict = NULL;
+
+        if (nOptions & OPT_BACKWARD) do_reverse_buffer(pDecompressedData, nDictionarySize);
+    } else if (pDictionaryIndex) {
+        /* Already reversed for -b */
+        memcpy(pDecompressedData, pDictionaryIndex->dictionary, nDictionarySize);
+    }
+
+    if (nOptions & OPT_VERBOSE) { nStartTime = do_get_time(); }
+
+    nDecompressedSize = apultra_decompress(
+        pCompressedData, pDecompressedData, nCompressedSize, nMaxDecompressedSize, nDictionarySize, nFlags);
+    if (nDecompressedSize == -1) {
+        free(pDecompressedData);
+        free(pOriginalData);
+        free(pCompressedData);
+
+        fprintf(stderr, "decompression error for '%s'\n", pszInFilename);
+        return 100;
+    }
+
+    if (nOptions & OPT_BACKWARD) do_reverse_buffer(pDecompressedData + nDictionarySize, nDecompressedSize);
+
+    if (nDecompressedSize != nOriginalSize
+        || memcmp(pDecompressedData + nDictionarySize, pOriginalData, nOriginalSize)) {
+        fprintf(stderr, "error comparing compressed file '%s' with original '%s'\n", pszInFilename, pszOutFilename);
+        return 100;
+    }
+
+    free(pDecompressedData);
+    free(pOriginalData);
+    free(pCompressedData);
+
+    if (nOptions & OPT_VERBOSE) {
+        nEndTime = do_get_time();
+        double fDelta = ((double)(nEndTime - nStartTime)) / 1000000.0;
+        double fSpeed = ((double)nOriginalSize / 1048576.0) / fDelta;
+        fprintf(stdout, "Compared '%s' in %g seconds, %g Mb/s\n", pszInFilename, fDelta, fSpeed);
+    }
+
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+static void generate_compressible_data(unsigned char *pBuffer,
+    size_t nBufferSize,
+    unsigned int nSeed,
+    int nNumLiteralValues,
+    float fMatchProbability) {
+    size_t nIndex = 0;
+    int nMatchProbability = (int)(fMatchProbability * 1023.0f);
+
+    srand(nSeed);
+
+    if (nIndex >= nBufferSize) return;
+    pBuffer[nIndex++] = rand() % nNumLiteralValues;
+
+    while (nIndex < nBufferSize) {
+        if ((rand() & 1023) >= nMatchProbability) {
+            size_t nLiteralCount = rand() & 127;
+            if (nLiteralCount > (nBufferSize - nIndex)) nLiteralCount = nBufferSize - nIndex;
+
+            while (nLiteralCount--) pBuffer[nIndex++] = rand() % nNumLiteralValues;
+        } else {
+            size_t nMatchLength = MIN_MATCH_SIZE + (rand() & 1023);
+            size_t nMatchOffset;
+
+            if (nMatchLength > (nBufferSize - nIndex)) nMatchLength = nBufferSize - nIndex;
+            if (nMatchLength > nIndex) nMatchLength = nIndex;
+
+            if (nMatchLength < nIndex)
+                nMatchOffset = rand() % (nIndex - nMatchLength);
+            else
+                nMatchOffset = 0;
+
+            while (nMatchLength--) {
+                pBuffer[nIndex] = pBuffer[nIndex - nMatchOffset];
+                nIndex++;
+            }
+        }
+    }
+}
+
+static void xor_data(unsigned char *pBuffer, size_t nBufferSize, unsigned int nSeed, float fXorProbability) {
+    size_t nIndex = 0;
+    int nXorProbability = (int)(fXorProbability * 1023.0f);
+
+    srand(nSeed);
+
+    if (nIndex >= nBufferSize) return;
+
+    while (nIndex < nBufferSize) {
+        if ((rand() & 1023) < nXorProbability) { pBuffer[nIndex] ^= 0xff; }
+        nIndex++;
+    }
+}
+
+/** Settings that a self-test compresses with, and what the compression function under test needs besides them */
+typedef struct {
+    unsigned int flags;
+    size_t max_window_size;
+    size_t dictionary_size;
+    const apultra_dictionary_index *index; /* for apultra_compress_indexed() */
+    apultra_cache *cache;                  /* for apultra_compress_cached() */
+    const apultra_input_segment *segments; /* for apultra_compress_iov(): the data, split in segments */
+    int num_segments;
+    const unsigned char *previous_data; /* for apultra_recompress(): previous data, and what it compressed to */
+    size_t previous_size;
+    const unsigned char *previous_compressed_data;
+    size_t previous_compressed_size;
+} self_test_options;
+
+/**
+ * Compression function under test, called by do_self_test_round_trip()
+ *
+ * @param pOptions settings to compress with
+ * @param pData data to compress, dictionary included
+ * @param pOutBuffer buffer for compressed data
+ * @param nDataSize size of data in bytes, dictionary included
+ * @param nMaxOutBufferSize maximum capacity of compression buffer
+ * @param pStats pointer to compression stats, or NULL
+ *
+ * @return compressed size, or -1 for error
+ */
+typedef size_t (*self_test_compress_func)(const self_test_options *pOptions,
+    const unsigned char *pData,
+    unsigned char *pOutBuffer,
+    size_t nDataSize,
+    size_t nMaxOutBufferSize,
+    apultra_stats *pStats);
+
+static size_t self_test_compress(const self_test_options *pOptions,
+    const unsigned char *pData,
+    unsigned char *pOutBuffer,
+    size_t nDataSize,
+    size_t nMaxOutBufferSize,
+    apultra_stats *pStats) {
+    return apultra_compress(pData,
+        pOutBuffer,
+        nDataSize,
+        nMaxOutBufferSize,
+        pOptions->flags,
+        pOptions->max_window_size,
+        pOptions->dictionary_size,
+        NULL,
+        pStats);
+}
+
+static size_t self_test_compress_indexed(const self_test_options *pOptions,
+    const unsigned char *pData,
+    unsigned char *pOutBuffer,
+    size_t nDataSize,
+    size_t nMaxOutBufferSize,
+    apultra_stats *pStats) {
+    return apultra_compress_indexed(pData,
+        pOutBuffer,
+        nDataSize,
+        nMaxOutBufferSize,
+        pOptions->flags,
+        pOptions->max_window_size,
+        pOptions->index,
+        NULL,
+        pStats);
+}
+
+static size_t self_test_compress_cached(const self_test_options *pOptions,
+    const unsigned char *pData,
+    unsigned char *pOutBuffer,
+    size_t nDataSize,
+    size_t nMaxOutBufferSize,
+    apultra_stats *pStats) {
+    return apultra_compress_cached(pOptions->cache,
+        pData,
+        pOutBuffer,
+        nDataSize,
+        nMaxOutBufferSize,
+        pOptions->flags,
+        pOptions->max_window_size,
+        pOptions->dictionary_size,
+        NULL,
+        pStats);
+}
+
+static size_t self_test_compress_iov(const self_test_options *pOptions,
+    const unsigned char *pData,
+    unsigned char *pOutBuffer,
+    size_t nDataSize,
+    size_t nMaxOutBufferSize,
+    apultra_stats *pStats) {
+    return apultra_compress_iov(pOptions->segments,
+        pOptions->num_segments,
+        pOutBuffer,
+        nMaxOutBufferSize,
+        pOptions->flags,
+        pOptions->max_window_size,
+        pOptions->dictionary_size,
+        NULL,
+        pStats);
+}
+
+static size_t self_test_recompress(const self_test_options *pOptions,
+    const unsigned char *pData,
+    unsigned char *pOutBuffer,
+    size_t nDataSize,
+    size_t nMaxOutBufferSize,
+    apultra_stats *pStats) {
+    return apultra_recompress(pOptions->previous_data,
+        pOptions->previous_size,
+        pOptions->previous_compressed_data,
+        pOptions->previous_compressed_size,
+        pData,
+        pOutBuffer,
+        nDataSize,
+        nMaxOutBufferSize,
+        pOptions->flags,
+        pOptions->max_window_size,
+        pStats);
+}
+
+/**
+ * Check that compressed data decompresses back to the data it was compressed from
+ *
+ * @param pCompressedData compressed data
+ * @param nCompressedSize compressed size in bytes
+ * @param pData original data, dictionary included
+ * @param nDataSize size of original data in bytes, dictionary included
+ * @param nDictionarySize size of the dictionary at the start of the data (0 for none)
+ *
+ * @return 0 if the data decompresses back, -1 if not
+ */
+static int do_self_test_decompress(const unsigned char *pCompressedData,
+    const size_t nCompressedSize,
+    const unsigned char *pData,
+    const size_t nDataSize,
+    const size_t nDictionarySize) {
+    unsigned char *pDecompressedData = (unsigned char *)malloc(nDataSize);
+    int nResult = -1;
+
+    if (pDecompressedData) {
+        size_t nDecompressedSize;
+
+        memcpy(pDecompressedData, pData, nDictionarySize);
+        nDecompressedSize = apultra_decompress(pCompressedData,
+            pDecompressedData,
+            nCompressedSize,
+            nDataSize - nDictionarySize,
+            nDictionarySize,
+            0);
+        if (nDecompressedSize == (nDataSize - nDictionarySize) && !memcmp(pDecompressedData, pData, nDataSize))
+            nResult = 0;
+        free(pDecompressedData);
+    }
+
+    return nResult;
+}
+
+/**
+ * Compress data with a compression function under test, and check that it decompresses back to the data
+ *
+ * @param pCompress compression function
+ * @param pOptions settings to compress with
+ * @param pData data to compress, dictionary included
+ * @param nDataSize size of data in bytes, dictionary included
+ * @param pCompressedData buffer for compressed data, of apultra_get_max_compressed_size(nDataSize) bytes
+ * @param pStats pointer to compression stats, or NULL
+ *
+ * @return compressed size, or -1 if compressing failed or the data didn't decompress back
+ */
+static size_t do_self_test_round_trip(self_test_compress_func pCompress,
+    const self_test_options *pOptions,
+    const unsigned char *pData,
+    const size_t nDataSize,
+    unsigned char *pCompressedData,
+    apultra_stats *pStats) {
+    size_t nCompressedSize =
+        pCompress(pOptions, pData, pCompressedData, nDataSize, apultra_get_max_compressed_size(nDataSize), pStats);
+
+    if (nCompressedSize != -1
+        && do_self_test_decompress(pCompressedData, nCompressedSize, pData, nDataSize, pOptions->dictionary_size))
+        nCompressedSize = -1;
+    return nCompressedSize;
+}
+
+static int do_self_test_recompress(const unsigned int nMaxWindowSize, const int nIsQuickTest) {
+    const size_t nTestSize = 100000;
+    /* The full test also changes bytes inside a repeat that spans two blocks */
+    const size_t nLongTestSize = BLOCK_SIZE + BLOCK_SIZE / 16;
+    const size_t nMaxEditedSize = nIsQuickTest ? (nTestSize + 64) : nLongTestSize;
+    size_t nMaxCompressedSize = apultra_get_max_compressed_size(nMaxEditedSize);
+    unsigned char *pData = (unsigned char *)malloc(nMaxEditedSize);
+    unsigned char *pEditedData = (unsigned char *)malloc(nMaxEditedSize);
+    unsigned char *pCompressedData = (unsigned char *)malloc(nMaxCompressedSize);
+    unsigned char *pRecompressedData = (unsigned char *)malloc(nMaxCompressedSize);
+    self_test_options options;
+    int nResult = 0;
+    int i;
+
+    memset(&options, 0, sizeof(options));
+    options.max_window_size = nMaxWindowSize;
+    options.previous_data = pData;
+    options.previous_compressed_data = pCompressedData;
+
+    if (!pData || !pEditedData || !pCompressedData || !pRecompressedData) {
+        fprintf(stderr, "out of memory\n");
+        nResult = 100;
+    }
+
+    if (!nResult) {
+        generate_compressible_data(pData, nTestSize, 456, 56, 0.5f);
+        options.previous_size = nTestSize;
+        options.previous_compressed_size =
+            do_self_test_round_trip(self_test_compress, &options, pData, nTestSize, pCompressedData, NULL);
+        if (options.previous_compressed_size == -1) {
+            fprintf(stderr, "self-test: error compressing data to recompress\n");
+            nResult = 100;
+        }
+    }
+
+    /* Recompress after inserting and after removing bytes: the commands after the change that copy from before it must
+     * be kept with their moved offsets, not make all the data be compressed again */
+    for (i = 0; i < 2 && !nResult; i++) {
+        static const char szInserted[] = "inserted bytes";
+        const size_t nEditPos = 40000;
+        size_t nEditedSize;
+        apultra_stats stats;
+
+        if (i == 0) {
+            nEditedSize = nTestSize + sizeof(szInserted) - 1;
+            memcpy(pEditedData, pData, nEditPos);
+            memcpy(pEditedData + nEditPos, szInserted, sizeof(szInserted) - 1);
+            memcpy(pEditedData + nEditPos + sizeof(szInserted) - 1, pData + nEditPos, nTestSize - nEditPos);
+        } else {
+            nEditedSize = nTestSize - 11;
+            memcpy(pEditedData, pData, nEditPos);
+            memcpy(pEditedData + nEditPos, pData + nEditPos + 11, nEditedSize - nEditPos);
+        }
+
+        if (do_self_test_round_trip(self_test_recompress, &options, pEditedData, nEditedSize, pRecompressedData, &stats)
+            == -1) {
+            fprintf(stderr, "self-test: error recompressing data after %s bytes\n", i ? "removing" : "inserting");
+            nResult = 100;
+        } else if (stats.num_reparsed_bytes >= (long long)nEditedSize) {
+            fprintf(stderr,
+                "self-test: recompressing after %s bytes compressed all the data\n",
+                i ? "removing" : "inserting");
+            nResult = 100;
+        }
+    }
+
+    /* Recompress after changing bytes inside a repeat that spans two blocks: the start and the end of the long match
+     * that the change goes through must be kept, and only the changed bytes and the margins around them parsed again */
+    if (!nResult && !nIsQuickTest) {
+        static const char szChanged[] = "changed bytes";
+        const size_t nEditPos = BLOCK_SIZE - 100;
+        apultra_stats stats;
+        size_t j;
+
+        generate_compressible_data(pData, 1024, 123, 256, 0.5f);
+        for (j = 1024; j < nLongTestSize; j++) pData[j] = pData[j - 1024];
+        memcpy(pEditedData, pData, nLongTestSize);
+        memcpy(pEditedData + nEditPos, szChanged, sizeof(szChanged) - 1);
+
+        options.previous_size = nLongTestSize;
+        options.previous_compressed_size =
+            do_self_test_round_trip(self_test_compress, &options, pData, nLongTestSize, pCompressedData, NULL);
+        if (options.previous_compressed_size == -1
+            || do_self_test_round_trip(
+                   self_test_recompress, &options, pEditedData, nLongTestSize, pRecompressedData, &stats)
+                   == -1) {
+            fprintf(stderr, "self-test: error recompressing data after changing bytes inside a repeat\n");
+            nResult = 100;
+        } else if (stats.num_reparsed_bytes > (long long)(4 * RECOMPRESS_MARGIN)) {
+            fprintf(stderr,
+                "self-test: recompressing after changing bytes inside a repeat parsed %lld bytes again\n",
+                stats.num_reparsed_bytes);
+            nResult = 100;
+        }
+    }
+
+    if (pRecompressedData) free(pRecompressedData);
+    if (pCompressedData) free(pCompressedData);
+    if (pEditedData) free(pEditedData);
+    if (pData) free(pData);
+    return nResult;
+}
+
+static int do_self_test_threads(const unsigned int nMaxWindowSize, const int nIsQuickTest) {
+    const size_t nTestSize = 65536;
+    size_t nMaxCompressedSize = apultra_get_max_compressed_size(nTestSize);
+    unsigned char *pData = (unsigned char *)malloc(nTestSize);
+    unsigned char *pCompressedData = (unsigned char *)malloc(nMaxCompressedSize);
+    self_test_options options;
+    int nResult = 0;
+    int i;
+
+    memset(&options, 0, sizeof(options));
+    options.flags = 4 & APULTRA_FLAG_THREADS_MASK;
+    options.max_window_size = nMaxWindowSize;
+
+    if (!pData || !pCompressedData) {
+        fprintf(stderr, "out of memory\n");
+        nResult = 100;
+    }
+
+    /* Parse the blocks in segments with several threads: the stitched parse must still decompress to the data. The
+     * full test also does it for data with more and longer matches */
+    for (i = 0; i < (nIsQuickTest ? 1 : 2) && !nResult; i++) {
+        apultra_stats stats;
+
+        generate_compressible_data(pData, nTestSize, 789 + i, 16 << i, i ? 0.9f : 0.5f);
+        if (do_self_test_round_trip(self_test_compress, &options, pData, nTestSize, pCompressedData, &stats) == -1) {
+            fprintf(stderr, "self-test: error compressing data with %d thread(s)\n", 4);
+            nResult = 100;
+        } else if (stats.num_segments <= stats.num_blocks) {
+            fprintf(stderr, "self-test: compressing with %d thread(s) didn't split any block\n", 4);
+            nResult = 100;
+        }
+    }
+
+    if (pCompressedData) free(pCompressedData);
+    if (pData) free(pData);
+    return nResult;
+}
+
+static int do_self_test_window(const int nIsQuickTest) {
+    /* Offsets below the 64K chunk threshold (64K chunks), right at it, and above it (chunks of 4 * max_offset); the
+     * quick test only checks the last one */
+    const size_t nMaxOffsets[3] = { 4096, 16384, 30000 };
+    const size_t nTestSize = 200000;
+    size_t nMaxCompressedSize = apultra_get_max_compressed_size(nTestSize);
+    unsigned char *pData = (unsigned char *)malloc(nTestSize);
+    unsigned char *pCompressedData = (unsigned char *)malloc(nMaxCompressedSize);
+    self_test_options options;
+    int nResult = 0;
+    int i;
+
+    memset(&options, 0, sizeof(options));
+
+    if (!pData || !pCompressedData) {
+        fprintf(stderr, "out of memory\n");
+        nResult = 100;
+    }
+
+    /* With a small -w, matches are found in chunks of the block, each with its own suffix array; round trip data
+     * with matches that straddle the chunk boundaries */
+    for (i = nIsQuickTest ? 2 : 0; i < 3 && !nResult; i++) {
+        const size_t nMaxOffset = nMaxOffsets[i];
+        const size_t nChunkSize =
+            (nMaxOffset < (WINDOWED_MIN_CHUNK_SIZE / 4)) ? WINDOWED_MIN_CHUNK_SIZE : (nMaxOffset * 4);
+        size_t nBoundary, j;
+        apultra_stats stats;
+
+        generate_compressible_data(pData, nTestSize, 1011 + i, 64, 0.3f);
+        for (nBoundary = nChunkSize; nBoundary < nTestSize; nBoundary += nChunkSize) {
+            /* A repeat long enough that its inner positions are skipped, running into the next chunk... */
+            for (j = nBoundary - 1500; j < nBoundary + 1500; j++) pData[j] = pData[j - 3000];
+            /* ...and a short match from exactly max_offset bytes back, right at the boundary */
+            for (j = nBoundary - 16; j < nBoundary + 16; j++) pData[j + 2000] = pData[j + 2000 - nMaxOffset];
+        }
+
+        options.max_window_size = nMaxOffset;
+        if (do_self_test_round_trip(self_test_compress, &options, pData, nTestSize, pCompressedData, &stats) == -1) {
+            fprintf(stderr, "self-test: error compressing data with -w %zd\n", nMaxOffset);
+            nResult = 100;
+        } else if (stats.max_offset > (int)nMaxOffset) {
+            fprintf(stderr, "self-test: compressing with -w %zd used offset %d\n", nMaxOffset, stats.max_offset);
+            nResult = 100;
+        }
+    }
+
+    if (pCompressedData) free(pCompressedData);
+    if (pData) free(pData);
+    return nResult;
+}
+
+static int do_self_test_multi(const int nIsQuickTest) {
+    const size_t nMaxWindowSizes[3] = { 2048, 16384, 0 };
+    const size_t nTestSize = 100000;
+    size_t nMaxCompressedSize = apultra_get_max_compressed_size(nTestSize);
+    unsigned char *pData = (unsigned char *)malloc(nTestSize);
+    unsigned char *pCompressedData[3];
+    unsigned char *pSingleCompressedData = (unsigned char *)malloc(nMaxCompressedSize);
+    size_t nMaxCompressedSizes[3];
+    size_t nCompressedSizes[3];
+    apultra_stats stats[3];
+    self_test_options options;
+    int nResult = 0;
+    size_t j;
+    int f, i;
+
+    memset(&options, 0, sizeof(options));
+
+    for (i = 0; i < 3; i++) {
+        pCompressedData[i] = (unsigned char *)malloc(nMaxCompressedSize);
+        nMaxCompressedSizes[i] = nMaxCompressedSize;
+        if (!pCompressedData[i]) nResult = 100;
+    }
+    if (nResult || !pData || !pSingleCompressedData) {
+        fprintf(stderr, "out of memory\n");
+        nResult = 100;
+    }
+
+    if (!nResult) {
+        /* Very long repeats from 4000 and 30000 bytes back, that only some of the windows can reach. The second one
+         * also repeats itself every 200 bytes but for one byte: the small windows must still find those matches */
+        generate_compressible_data(pData, nTestSize, 1213, 32, 0.5f);
+        for (j = 20000; j < 23000; j++) pData[j] = pData[j - 4000];
+        for (j = 40200; j < 43000; j++) pData[j] = (j % 200) ? pData[j - 200] : (pData[j - 200] ^ 0x55);
+        for (j = 70000; j < 73000; j++) pData[j] = pData[j - 30000];
+    }
+
+    /* Without -fast, and in the full test with -fast too, that skips the inside of very long repeats when all the
+     * windows reach them */
+    for (f = 0; f < (nIsQuickTest ? 1 : 2) && !nResult; f++) {
+        options.flags = f ? APULTRA_FLAG_FAST_PARSE : 0;
+
+        if (apultra_compress_multi(pData,
+                pCompressedData,
+                nTestSize,
+                nMaxCompressedSizes,
+                nCompressedSizes,
+                options.flags,
+                nMaxWindowSizes,
+                3,
+                0 /* dictionary size */,
+                NULL,
+                NULL,
+                stats)) {
+            fprintf(stderr, "self-test: error compressing data for several window sizes\n");
+            nResult = 100;
+        }
+
+        /* Every output must decompress to the data, stay in its window, and, in the full test, be about as small as
+         * with -w alone */
+        for (i = 0; i < 3 && !nResult; i++) {
+            size_t nSingleCompressedSize = nCompressedSizes[i];
+
+            options.max_window_size = nMaxWindowSizes[i];
+            if (!nIsQuickTest)
+                nSingleCompressedSize = do_self_test_round_trip(
+                    self_test_compress, &options, pData, nTestSize, pSingleCompressedData, NULL);
+            if (do_self_test_decompress(pCompressedData[i], nCompressedSizes[i], pData, nTestSize, 0)) {
+                fprintf(stderr, "self-test: error compressing data for window size %zd of several\n", nMaxWindowSizes[i]);
+                nResult = 100;
+            } else if (nMaxWindowSizes[i] && stats[i].max_offset > (int)nMaxWindowSizes[i]) {
+                fprintf(stderr,
+                    "self-test: compressing for window size %zd of several used offset %d\n",
+                    nMaxWindowSizes[i],
+                    stats[i].max_offset);
+                nResult = 100;
+            } else if (nSingleCompressedSize == -1
+                       || nCompressedSizes[i] > (nSingleCompressedSize + nSingleCompressedSize / 100)) {
+                fprintf(stderr,
+                    "self-test: compressing for window size %zd of several gave %zd bytes, %zd alone\n",
+                    nMaxWindowSizes[i],
+                    nCompressedSizes[i],
+                    nSingleCompressedSize);
+                nResult = 100;
+            }
+        }
+    }
+
+    for (i = 0; i < 3; i++) {
+        if (pCompressedData[i]) free(pCompressedData[i]);
+    }
+    if (pSingleCompressedData) free(pSingleCompressedData);
+    if (pData) free(pData);
+    return nResult;
+}
 
-    nMaxDecompressedSize = apultra_get_max_decompressed_size(pCompressedData, nCompressedSize, nFlags);
-    if (nMaxDecompressedSize == -1) {
-        free(pOriginalData);
-        free(pCompressedData);
-        fprintf(stderr, "invalid compressed format for file '%s'\n", pszInFilename);
-        return 100;
+static int do_self_test_dictionary_index(const unsigned int nMaxWindowSize) {
+    const size_t nTestSize = 70000;
+    const size_t nDictionarySize = 30000;
+    size_t nMaxCompressedSize = apultra_get_max_compressed_size(nTestSize);
+    size_t nMaxIndexSize = apultra_get_max_dictionary_index_size(nDictionarySize);
+    unsigned char *pData = (unsigned char *)malloc(nTestSize);
+    unsigned char *pIndexData = (unsigned char *)malloc(nMaxIndexSize);
+    unsigned char *pCompressedData = (unsigned char *)malloc(nMaxCompressedSize);
+    unsigned char *pIndexedCompressedData = (unsigned char *)malloc(nMaxCompressedSize);
+    size_t nCompressedSize = -1, nIndexedCompressedSize = -1;
+    apultra_dictionary_index index;
+    self_test_options options;
+    int nResult = 0;
+
+    memset(&options, 0, sizeof(options));
+    options.max_window_size = nMaxWindowSize;
+    options.dictionary_size = nDictionarySize;
+    options.index = &index;
+
+    if (!pData || !pIndexData || !pCompressedData || !pIndexedCompressedData) {
+        fprintf(stderr, "out of memory\n");
+        nResult = 100;
     }
 
-    FILE *f_dict = NULL;
-    size_t nDictionarySize = 0;
-    if (pszDictionaryFilename) {
-        /* Open the dictionary */
-        f_dict = fopen(pszDictionaryFilename, "rb");
-        if (!f_dict) {
-            fprintf(stderr, "error opening dictionary '%s' for reading\n", pszDictionaryFilename);
-            return 100;
-        }
+    if (!nResult) {
+        size_t nIndexSize;
 
-        /* Get dictionary size */
-        fseek(f_dict, 0, SEEK_END);
-        nDictionarySize = (size_t)ftell(f_dict);
-        fseek(f_dict, 0, SEEK_SET);
+        generate_compressible_data(pData, nTestSize, 1819, 56, 0.5f);
+        nCompressedSize =
+            do_self_test_round_trip(self_test_compress, &options, pData, nTestSize, pCompressedData, NULL);
 
-        if (nDictionarySize > BLOCK_SIZE) nDictionarySize = BLOCK_SIZE;
+        nIndexSize = apultra_build_dictionary_index(pData, nDictionarySize, pIndexData, nMaxIndexSize, 0);
+        if (nCompressedSize == -1 || nIndexSize == -1
+            || apultra_open_dictionary_index(pIndexData, nIndexSize, &index)) {
+            fprintf(stderr, "self-test: error compressing data with a dictionary, or indexing the dictionary\n");
+            nResult = 100;
+        }
     }
 
-    /* Allocate max decompressed size */
-
-    pDecompressedData = (unsigned char *)malloc(nDictionarySize + nMaxDecompressedSize);
-    if (!pDecompressedData) {
-        free(pOriginalData);
-        free(pCompressedData);
-        if (f_dict) fclose(f_dict);
-        fprintf(
-            stderr, "out of memory for decompressing '%s', %zd bytes needed\n", pszInFilename, nMaxDecompressedSize);
-        return 100;
+    /* Compressing against the index must decompress with the dictionary, and be about as small as sorting the
+     * dictionary along with the input */
+    if (!nResult) {
+        nIndexedCompressedSize = do_self_test_round_trip(
+            self_test_compress_indexed, &options, pData, nTestSize, pIndexedCompressedData, NULL);
+        if (nIndexedCompressedSize == -1) {
+            fprintf(stderr, "self-test: error compressing data with an indexed dictionary\n");
+            nResult = 100;
+        } else if (nIndexedCompressedSize > (nCompressedSize + nCompressedSize / 200)) {
+            fprintf(stderr,
+                "self-test: compressing with an indexed dictionary gave %zd bytes, %zd without the index\n",
+                nIndexedCompressedSize,
+                nCompressedSize);
+            nResult = 100;
+        }
     }
 
-    memset(pDecompressedData, 0, nDictionarySize + nMaxDecompressedSize);
+    /* An index whose arrays point out of the dictionary, or whose intervals loop, must be rejected when opened */
+    if (!nResult) {
+        const size_t nIndexSize =
+            (const unsigned char *)(index.interval_max_pos + index.num_intervals) - (const unsigned char *)pIndexData;
+        int *pSuffixArray = (int *)index.suffix_array;
+        int *pIntervalParent = (int *)index.interval_parent;
+        const int nSavedSuffix = pSuffixArray[0];
+        int nBadSuffix, nBadParent = 0;
+
+        pSuffixArray[0] = index.size;
+        nBadSuffix = !apultra_open_dictionary_index(pIndexData, nIndexSize, &index);
+        pSuffixArray[0] = nSavedSuffix;
+
+        if (index.num_intervals > 1) {
+            pIntervalParent[1] = 1;
+            nBadParent = !apultra_open_dictionary_index(pIndexData, nIndexSize, &index);
+        }
 
-    if (f_dict) {
-        /* Read dictionary data */
-        if (fread(pDecompressedData, 1, nDictionarySize, f_dict) != nDictionarySize) {
-            free(pDecompressedData);
-            fclose(f_in);
-            fclose(f_dict);
-            fprintf(stderr, "I/O error while reading dictionary '%s'\n", pszDictionaryFilename);
-            return 100;
+        if (nBadSuffix || nBadParent) {
+            fprintf(stderr, "self-test: a corrupted dictionary index was accepted\n");
+            nResult = 100;
         }
+    }
 
-        fclose(f_dict);
-        f_dict = NULL;
+    if (pIndexedCompressedData) free(pIndexedCompressedData);
+    if (pCompressedData) free(pCompressedData);
+    if (pIndexData) free(pIndexData);
+    if (pData) free(pData);
+    return nResult;
+}
 
-        if (nOptions & OPT_BACKWARD) do_reverse_buffer(pDecompressedData, nDictionarySize);
+/** Files of a self-test's scratch directory, as they are listed */
+typedef struct {
+    const char *directory;
+    int remove;
+} self_test_files;
+
+static int do_self_test_change_file(void *pUserData, const char *pszName, long long nSize, long long nTime) {
+    const self_test_files *pFiles = (const self_test_files *)pUserData;
+    char szPath[4096];
+    FILE *f;
+    int c;
+
+    snprintf(szPath, sizeof(szPath), "%s/%s", pFiles->directory, pszName);
+    if (pFiles->remove) return remove(szPath) ? -1 : 0;
+
+    /* Flip the bits of the last byte, which is compressed data */
+    f = fopen(szPath, "r+b");
+    if (!f) return -1;
+    if (nSize < 1 || fseek(f, (long)(nSize - 1), SEEK_SET) || (c = fgetc(f)) == EOF
+        || fseek(f, (long)(nSize - 1), SEEK_SET) || fputc(c ^ 0xff, f) == EOF) {
+        fclose(f);
+        return -1;
     }
+    return fclose(f) ? -1 : 0;
+}
 
-    if (nOptions & OPT_VERBOSE) { nStartTime = do_get_time(); }
+static int do_self_test_cache(const unsigned int nMaxWindowSize, const int nIsQuickTest) {
+    const size_t nTestSize = nIsQuickTest ? 10000 : 40000;
+    /* Settings that each make a different entry: the ones under test, another window size, and other flags */
+    const size_t nWindowSizes[3] = { nMaxWindowSize, (nMaxWindowSize != 16384) ? 16384 : 8192, nMaxWindowSize };
+    const unsigned int nFlags[3] = { 0, 0, APULTRA_FLAG_FAST_PARSE };
+    size_t nMaxCompressedSize = apultra_get_max_compressed_size(nTestSize);
+    unsigned char *pData = (unsigned char *)malloc(nTestSize);
+    unsigned char *pCompressedData = (unsigned char *)malloc(3 * nMaxCompressedSize);
+    unsigned char *pCachedData = (unsigned char *)malloc(nMaxCompressedSize);
+    size_t nCompressedSizes[3];
+    char szDirectory[4096];
+    self_test_files files;
+    self_test_options options;
+    apultra_cache cache;
+    long long nEntrySize = 0;
+    int nCacheOpen = 0;
+    int nResult = 0;
+    int i;
 
-    nDecompressedSize = apultra_decompress(
-        pCompressedData, pDecompressedData, nCompressedSize, nMaxDecompressedSize, nDictionarySize, nFlags);
-    if (nDecompressedSize == -1) {
-        free(pDecompressedData);
-        free(pOriginalData);
-        free(pCompressedData);
+#ifdef _WIN32
+    char szTempPath[MAX_PATH];
 
-        fprintf(stderr, "decompression error for '%s'\n", pszInFilename);
-        return 100;
+    if (!GetTempPathA(sizeof(szTempPath), szTempPath)) strcpy(szTempPath, ".");
+    snprintf(szDirectory, sizeof(szDirectory), "%s/apultra-self-test-%u", szTempPath, (unsigned int)GetCurrentProcessId());
+#else
+    const char *pszTempPath = getenv("TMPDIR");
+
+    snprintf(szDirectory,
+        sizeof(szDirectory),
+        "%s/apultra-self-test-%u",
+        pszTempPath ? pszTempPath : "/tmp",
+        (unsigned int)getpid());
+#endif
+    files.directory = szDirectory;
+    files.remove = 0;
+
+    memset(&options, 0, sizeof(options));
+    options.cache = &cache;
+
+    if (!pData || !pCompressedData || !pCachedData) {
+        fprintf(stderr, "out of memory\n");
+        nResult = 100;
     }
 
-    if (nOptions & OPT_BACKWARD) do_reverse_buffer(pDecompressedData + nDictionarySize, nDecompressedSize);
+    /* What each of the settings compresses to without the cache */
+    if (!nResult) {
+        generate_compressible_data(pData, nTestSize, 2024, 32, 0.6f);
+        for (i = 0; i < 3 && !nResult; i++) {
+            options.flags = nFlags[i];
+            options.max_window_size = nWindowSizes[i];
+            nCompressedSizes[i] = do_self_test_round_trip(
+                self_test_compress, &options, pData, nTestSize, pCompressedData + i * nMaxCompressedSize, NULL);
+            if (nCompressedSizes[i] == -1) {
+                fprintf(stderr, "self-test: error compressing data\n");
+                nResult = 100;
+            }
+        }
+    }
 
-    if (nDecompressedSize != nOriginalSize
-        || memcmp(pDecompressedData + nDictionarySize, pOriginalData, nOriginalSize)) {
-        fprintf(stderr, "error comparing compressed file '%s' with original '%s'\n", pszInFilename, pszOutFilename);
-        return 100;
+    if (!nResult) {
+        if (apultra_cache_open(&cache, szDirectory, 0)) {
+            fprintf(stderr, "self-test: error opening cache directory '%s'\n", szDirectory);
+            nResult = 100;
+        } else {
+            nCacheOpen = 1;
+        }
     }
 
-    free(pDecompressedData);
-    free(pOriginalData);
-    free(pCompressedData);
+    /* A miss stores the data, that the same settings then hit; the other settings each miss once. Then every
+     * entry is damaged, which must be noticed and make the lookups miss again */
+    for (i = 0; i < 8 && !nResult; i++) {
+        const int nSettings = (i < 6) ? (i >> 1) : 0;
+        const int nExpectHit = (i < 6) ? (i & 1) : (i == 7);
+        long long nHits = cache.stats.num_hits;
+        size_t nCachedSize;
+
+        if (i == 6 && apultra_list_directory(szDirectory, do_self_test_change_file, &files)) {
+            fprintf(stderr, "self-test: error damaging cache entries\n");
+            nResult = 100;
+            break;
+        }
 
-    if (nOptions & OPT_VERBOSE) {
-        nEndTime = do_get_time();
-        double fDelta = ((double)(nEndTime - nStartTime)) / 1000000.0;
-        double fSpeed = ((double)nOriginalSize / 1048576.0) / fDelta;
-        fprintf(stdout, "Compared '%s' in %g seconds, %g Mb/s\n", pszInFilename, fDelta, fSpeed);
+        options.flags = nFlags[nSettings];
+        options.max_window_size = nWindowSizes[nSettings];
+        nCachedSize = do_self_test_round_trip(self_test_compress_cached, &options, pData, nTestSize, pCachedData, NULL);
+        if (i == 0) nEntrySize = cache.stats.size;
+
+        if (nCachedSize != nCompressedSizes[nSettings]
+            || memcmp(pCachedData, pCompressedData + nSettings * nMaxCompressedSize, nCachedSize)) {
+            fprintf(stderr, "self-test: cached compression %d doesn't match compressing anew\n", i);
+            nResult = 100;
+        } else if ((cache.stats.num_hits - nHits) != nExpectHit) {
+            fprintf(stderr, "self-test: cached compression %d %s\n", i, nExpectHit ? "missed" : "hit");
+            nResult = 100;
+        }
     }
 
-    return 0;
-}
+    /* With room for one entry only, reopening the cache evicts all but the most recently used one */
+    if (!nResult) {
+        apultra_cache_close(&cache);
+        nCacheOpen = 0;
+        if (apultra_cache_open(&cache, szDirectory, nEntrySize + nEntrySize / 2)) {
+            fprintf(stderr, "self-test: error opening cache directory '%s'\n", szDirectory);
+            nResult = 100;
+        } else {
+            nCacheOpen = 1;
+            options.flags = nFlags[0];
+            options.max_window_size = nWindowSizes[0];
+            if (cache.stats.num_evictions != 2 || cache.stats.size != nEntrySize
+                || do_self_test_round_trip(self_test_compress_cached, &options, pData, nTestSize, pCachedData, NULL)
+                       != nCompressedSizes[0]
+                || cache.stats.num_hits != 1) {
+                fprintf(stderr, "self-test: evicting cache entries under a small maximum size failed\n");
+                nResult = 100;
+            }
+        }
+    }
 
-/*---------------------------------------------------------------------------*/
+    if (nCacheOpen) apultra_cache_close(&cache);
 
-static void generate_compressible_data(unsigned char *pBuffer,
-    size_t nBufferSize,
-    unsigned int nSeed,
-    int nNumLiteralValues,
-    float fMatchProbability) {
-    size_t nIndex = 0;
-    int nMatchProbability = (int)(fMatchProbability * 1023.0f);
+    files.remove = 1;
+    apultra_list_directory(szDirectory, do_self_test_change_file, &files);
+#ifdef _WIN32
+    RemoveDirectoryA(szDirectory);
+#else
+    rmdir(szDirectory);
+#endif
 
-    srand(nSeed);
+    if (pCachedData) free(pCachedData);
+    if (pCompressedData) free(pCompressedData);
+    if (pData) free(pData);
+    return nResult;
+}
 
-    if (nIndex >= nBufferSize) return;
-    pBuffer[nIndex++] = rand() % nNumLiteralValues;
+#define IOV_TEST_MAX_SPLITS 80
+
+static int do_self_test_iov(const unsigned int nMaxWindowSize, const int nIsQuickTest) {
+    /* The full test also splits the input where the second block starts, with the dictionary in front of it */
+    const size_t nTestSize = nIsQuickTest ? 80000 : (BLOCK_SIZE + 80000);
+    const size_t nDictionarySize = 20000;
+    const size_t nGapSize = 16;
+    size_t nMaxCompressedSize = apultra_get_max_compressed_size(nTestSize);
+    unsigned char *pData = (unsigned char *)malloc(nTestSize);
+    unsigned char *pScatteredData = (unsigned char *)malloc(nTestSize + (IOV_TEST_MAX_SPLITS + 1) * nGapSize);
+    unsigned char *pCompressedData = (unsigned char *)malloc(nMaxCompressedSize);
+    unsigned char *pIovCompressedData = (unsigned char *)malloc(nMaxCompressedSize);
+    apultra_input_segment segments[IOV_TEST_MAX_SPLITS + 1];
+    size_t nSplits[IOV_TEST_MAX_SPLITS];
+    size_t nLongMatchPos[3];
+    size_t nCompressedSize = -1;
+    self_test_options options;
+    int nNumLongMatches = 0;
+    int nResult = 0;
+    size_t j;
+    int i, k, s;
+
+    memset(&options, 0, sizeof(options));
+    options.max_window_size = nMaxWindowSize;
+    options.dictionary_size = nDictionarySize;
+    options.segments = segments;
+
+    if (!pData || !pScatteredData || !pCompressedData || !pIovCompressedData) {
+        fprintf(stderr, "out of memory\n");
+        nResult = 100;
+    }
 
-    while (nIndex < nBufferSize) {
-        if ((rand() & 1023) >= nMatchProbability) {
-            size_t nLiteralCount = rand() & 127;
-            if (nLiteralCount > (nBufferSize - nIndex)) nLiteralCount = nBufferSize - nIndex;
+    if (!nResult) {
+        /* Very long matches, that the input is split inside of */
+        nLongMatchPos[nNumLongMatches++] = 60000;
+        if (!nIsQuickTest) {
+            nLongMatchPos[nNumLongMatches++] = BLOCK_SIZE;
+            nLongMatchPos[nNumLongMatches++] = BLOCK_SIZE + nDictionarySize;
+        }
 
-            while (nLiteralCount--) pBuffer[nIndex++] = rand() % nNumLiteralValues;
-        } else {
-            size_t nMatchLength = MIN_MATCH_SIZE + (rand() & 1023);
-            size_t nMatchOffset;
+        generate_compressible_data(pData, nTestSize, 1415, 64, 0.5f);
+        for (k = 0; k < nNumLongMatches; k++) {
+            for (j = nLongMatchPos[k] - 1500; j < nLongMatchPos[k] + 1500; j++) pData[j] = pData[j - 5000];
+        }
 
-            if (nMatchLength > (nBufferSize - nIndex)) nMatchLength = nBufferSize - nIndex;
-            if (nMatchLength > nIndex) nMatchLength = nIndex;
+        nCompressedSize =
+            do_self_test_round_trip(self_test_compress, &options, pData, nTestSize, pCompressedData, NULL);
+        if (nCompressedSize == -1) {
+            fprintf(stderr, "self-test: error compressing data to compare with segmented input\n");
+            nResult = 100;
+        }
+    }
 
-            if (nMatchLength < nIndex)
-                nMatchOffset = rand() % (nIndex - nMatchLength);
-            else
-                nMatchOffset = 0;
+    /* Split the same input in a few and in many segments, with the dictionary split too, an empty segment and a
+     * one-byte one, and the segments apart in memory: the compressed data must not change */
+    for (i = 0; i < 2 && !nResult; i++) {
+        const int nNumRandomSplits = i ? (IOV_TEST_MAX_SPLITS - 16) : 8;
+        unsigned char *pSegmentData = pScatteredData;
+        size_t nSegmentStart = 0;
+        size_t nIovCompressedSize;
+        int nNumSplits = 0;
+        int nNumSegments = 0;
+
+        nSplits[nNumSplits++] = 0;
+        nSplits[nNumSplits++] = 7;
+        nSplits[nNumSplits++] = nDictionarySize - 3;
+        nSplits[nNumSplits++] = nDictionarySize;
+        nSplits[nNumSplits++] = nDictionarySize + 1;
+        for (k = 0; k < nNumLongMatches; k++) {
+            nSplits[nNumSplits++] = nLongMatchPos[k] - 1;
+            nSplits[nNumSplits++] = nLongMatchPos[k] + 33;
+        }
 
-            while (nMatchLength--) {
-                pBuffer[nIndex] = pBuffer[nIndex - nMatchOffset];
-                nIndex++;
+        srand(1617 + i);
+        for (k = 0; k < nNumRandomSplits; k++) nSplits[nNumSplits++] = ((size_t)rand() * (size_t)rand()) % nTestSize;
+
+        for (k = 1; k < nNumSplits; k++) {
+            for (s = k; s > 0 && nSplits[s - 1] > nSplits[s]; s--) {
+                const size_t nSplit = nSplits[s];
+                nSplits[s] = nSplits[s - 1];
+                nSplits[s - 1] = nSplit;
             }
         }
-    }
-}
 
-static void xor_data(unsigned char *pBuffer, size_t nBufferSize, unsigned int nSeed, float fXorProbability) {
-    size_t nIndex = 0;
-    int nXorProbability = (int)(fXorProbability * 1023.0f);
+        for (k = 0; k <= nNumSplits; k++) {
+            const size_t nSegmentEnd = (k < nNumSplits) ? nSplits[k] : nTestSize;
+            const size_t nSegmentSize = nSegmentEnd - nSegmentStart;
 
-    srand(nSeed);
+            /* Fill the gaps between the segments with bytes that would break matches running into them */
+            memset(pSegmentData, 0xa5 ^ k, nGapSize);
+            pSegmentData += nGapSize;
 
-    if (nIndex >= nBufferSize) return;
+            segments[nNumSegments].data = nSegmentSize ? pSegmentData : NULL;
+            segments[nNumSegments].size = nSegmentSize;
+            nNumSegments++;
 
-    while (nIndex < nBufferSize) {
-        if ((rand() & 1023) < nXorProbability) { pBuffer[nIndex] ^= 0xff; }
-        nIndex++;
+            memcpy(pSegmentData, pData + nSegmentStart, nSegmentSize);
+            pSegmentData += nSegmentSize;
+            nSegmentStart = nSegmentEnd;
+        }
+
+        options.num_segments = nNumSegments;
+        nIovCompressedSize =
+            do_self_test_round_trip(self_test_compress_iov, &options, pData, nTestSize, pIovCompressedData, NULL);
+        if (nIovCompressedSize != nCompressedSize || memcmp(pIovCompressedData, pCompressedData, nCompressedSize)) {
+            fprintf(stderr, "self-test: compressing data in %d segments doesn't give the same data\n", nNumSegments);
+            nResult = 100;
+        }
     }
+
+    if (pIovCompressedData) free(pIovCompressedData);
+    if (pCompressedData) free(pCompressedData);
+    if (pScatteredData) free(pScatteredData);
+    if (pData) free(pData);
+    return nResult;
 }
 
 static int do_self_test(const unsigned int nOptions, const unsigned int nMaxWindowSize, const int nIsQuickTest) {
@@ -674,6 +2238,7 @@ static int do_self_test(const unsigned int nOptions, const unsigned int nMaxWind
     size_t nMaxCompressedDataSize;
     unsigned int nSeed = 123;
     int nFlags = 0;
+    int nResult = 0;
     int i;
 
     pGeneratedData = (unsigned char *)malloc(4 * BLOCK_SIZE);
@@ -727,6 +2292,90 @@ static int do_self_test(const unsigned int nOptions, const unsigned int nMaxWind
             pGeneratedData, pCompressedData, i, i, nFlags, nMaxWindowSize, 0 /* dictionary size */, NULL, NULL);
     }
 
+    /* Test parsing and encoding separately, expected to give the same compressed data as compressing at once */
+    for (i = 0; i < (nIsQuickTest ? 2 : 3) && nResult == 0; i++) {
+        static const size_t nParseTestSizes[3] = { 1024, 70000, 2 * BLOCK_SIZE + 1000 };
+        static const size_t nParseDictionarySizes[3] = { 0, 30000, 0 };
+        const size_t nParseTestSize = nParseTestSizes[i];
+        const size_t nParseDictionarySize = nParseDictionarySizes[i];
+        apultra_token *pTokens = (apultra_token *)malloc(nParseTestSize * sizeof(apultra_token));
+        size_t nCompressedSize, nNumTokens, nEncodedSize = -1;
+
+        if (!pTokens) {
+            fprintf(stderr, "out of memory, %zd bytes needed\n", nParseTestSize * sizeof(apultra_token));
+            nResult = 100;
+            break;
+        }
+
+        generate_compressible_data(pGeneratedData, nParseTestSize, nSeed, 56, 0.5f);
+        nCompressedSize = apultra_compress(pGeneratedData,
+            pCompressedData,
+            nParseTestSize,
+            nMaxCompressedDataSize,
+            nFlags,
+            nMaxWindowSize,
+            nParseDictionarySize,
+            NULL,
+            NULL);
+        nNumTokens = apultra_parse(
+            pGeneratedData, pTokens, nParseTestSize, nParseTestSize, nFlags, nMaxWindowSize, nParseDictionarySize, NULL);
+        if (nNumTokens != -1) {
+            nEncodedSize = apultra_encode(pGeneratedData,
+                pTokens,
+                pTmpCompressedData,
+                nParseTestSize,
+                nNumTokens,
+                nMaxCompressedDataSize,
+                nMaxWindowSize,
+                nParseDictionarySize,
+                NULL);
+        }
+
+        if (nCompressedSize == -1 || nEncodedSize != nCompressedSize
+            || memcmp(pCompressedData, pTmpCompressedData, nCompressedSize)) {
+            fprintf(stderr, "self-test: parsing and encoding size %zd doesn't give the compressed data\n", nParseTestSize);
+            nResult = 100;
+        } else {
+            /* Commands that don't describe the data are expected to be refused */
+            pTokens[nNumTokens - 1].length++;
+            if (apultra_encode(pGeneratedData,
+                    pTokens,
+                    pTmpCompressedData,
+                    nParseTestSize,
+                    nNumTokens,
+                    nMaxCompressedDataSize,
+                    nMaxWindowSize,
+                    nParseDictionarySize,
+                    NULL)
+                != -1) {
+                fprintf(stderr, "self-test: encoding invalid commands for size %zd didn't fail\n", nParseTestSize);
+                nResult = 100;
+            }
+        }
+
+        free(pTokens);
+    }
+
+    if (!nResult) nResult = do_self_test_recompress(nMaxWindowSize, nIsQuickTest);
+    if (!nResult) nResult = do_self_test_threads(nMaxWindowSize, nIsQuickTest);
+    if (!nResult) nResult = do_self_test_window(nIsQuickTest);
+    if (!nResult) nResult = do_self_test_multi(nIsQuickTest);
+    if (!nResult) nResult = do_self_test_iov(nMaxWindowSize, nIsQuickTest);
+    if (!nResult) nResult = do_self_test_dictionary_index(nMaxWindowSize);
+    if (!nResult) nResult = do_self_test_cache(nMaxWindowSize, nIsQuickTest);
+
+    if (nResult) {
+        free(pTmpDecompressedData);
+        pTmpDecompressedData = NULL;
+        free(pTmpCompressedData);
+        pTmpCompressedData = NULL;
+        free(pCompressedData);
+        pCompressedData = NULL;
+        free(pGeneratedData);
+        pGeneratedData = NULL;
+        return nResult;
+    }
+
     size_t nDataSizeStep = 128;
     float fProbabilitySizeStep = nIsQuickTest ? 0.005f : 0.0005f;
 
@@ -867,6 +2516,237 @@ static int do_self_test(const unsigned int nOptions, const unsigned int nMaxWind
 
 /*---------------------------------------------------------------------------*/
 
+#define CYCLES_TEST_MAX_MODELS 16
+
+static int do_cycles_test(const char *pszBaselineFilename,
+    const unsigned int nOptions,
+    const unsigned int nMaxWindowSize) {
+    unsigned char *pGeneratedData;
+    unsigned char *pCompressedData;
+    unsigned char *pTmpDecompressedData;
+    /* The largest size still fits in the 64 KB of the emulated CPUs, along with its compressed data */
+    const size_t nDataSizes[4] = { 1024, 4096, 16384, 24576 };
+    const int nNumLiteralValues[4] = { 2, 15, 96, 256 };
+    const float fMatchProbabilities[3] = { 0.1f, 0.5f, 0.9f };
+    long long nTotalCycles[CYCLES_TEST_MAX_MODELS];
+    long long nTotalExecutedCycles[CYCLES_TEST_MAX_MODELS];
+    const apultra_emulated_decompressor *pEmulated[CYCLES_TEST_MAX_MODELS];
+    long long nTotalDecompressedSize = 0;
+    int nNumModels = apultra_get_cycle_model_count();
+    size_t nMaxCompressedDataSize;
+    unsigned int nSeed = 123;
+    int nFlags = 0;
+    int nResult = 0;
+    int i, j, k, m;
+
+    if (nNumModels > CYCLES_TEST_MAX_MODELS) nNumModels = CYCLES_TEST_MAX_MODELS;
+    memset(nTotalCycles, 0, sizeof(nTotalCycles));
+    memset(nTotalExecutedCycles, 0, sizeof(nTotalExecutedCycles));
+
+    /* Run the decompressors that can be emulated, and compare the models against the cycles that they really take */
+    for (m = 0; m < nNumModels; m++) {
+        pEmulated[m] = NULL;
+        for (i = 0; i < apultra_get_emulated_decompressor_count(); i++) {
+            if (!strcmp(apultra_get_emulated_decompressor(i)->name, apultra_get_cycle_model(m)->name))
+                pEmulated[m] = apultra_get_emulated_decompressor(i);
+        }
+    }
+
+    nMaxCompressedDataSize = apultra_get_max_compressed_size(24576);
+    pGeneratedData = (unsigned char *)malloc(24576);
+    pCompressedData = (unsigned char *)malloc(nMaxCompressedDataSize);
+    pTmpDecompressedData = (unsigned char *)malloc(24576);
+    if (!pGeneratedData || !pCompressedData || !pTmpDecompressedData) {
+        if (pTmpDecompressedData) free(pTmpDecompressedData);
+        if (pCompressedData) free(pCompressedData);
+        if (pGeneratedData) free(pGeneratedData);
+        fprintf(stderr, "out of memory\n");
+        return 100;
+    }
+
+    for (i = 0; i < 4 && !nResult; i++) {
+        size_t nGeneratedDataSize = nDataSizes[i];
+
+        fprintf(stdout, "size %zd", nGeneratedDataSize);
+        for (j = 0; j < 3 && !nResult; j++) {
+            for (k = 0; k < 4 && !nResult; k++) {
+                apultra_decode_profile profile;
+                size_t nActualCompressedSize, nActualDecompressedSize;
+
+                fputc('.', stdout);
+                fflush(stdout);
+
+                generate_compressible_data(
+                    pGeneratedData, nGeneratedDataSize, nSeed, nNumLiteralValues[k], fMatchProbabilities[j]);
+
+                nActualCompressedSize = apultra_compress(pGeneratedData,
+                    pCompressedData,
+                    nGeneratedDataSize,
+                    nMaxCompressedDataSize,
+                    nFlags,
+                    nMaxWindowSize,
+                    0 /* dictionary size */,
+                    NULL,
+                    NULL);
+                if (nActualCompressedSize == -1) {
+                    fprintf(stderr, "\ncycles test: error compressing size %zd, seed %d\n", nGeneratedDataSize, nSeed);
+                    nResult = 100;
+                    break;
+                }
+
+                /* Check the reference decompressor and the modeled one against the original data */
+                nActualDecompressedSize = apultra_decompress(pCompressedData,
+                    pTmpDecompressedData,
+                    nActualCompressedSize,
+                    nGeneratedDataSize,
+                    0 /* dictionary size */,
+                    nFlags);
+                if (nActualDecompressedSize != nGeneratedDataSize ||
+                    memcmp(pGeneratedData, pTmpDecompressedData, nGeneratedDataSize)) {
+                    fprintf(stderr,
+                        "\ncycles test: reference decompressor mismatch, size %zd, seed %d\n",
+                        nGeneratedDataSize,
+                        nSeed);
+                    nResult = 100;
+                    break;
+                }
+
+                memset(pTmpDecompressedData, 0, nGeneratedDataSize);
+                nActualDecompressedSize = apultra_profile_decompression(pCompressedData,
+                    pTmpDecompressedData,
+                    nActualCompressedSize,
+                    nGeneratedDataSize,
+                    nFlags,
+                    &profile);
+                if (nActualDecompressedSize != nGeneratedDataSize ||
+                    memcmp(pGeneratedData, pTmpDecompressedData, nGeneratedDataSize)) {
+                    fprintf(stderr,
+                        "\ncycles test: modeled decompressor mismatch, size %zd, seed %d\n",
+                        nGeneratedDataSize,
+                        nSeed);
+                    nResult = 100;
+                    break;
+                }
+
+                for (m = 0; m < nNumModels && !nResult; m++) {
+                    nTotalCycles[m] += apultra_estimate_cycles(&profile, apultra_get_cycle_model(m));
+
+                    if (pEmulated[m]) {
+                        long long nCycles = 0;
+
+                        memset(pTmpDecompressedData, 0, nGeneratedDataSize);
+                        nActualDecompressedSize = apultra_emulate_decompression(pEmulated[m],
+                            pCompressedData,
+                            pTmpDecompressedData,
+                            nActualCompressedSize,
+                            nGeneratedDataSize,
+                            &nCycles);
+                        if (nActualDecompressedSize != nGeneratedDataSize ||
+                            memcmp(pGeneratedData, pTmpDecompressedData, nGeneratedDataSize)) {
+                            fprintf(stderr,
+                                "\ncycles test: %s mismatch, size %zd, seed %d\n",
+                                pEmulated[m]->name,
+                                nGeneratedDataSize,
+                                nSeed);
+                            nResult = 100;
+                            break;
+                        }
+
+                        nTotalExecutedCycles[m] += nCycles;
+                    }
+                }
+                if (nResult) break;
+                nTotalDecompressedSize += nGeneratedDataSize;
+
+                nSeed++;
+            }
+        }
+
+        fputc(10, stdout);
+        fflush(stdout);
+    }
+
+    free(pTmpDecompressedData);
+    free(pCompressedData);
+    free(pGeneratedData);
+
+    if (nResult) return nResult;
+
+    for (m = 0; m < nNumModels; m++) {
+        const apultra_cycle_model *pModel = apultra_get_cycle_model(m);
+
+        if (pEmulated[m]) {
+            /* Report what the asm really took, and how far off the model is */
+            fprintf(stdout,
+                "%-24s %12lld %s (%.2f per byte), executed; model: %lld (%+.1f%%)\n",
+                pModel->name,
+                nTotalExecutedCycles[m],
+                pModel->unit,
+                (double)nTotalExecutedCycles[m] / (double)nTotalDecompressedSize,
+                nTotalCycles[m],
+                100.0 * (double)(nTotalCycles[m] - nTotalExecutedCycles[m]) / (double)nTotalExecutedCycles[m]);
+
+            /* Track the real cycles for the baseline */
+            nTotalCycles[m] = nTotalExecutedCycles[m];
+        } else {
+            fprintf(stdout,
+                "%-24s %12lld %s (%.2f per byte), estimated\n",
+                pModel->name,
+                nTotalCycles[m],
+                pModel->unit,
+                (double)nTotalCycles[m] / (double)nTotalDecompressedSize);
+        }
+    }
+
+    if (pszBaselineFilename) {
+        FILE *f_baseline = fopen(pszBaselineFilename, "r");
+
+        if (f_baseline) {
+            /* Compare against recorded totals, fail if any decompressor got more than 0.5% slower */
+            char szName[256];
+            long long nBaselineCycles;
+
+            while (fscanf(f_baseline, "%255s %lld", szName, &nBaselineCycles) == 2) {
+                for (m = 0; m < nNumModels; m++) {
+                    if (!strcmp(szName, apultra_get_cycle_model(m)->name)) {
+                        if (nTotalCycles[m] * 1000LL > nBaselineCycles * 1005LL) {
+                            fprintf(stderr,
+                                "cycles test: %s regressed from %lld to %lld\n",
+                                szName,
+                                nBaselineCycles,
+                                nTotalCycles[m]);
+                            nResult = 100;
+                        } else if ((nOptions & OPT_VERBOSE) && nTotalCycles[m] != nBaselineCycles) {
+                            fprintf(stdout, "%s: %lld -> %lld\n", szName, nBaselineCycles, nTotalCycles[m]);
+                        }
+                    }
+                }
+            }
+
+            fclose(f_baseline);
+        } else {
+            /* No baseline yet, record this run */
+            f_baseline = fopen(pszBaselineFilename, "w");
+            if (!f_baseline) {
+                fprintf(stderr, "error opening '%s' for writing\n", pszBaselineFilename);
+                return 100;
+            }
+
+            for (m = 0; m < nNumModels; m++) {
+                fprintf(f_baseline, "%s %lld\n", apultra_get_cycle_model(m)->name, nTotalCycles[m]);
+            }
+
+            fclose(f_baseline);
+            fprintf(stdout, "baseline written to '%s'\n", pszBaselineFilename);
+        }
+    }
+
+    if (!nResult) fprintf(stdout, "All tests passed.\n");
+    return nResult;
+}
+
+/*---------------------------------------------------------------------------*/
+
 static int do_compr_benchmark(const char *pszInFilename,
     const char *pszOutFilename,
     const char *pszDictionaryFilename,
@@ -875,7 +2755,7 @@ static int do_compr_benchmark(const char *pszInFilename,
     size_t nFileSize, nMaxCompressedSize;
     unsigned char *pFileData;
     unsigned char *pCompressedData;
-    int nFlags = 0;
+    int nFlags = (nOptions & OPT_FAST) ? APULTRA_FLAG_FAST_PARSE : 0;
     int i;
 
     if (pszDictionaryFilename) {
@@ -1122,17 +3002,522 @@ static int do_dec_benchmark(const char *pszInFilename,
 
 /*---------------------------------------------------------------------------*/
 
+/** Results of benchmarking one file of a corpus */
+typedef struct {
+    char *name;
+    size_t original_size;
+    size_t compressed_size;
+    double best_comp_mbs;
+    double median_comp_mbs;
+    double best_dec_mbs;
+    double median_dec_mbs;
+    const char *error; /* why the file couldn't be benchmarked, or NULL if it was */
+} bench_result;
+
+static int do_compare_names(const void *pA, const void *pB) {
+    return strcmp(*(const char *const *)pA, *(const char *const *)pB);
+}
+
+static double do_get_mbs(const size_t nSize, const long long nTime) {
+    /* Times are in microseconds, so bytes per microsecond are MB/s */
+    return (double)nSize / (double)(nTime > 0 ? nTime : 1);
+}
+
+static int do_compare_times(const void *pA, const void *pB) {
+    long long nA = *(const long long *)pA, nB = *(const long long *)pB;
+    return (nA > nB) - (nA < nB);
+}
+
+/** Names of the files in a directory, as they are listed */
+typedef struct {
+    char **names;
+    int num_names;
+    int max_names;
+    int out_of_memory;
+} dir_listing;
+
+static int do_add_listed_name(void *pUserData, const char *pszName, long long nSize, long long nTime) {
+    dir_listing *pListing = (dir_listing *)pUserData;
+
+    if (pListing->num_names == pListing->max_names) {
+        int nMaxNames = pListing->max_names ? (pListing->max_names * 2) : 64;
+        char **pNewNames = (char **)realloc(pListing->names, nMaxNames * sizeof(char *));
+
+        if (!pNewNames) {
+            pListing->out_of_memory = 1;
+            return -1;
+        }
+        pListing->names = pNewNames;
+        pListing->max_names = nMaxNames;
+    }
+
+    pListing->names[pListing->num_names] = (char *)malloc(strlen(pszName) + 1);
+    if (!pListing->names[pListing->num_names]) {
+        pListing->out_of_memory = 1;
+        return -1;
+    }
+    strcpy(pListing->names[pListing->num_names], pszName);
+    pListing->num_names++;
+    return 0;
+}
+
+/**
+ * List the regular files in a directory, sorted by name. Errors are reported here; a directory that can't be listed
+ * completely is not returned at all
+ *
+ * @param pszDirName directory name
+ * @param pNumNames pointer to returned number of names
+ *
+ * @return array of allocated names (to be freed along with each name), or NULL for error
+ */
+static char **do_list_directory(const char *pszDirName, int *pNumNames) {
+    dir_listing listing;
+    int nResult;
+    int i;
+
+    memset(&listing, 0, sizeof(dir_listing));
+    nResult = apultra_list_directory(pszDirName, do_add_listed_name, &listing);
+    if (!nResult && !listing.names) {
+        listing.names = (char **)malloc(sizeof(char *));
+        if (!listing.names) {
+            listing.out_of_memory = 1;
+            nResult = -1;
+        }
+    }
+
+    /* Benchmarking only part of a corpus would give misleading totals */
+    if (nResult) {
+        for (i = 0; i < listing.num_names; i++) free(listing.names[i]);
+        if (listing.names) free(listing.names);
+        if (listing.out_of_memory)
+            fprintf(stderr, "out of memory listing directory '%s'\n", pszDirName);
+        else
+            fprintf(stderr, "error listing directory '%s'\n", pszDirName);
+        return NULL;
+    }
+
+    qsort(listing.names, listing.num_names, sizeof(char *), do_compare_names);
+
+    *pNumNames = listing.num_names;
+    return listing.names;
+}
+
+/**
+ * Benchmark compression and decompression of one file
+ *
+ * @param pszInFilename name of file to benchmark
+ * @param nOptions tool options
+ * @param nMaxWindowSize maximum window size to use (0 for default)
+ * @param nRepetitions number of timed runs, after one warm-up run
+ * @param pResult pointer to returned results
+ *
+ * @return 0 for success, non-zero for failure
+ */
+static int do_bench_file(const char *pszInFilename,
+    const unsigned int nOptions,
+    const unsigned int nMaxWindowSize,
+    const int nRepetitions,
+    bench_result *pResult) {
+    size_t nFileSize, nMaxCompressedSize, nCompressedSize = 0;
+    unsigned char *pFileData;
+    unsigned char *pCompressedData;
+    unsigned char *pDecompressedData;
+    long long *pCompTimes;
+    long long *pDecTimes;
+    int nFlags = (nOptions & OPT_FAST) ? APULTRA_FLAG_FAST_PARSE : 0;
+    int nResult = 0;
+    int i;
+
+    memset(pResult, 0, sizeof(bench_result));
+
+    FILE *f_in = fopen(pszInFilename, "rb");
+    if (!f_in) {
+        fprintf(stderr, "error opening '%s' for reading\n", pszInFilename);
+        pResult->error = "open error";
+        return 100;
+    }
+
+    fseek(f_in, 0, SEEK_END);
+    nFileSize = (size_t)ftell(f_in);
+    fseek(f_in, 0, SEEK_SET);
+
+    nMaxCompressedSize = apultra_get_max_compressed_size(nFileSize);
+    pFileData = (unsigned char *)malloc(nFileSize ? nFileSize : 1);
+    pCompressedData = (unsigned char *)malloc(nMaxCompressedSize);
+    pDecompressedData = (unsigned char *)malloc(nFileSize ? nFileSize : 1);
+    pCompTimes = (long long *)malloc(nRepetitions * sizeof(long long));
+    pDecTimes = (long long *)malloc(nRepetitions * sizeof(long long));
+
+    pResult->original_size = nFileSize;
+
+    if (!pFileData || !pCompressedData || !pDecompressedData || !pCompTimes || !pDecTimes) {
+        fprintf(stderr, "out of memory for benchmarking '%s'\n", pszInFilename);
+        pResult->error = "out of memory";
+        nResult = 100;
+    } else if (fread(pFileData, 1, nFileSize, f_in) != nFileSize) {
+        fprintf(stderr, "I/O error while reading '%s'\n", pszInFilename);
+        pResult->error = "read error";
+        nResult = 100;
+    }
+
+    fclose(f_in);
+
+    if (!nResult && !nFileSize) {
+        fprintf(stderr, "skipping empty file '%s'\n", pszInFilename);
+        nResult = 1;
+    }
+
+    if (!nResult) {
+        if (nOptions & OPT_BACKWARD) do_reverse_buffer(pFileData, nFileSize);
+
+        /* Run once to warm up, then time each repetition */
+        for (i = -1; i < nRepetitions && !nResult; i++) {
+            long long t0 = do_get_time();
+            nCompressedSize = apultra_compress(pFileData,
+                pCompressedData,
+                nFileSize,
+                nMaxCompressedSize,
+                nFlags,
+                nMaxWindowSize,
+                0 /* dictionary size */,
+                NULL,
+                NULL);
+            long long t1 = do_get_time();
+
+            if (nCompressedSize == -1) {
+                fprintf(stderr, "compression error for '%s'\n", pszInFilename);
+                pResult->error = "compression error";
+                nResult = 100;
+            } else if (i >= 0) {
+                pCompTimes[i] = t1 - t0;
+            }
+        }
+
+        for (i = -1; i < nRepetitions && !nResult; i++) {
+            long long t0 = do_get_time();
+            size_t nDecompressedSize = apultra_decompress(
+                pCompressedData, pDecompressedData, nCompressedSize, nFileSize, 0 /* dictionary size */, 0);
+            long long t1 = do_get_time();
+
+            if (nDecompressedSize != nFileSize || memcmp(pDecompressedData, pFileData, nFileSize)) {
+                fprintf(stderr, "decompressed data does not match '%s'\n", pszInFilename);
+                pResult->error = "decompressed data does not match";
+                nResult = 100;
+            } else if (i >= 0) {
+                pDecTimes[i] = t1 - t0;
+            }
+        }
+    }
+
+    if (!nResult) {
+        qsort(pCompTimes, nRepetitions, sizeof(long long), do_compare_times);
+        qsort(pDecTimes, nRepetitions, sizeof(long long), do_compare_times);
+
+        /* Report the fastest run, which has the least noise, and the median run */
+        pResult->compressed_size = nCompressedSize;
+        pResult->best_comp_mbs = do_get_mbs(nFileSize, pCompTimes[0]);
+        pResult->median_comp_mbs = do_get_mbs(nFileSize, pCompTimes[nRepetitions / 2]);
+        pResult->best_dec_mbs = do_get_mbs(nFileSize, pDecTimes[0]);
+        pResult->median_dec_mbs = do_get_mbs(nFileSize, pDecTimes[nRepetitions / 2]);
+    }
+
+    if (pDecTimes) free(pDecTimes);
+    if (pCompTimes) free(pCompTimes);
+    if (pDecompressedData) free(pDecompressedData);
+    if (pCompressedData) free(pCompressedData);
+    if (pFileData) free(pFileData);
+
+    return nResult;
+}
+
+/**
+ * Write a quoted string to a results file
+ *
+ * @param f_out file to write to
+ * @param pszStr string to write
+ * @param cQuote character that escapes a quote: '\\' for JSON, which also escapes control characters, '"' for CSV
+ */
+static void do_write_escaped(FILE *f_out, const char *pszStr, const char cQuote) {
+    fputc('"', f_out);
+    while (*pszStr) {
+        const unsigned char c = (unsigned char)*pszStr++;
+
+        if (c < 0x20 && cQuote == '\\') {
+            fprintf(f_out, "\\u%04x", c);
+            continue;
+        }
+        if (c == '"') {
+            fputc(cQuote, f_out);
+        } else if (c == '\\' && cQuote == '\\') {
+            fputc('\\', f_out);
+        }
+        fputc(c, f_out);
+    }
+    fputc('"', f_out);
+}
+
+static int do_bench_dir(const char *pszDirName,
+    const char *pszResultsFilename,
+    const unsigned int nOptions,
+    const unsigned int nMaxWindowSize,
+    const int nRepetitions) {
+    bench_result *pResults;
+    char **pNames;
+    int nNumNames = 0, nNumResults = 0;
+    int nResult = 0;
+    int i;
+
+    pNames = do_list_directory(pszDirName, &nNumNames);
+    if (!pNames) return 100;
+
+    pResults = (bench_result *)malloc((nNumNames ? nNumNames : 1) * sizeof(bench_result));
+    if (!pResults) {
+        for (i = 0; i < nNumNames; i++) free(pNames[i]);
+        free(pNames);
+        fprintf(stderr, "out of memory\n");
+        return 100;
+    }
+
+    fprintf(stdout,
+        "%-32s %10s %10s %7s %12s %12s %12s %12s\n",
+        "file",
+        "size",
+        "packed",
+        "ratio",
+        "comp MB/s",
+        "(median)",
+        "dec MB/s",
+        "(median)");
+
+    /* A file that fails is reported as such, and doesn't stop the other ones from being benchmarked */
+    for (i = 0; i < nNumNames; i++) {
+        char szPath[4096];
+        int nFileResult;
+
+        snprintf(szPath, sizeof(szPath), "%s/%s", pszDirName, pNames[i]);
+        nFileResult = do_bench_file(szPath, nOptions, nMaxWindowSize, nRepetitions, &pResults[nNumResults]);
+        if (nFileResult == 0) {
+            bench_result *pResult = &pResults[nNumResults++];
+
+            pResult->name = pNames[i];
+            fprintf(stdout,
+                "%-32s %10zd %10zd %6.2f%% %12.3f %12.3f %12.3f %12.3f\n",
+                pResult->name,
+                pResult->original_size,
+                pResult->compressed_size,
+                (double)pResult->compressed_size * 100.0 / (double)pResult->original_size,
+                pResult->best_comp_mbs,
+                pResult->median_comp_mbs,
+                pResult->best_dec_mbs,
+                pResult->median_dec_mbs);
+            fflush(stdout);
+        } else if (nFileResult != 1) {
+            bench_result *pResult = &pResults[nNumResults++];
+
+            pResult->name = pNames[i];
+            fprintf(stdout, "%-32s failed: %s\n", pResult->name, pResult->error);
+            fflush(stdout);
+            nResult = nFileResult;
+        }
+    }
+
+    if (pszResultsFilename) {
+        size_t nNameLen = strlen(pszResultsFilename);
+        int nIsJson = (nNameLen >= 5 && !strcmp(pszResultsFilename + nNameLen - 5, ".json")) ? 1 : 0;
+        FILE *f_out = fopen(pszResultsFilename, "w");
+
+        if (f_out) {
+            if (nIsJson) {
+                fprintf(f_out,
+                    "{\n  \"version\": \"" TOOL_VERSION "\",\n  \"repetitions\": %d,\n  \"files\": [",
+                    nRepetitions);
+            } else {
+                fprintf(f_out,
+                    "file,original_size,compressed_size,ratio,best_comp_mbs,median_comp_mbs,best_dec_mbs,"
+                    "median_dec_mbs,error\n");
+            }
+
+            for (i = 0; i < nNumResults; i++) {
+                const bench_result *pResult = &pResults[i];
+                double fRatio = (double)pResult->compressed_size / (double)pResult->original_size;
+
+                if (pResult->error) {
+                    if (nIsJson) {
+                        fprintf(f_out, "%s\n    { \"file\": ", i ? "," : "");
+                        do_write_escaped(f_out, pResult->name, '\\');
+                        fprintf(f_out, ", \"original_size\": %zd, \"error\": ", pResult->original_size);
+                        do_write_escaped(f_out, pResult->error, '\\');
+                        fprintf(f_out, " }");
+                    } else {
+                        do_write_escaped(f_out, pResult->name, '"');
+                        fprintf(f_out, ",%zd,,,,,,,", pResult->original_size);
+                        do_write_escaped(f_out, pResult->error, '"');
+                        fprintf(f_out, "\n");
+                    }
+                } else if (nIsJson) {
+                    fprintf(f_out, "%s\n    { \"file\": ", i ? "," : "");
+                    do_write_escaped(f_out, pResult->name, '\\');
+                    fprintf(f_out,
+                        ", \"original_size\": %zd, \"compressed_size\": %zd, \"ratio\": %.6f, "
+                        "\"best_comp_mbs\": %.3f, \"median_comp_mbs\": %.3f, \"best_dec_mbs\": %.3f, "
+                        "\"median_dec_mbs\": %.3f }",
+                        pResult->original_size,
+                        pResult->compressed_size,
+                        fRatio,
+                        pResult->best_comp_mbs,
+                        pResult->median_comp_mbs,
+                        pResult->best_dec_mbs,
+                        pResult->median_dec_mbs);
+                } else {
+                    do_write_escaped(f_out, pResult->name, '"');
+                    fprintf(f_out,
+                        ",%zd,%zd,%.6f,%.3f,%.3f,%.3f,%.3f,\n",
+                        pResult->original_size,
+                        pResult->compressed_size,
+                        fRatio,
+                        pResult->best_comp_mbs,
+                        pResult->median_comp_mbs,
+                        pResult->best_dec_mbs,
+                        pResult->median_dec_mbs);
+                }
+            }
+
+            if (nIsJson) fprintf(f_out, "\n  ]\n}\n");
+            fclose(f_out);
+        } else {
+            fprintf(stderr, "error opening '%s' for writing\n", pszResultsFilename);
+            nResult = 100;
+        }
+    }
+
+    free(pResults);
+    for (i = 0; i < nNumNames; i++) free(pNames[i]);
+    free(pNames);
+
+    return nResult;
+}
+
+/*---------------------------------------------------------------------------*/
+
+static int do_cycles(const char *pszInFilename, const unsigned int nOptions) {
+    size_t nFileSize, nMaxDecompressedSize, nDecompressedSize;
+    unsigned char *pFileData, *pDecompressedData;
+    apultra_decode_profile profile;
+    int nFlags = 0;
+    int i;
+
+    /* Read the whole compressed file in memory */
+
+    FILE *f_in = fopen(pszInFilename, "rb");
+    if (!f_in) {
+        fprintf(stderr, "error opening '%s' for reading\n", pszInFilename);
+        return 100;
+    }
+
+    fseek(f_in, 0, SEEK_END);
+    nFileSize = (size_t)ftell(f_in);
+    fseek(f_in, 0, SEEK_SET);
+
+    pFileData = (unsigned char *)malloc(nFileSize);
+    if (!pFileData) {
+        fclose(f_in);
+        fprintf(stderr, "out of memory for reading '%s', %zd bytes needed\n", pszInFilename, nFileSize);
+        return 100;
+    }
+
+    if (fread(pFileData, 1, nFileSize, f_in) != nFileSize) {
+        free(pFileData);
+        fclose(f_in);
+        fprintf(stderr, "I/O error while reading '%s'\n", pszInFilename);
+        return 100;
+    }
+
+    fclose(f_in);
+
+    if (nOptions & OPT_BACKWARD) do_reverse_buffer(pFileData, nFileSize);
+
+    nMaxDecompressedSize = apultra_get_max_decompressed_size(pFileData, nFileSize, nFlags);
+    if (nMaxDecompressedSize == -1) {
+        free(pFileData);
+        fprintf(stderr, "invalid compressed format for file '%s'\n", pszInFilename);
+        return 100;
+    }
+
+    pDecompressedData = (unsigned char *)malloc(nMaxDecompressedSize ? nMaxDecompressedSize : 1);
+    if (!pDecompressedData) {
+        free(pFileData);
+        fprintf(stderr, "out of memory for decompressing '%s', %zd bytes needed\n", pszInFilename, nMaxDecompressedSize);
+        return 100;
+    }
+
+    nDecompressedSize =
+        apultra_profile_decompression(pFileData, pDecompressedData, nFileSize, nMaxDecompressedSize, nFlags, &profile);
+    free(pDecompressedData);
+    free(pFileData);
+
+    if (nDecompressedSize == -1) {
+        fprintf(stderr, "invalid compressed format for file '%s'\n", pszInFilename);
+        return 100;
+    }
+
+    fprintf(stdout, "compressed size: %zd bytes, decompressed size: %zd bytes\n", nFileSize, nDecompressedSize);
+
+    if (nOptions & OPT_VERBOSE) {
+        fprintf(stdout,
+            "literals: %lld, large matches: %lld, rep matches: %lld, 7-bit matches: %lld, 4-bit matches: %lld, zeroes: "
+            "%lld\n",
+            profile.num_literals,
+            profile.num_large_matches,
+            profile.num_rep_matches,
+            profile.num_7bit_matches,
+            profile.num_4bit_matches,
+            profile.num_4bit_zeroes);
+        fprintf(stdout,
+            "gamma2 values: %lld (%lld bit pairs), tag bytes: %lld, matched bytes: %lld\n",
+            profile.num_gamma2_values,
+            profile.num_gamma2_pairs,
+            profile.num_tag_bytes,
+            profile.num_match_bytes);
+    }
+
+    for (i = 0; i < apultra_get_cycle_model_count(); i++) {
+        const apultra_cycle_model *pModel = apultra_get_cycle_model(i);
+        long long nCycles = apultra_estimate_cycles(&profile, pModel);
+
+        fprintf(stdout,
+            "%-24s %12lld %s (%.2f per byte)\n",
+            pModel->name,
+            nCycles,
+            pModel->unit,
+            nDecompressedSize ? ((double)nCycles / (double)nDecompressedSize) : 0.0);
+    }
+
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
 int main(int argc, char **argv) {
     int i;
     const char *pszInFilename = NULL;
     const char *pszOutFilename = NULL;
     const char *pszDictionaryFilename = NULL;
+    const char *pszDictionaryIndexFilename = NULL;
+    const char *pszCacheDirName = NULL;
+    long long nMaxCacheSize = 0;
+    const char *pszPreviousInFilename = NULL;
+    const char *pszPreviousOutFilename = NULL;
     int nArgsError = 0;
     int nCommandDefined = 0;
     int nVerifyCompression = 0;
     char cCommand = 'z';
     unsigned int nOptions = 0;
     unsigned int nMaxWindowSize = 0;
+    size_t nMaxWindowSizes[MAX_WINDOW_SIZES];
+    int nNumWindowSizes = 0;
+    const char *pszBenchDirName = NULL;
+    int nRepetitions = 0;
+    int nThreads = 0;
 
     for (i = 1; i < argc; i++) {
         if (!strcmp(argv[i], "-d")) {
@@ -1176,6 +3561,85 @@ int main(int argc, char **argv) {
                 cCommand = 'T';
             } else
                 nArgsError = 1;
+        } else if (!strcmp(argv[i], "-bench-dir")) {
+            if (!nCommandDefined && (i + 1) < argc) {
+                nCommandDefined = 1;
+                cCommand = 'R';
+                pszBenchDirName = argv[i + 1];
+                i++;
+            } else
+                nArgsError = 1;
+        } else if (!strcmp(argv[i], "-reps")) {
+            if (!nRepetitions && (i + 1) < argc) {
+                char *pEnd = NULL;
+                nRepetitions = (int)strtol(argv[i + 1], &pEnd, 10);
+                if (pEnd && pEnd != argv[i + 1] && (nRepetitions >= 1 && nRepetitions <= 1000)) {
+                    i++;
+                } else {
+                    nArgsError = 1;
+                }
+            } else
+                nArgsError = 1;
+        } else if (!strcmp(argv[i], "-threads")) {
+            if (!nThreads && (i + 1) < argc) {
+                char *pEnd = NULL;
+                nThreads = (int)strtol(argv[i + 1], &pEnd, 10);
+                if (pEnd && pEnd != argv[i + 1] && (nThreads >= 1 && nThreads <= APULTRA_MAX_THREADS)) {
+                    i++;
+                } else {
+                    nArgsError = 1;
+                }
+            } else
+                nArgsError = 1;
+        } else if (!strcmp(argv[i], "-cyclestest")) {
+            if (!nCommandDefined) {
+                nCommandDefined = 1;
+                cCommand = 'C';
+            } else
+                nArgsError = 1;
+        } else if (!strcmp(argv[i], "-cycles")) {
+            if (!nCommandDefined) {
+                nCommandDefined = 1;
+                cCommand = 'c';
+            } else
+                nArgsError = 1;
+        } else if (!strcmp(argv[i], "-mkdictindex")) {
+            if (!nCommandDefined) {
+                nCommandDefined = 1;
+                cCommand = 'I';
+            } else
+                nArgsError = 1;
+        } else if (!strcmp(argv[i], "-cache")) {
+            if (!pszCacheDirName && (i + 1) < argc) {
+                pszCacheDirName = argv[i + 1];
+                i++;
+            } else
+                nArgsError = 1;
+        } else if (!strcmp(argv[i], "-prev")) {
+            if (!pszPreviousInFilename && (i + 2) < argc) {
+                pszPreviousInFilename = argv[i + 1];
+                pszPreviousOutFilename = argv[i + 2];
+                i += 2;
+            } else
+                nArgsError = 1;
+        } else if (!strcmp(argv[i], "-cachesize")) {
+            if (!nMaxCacheSize && (i + 1) < argc) {
+                char *pEnd = NULL;
+                nMaxCacheSize = strtoll(argv[i + 1], &pEnd, 10);
+                if (pEnd && pEnd != argv[i + 1] && (nMaxCacheSize >= 1 && nMaxCacheSize <= 1048576)) {
+                    nMaxCacheSize *= 1024LL * 1024LL;
+                    i++;
+                } else {
+                    nArgsError = 1;
+                }
+            } else
+                nArgsError = 1;
+        } else if (!strcmp(argv[i], "-Di")) {
+            if (!pszDictionaryIndexFilename && (i + 1) < argc) {
+                pszDictionaryIndexFilename = argv[i + 1];
+                i++;
+            } else
+                nArgsError = 1;
         } else if (!strcmp(argv[i], "-D")) {
             if (!pszDictionaryFilename && (i + 1) < argc) {
                 pszDictionaryFilename = argv[i + 1];
@@ -1192,6 +3656,31 @@ int main(int argc, char **argv) {
                 nOptions |= OPT_VERBOSE;
             } else
                 nArgsError = 1;
+        } else if (!strcmp(argv[i], "-wlist")) {
+            if (!nNumWindowSizes && (i + 1) < argc) {
+                const char *pszSize = argv[i + 1];
+
+                /* Comma-separated list of window sizes */
+                while (!nArgsError) {
+                    char *pEnd = NULL;
+                    long nSize = strtol(pszSize, &pEnd, 10);
+
+                    if (pEnd && pEnd != pszSize && (nSize >= 16 && nSize <= 0x200000)
+                        && nNumWindowSizes < MAX_WINDOW_SIZES) {
+                        nMaxWindowSizes[nNumWindowSizes++] = (size_t)nSize;
+                        if (*pEnd == ',')
+                            pszSize = pEnd + 1;
+                        else if (*pEnd == 0)
+                            break;
+                        else
+                            nArgsError = 1;
+                    } else {
+                        nArgsError = 1;
+                    }
+                }
+                i++;
+            } else
+                nArgsError = 1;
         } else if (!strcmp(argv[i], "-w")) {
             if (!nMaxWindowSize && (i + 1) < argc) {
                 char *pEnd = NULL;
@@ -1222,6 +3711,11 @@ int main(int argc, char **argv) {
                 nOptions |= OPT_BACKWARD;
             } else
                 nArgsError = 1;
+        } else if (!strcmp(argv[i], "-fast")) {
+            if ((nOptions & OPT_FAST) == 0) {
+                nOptions |= OPT_FAST;
+            } else
+                nArgsError = 1;
         } else {
             if (!pszInFilename)
                 pszInFilename = argv[i];
@@ -1238,6 +3732,13 @@ int main(int argc, char **argv) {
         return do_self_test(nOptions, nMaxWindowSize, 0);
     } else if (!nArgsError && cCommand == 'T') {
         return do_self_test(nOptions, nMaxWindowSize, 1);
+    } else if (!nArgsError && cCommand == 'R' && !pszOutFilename) {
+        do_init_time();
+        return do_bench_dir(pszBenchDirName, pszInFilename, nOptions, nMaxWindowSize, nRepetitions ? nRepetitions : 5);
+    } else if (!nArgsError && cCommand == 'C' && !pszOutFilename) {
+        return do_cycles_test(pszInFilename, nOptions, nMaxWindowSize);
+    } else if (!nArgsError && cCommand == 'c' && pszInFilename && !pszOutFilename) {
+        return do_cycles(pszInFilename, nOptions);
     }
 
     if (nArgsError || !pszInFilename || !pszOutFilename) {
@@ -1246,12 +3747,29 @@ int main(int argc, char **argv) {
         fprintf(stderr, "        -c: check resulting stream after compressing\n");
         fprintf(stderr, "        -d: decompress (default: compress)\n");
         fprintf(stderr, "        -b: backwards compression or decompression\n");
+        fprintf(stderr, "     -fast: parse faster, for a slightly larger output\n");
         fprintf(stderr, " -w <size>: maximum window size, in bytes (16..2097152), defaults to maximum\n");
+        fprintf(stderr, "         small windows are searched in chunks, the output can differ by a few bytes from a full search\n");
+        fprintf(stderr, "-wlist <size,size,...>: compress once per window size, matches found once, to <outfile>.<size>\n");
+        fprintf(stderr, "         outputs can differ by a few bytes from separate -w runs, and are all valid\n");
         fprintf(stderr, " -D <file>: use dictionary file\n");
+        fprintf(stderr, "-Di <file>: compress with a dictionary index built by -mkdictindex, instead of -D\n");
+        fprintf(stderr, "-cache <dir>: reuse the compressed data stored in <dir> for the same input and options\n");
+        fprintf(stderr, "-cachesize <n>: maximum size of the -cache directory, in megabytes (defaults to 256)\n");
+        fprintf(stderr, "-prev <infile> <outfile>: compress by only parsing the changes from a previous <infile> compressed to <outfile>\n");
+        fprintf(stderr, "-mkdictindex: build the index of dictionary <infile> into <outfile> (with -b, for backward compression)\n");
+        fprintf(stderr,
+            "-threads <n>: parse each block on up to <n> threads (1..%d), defaults to 1\n",
+            APULTRA_MAX_THREADS);
         fprintf(stderr, "   -cbench: benchmark in-memory compression\n");
         fprintf(stderr, "   -dbench: benchmark in-memory decompression\n");
+        fprintf(stderr, "-bench-dir <dir> [<results.json|.csv>]: benchmark all files in <dir>\n");
+        fprintf(stderr, "-reps <n>: number of timed runs for -bench-dir, after one warm-up run (defaults to 5)\n");
+        fprintf(stderr, "   -cycles: estimate decompression time of <infile> for each asm decompressor\n");
         fprintf(stderr, "     -test: run full automated self-tests\n");
         fprintf(stderr, "-quicktest: run quick automated self-tests\n");
+        fprintf(stderr, "-cyclestest [<file>]: run the Z80 and 6502 decompressors on emulated CPUs, check the cycle models against\n");
+        fprintf(stderr, "              them and compare cycle totals with <file>\n");
         fprintf(stderr, "    -stats: show compressed data stats\n");
         fprintf(stderr, "        -v: be verbose\n");
         return 100;
@@ -1259,13 +3777,90 @@ int main(int argc, char **argv) {
 
     do_init_time();
 
+    if (pszDictionaryIndexFilename && (pszDictionaryFilename || cCommand != 'z')) {
+        fprintf(stderr, "-Di is only used for compressing, and can't be used with -D\n");
+        return 100;
+    }
+
+    if ((pszCacheDirName || nMaxCacheSize)
+        && (!pszCacheDirName || pszDictionaryIndexFilename || nNumWindowSizes || cCommand != 'z')) {
+        fprintf(stderr, "-cache is only used for compressing, and can't be used with -Di or -wlist\n");
+        return 100;
+    }
+
+    if (pszPreviousInFilename
+        && (pszDictionaryFilename || pszDictionaryIndexFilename || pszCacheDirName || nNumWindowSizes || cCommand != 'z')) {
+        fprintf(stderr, "-prev is only used for compressing, and can't be used with -D, -Di, -cache or -wlist\n");
+        return 100;
+    }
+
     if (cCommand == 'z') {
-        int nResult = do_compress(pszInFilename, pszOutFilename, pszDictionaryFilename, nOptions, nMaxWindowSize);
-        if (nResult == 0 && nVerifyCompression) {
-            return do_compare(pszOutFilename, pszInFilename, pszDictionaryFilename, nOptions);
+        dictionary_index_file dictionary_index;
+        const apultra_dictionary_index *pDictionaryIndex = NULL;
+        apultra_cache cache;
+        int nResult = 0;
+
+        if (nMaxWindowSize && nNumWindowSizes) {
+            fprintf(stderr, "-w and -wlist can't be used together\n");
+            return 100;
+        }
+
+        if (pszCacheDirName && apultra_cache_open(&cache, pszCacheDirName, nMaxCacheSize)) {
+            fprintf(stderr, "error opening cache directory '%s'\n", pszCacheDirName);
+            return 100;
+        }
+
+        if (pszDictionaryIndexFilename) {
+            nResult = do_open_dictionary_index(pszDictionaryIndexFilename, nOptions, &dictionary_index);
+            if (nResult) return nResult;
+            pDictionaryIndex = &dictionary_index.index;
+        }
+
+        if (pszPreviousInFilename) {
+            nResult = do_recompress(pszInFilename,
+                pszOutFilename,
+                pszPreviousInFilename,
+                pszPreviousOutFilename,
+                nOptions,
+                nMaxWindowSize,
+                nThreads);
+            if (nResult == 0 && nVerifyCompression) {
+                nResult = do_compare(pszOutFilename, pszInFilename, NULL, NULL, nOptions);
+            }
+        } else if (nNumWindowSizes) {
+            nResult = do_compress_windows(pszInFilename,
+                pszOutFilename,
+                pszDictionaryFilename,
+                pDictionaryIndex,
+                nOptions,
+                nMaxWindowSizes,
+                nNumWindowSizes,
+                nThreads);
+            for (i = 0; i < nNumWindowSizes && nResult == 0 && nVerifyCompression; i++) {
+                char szOutFilename[1024];
+
+                snprintf(szOutFilename, sizeof(szOutFilename), "%s.%zd", pszOutFilename, nMaxWindowSizes[i]);
+                nResult = do_compare(szOutFilename, pszInFilename, pszDictionaryFilename, pDictionaryIndex, nOptions);
+            }
         } else {
-            return nResult;
+            nResult = do_compress(pszInFilename,
+                pszOutFilename,
+                pszDictionaryFilename,
+                pDictionaryIndex,
+                pszCacheDirName ? &cache : NULL,
+                nOptions,
+                nMaxWindowSize,
+                nThreads);
+            if (nResult == 0 && nVerifyCompression) {
+                nResult = do_compare(pszOutFilename, pszInFilename, pszDictionaryFilename, pDictionaryIndex, nOptions);
+            }
         }
+
+        if (pDictionaryIndex) do_close_dictionary_index(&dictionary_index);
+        if (pszCacheDirName) apultra_cache_close(&cache);
+        return nResult;
+    } else if (cCommand == 'I') {
+        return do_build_dictionary_index(pszInFilename, pszOutFilename, nOptions);
     } else if (cCommand == 'd') {
         return do_decompress(pszInFilename, pszOutFilename, pszDictionaryFilename, nOptions);
     } else if (cCommand == 'B') {
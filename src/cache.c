@@ -0,0 +1,698 @@
+/*
+ * cache.c - compression cache
+ *
+ * Copyright (C) 2019 Emmanuel Marty
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+/*
+ * Uses the libdivsufsort library Copyright (c) 2003-2008 Yuta Mori
+ *
+ * Inspired by cap by Sven-�ke Dahl. https://github.com/svendahl/cap
+ * Also inspired by Charles Bloom's compression blog. http://cbloomrants.blogspot.com/
+ * With ideas from LZ4 by Yann Collet. https://github.com/lz4/lz4
+ * With help and support from spke <zxintrospec@gmail.com>
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#include <process.h>
+#include <sys/utime.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+#include "format.h"
+#include "shrink.h"
+#include "cache.h"
+#include "dirlist.h"
+
+#define CACHE_ENTRY_HEADER_SIZE 72
+#define CACHE_ENTRY_FORMAT_VERSION 3 /* layout of the entry files */
+#define CACHE_ENTRY_SUFFIX ".apc"
+#define CACHE_TEMP_SUFFIX ".tmp"
+#define CACHE_PATH_MAX 4096
+
+#define CACHE_NAME_ENTRY 1 /* file name of a cache entry */
+#define CACHE_NAME_TEMP 2  /* file name of an entry being stored, or left behind by an interrupted store */
+
+/** Cache entry file signature */
+static const unsigned char g_cache_entry_magic[8] = { 'A', 'P', 'U', 'L', 'T', 'R', 'A', 'C' };
+
+/** Everything that compressed data depends on, stored in the header of each cache entry */
+typedef struct {
+    unsigned long long hash; /* hash of the input data, dictionary included */
+    unsigned long long input_size;
+    unsigned long long dictionary_size;
+    unsigned long long max_window_size;
+    unsigned int flags;
+} apultra_cache_key;
+
+/** Cache entry file, as listed for eviction */
+typedef struct {
+    char *name;
+    long long size;
+    long long time; /* modification time, in nanoseconds */
+    int type;       /* CACHE_NAME_xxx */
+} apultra_cache_entry;
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3 0x165667B19E3779F9ULL
+#define HASH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define HASH_PRIME5 0x27D4EB2F165667C5ULL
+
+/**
+ * Read a little-endian 64-bit value
+ *
+ * @param pData pointer to value
+ *
+ * @return value
+ */
+static unsigned long long apultra_cache_read_u64(const unsigned char *pData) {
+    return ((unsigned long long)pData[0]) | ((unsigned long long)pData[1] << 8) | ((unsigned long long)pData[2] << 16)
+        | ((unsigned long long)pData[3] << 24) | ((unsigned long long)pData[4] << 32)
+        | ((unsigned long long)pData[5] << 40) | ((unsigned long long)pData[6] << 48)
+        | ((unsigned long long)pData[7] << 56);
+}
+
+/**
+ * Read a little-endian 32-bit value
+ *
+ * @param pData pointer to value
+ *
+ * @return value
+ */
+static unsigned int apultra_cache_read_u32(const unsigned char *pData) {
+    return ((unsigned int)pData[0]) | ((unsigned int)pData[1] << 8) | ((unsigned int)pData[2] << 16)
+        | ((unsigned int)pData[3] << 24);
+}
+
+/**
+ * Write a little-endian 64-bit value
+ *
+ * @param pData pointer to write the value to
+ * @param nValue value to write
+ */
+static void apultra_cache_write_u64(unsigned char *pData, const unsigned long long nValue) {
+    int i;
+
+    for (i = 0; i < 8; i++) pData[i] = (unsigned char)(nValue >> (i * 8));
+}
+
+/**
+ * Write a little-endian 32-bit value
+ *
+ * @param pData pointer to write the value to
+ * @param nValue value to write
+ */
+static void apultra_cache_write_u32(unsigned char *pData, const unsigned int nValue) {
+    int i;
+
+    for (i = 0; i < 4; i++) pData[i] = (unsigned char)(nValue >> (i * 8));
+}
+
+static unsigned long long apultra_cache_rotl64(const unsigned long long nValue, const int nBits) {
+    return (nValue << nBits) | (nValue >> (64 - nBits));
+}
+
+static unsigned long long apultra_cache_hash_round(unsigned long long nAcc, const unsigned long long nInput) {
+    nAcc += nInput * HASH_PRIME2;
+    nAcc = apultra_cache_rotl64(nAcc, 31);
+    return nAcc * HASH_PRIME1;
+}
+
+static unsigned long long apultra_cache_hash_merge(unsigned long long nAcc, const unsigned long long nLane) {
+    nAcc ^= apultra_cache_hash_round(0, nLane);
+    return nAcc * HASH_PRIME1 + HASH_PRIME4;
+}
+
+/**
+ * Hash data, 32 bytes at a time on four lanes (the xxHash64 construction)
+ *
+ * @param pData data to hash
+ * @param nSize data size in bytes
+ * @param nSeed seed
+ *
+ * @return 64-bit hash
+ */
+static unsigned long long apultra_cache_hash(const unsigned char *pData, const size_t nSize,
+    const unsigned long long nSeed) {
+    const unsigned char *pEnd = pData + nSize;
+    unsigned long long nHash;
+
+    if (nSize >= 32) {
+        const unsigned char *pLimit = pEnd - 32;
+        unsigned long long v1 = nSeed + HASH_PRIME1 + HASH_PRIME2;
+        unsigned long long v2 = nSeed + HASH_PRIME2;
+        unsigned long long v3 = nSeed;
+        unsigned long long v4 = nSeed - HASH_PRIME1;
+
+        do {
+            v1 = apultra_cache_hash_round(v1, apultra_cache_read_u64(pData));
+            v2 = apultra_cache_hash_round(v2, apultra_cache_read_u64(pData + 8));
+            v3 = apultra_cache_hash_round(v3, apultra_cache_read_u64(pData + 16));
+            v4 = apultra_cache_hash_round(v4, apultra_cache_read_u64(pData + 24));
+            pData += 32;
+        } while (pData <= pLimit);
+
+        nHash = apultra_cache_rotl64(v1, 1) + apultra_cache_rotl64(v2, 7) + apultra_cache_rotl64(v3, 12)
+            + apultra_cache_rotl64(v4, 18);
+        nHash = apultra_cache_hash_merge(nHash, v1);
+        nHash = apultra_cache_hash_merge(nHash, v2);
+        nHash = apultra_cache_hash_merge(nHash, v3);
+        nHash = apultra_cache_hash_merge(nHash, v4);
+    } else {
+        nHash = nSeed + HASH_PRIME5;
+    }
+
+    nHash += (unsigned long long)nSize;
+
+    while ((pData + 8) <= pEnd) {
+        nHash ^= apultra_cache_hash_round(0, apultra_cache_read_u64(pData));
+        nHash = apultra_cache_rotl64(nHash, 27) * HASH_PRIME1 + HASH_PRIME4;
+        pData += 8;
+    }
+
+    if ((pData + 4) <= pEnd) {
+        nHash ^= (unsigned long long)apultra_cache_read_u32(pData) * HASH_PRIME1;
+        nHash = apultra_cache_rotl64(nHash, 23) * HASH_PRIME2 + HASH_PRIME3;
+        pData += 4;
+    }
+
+    while (pData < pEnd) {
+        nHash ^= (*pData++) * HASH_PRIME5;
+        nHash = apultra_cache_rotl64(nHash, 11) * HASH_PRIME1;
+    }
+
+    nHash ^= nHash >> 33;
+    nHash *= HASH_PRIME2;
+    nHash ^= nHash >> 29;
+    nHash *= HASH_PRIME3;
+    nHash ^= nHash >> 32;
+
+    return nHash;
+}
+
+/**
+ * Get the hash of the compressor's version, that entries stored by another version don't match
+ *
+ * @return 64-bit hash
+ */
+static unsigned long long apultra_cache_get_compressor_hash(void) {
+    static const char szVersion[] = APULTRA_VERSION;
+
+    return apultra_cache_hash((const unsigned char *)szVersion, sizeof(szVersion) - 1, APULTRA_PARSER_REVISION);
+}
+
+/**
+ * Get the hash of what an entry stores after its header, that tells a damaged entry from a valid one
+ *
+ * @param pStats compression stats
+ * @param pCompressedData compressed data
+ * @param nCompressedSize compressed size in bytes
+ *
+ * @return 64-bit hash
+ */
+static unsigned long long apultra_cache_get_payload_hash(const apultra_stats *pStats,
+    const unsigned char *pCompressedData, const size_t nCompressedSize) {
+    unsigned long long nHash = apultra_cache_hash((const unsigned char *)pStats, sizeof(apultra_stats), 0);
+
+    return apultra_cache_hash(pCompressedData, nCompressedSize, nHash);
+}
+
+/**
+ * Get the file name of a cache entry
+ *
+ * @param pCache compression cache
+ * @param pKey key of entry
+ * @param pszPath buffer for returned path
+ * @param nMaxPathSize size of path buffer
+ *
+ * @return 0 for success, -1 if the path doesn't fit in the buffer
+ */
+static int apultra_cache_get_entry_path(const apultra_cache *pCache, const apultra_cache_key *pKey, char *pszPath,
+    const size_t nMaxPathSize) {
+    /* Settings only go into the name, the data and its size are checked against the header as well */
+    unsigned long long nNameHash = pKey->hash;
+    int nPathSize;
+
+    nNameHash = apultra_cache_hash_round(nNameHash, pKey->dictionary_size);
+    nNameHash = apultra_cache_hash_round(nNameHash, pKey->max_window_size);
+    nNameHash = apultra_cache_hash_round(nNameHash, (unsigned long long)pKey->flags);
+    nNameHash = apultra_cache_hash_round(nNameHash, apultra_cache_get_compressor_hash());
+
+    nPathSize = snprintf(pszPath, nMaxPathSize, "%s/%016llx" CACHE_ENTRY_SUFFIX, pCache->directory, nNameHash);
+    return (nPathSize >= 0 && (size_t)nPathSize < nMaxPathSize) ? 0 : -1;
+}
+
+/**
+ * Get the type of a file in the cache directory from its name
+ *
+ * @param pszName file name
+ *
+ * @return CACHE_NAME_ENTRY for an entry, CACHE_NAME_TEMP for an entry being stored, 0 for another file
+ */
+static int apultra_cache_get_name_type(const char *pszName) {
+    const size_t nEntryLength = 16 + strlen(CACHE_ENTRY_SUFFIX);
+    size_t nLength = strlen(pszName);
+    size_t i;
+
+    for (i = 0; i < 16; i++) {
+        if (!((pszName[i] >= '0' && pszName[i] <= '9') || (pszName[i] >= 'a' && pszName[i] <= 'f'))) return 0;
+    }
+    if (strncmp(pszName + 16, CACHE_ENTRY_SUFFIX, strlen(CACHE_ENTRY_SUFFIX))) return 0;
+    if (nLength == nEntryLength) return CACHE_NAME_ENTRY;
+
+    /* <entry>.<process id>.tmp */
+    if (nLength > (nEntryLength + 1 + strlen(CACHE_TEMP_SUFFIX)) && pszName[nEntryLength] == '.'
+        && !strcmp(pszName + nLength - strlen(CACHE_TEMP_SUFFIX), CACHE_TEMP_SUFFIX))
+        return CACHE_NAME_TEMP;
+    return 0;
+}
+
+static int apultra_cache_compare_entries(const void *pA, const void *pB) {
+    const apultra_cache_entry *pEntryA = (const apultra_cache_entry *)pA;
+    const apultra_cache_entry *pEntryB = (const apultra_cache_entry *)pB;
+
+    /* Entries used in the same clock tick are ordered by name, so that eviction doesn't depend on listing order */
+    if (pEntryA->time != pEntryB->time) return (pEntryA->time > pEntryB->time) - (pEntryA->time < pEntryB->time);
+    return strcmp(pEntryA->name, pEntryB->name);
+}
+
+/**
+ * Get the current time, in the same units as the modification times of listed entries
+ *
+ * @return time in nanoseconds
+ */
+static long long apultra_cache_get_time(void) {
+#ifdef _WIN32
+    FILETIME ft;
+
+    GetSystemTimeAsFileTime(&ft);
+    return ((((long long)ft.dwHighDateTime << 32) | (long long)ft.dwLowDateTime)) * 100LL;
+#else
+    return (long long)time(NULL) * 1000000000LL;
+#endif
+}
+
+/** Entries of the cache directory, as they are listed */
+typedef struct {
+    apultra_cache_entry *entries;
+    int num_entries;
+    int max_entries;
+    long long total_size;
+} apultra_cache_listing;
+
+static int apultra_cache_add_listed_entry(void *pUserData, const char *pszName, long long nSize, long long nTime) {
+    apultra_cache_listing *pListing = (apultra_cache_listing *)pUserData;
+    apultra_cache_entry *pEntry;
+    int nType = apultra_cache_get_name_type(pszName);
+
+    if (!nType) return 0;
+
+    if (pListing->num_entries == pListing->max_entries) {
+        int nMaxEntries = pListing->max_entries ? (pListing->max_entries * 2) : 64;
+        apultra_cache_entry *pNewEntries =
+            (apultra_cache_entry *)realloc(pListing->entries, nMaxEntries * sizeof(apultra_cache_entry));
+
+        if (!pNewEntries) return -1;
+        pListing->entries = pNewEntries;
+        pListing->max_entries = nMaxEntries;
+    }
+
+    pEntry = &pListing->entries[pListing->num_entries];
+    pEntry->name = (char *)malloc(strlen(pszName) + 1);
+    if (!pEntry->name) return -1;
+    strcpy(pEntry->name, pszName);
+    pEntry->size = nSize;
+    pEntry->time = nTime;
+    pEntry->type = nType;
+    pListing->total_size += nSize;
+    pListing->num_entries++;
+    return 0;
+}
+
+/**
+ * List the entries in the cache directory, least recently used first, along with the partially stored ones
+ *
+ * @param pCache compression cache
+ * @param pNumEntries pointer to returned number of entries
+ * @param pTotalSize pointer to returned size of all entries, in bytes
+ *
+ * @return array of entries (to be freed along with each name), or NULL for error
+ */
+static apultra_cache_entry *apultra_cache_list_entries(const apultra_cache *pCache, int *pNumEntries,
+    long long *pTotalSize) {
+    apultra_cache_listing listing;
+    int i;
+
+    memset(&listing, 0, sizeof(apultra_cache_listing));
+
+    /* Evicting from a partial listing could remove recently used entries first */
+    if (apultra_list_directory(pCache->directory, apultra_cache_add_listed_entry, &listing)) {
+        for (i = 0; i < listing.num_entries; i++) free(listing.entries[i].name);
+        if (listing.entries) free(listing.entries);
+        return NULL;
+    }
+
+    if (!listing.entries) listing.entries = (apultra_cache_entry *)malloc(sizeof(apultra_cache_entry));
+    if (listing.entries)
+        qsort(listing.entries, listing.num_entries, sizeof(apultra_cache_entry), apultra_cache_compare_entries);
+
+    *pNumEntries = listing.num_entries;
+    *pTotalSize = listing.total_size;
+    return listing.entries;
+}
+
+/**
+ * Remove the files left behind by interrupted stores, then the least recently used entries until the cache is no
+ * larger than its maximum size
+ *
+ * Partially stored entries that aren't abandoned yet may still be renamed into place by another process: they are
+ * counted, but left alone.
+ *
+ * @param pCache compression cache
+ * @param pszKeepName name of the entry that was just stored, that is kept, or NULL for none
+ */
+static void apultra_cache_evict(apultra_cache *pCache, const char *pszKeepName) {
+    const long long nAbandonedTime = apultra_cache_get_time() - (long long)APULTRA_CACHE_TEMP_MAX_AGE * 1000000000LL;
+    int nNumEntries = 0;
+    long long nTotalSize = 0;
+    apultra_cache_entry *pEntries = apultra_cache_list_entries(pCache, &nNumEntries, &nTotalSize);
+    int nPass, i;
+
+    if (!pEntries) return;
+
+    for (nPass = 0; nPass < 2; nPass++) {
+        for (i = 0; i < nNumEntries; i++) {
+            apultra_cache_entry *pEntry = &pEntries[i];
+            int nRemove;
+
+            if (!pEntry->name) continue;
+            if (nPass == 0)
+                nRemove = (pEntry->type == CACHE_NAME_TEMP && pEntry->time < nAbandonedTime);
+            else
+                nRemove = (pEntry->type == CACHE_NAME_ENTRY && nTotalSize > pCache->max_size
+                           && (!pszKeepName || strcmp(pEntry->name, pszKeepName)));
+
+            if (nRemove) {
+                char szPath[CACHE_PATH_MAX];
+                int nPathSize = snprintf(szPath, sizeof(szPath), "%s/%s", pCache->directory, pEntry->name);
+
+                if (nPathSize >= 0 && nPathSize < (int)sizeof(szPath) && remove(szPath) == 0) {
+                    nTotalSize -= pEntry->size;
+                    pCache->stats.num_evictions++;
+                    free(pEntry->name);
+                    pEntry->name = NULL;
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < nNumEntries; i++) {
+        if (pEntries[i].name) free(pEntries[i].name);
+    }
+
+    free(pEntries);
+    pCache->stats.size = nTotalSize;
+}
+
+/**
+ * Look for the compressed data of a key in the cache
+ *
+ * @param pKey key to look for
+ * @param pszPath file name of the key's entry
+ * @param pOutBuffer buffer for compressed data
+ * @param nMaxOutBufferSize maximum capacity of compression buffer
+ * @param pStats pointer to returned compression stats
+ *
+ * @return compressed size, or -1 if the data isn't in the cache
+ */
+static size_t apultra_cache_lookup(const apultra_cache_key *pKey, const char *pszPath,
+    unsigned char *pOutBuffer, const size_t nMaxOutBufferSize, apultra_stats *pStats) {
+    unsigned char cHeader[CACHE_ENTRY_HEADER_SIZE];
+    unsigned long long nCompressedSize;
+    FILE *f_entry = fopen(pszPath, "rb");
+
+    if (!f_entry) return -1;
+
+    if (fread(cHeader, 1, CACHE_ENTRY_HEADER_SIZE, f_entry) != CACHE_ENTRY_HEADER_SIZE
+        || memcmp(cHeader, g_cache_entry_magic, 8)
+        || apultra_cache_read_u32(cHeader + 8) != CACHE_ENTRY_FORMAT_VERSION
+        || apultra_cache_read_u32(cHeader + 12) != pKey->flags || apultra_cache_read_u64(cHeader + 16) != pKey->hash
+        || apultra_cache_read_u64(cHeader + 24) != pKey->input_size
+        || apultra_cache_read_u64(cHeader + 32) != pKey->dictionary_size
+        || apultra_cache_read_u64(cHeader + 40) != pKey->max_window_size
+        || apultra_cache_read_u32(cHeader + 56) != sizeof(apultra_stats)
+        || apultra_cache_read_u32(cHeader + 60) != (unsigned int)apultra_cache_get_compressor_hash()) {
+        fclose(f_entry);
+        return -1;
+    }
+
+    nCompressedSize = apultra_cache_read_u64(cHeader + 48);
+    if (nCompressedSize > nMaxOutBufferSize || fread(pStats, 1, sizeof(apultra_stats), f_entry) != sizeof(apultra_stats)
+        || fread(pOutBuffer, 1, (size_t)nCompressedSize, f_entry) != (size_t)nCompressedSize
+        || apultra_cache_read_u64(cHeader + 64)
+               != apultra_cache_get_payload_hash(pStats, pOutBuffer, (size_t)nCompressedSize)) {
+        /* A damaged entry is a miss, and is replaced by the compression that follows */
+        fclose(f_entry);
+        return -1;
+    }
+
+    fclose(f_entry);
+
+    /* Mark the entry as recently used */
+#ifdef _WIN32
+    _utime(pszPath, NULL);
+#else
+    utime(pszPath, NULL);
+#endif
+
+    return (size_t)nCompressedSize;
+}
+
+/**
+ * Store compressed data in the cache
+ *
+ * The entry is written under a temporary name and then renamed, so that other processes sharing the cache never
+ * read a partial entry.
+ *
+ * @param pCache compression cache
+ * @param pKey key of the compressed data
+ * @param pszPath file name of the key's entry
+ * @param pCompressedData compressed data
+ * @param nCompressedSize compressed size in bytes
+ * @param pStats compression stats
+ */
+static void apultra_cache_store(apultra_cache *pCache, const apultra_cache_key *pKey, const char *pszPath,
+    const unsigned char *pCompressedData, const size_t nCompressedSize, const apultra_stats *pStats) {
+    unsigned char cHeader[CACHE_ENTRY_HEADER_SIZE];
+    char szTempPath[CACHE_PATH_MAX];
+    long long nEntrySize = CACHE_ENTRY_HEADER_SIZE + sizeof(apultra_stats) + (long long)nCompressedSize;
+    FILE *f_entry;
+    int nPathSize;
+    int nError = 0;
+
+    if (nEntrySize > pCache->max_size) return;
+
+    memset(cHeader, 0, CACHE_ENTRY_HEADER_SIZE);
+    memcpy(cHeader, g_cache_entry_magic, 8);
+    apultra_cache_write_u32(cHeader + 8, CACHE_ENTRY_FORMAT_VERSION);
+    apultra_cache_write_u32(cHeader + 12, pKey->flags);
+    apultra_cache_write_u64(cHeader + 16, pKey->hash);
+    apultra_cache_write_u64(cHeader + 24, pKey->input_size);
+    apultra_cache_write_u64(cHeader + 32, pKey->dictionary_size);
+    apultra_cache_write_u64(cHeader + 40, pKey->max_window_size);
+    apultra_cache_write_u64(cHeader + 48, (unsigned long long)nCompressedSize);
+    apultra_cache_write_u32(cHeader + 56, sizeof(apultra_stats));
+    apultra_cache_write_u32(cHeader + 60, (unsigned int)apultra_cache_get_compressor_hash());
+    apultra_cache_write_u64(cHeader + 64, apultra_cache_get_payload_hash(pStats, pCompressedData, nCompressedSize));
+
+#ifdef _WIN32
+    nPathSize = snprintf(szTempPath, sizeof(szTempPath), "%s.%d" CACHE_TEMP_SUFFIX, pszPath, (int)_getpid());
+#else
+    nPathSize = snprintf(szTempPath, sizeof(szTempPath), "%s.%d" CACHE_TEMP_SUFFIX, pszPath, (int)getpid());
+#endif
+    if (nPathSize < 0 || nPathSize >= (int)sizeof(szTempPath)) return;
+
+    f_entry = fopen(szTempPath, "wb");
+    if (!f_entry) return;
+
+    if (fwrite(cHeader, 1, CACHE_ENTRY_HEADER_SIZE, f_entry) != CACHE_ENTRY_HEADER_SIZE
+        || fwrite(pStats, 1, sizeof(apultra_stats), f_entry) != sizeof(apultra_stats)
+        || fwrite(pCompressedData, 1, nCompressedSize, f_entry) != nCompressedSize)
+        nError = 1;
+    if (fclose(f_entry)) nError = 1;
+
+#ifdef _WIN32
+    if (!nError && !MoveFileExA(szTempPath, pszPath, MOVEFILE_REPLACE_EXISTING)) nError = 1;
+#else
+    if (!nError && rename(szTempPath, pszPath)) nError = 1;
+#endif
+
+    if (nError) {
+        remove(szTempPath);
+        return;
+    }
+
+    pCache->stats.num_stores++;
+    pCache->stats.size += nEntrySize;
+
+    if (pCache->stats.size > pCache->max_size) {
+        const char *pszName = strrchr(pszPath, '/');
+        apultra_cache_evict(pCache, pszName ? (pszName + 1) : pszPath);
+    }
+}
+
+/**
+ * Open a compression cache, creating its directory if needed
+ *
+ * @param pCache cache to initialize
+ * @param pszDirectory cache directory
+ * @param nMaxSize maximum bytes of cached entries (0 for APULTRA_CACHE_DEFAULT_MAX_SIZE)
+ *
+ * @return 0 for success, -1 for error
+ */
+int apultra_cache_open(apultra_cache *pCache, const char *pszDirectory, long long nMaxSize) {
+    apultra_cache_entry *pEntries;
+    int nNumEntries = 0, nNumTempEntries = 0;
+    long long nTotalSize = 0;
+    int i;
+
+    memset(pCache, 0, sizeof(apultra_cache));
+    pCache->max_size = (nMaxSize > 0) ? nMaxSize : APULTRA_CACHE_DEFAULT_MAX_SIZE;
+
+    if (strlen(pszDirectory) + 32 >= CACHE_PATH_MAX) return -1;
+    pCache->directory = (char *)malloc(strlen(pszDirectory) + 1);
+    if (!pCache->directory) return -1;
+    strcpy(pCache->directory, pszDirectory);
+
+#ifdef _WIN32
+    _mkdir(pszDirectory);
+#else
+    mkdir(pszDirectory, 0777);
+#endif
+
+    /* Get the cache's current size, which also checks that the directory can be listed */
+    pEntries = apultra_cache_list_entries(pCache, &nNumEntries, &nTotalSize);
+    if (!pEntries) {
+        apultra_cache_close(pCache);
+        return -1;
+    }
+
+    for (i = 0; i < nNumEntries; i++) {
+        if (pEntries[i].type == CACHE_NAME_TEMP) nNumTempEntries++;
+        free(pEntries[i].name);
+    }
+    free(pEntries);
+
+    pCache->stats.size = nTotalSize;
+
+    /* Clean up after interrupted stores, and after a smaller maximum size was set */
+    if (nNumTempEntries || nTotalSize > pCache->max_size) apultra_cache_evict(pCache, NULL);
+    return 0;
+}
+
+/**
+ * Close a compression cache
+ *
+ * @param pCache cache to close
+ */
+void apultra_cache_close(apultra_cache *pCache) {
+    if (pCache->directory) {
+        free(pCache->directory);
+        pCache->directory = NULL;
+    }
+}
+
+/**
+ * Compress memory, or return the compressed data stored for the same input and settings
+ *
+ * @param pCache compression cache
+ * @param pInputData pointer to input(source) data to compress
+ * @param pOutBuffer buffer for compressed data
+ * @param nInputSize input(source) size in bytes
+ * @param nMaxOutBufferSize maximum capacity of compression buffer
+ * @param nFlags compression flags (number of parsing threads in APULTRA_FLAG_THREADS_MASK, APULTRA_FLAG_xxx, or 0)
+ * @param nMaxWindowSize maximum window size to use (0 for default)
+ * @param nDictionarySize size of dictionary in front of input data (0 for none)
+ * @param progress progress function, called after compressing each block, or NULL for none
+ * @param pStats pointer to compression stats that are filled if this function is successful, or NULL
+ *
+ * @return actual compressed size, or -1 for error
+ */
+size_t apultra_compress_cached(apultra_cache *pCache,
+    const unsigned char *pInputData,
+    unsigned char *pOutBuffer,
+    size_t nInputSize,
+    size_t nMaxOutBufferSize,
+    const unsigned int nFlags,
+    size_t nMaxWindowSize,
+    size_t nDictionarySize,
+    void (*progress)(long long nOriginalSize, long long nCompressedSize),
+    apultra_stats *pStats) {
+    char szPath[CACHE_PATH_MAX];
+    apultra_cache_key key;
+    apultra_stats stats;
+    size_t nCompressedSize;
+
+    key.hash = apultra_cache_hash(pInputData, nInputSize, 0);
+    key.input_size = (unsigned long long)nInputSize;
+    key.dictionary_size = (unsigned long long)nDictionarySize;
+    key.max_window_size = (unsigned long long)nMaxWindowSize;
+    key.flags = nFlags;
+    if (apultra_cache_get_entry_path(pCache, &key, szPath, sizeof(szPath))) szPath[0] = 0;
+
+    nCompressedSize = szPath[0] ? apultra_cache_lookup(&key, szPath, pOutBuffer, nMaxOutBufferSize, &stats) : (size_t)-1;
+    if (nCompressedSize != (size_t)-1) {
+        pCache->stats.num_hits++;
+        pCache->stats.bytes_saved += (long long)(nInputSize - nDictionarySize);
+
+        /* No phase was run this time */
+        memset(stats.phase_time, 0, sizeof(stats.phase_time));
+        if (pStats) memcpy(pStats, &stats, sizeof(apultra_stats));
+        if (progress) progress((long long)nInputSize, (long long)nCompressedSize);
+        return nCompressedSize;
+    }
+
+    pCache->stats.num_misses++;
+    nCompressedSize = apultra_compress(pInputData,
+        pOutBuffer,
+        nInputSize,
+        nMaxOutBufferSize,
+        nFlags,
+        nMaxWindowSize,
+        nDictionarySize,
+        progress,
+        &stats);
+    if (nCompressedSize == (size_t)-1) return -1;
+
+    if (szPath[0]) apultra_cache_store(pCache, &key, szPath, pOutBuffer, nCompressedSize, &stats);
+
+    if (pStats) memcpy(pStats, &stats, sizeof(apultra_stats));
+    return nCompressedSize;
+}
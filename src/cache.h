@@ -0,0 +1,125 @@
+/*
+ * cache.h - compression cache definitions
+ *
+ * Copyright (C) 2019 Emmanuel Marty
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+/*
+ * Uses the libdivsufsort library Copyright (c) 2003-2008 Yuta Mori
+ *
+ * Inspired by cap by Sven-�ke Dahl. https://github.com/svendahl/cap
+ * Also inspired by Charles Bloom's compression blog. http://cbloomrants.blogspot.com/
+ * With ideas from LZ4 by Yann Collet. https://github.com/lz4/lz4
+ * With help and support from spke <zxintrospec@gmail.com>
+ *
+ */
+
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stdlib.h>
+#include "shrink.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define APULTRA_CACHE_DEFAULT_MAX_SIZE (256LL * 1024LL * 1024LL) /* bytes of cached entries kept by default */
+#define APULTRA_CACHE_TEMP_MAX_AGE 3600 /* seconds after which a partially stored entry is considered abandoned */
+
+/** Compression cache statistics */
+typedef struct _apultra_cache_stats {
+    long long num_hits;      /* compressions answered from the cache */
+    long long num_misses;    /* compressions that had to be run */
+    long long num_stores;    /* entries written to the cache */
+    long long num_evictions; /* entries removed to keep the cache under its maximum size */
+    long long bytes_saved;   /* input bytes that weren't compressed again, thanks to hits */
+    long long size;          /* bytes of cached entries, as last known */
+} apultra_cache_stats;
+
+/**
+ * On-disk cache of compressed data, keyed by a hash of everything the compressed data depends on
+ *
+ * Each entry is a file in the cache directory, named after its key, which includes APULTRA_VERSION and
+ * APULTRA_PARSER_REVISION. The stats and compressed data in an entry are hashed too, and a damaged entry is a miss.
+ * Entries are evicted least recently used first, as told by their modification time, which is updated on each hit.
+ * Files left behind by interrupted stores count towards the cache's size, and are removed once they are older than
+ * APULTRA_CACHE_TEMP_MAX_AGE.
+ */
+typedef struct _apultra_cache {
+    char *directory;        /* cache directory, allocated */
+    long long max_size;     /* maximum bytes of cached entries */
+    apultra_cache_stats stats;
+} apultra_cache;
+
+/**
+ * Open a compression cache, creating its directory if needed
+ *
+ * @param pCache cache to initialize
+ * @param pszDirectory cache directory
+ * @param nMaxSize maximum bytes of cached entries (0 for APULTRA_CACHE_DEFAULT_MAX_SIZE)
+ *
+ * @return 0 for success, -1 for error
+ */
+int apultra_cache_open(apultra_cache *pCache, const char *pszDirectory, long long nMaxSize);
+
+/**
+ * Close a compression cache
+ *
+ * @param pCache cache to close
+ */
+void apultra_cache_close(apultra_cache *pCache);
+
+/**
+ * Compress memory, or return the compressed data stored for the same input and settings
+ *
+ * Takes the same arguments as apultra_compress(). On a hit, the stored data is copied to the output buffer and the
+ * compression stats are the ones of the compression that stored it, with no time spent in any phase; the progress
+ * function is called once. The cache's stats are updated either way. Errors accessing the cache make it a miss,
+ * they don't fail the compression.
+ *
+ * @param pCache compression cache
+ * @param pInputData pointer to input(source) data to compress
+ * @param pOutBuffer buffer for compressed data
+ * @param nInputSize input(source) size in bytes
+ * @param nMaxOutBufferSize maximum capacity of compression buffer
+ * @param nFlags compression flags (number of parsing threads in APULTRA_FLAG_THREADS_MASK, APULTRA_FLAG_xxx, or 0)
+ * @param nMaxWindowSize maximum window size to use (0 for default)
+ * @param nDictionarySize size of dictionary in front of input data (0 for none)
+ * @param progress progress function, called after compressing each block, or NULL for none
+ * @param pStats pointer to compression stats that are filled if this function is successful, or NULL
+ *
+ * @return actual compressed size, or -1 for error
+ */
+size_t apultra_compress_cached(apultra_cache *pCache,
+    const unsigned char *pInputData,
+    unsigned char *pOutBuffer,
+    size_t nInputSize,
+    size_t nMaxOutBufferSize,
+    const unsigned int nFlags,
+    size_t nMaxWindowSize,
+    size_t nDictionarySize,
+    void (*progress)(long long nOriginalSize, long long nCompressedSize),
+    apultra_stats *pStats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CACHE_H */
@@ -0,0 +1,99 @@
+/*
+ * cycles.c - decompression cycle estimator
+ *
+ * Copyright (C) 2019 Emmanuel Marty
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+/*
+ * Uses the libdivsufsort library Copyright (c) 2003-2008 Yuta Mori
+ *
+ * Inspired by cap by Sven-�ke Dahl. https://github.com/svendahl/cap
+ * Also inspired by Charles Bloom's compression blog. http://cbloomrants.blogspot.com/
+ * With ideas from LZ4 by Yann Collet. https://github.com/lz4/lz4
+ * With help and support from spke <zxintrospec@gmail.com>
+ *
+ */
+
+#include <stdlib.h>
+#include "cycles.h"
+
+/**
+ * Per-token costs of the shipped decompressors, counted by hand from the sources in asm/, assuming the common path
+ * through each routine (no page crossings, no wait states). Bit reads are folded into the token costs; only the extra
+ * work done when the bit queue runs empty is counted separately, as tag_byte.
+ */
+static const apultra_cycle_model g_cycle_models[] = {
+    /* name, unit, init, literal, large, rep, 7bit, 4bit, 4bit zero, eod, gamma2, gamma2 pair, tag byte, match byte */
+    { "Z80/unaplib_small", "T-states", 57, 67, 307, 230, 323, 420, 382, 158, 21, 97, 21, 21 },
+    { "Z80/unaplib_fast", "T-states", 47, 32, 197, 136, 176, 239, 201, 86, 21, 48, 34, 21 },
+    { "6502/aplib_6502", "cycles", 48, 40, 130, 98, 125, 127, 102, 55, 14, 26, 32, 16 },
+    { "6809/unaplib", "cycles", 26, 39, 161, 109, 145, 194, 184, 89, 15, 51, 22, 20 },
+    { "68000/unaplib_68000", "cycles", 96, 74, 248, 172, 250, 438, 420, 290, 38, 114, 10, 22 },
+    { "8088/aplib_8088_small", "cycles", 51, 97, 325, 273, 373, 528, 518, 277, 48, 140, 7, 17 },
+};
+
+#define NCYCLE_MODELS ((int)(sizeof(g_cycle_models) / sizeof(g_cycle_models[0])))
+
+/**
+ * Get the number of known decompressor cost models
+ *
+ * @return number of cost models
+ */
+int apultra_get_cycle_model_count(void) {
+    return NCYCLE_MODELS;
+}
+
+/**
+ * Get a decompressor cost model
+ *
+ * @param nIndex index of model, 0..apultra_get_cycle_model_count()-1
+ *
+ * @return cost model, or NULL for an invalid index
+ */
+const apultra_cycle_model *apultra_get_cycle_model(const int nIndex) {
+    if (nIndex < 0 || nIndex >= NCYCLE_MODELS) return NULL;
+    return &g_cycle_models[nIndex];
+}
+
+/**
+ * Estimate the number of cycles taken by a decompressor to unpack profiled data
+ *
+ * @param pProfile token counts, as returned by apultra_profile_decompression()
+ * @param pModel decompressor cost model
+ *
+ * @return estimated number of cycles
+ */
+long long apultra_estimate_cycles(const apultra_decode_profile *pProfile, const apultra_cycle_model *pModel) {
+    long long nCycles = pModel->init;
+
+    /* The first byte is copied by the init code */
+    if (pProfile->num_literals > 0) nCycles += (pProfile->num_literals - 1) * pModel->literal;
+    nCycles += pProfile->num_large_matches * pModel->large_match;
+    nCycles += pProfile->num_rep_matches * pModel->rep_match;
+    nCycles += pProfile->num_7bit_matches * pModel->match_7bit;
+    nCycles += pProfile->num_4bit_matches * pModel->match_4bit;
+    nCycles += pProfile->num_4bit_zeroes * pModel->match_4bit_zero;
+    nCycles += pProfile->num_eod * pModel->eod;
+    nCycles += pProfile->num_gamma2_values * pModel->gamma2_value;
+    nCycles += pProfile->num_gamma2_pairs * pModel->gamma2_pair;
+    nCycles += pProfile->num_tag_bytes * pModel->tag_byte;
+    nCycles += pProfile->num_match_bytes * pModel->match_byte;
+
+    return nCycles;
+}
@@ -0,0 +1,127 @@
+/*
+ * cycles.h - decompression cycle estimator definitions
+ *
+ * Copyright (C) 2019 Emmanuel Marty
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+/*
+ * Uses the libdivsufsort library Copyright (c) 2003-2008 Yuta Mori
+ *
+ * Inspired by cap by Sven-�ke Dahl. https://github.com/svendahl/cap
+ * Also inspired by Charles Bloom's compression blog. http://cbloomrants.blogspot.com/
+ * With ideas from LZ4 by Yann Collet. https://github.com/lz4/lz4
+ * With help and support from spke <zxintrospec@gmail.com>
+ *
+ */
+
+#ifndef _CYCLES_H
+#define _CYCLES_H
+
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Token counts gathered by walking a compressed stream, independent of the target CPU */
+typedef struct {
+    long long num_literals;        /* '0' literals, including the first byte */
+    long long num_large_matches;   /* '10' matches with an explicit 8+n bits offset */
+    long long num_rep_matches;     /* '10' matches reusing the previous offset */
+    long long num_7bit_matches;    /* '110' matches with a 7 bits offset */
+    long long num_4bit_matches;    /* '111' 1-byte copies from a non-zero 4 bits offset */
+    long long num_4bit_zeroes;     /* '111' zero bytes (4 bits offset of 0) */
+    long long num_eod;             /* end of data markers */
+    long long num_gamma2_values;   /* gamma2 values read */
+    long long num_gamma2_pairs;    /* (data, continuation) bit pairs read for all gamma2 values */
+    long long num_tag_bytes;       /* bytes read into the bit queue */
+    long long num_match_bytes;     /* bytes copied by '10' and '110' matches */
+    long long decompressed_size;   /* total decompressed size */
+} apultra_decode_profile;
+
+/** Per-token cost model of one decompressor, in CPU cycles (T-states for the Z80) */
+typedef struct {
+    const char *name;              /* decompressor name */
+    const char *unit;              /* name of the cycle unit */
+    int init;                      /* call, setup, first literal and return */
+    int literal;                   /* '0' literal, token bit included */
+    int large_match;               /* '10' match, excluding gamma2 values and bytes copied */
+    int rep_match;                 /* '10' rep-match, excluding gamma2 values and bytes copied */
+    int match_7bit;                /* '110' match, excluding bytes copied */
+    int match_4bit;                /* '111' 1-byte copy from a non-zero offset */
+    int match_4bit_zero;           /* '111' zero byte */
+    int eod;                       /* end of data marker */
+    int gamma2_value;              /* fixed cost of reading one gamma2 value */
+    int gamma2_pair;               /* cost of each (data, continuation) bit pair of a gamma2 value */
+    int tag_byte;                  /* extra cost of refilling the bit queue */
+    int match_byte;                /* cost of copying one matched byte */
+} apultra_cycle_model;
+
+/**
+ * Decompress data in memory and count the commands and bits that a decompressor reads
+ *
+ * This runs the same decoding loop as apultra_decompress() (in expand.c), with counting added.
+ *
+ * @param pInputData compressed data
+ * @param pOutData buffer for decompressed data
+ * @param nInputSize compressed size in bytes
+ * @param nMaxOutBufferSize maximum capacity of decompression buffer
+ * @param nFlags compression flags (set to 0)
+ * @param pProfile pointer to returned token counts
+ *
+ * @return decompressed size, or -1 for error
+ */
+size_t apultra_profile_decompression(const unsigned char *pInputData,
+    unsigned char *pOutData,
+    size_t nInputSize,
+    size_t nMaxOutBufferSize,
+    const unsigned int nFlags,
+    apultra_decode_profile *pProfile);
+
+/**
+ * Get the number of known decompressor cost models
+ *
+ * @return number of cost models
+ */
+int apultra_get_cycle_model_count(void);
+
+/**
+ * Get a decompressor cost model
+ *
+ * @param nIndex index of model, 0..apultra_get_cycle_model_count()-1
+ *
+ * @return cost model, or NULL for an invalid index
+ */
+const apultra_cycle_model *apultra_get_cycle_model(const int nIndex);
+
+/**
+ * Estimate the number of cycles taken by a decompressor to unpack profiled data
+ *
+ * @param pProfile token counts, as returned by apultra_profile_decompression()
+ * @param pModel decompressor cost model
+ *
+ * @return estimated number of cycles
+ */
+long long apultra_estimate_cycles(const apultra_decode_profile *pProfile, const apultra_cycle_model *pModel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CYCLES_H */
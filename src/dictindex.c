@@ -0,0 +1,306 @@
+/*
+ * dictindex.c - precomputed dictionary index
+ *
+ * Copyright (C) 2019 Emmanuel Marty
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+/*
+ * Uses the libdivsufsort library Copyright (c) 2003-2008 Yuta Mori
+ *
+ * Inspired by cap by Sven-�ke Dahl. https://github.com/svendahl/cap
+ * Also inspired by Charles Bloom's compression blog. http://cbloomrants.blogspot.com/
+ * With ideas from LZ4 by Yann Collet. https://github.com/lz4/lz4
+ * With help and support from spke <zxintrospec@gmail.com>
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "format.h"
+#include "matchfinder.h"
+#include "dictindex.h"
+
+/** Dictionary index file signature */
+static const unsigned char g_dictionary_index_magic[8] = { 'A', 'P', 'U', 'L', 'T', 'R', 'A', 'D' };
+
+/**
+ * Get the offset of the suffix array in an index, after the header and the dictionary bytes
+ *
+ * @param nDictionarySize dictionary size in bytes
+ *
+ * @return offset in bytes, aligned to 4
+ */
+static size_t apultra_get_dictionary_index_arrays_offset(const size_t nDictionarySize) {
+    return DICTIONARY_INDEX_HEADER_SIZE + ((nDictionarySize + 3) & ~(size_t)3);
+}
+
+/**
+ * Write a 32-bit value to an index header
+ *
+ * @param pData pointer to write the value to
+ * @param nValue value to write
+ */
+static void apultra_write_dictionary_index_word(unsigned char *pData, const unsigned int nValue) {
+    pData[0] = nValue & 0xff;
+    pData[1] = (nValue >> 8) & 0xff;
+    pData[2] = (nValue >> 16) & 0xff;
+    pData[3] = (nValue >> 24) & 0xff;
+}
+
+/**
+ * Read a 32-bit value from an index header
+ *
+ * @param pData pointer to read the value from
+ *
+ * @return value
+ */
+static unsigned int apultra_read_dictionary_index_word(const unsigned char *pData) {
+    return ((unsigned int)pData[0]) | (((unsigned int)pData[1]) << 8) | (((unsigned int)pData[2]) << 16)
+           | (((unsigned int)pData[3]) << 24);
+}
+
+/**
+ * Get maximum size of the index of a dictionary
+ *
+ * @param nDictionarySize dictionary size in bytes
+ *
+ * @return maximum index size in bytes
+ */
+size_t apultra_get_max_dictionary_index_size(size_t nDictionarySize) {
+    /* Suffix array and deepest interval of each suffix, and at most one lcp-interval per suffix */
+    return apultra_get_dictionary_index_arrays_offset(nDictionarySize) + nDictionarySize * 5 * sizeof(int);
+}
+
+/**
+ * Build the index of a dictionary
+ *
+ * @param pDictionaryData dictionary bytes, as they will be in front of the input data to compress
+ * @param nDictionarySize dictionary size in bytes, up to BLOCK_SIZE
+ * @param pIndexData buffer for the index
+ * @param nMaxIndexSize capacity of the index buffer
+ * @param nFlags APULTRA_DICTIONARY_INDEX_xxx flags to store with the index
+ *
+ * @return actual index size, or -1 for error
+ */
+size_t apultra_build_dictionary_index(const unsigned char *pDictionaryData,
+    size_t nDictionarySize,
+    unsigned char *pIndexData,
+    size_t nMaxIndexSize,
+    const unsigned int nFlags) {
+    const int nSize = (int)nDictionarySize;
+    const size_t nArraysOffset = apultra_get_dictionary_index_arrays_offset(nDictionarySize);
+    divsufsort_ctx_t divsufsort_context;
+    int *pSuffixArray, *pLeafInterval, *pIntervalParent, *pIntervalLcp, *pIntervalMaxPos;
+    int *PLCP, *pOpenIntervals;
+    int nNumIntervals, nTop;
+    int i, r;
+
+    if (nDictionarySize < 1 || nDictionarySize > BLOCK_SIZE) return -1;
+    if (nMaxIndexSize < apultra_get_max_dictionary_index_size(nDictionarySize)) return -1;
+    if (((size_t)pIndexData) & 3) return -1;
+
+    memset(pIndexData, 0, nArraysOffset);
+    memcpy(pIndexData + DICTIONARY_INDEX_HEADER_SIZE, pDictionaryData, nDictionarySize);
+
+    /* The intervals are stored after the suffix array and the deepest interval of each suffix, without knowing how
+     * many there are yet. Their three arrays are moved next to each other once they are all built */
+    pSuffixArray = (int *)(pIndexData + nArraysOffset);
+    pLeafInterval = pSuffixArray + nSize;
+    pIntervalParent = pLeafInterval + nSize;
+    pIntervalLcp = pIntervalParent + nSize;
+    pIntervalMaxPos = pIntervalLcp + nSize;
+
+    if (divsufsort_init(&divsufsort_context) != 0) return -1;
+    if (divsufsort_build_array(&divsufsort_context, pDictionaryData, (saidx_t *)pSuffixArray, nSize) != 0) {
+        divsufsort_destroy(&divsufsort_context);
+        return -1;
+    }
+    divsufsort_destroy(&divsufsort_context);
+
+    PLCP = (int *)malloc(nSize * sizeof(int));
+    if (!PLCP) return -1;
+    pOpenIntervals = (int *)malloc((nSize + 1) * sizeof(int));
+    if (!pOpenIntervals) {
+        free(PLCP);
+        return -1;
+    }
+
+    /* Compute the permuted LCP (Karkkainen method), as apultra_build_suffix_array() does */
+    int *Phi = PLCP;
+    int nCurLen = 0;
+
+    Phi[pSuffixArray[0]] = -1;
+    for (i = 1; i < nSize; i++) Phi[pSuffixArray[i]] = pSuffixArray[i - 1];
+    for (i = 0; i < nSize; i++) {
+        if (Phi[i] == -1) {
+            PLCP[i] = 0;
+            continue;
+        }
+        int nMaxLen = (i > Phi[i]) ? (nSize - i) : (nSize - Phi[i]);
+        while (nCurLen < nMaxLen && pDictionaryData[i + nCurLen] == pDictionaryData[Phi[i] + nCurLen]) nCurLen++;
+        PLCP[i] = nCurLen;
+        if (nCurLen > 0) nCurLen--;
+    }
+
+    /* Build the lcp-intervals bottom-up, with the same method as the matchfinder. Each suffix belongs to the deepest
+     * interval open on either side of it, and the highest offset of an interval is passed on to its parent when it
+     * is closed */
+    pIntervalParent[0] = -1;
+    pIntervalLcp[0] = 0;
+    pIntervalMaxPos[0] = -1;
+    nNumIntervals = 1;
+    nTop = 0;
+    pOpenIntervals[0] = 0;
+
+    for (r = 1; r <= nSize; r++) {
+        const int nPrevPos = pSuffixArray[r - 1];
+        int nNextLcp = 0;
+        int nLeafInterval;
+
+        if (r < nSize) {
+            nNextLcp = PLCP[pSuffixArray[r]];
+            if (nNextLcp < MIN_MATCH_SIZE) nNextLcp = 0;
+            if (nNextLcp > LCP_MAX) nNextLcp = LCP_MAX;
+        }
+
+        if (nNextLcp > pIntervalLcp[pOpenIntervals[nTop]]) {
+            /* Opening a new interval */
+            pIntervalParent[nNumIntervals] = -1;
+            pIntervalLcp[nNumIntervals] = nNextLcp;
+            pIntervalMaxPos[nNumIntervals] = -1;
+            pOpenIntervals[++nTop] = nNumIntervals++;
+        }
+
+        nLeafInterval = pOpenIntervals[nTop];
+        pLeafInterval[r - 1] = nLeafInterval;
+        if (pIntervalMaxPos[nLeafInterval] < nPrevPos) pIntervalMaxPos[nLeafInterval] = nPrevPos;
+
+        /* Close the intervals that don't go on, down to the one that continues; the root is never closed */
+        while (nNextLcp < pIntervalLcp[pOpenIntervals[nTop]]) {
+            const int nClosedInterval = pOpenIntervals[nTop--];
+            int nSuperInterval = pOpenIntervals[nTop];
+
+            if (nNextLcp > pIntervalLcp[nSuperInterval]) {
+                /* Creating a new interval that is a superinterval of the one being closed, but still a subinterval
+                 * of its superinterval */
+                pIntervalParent[nNumIntervals] = -1;
+                pIntervalLcp[nNumIntervals] = nNextLcp;
+                pIntervalMaxPos[nNumIntervals] = -1;
+                nSuperInterval = nNumIntervals++;
+                pOpenIntervals[++nTop] = nSuperInterval;
+            }
+
+            pIntervalParent[nClosedInterval] = nSuperInterval;
+            if (pIntervalMaxPos[nSuperInterval] < pIntervalMaxPos[nClosedInterval])
+                pIntervalMaxPos[nSuperInterval] = pIntervalMaxPos[nClosedInterval];
+        }
+    }
+
+    free(pOpenIntervals);
+    free(PLCP);
+
+    /* Pack the interval arrays */
+    memmove(pLeafInterval + nSize + nNumIntervals, pIntervalLcp, nNumIntervals * sizeof(int));
+    memmove(pLeafInterval + nSize + nNumIntervals * 2, pIntervalMaxPos, nNumIntervals * sizeof(int));
+
+    memcpy(pIndexData, g_dictionary_index_magic, sizeof(g_dictionary_index_magic));
+    apultra_write_dictionary_index_word(pIndexData + 8, DICTIONARY_INDEX_VERSION);
+    apultra_write_dictionary_index_word(pIndexData + 12, nFlags);
+    apultra_write_dictionary_index_word(pIndexData + 16, (unsigned int)nSize);
+    apultra_write_dictionary_index_word(pIndexData + 20, (unsigned int)nNumIntervals);
+
+    return nArraysOffset + (nSize * 2 + nNumIntervals * 3) * sizeof(int);
+}
+
+/**
+ * Check that the arrays of an index only point within the dictionary and the intervals, so that searching it can't
+ * read out of bounds or loop forever, whatever the file holds
+ *
+ * @param pIndex index to check
+ *
+ * @return 0 if the index is usable, -1 if not
+ */
+static int apultra_check_dictionary_index(const apultra_dictionary_index *pIndex) {
+    const int nSize = pIndex->size;
+    const int nNumIntervals = pIndex->num_intervals;
+    int i;
+
+    for (i = 0; i < nSize; i++) {
+        if (pIndex->suffix_array[i] < 0 || pIndex->suffix_array[i] >= nSize) return -1;
+        if (pIndex->leaf_interval[i] < 0 || pIndex->leaf_interval[i] >= nNumIntervals) return -1;
+    }
+
+    /* The root has no parent, and each other interval is strictly deeper than its parent, so walking up the parents
+     * always ends at the root */
+    if (pIndex->interval_parent[0] != -1 || pIndex->interval_lcp[0] != 0) return -1;
+    for (i = 0; i < nNumIntervals; i++) {
+        const int nParent = pIndex->interval_parent[i];
+
+        if (pIndex->interval_lcp[i] < 0 || pIndex->interval_lcp[i] > LCP_MAX) return -1;
+        if (pIndex->interval_max_pos[i] < -1 || pIndex->interval_max_pos[i] >= nSize) return -1;
+        if (i > 0) {
+            if (nParent < 0 || nParent >= nNumIntervals) return -1;
+            if (pIndex->interval_lcp[nParent] >= pIndex->interval_lcp[i]) return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Open a dictionary index built by apultra_build_dictionary_index(), without copying it
+ *
+ * The header, the size of the data and the range of every value in the arrays are checked, in one pass. The order of
+ * the suffixes is trusted: a wrong order only makes the search miss matches.
+ *
+ * @param pIndexData index data, aligned to 4 bytes (for instance, a memory-mapped index file)
+ * @param nIndexSize index size in bytes
+ * @param pIndex pointer to returned index, pointing into pIndexData
+ *
+ * @return 0 for success, -1 for an invalid index
+ */
+int apultra_open_dictionary_index(const unsigned char *pIndexData,
+    size_t nIndexSize,
+    apultra_dictionary_index *pIndex) {
+    size_t nArraysOffset;
+    unsigned int nSize, nNumIntervals;
+
+    if (nIndexSize < DICTIONARY_INDEX_HEADER_SIZE || (((size_t)pIndexData) & 3)) return -1;
+    if (memcmp(pIndexData, g_dictionary_index_magic, sizeof(g_dictionary_index_magic))) return -1;
+    if (apultra_read_dictionary_index_word(pIndexData + 8) != DICTIONARY_INDEX_VERSION) return -1;
+
+    nSize = apultra_read_dictionary_index_word(pIndexData + 16);
+    nNumIntervals = apultra_read_dictionary_index_word(pIndexData + 20);
+    if (nSize < 1 || nSize > BLOCK_SIZE || nNumIntervals < 1 || nNumIntervals > nSize) return -1;
+
+    nArraysOffset = apultra_get_dictionary_index_arrays_offset(nSize);
+    if (nIndexSize != nArraysOffset + ((size_t)nSize * 2 + (size_t)nNumIntervals * 3) * sizeof(int)) return -1;
+
+    pIndex->dictionary = pIndexData + DICTIONARY_INDEX_HEADER_SIZE;
+    pIndex->suffix_array = (const int *)(pIndexData + nArraysOffset);
+    pIndex->leaf_interval = pIndex->suffix_array + nSize;
+    pIndex->interval_parent = pIndex->leaf_interval + nSize;
+    pIndex->interval_lcp = pIndex->interval_parent + nNumIntervals;
+    pIndex->interval_max_pos = pIndex->interval_lcp + nNumIntervals;
+    pIndex->size = (int)nSize;
+    pIndex->num_intervals = (int)nNumIntervals;
+    pIndex->flags = apultra_read_dictionary_index_word(pIndexData + 12);
+
+    return apultra_check_dictionary_index(pIndex);
+}
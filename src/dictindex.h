@@ -0,0 +1,114 @@
+/*
+ * dictindex.h - precomputed dictionary index definitions
+ *
+ * Copyright (C) 2019 Emmanuel Marty
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+/*
+ * Uses the libdivsufsort library Copyright (c) 2003-2008 Yuta Mori
+ *
+ * Inspired by cap by Sven-�ke Dahl. https://github.com/svendahl/cap
+ * Also inspired by Charles Bloom's compression blog. http://cbloomrants.blogspot.com/
+ * With ideas from LZ4 by Yann Collet. https://github.com/lz4/lz4
+ * With help and support from spke <zxintrospec@gmail.com>
+ *
+ */
+
+#ifndef _DICTINDEX_H
+#define _DICTINDEX_H
+
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DICTIONARY_INDEX_VERSION 1
+#define DICTIONARY_INDEX_HEADER_SIZE 32
+
+/** Dictionary index flags, stored with the index for the caller */
+#define APULTRA_DICTIONARY_INDEX_BACKWARD 1 /* the dictionary bytes were reversed, for backward compression */
+
+/**
+ * Precomputed index of a dictionary, for compressing many inputs against it
+ *
+ * The dictionary's suffixes are sorted once, and its lcp-intervals are stored with the most recent dictionary
+ * position that each one contains. Matches into the dictionary are then found with a binary search for each input
+ * position, instead of sorting and walking the dictionary again for every input. All the pointers point into the
+ * index data, which can be memory-mapped.
+ */
+typedef struct _apultra_dictionary_index {
+    const unsigned char *dictionary;  /* dictionary bytes, as they are in front of the input data */
+    const int *suffix_array;          /* dictionary offsets, in the sorted order of their suffixes */
+    const int *leaf_interval;         /* deepest lcp-interval of each suffix, by rank in the suffix array */
+    const int *interval_parent;       /* enclosing lcp-interval of each lcp-interval (-1 for the root, interval 0) */
+    const int *interval_lcp;          /* length shared by all the suffixes of each lcp-interval, up to LCP_MAX */
+    const int *interval_max_pos;      /* highest dictionary offset in each lcp-interval */
+    int size;                         /* dictionary size in bytes */
+    int num_intervals;
+    unsigned int flags;               /* APULTRA_DICTIONARY_INDEX_xxx flags */
+} apultra_dictionary_index;
+
+/**
+ * Get maximum size of the index of a dictionary
+ *
+ * @param nDictionarySize dictionary size in bytes
+ *
+ * @return maximum index size in bytes
+ */
+size_t apultra_get_max_dictionary_index_size(size_t nDictionarySize);
+
+/**
+ * Build the index of a dictionary
+ *
+ * @param pDictionaryData dictionary bytes, as they will be in front of the input data to compress
+ * @param nDictionarySize dictionary size in bytes, up to BLOCK_SIZE
+ * @param pIndexData buffer for the index
+ * @param nMaxIndexSize capacity of the index buffer
+ * @param nFlags APULTRA_DICTIONARY_INDEX_xxx flags to store with the index
+ *
+ * @return actual index size, or -1 for error
+ */
+size_t apultra_build_dictionary_index(const unsigned char *pDictionaryData,
+    size_t nDictionarySize,
+    unsigned char *pIndexData,
+    size_t nMaxIndexSize,
+    const unsigned int nFlags);
+
+/**
+ * Open a dictionary index built by apultra_build_dictionary_index(), without copying it
+ *
+ * The header, the size of the data and the range of every value in the arrays are checked, in one pass. The order of
+ * the suffixes is trusted: a wrong order only makes the search miss matches.
+ *
+ * @param pIndexData index data, aligned to 4 bytes (for instance, a memory-mapped index file)
+ * @param nIndexSize index size in bytes
+ * @param pIndex pointer to returned index, pointing into pIndexData
+ *
+ * @return 0 for success, -1 for an invalid index
+ */
+int apultra_open_dictionary_index(const unsigned char *pIndexData,
+    size_t nIndexSize,
+    apultra_dictionary_index *pIndex);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _DICTINDEX_H */
@@ -0,0 +1,109 @@
+/*
+ * dirlist.c - directory listing
+ *
+ * Copyright (C) 2019 Emmanuel Marty
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+/*
+ * Uses the libdivsufsort library Copyright (c) 2003-2008 Yuta Mori
+ *
+ * Inspired by cap by Sven-�ke Dahl. https://github.com/svendahl/cap
+ * Also inspired by Charles Bloom's compression blog. http://cbloomrants.blogspot.com/
+ * With ideas from LZ4 by Yann Collet. https://github.com/lz4/lz4
+ * With help and support from spke <zxintrospec@gmail.com>
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#endif
+#include "dirlist.h"
+
+#define DIRLIST_PATH_MAX 4096
+
+/**
+ * Call a function for each regular file in a directory, in no particular order
+ *
+ * @param pszDirName directory name
+ * @param callback function to call for each file
+ * @param pUserData user data passed to the function
+ *
+ * @return 0 for success, -1 if the directory couldn't be listed or the function failed
+ */
+int apultra_list_directory(const char *pszDirName, apultra_list_directory_func callback, void *pUserData) {
+    int nResult = 0;
+
+#ifdef _WIN32
+    WIN32_FIND_DATAA fd;
+    char szPattern[DIRLIST_PATH_MAX];
+    HANDLE hFind;
+    int nPathSize;
+
+    nPathSize = snprintf(szPattern, sizeof(szPattern), "%s\\*", pszDirName);
+    if (nPathSize < 0 || nPathSize >= (int)sizeof(szPattern)) return -1;
+    hFind = FindFirstFileA(szPattern, &fd);
+    if (hFind == INVALID_HANDLE_VALUE) return (GetLastError() == ERROR_FILE_NOT_FOUND) ? 0 : -1;
+
+    do {
+        long long nSize, nTime;
+
+        if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+        nSize = ((long long)fd.nFileSizeHigh << 32) | (long long)fd.nFileSizeLow;
+        nTime = (((long long)fd.ftLastWriteTime.dwHighDateTime << 32) | (long long)fd.ftLastWriteTime.dwLowDateTime)
+            * 100LL;
+        if (callback(pUserData, fd.cFileName, nSize, nTime)) nResult = -1;
+    } while (!nResult && FindNextFileA(hFind, &fd));
+
+    FindClose(hFind);
+#else
+    DIR *pDir = opendir(pszDirName);
+    struct dirent *pEntry;
+
+    if (!pDir) return -1;
+
+    while (!nResult && (pEntry = readdir(pDir)) != NULL) {
+        char szPath[DIRLIST_PATH_MAX];
+        struct stat st;
+        long long nTime;
+        int nPathSize;
+
+        nPathSize = snprintf(szPath, sizeof(szPath), "%s/%s", pszDirName, pEntry->d_name);
+        if (nPathSize < 0 || nPathSize >= (int)sizeof(szPath)) continue;
+        if (stat(szPath, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+#if defined(__APPLE__)
+        nTime = (long long)st.st_mtimespec.tv_sec * 1000000000LL + (long long)st.st_mtimespec.tv_nsec;
+#elif defined(__linux__)
+        nTime = (long long)st.st_mtim.tv_sec * 1000000000LL + (long long)st.st_mtim.tv_nsec;
+#else
+        nTime = (long long)st.st_mtime * 1000000000LL;
+#endif
+        if (callback(pUserData, pEntry->d_name, (long long)st.st_size, nTime)) nResult = -1;
+    }
+
+    closedir(pDir);
+#endif
+
+    return nResult;
+}
@@ -0,0 +1,67 @@
+/*
+ * dirlist.h - directory listing
+ *
+ * Copyright (C) 2019 Emmanuel Marty
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+/*
+ * Uses the libdivsufsort library Copyright (c) 2003-2008 Yuta Mori
+ *
+ * Inspired by cap by Sven-�ke Dahl. https://github.com/svendahl/cap
+ * Also inspired by Charles Bloom's compression blog. http://cbloomrants.blogspot.com/
+ * With ideas from LZ4 by Yann Collet. https://github.com/lz4/lz4
+ * With help and support from spke <zxintrospec@gmail.com>
+ *
+ */
+
+#ifndef _DIRLIST_H
+#define _DIRLIST_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Function called for each file listed by apultra_list_directory()
+ *
+ * @param pUserData user data passed to apultra_list_directory()
+ * @param pszName file name, without the directory
+ * @param nSize file size in bytes
+ * @param nTime modification time, in nanoseconds
+ *
+ * @return 0 to go on listing, non-zero to stop and fail the listing
+ */
+typedef int (*apultra_list_directory_func)(void *pUserData, const char *pszName, long long nSize, long long nTime);
+
+/**
+ * Call a function for each regular file in a directory, in no particular order
+ *
+ * @param pszDirName directory name
+ * @param callback function to call for each file
+ * @param pUserData user data passed to the function
+ *
+ * @return 0 for success, -1 if the directory couldn't be listed or the function failed
+ */
+int apultra_list_directory(const char *pszDirName, apultra_list_directory_func callback, void *pUserData);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _DIRLIST_H */
@@ -0,0 +1,872 @@
+/*
+ * emulate.c - run the asm decompressors on emulated CPUs
+ *
+ * Copyright (C) 2019 Emmanuel Marty
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "emulate.h"
+
+/** Size of the memory of the emulated CPUs */
+#define EMULATED_MEMORY_SIZE 65536
+
+/** Address that the compressed data is put at; the decompressors are below it and the output follows it */
+#define EMULATED_DATA_ADDRESS 0x0400
+
+/** Top of the memory that the data may use; the Z80 stack is above it */
+#define EMULATED_DATA_END 0xff00
+
+/** Z80 flags, only carry and zero are kept; the decompressors don't test the others */
+#define Z80_FLAG_C 0x01
+#define Z80_FLAG_Z 0x40
+
+/** 6502 flags, only negative, zero and carry are kept; the decompressor doesn't test the others */
+#define M6502_FLAG_C 0x01
+#define M6502_FLAG_Z 0x02
+#define M6502_FLAG_N 0x80
+
+/** Zero page pointers to the compressed data and to the output (apl_srcptr and apl_dstptr in asm/6502/aplib_6502.asm) */
+#define M6502_SRCPTR 0xfc
+#define M6502_DSTPTR 0xfe
+
+/* asm/Z80/unaplib_small.asm, with the default options, assembled at 0x0100 */
+static const unsigned char g_z80_small[] = {
+    0x3e, 0x80, 0xed, 0xa0, 0x06, 0xff, 0xcd, 0x85, 0x01, 0x30, 0xf7, 0xcd, 0x85, 0x01, 0x30, 0x2a,
+    0x01, 0xe0, 0x00, 0xcd, 0x85, 0x01, 0x30, 0x14, 0xcd, 0x85, 0x01, 0xcb, 0x11, 0x38, 0xf9, 0xeb,
+    0x28, 0x05, 0xe5, 0xed, 0x42, 0x4e, 0xe1, 0x71, 0x23, 0xeb, 0x18, 0xd8, 0x4e, 0xcb, 0x19, 0xc8,
+    0x23, 0xe5, 0x60, 0x69, 0x0e, 0x01, 0xcb, 0x11, 0x18, 0x26, 0x08, 0x78, 0x08, 0xcd, 0x75, 0x01,
+    0x08, 0x81, 0x4f, 0x08, 0x0d, 0x28, 0x26, 0x0d, 0x41, 0x4e, 0x23, 0xc5, 0xcd, 0x75, 0x01, 0xe3,
+    0x08, 0x7c, 0xfe, 0x05, 0x30, 0x08, 0xb7, 0x20, 0x06, 0xcb, 0x7d, 0x20, 0x02, 0x03, 0x03, 0x08,
+    0xe5, 0xdd, 0xe1, 0xd5, 0xeb, 0xed, 0x52, 0xd1, 0xed, 0xb0, 0xe1, 0x18, 0x99, 0xcd, 0x75, 0x01,
+    0xdd, 0xe5, 0xe3, 0x18, 0xee, 0x01, 0x01, 0x00, 0xcd, 0x85, 0x01, 0xcb, 0x11, 0xcb, 0x10, 0xcd,
+    0x85, 0x01, 0xd0, 0x18, 0xf3, 0x87, 0xc0, 0x7e, 0x23, 0x17, 0xc9
+};
+
+/* asm/Z80/unaplib_fast.asm, with the default options, assembled at 0x0100 */
+static const unsigned char g_z80_fast[] = {
+    0xed, 0xa0, 0x37, 0x7e, 0x23, 0x17, 0x38, 0x07, 0xed, 0xa0, 0x87, 0x30, 0xfb, 0x28, 0xf4, 0x87,
+    0x30, 0x31, 0x28, 0x2a, 0x87, 0xcc, 0xe7, 0x01, 0xda, 0x82, 0x01, 0x4e, 0xcb, 0x19, 0xc8, 0x23,
+    0x06, 0x00, 0xdd, 0x69, 0xdd, 0x60, 0xe5, 0x62, 0x6b, 0x38, 0x08, 0xed, 0x42, 0xed, 0xa0, 0xed,
+    0xa0, 0x18, 0x3e, 0xb7, 0xed, 0x42, 0xed, 0xa0, 0xed, 0xa0, 0xed, 0xa0, 0x18, 0x33, 0x7e, 0x23,
+    0x17, 0x38, 0xd1, 0xcd, 0xc8, 0x01, 0x0d, 0x0d, 0x28, 0x74, 0x0d, 0x41, 0x4e, 0x23, 0xdd, 0x69,
+    0xdd, 0x60, 0xc5, 0xcd, 0xc8, 0x01, 0xe3, 0x08, 0x7c, 0xfe, 0x05, 0x30, 0x08, 0xb7, 0x20, 0x06,
+    0xcb, 0x7d, 0x20, 0x02, 0x03, 0x03, 0x7b, 0x95, 0x6f, 0x7a, 0x9c, 0x67, 0x08, 0xed, 0xa0, 0xed,
+    0xb0, 0xe1, 0x87, 0x30, 0x93, 0x28, 0x34, 0x87, 0x30, 0x3e, 0x28, 0x37, 0x87, 0xcc, 0xe7, 0x01,
+    0x30, 0x99, 0x01, 0xe0, 0x00, 0x87, 0xcc, 0xe7, 0x01, 0xcb, 0x11, 0x87, 0xcc, 0xe7, 0x01, 0xcb,
+    0x11, 0x87, 0xcc, 0xe7, 0x01, 0xcb, 0x11, 0x87, 0xcc, 0xe7, 0x01, 0xcb, 0x11, 0xeb, 0x28, 0x05,
+    0xe5, 0xed, 0x42, 0x4e, 0xe1, 0x71, 0x23, 0xeb, 0xc3, 0x0a, 0x01, 0x7e, 0x23, 0x17, 0xd2, 0x08,
+    0x01, 0x18, 0xc4, 0x7e, 0x23, 0x17, 0x38, 0xc4, 0xcd, 0xc8, 0x01, 0x0d, 0x18, 0x8c, 0x0c, 0xcd,
+    0xcb, 0x01, 0xdd, 0xe5, 0xe3, 0x08, 0x18, 0x9e, 0x01, 0x01, 0x00, 0x87, 0x28, 0x0e, 0xcb, 0x11,
+    0xcb, 0x10, 0x87, 0xd0, 0x20, 0xf5, 0x7e, 0x23, 0x17, 0xd0, 0x18, 0xef, 0x7e, 0x23, 0x17, 0xcb,
+    0x11, 0xcb, 0x10, 0x87, 0xd0, 0x18, 0xe4, 0x7e, 0x23, 0x17, 0xc9
+};
+
+/* asm/6502/aplib_6502.asm, assembled at $0200 */
+static const unsigned char g_6502[] = {
+    0xa0, 0x00, 0xa9, 0x80, 0x85, 0xf7, 0xb1, 0xfc, 0xe6, 0xfc, 0xd0, 0x02, 0xe6, 0xfd, 0xa2, 0x00,
+    0x91, 0xfe, 0xe6, 0xfe, 0xd0, 0x02, 0xe6, 0xff, 0x06, 0xf7, 0xd0, 0x03, 0x20, 0xf0, 0x02, 0x90,
+    0xe5, 0x06, 0xf7, 0xd0, 0x03, 0x20, 0xf0, 0x02, 0x90, 0x56, 0x06, 0xf7, 0xd0, 0x03, 0x20, 0xf0,
+    0x02, 0x90, 0x1e, 0xa9, 0x10, 0x06, 0xf7, 0xd0, 0x05, 0x48, 0x20, 0xf0, 0x02, 0x68, 0x2a, 0x90,
+    0xf4, 0xf0, 0xcb, 0x49, 0xff, 0xa8, 0xc8, 0xc6, 0xff, 0xb1, 0xfe, 0xe6, 0xff, 0xa0, 0x00, 0xf0,
+    0xbd, 0xb1, 0xfc, 0xe6, 0xfc, 0xd0, 0x02, 0xe6, 0xfd, 0x4a, 0xf0, 0x23, 0x85, 0xf8, 0x84, 0xf9,
+    0x98, 0xaa, 0x69, 0x02, 0xd0, 0x59, 0xa9, 0x01, 0x06, 0xf7, 0xd0, 0x05, 0x48, 0x20, 0xf0, 0x02,
+    0x68, 0x2a, 0x26, 0xfb, 0x06, 0xf7, 0xd0, 0x05, 0x48, 0x20, 0xf0, 0x02, 0x68, 0xb0, 0xe9, 0x60,
+    0x20, 0x66, 0x02, 0x84, 0xfb, 0xe0, 0x01, 0xe9, 0x02, 0xb0, 0x07, 0x20, 0x66, 0x02, 0xa6, 0xfb,
+    0x90, 0x2d, 0x85, 0xf9, 0xb1, 0xfc, 0xe6, 0xfc, 0xd0, 0x02, 0xe6, 0xfd, 0x85, 0xf8, 0x20, 0x66,
+    0x02, 0xa6, 0xfb, 0xa4, 0xf9, 0xf0, 0x0a, 0xc0, 0x7d, 0xb0, 0x0b, 0xc0, 0x05, 0xb0, 0x0b, 0x90,
+    0x0e, 0xa4, 0xf8, 0x30, 0x0a, 0x38, 0x69, 0x01, 0xb0, 0x04, 0x69, 0x00, 0x90, 0x01, 0xe8, 0x49,
+    0xff, 0xa8, 0xc8, 0xf0, 0x0c, 0x49, 0xff, 0xe8, 0x18, 0x65, 0xfe, 0x85, 0xfe, 0xb0, 0x02, 0xc6,
+    0xff, 0x38, 0xa5, 0xfe, 0xe5, 0xf8, 0x85, 0xfa, 0xa5, 0xff, 0xe5, 0xf9, 0x85, 0xfb, 0xb1, 0xfa,
+    0x91, 0xfe, 0xc8, 0xd0, 0xf9, 0xe6, 0xfb, 0xe6, 0xff, 0xca, 0xd0, 0xf2, 0xe8, 0x4c, 0x18, 0x02,
+    0xb1, 0xfc, 0xe6, 0xfc, 0xd0, 0x02, 0xe6, 0xfd, 0x2a, 0x85, 0xf7, 0x60
+};
+
+static const apultra_emulated_decompressor g_emulated_decompressors[] = {
+    { "Z80/unaplib_small", "T-states", APULTRA_CPU_Z80, g_z80_small, (int)sizeof(g_z80_small), 0x0100 },
+    { "Z80/unaplib_fast", "T-states", APULTRA_CPU_Z80, g_z80_fast, (int)sizeof(g_z80_fast), 0x0100 },
+    { "6502/aplib_6502", "cycles", APULTRA_CPU_6502, g_6502, (int)sizeof(g_6502), 0x0200 },
+};
+
+/** Z80 state */
+typedef struct {
+    unsigned char *mem;
+    unsigned char r[8];        /* B, C, D, E, H, L, unused, A: indexed like the register fields of the opcodes */
+    unsigned char f;
+    unsigned char a_alt, f_alt;
+    unsigned short ix, sp, pc;
+    long long cycles;
+} apultra_z80;
+
+/** 6502 state */
+typedef struct {
+    unsigned char *mem;
+    unsigned char a, x, y, s, p;
+    unsigned short pc;
+    long long cycles;
+} apultra_6502;
+
+/**
+ * Get the number of decompressors that can be run on an emulated CPU
+ *
+ * @return number of emulated decompressors
+ */
+int apultra_get_emulated_decompressor_count(void) {
+    return (int)(sizeof(g_emulated_decompressors) / sizeof(g_emulated_decompressors[0]));
+}
+
+/**
+ * Get a decompressor that can be run on an emulated CPU
+ *
+ * @param nIndex index of decompressor, 0..apultra_get_emulated_decompressor_count()-1
+ *
+ * @return decompressor, or NULL for an invalid index
+ */
+const apultra_emulated_decompressor *apultra_get_emulated_decompressor(const int nIndex) {
+    if (nIndex < 0 || nIndex >= apultra_get_emulated_decompressor_count())
+        return NULL;
+    return &g_emulated_decompressors[nIndex];
+}
+
+static inline int apultra_z80_fetch(apultra_z80 *z) {
+    return z->mem[z->pc++];
+}
+
+static inline int apultra_z80_fetch16(apultra_z80 *z) {
+    int nValue = apultra_z80_fetch(z);
+    return nValue | (apultra_z80_fetch(z) << 8);
+}
+
+static inline int apultra_z80_get_hl(const apultra_z80 *z) {
+    return (z->r[4] << 8) | z->r[5];
+}
+
+static inline int apultra_z80_get_reg(const apultra_z80 *z, const int nReg) {
+    return (nReg == 6) ? z->mem[apultra_z80_get_hl(z)] : z->r[nReg];
+}
+
+static inline void apultra_z80_set_reg(apultra_z80 *z, const int nReg, const int nValue) {
+    if (nReg == 6)
+        z->mem[apultra_z80_get_hl(z)] = (unsigned char)nValue;
+    else
+        z->r[nReg] = (unsigned char)nValue;
+}
+
+static inline int apultra_z80_get_pair(const apultra_z80 *z, const int nPair) {
+    return (nPair == 3) ? z->sp : ((z->r[nPair * 2] << 8) | z->r[nPair * 2 + 1]);
+}
+
+static inline void apultra_z80_set_pair(apultra_z80 *z, const int nPair, const int nValue) {
+    if (nPair == 3) {
+        z->sp = (unsigned short)nValue;
+    } else {
+        z->r[nPair * 2] = (unsigned char)(nValue >> 8);
+        z->r[nPair * 2 + 1] = (unsigned char)nValue;
+    }
+}
+
+static inline void apultra_z80_push(apultra_z80 *z, const int nValue) {
+    z->sp -= 2;
+    z->mem[z->sp] = (unsigned char)nValue;
+    z->mem[(unsigned short)(z->sp + 1)] = (unsigned char)(nValue >> 8);
+}
+
+static inline int apultra_z80_pop(apultra_z80 *z) {
+    int nValue = z->mem[z->sp] | (z->mem[(unsigned short)(z->sp + 1)] << 8);
+    z->sp += 2;
+    return nValue;
+}
+
+/**
+ * Test a Z80 condition
+ *
+ * @param z Z80 state
+ * @param nCondition condition field of the opcode
+ *
+ * @return 1 if the condition is true, 0 if it is false, -1 for a condition on an unsupported flag
+ */
+static int apultra_z80_condition(const apultra_z80 *z, const int nCondition) {
+    switch (nCondition) {
+    case 0: return (z->f & Z80_FLAG_Z) ? 0 : 1;   /* nz */
+    case 1: return (z->f & Z80_FLAG_Z) ? 1 : 0;   /* z */
+    case 2: return (z->f & Z80_FLAG_C) ? 0 : 1;   /* nc */
+    case 3: return (z->f & Z80_FLAG_C) ? 1 : 0;   /* c */
+    default: return -1;
+    }
+}
+
+static void apultra_z80_alu(apultra_z80 *z, const int nOperation, const int nValue) {
+    const int nCarry = z->f & Z80_FLAG_C;
+    const int a = z->r[7];
+    int nResult;
+
+    switch (nOperation) {
+    case 0: nResult = a + nValue; break;            /* add */
+    case 1: nResult = a + nValue + nCarry; break;   /* adc */
+    case 3: nResult = a - nValue - nCarry; break;   /* sbc */
+    case 4: nResult = a & nValue; break;            /* and */
+    case 5: nResult = a ^ nValue; break;            /* xor */
+    case 6: nResult = a | nValue; break;            /* or */
+    default: nResult = a - nValue; break;           /* sub, cp */
+    }
+
+    z->f = ((nResult & 0xff) ? 0 : Z80_FLAG_Z) | ((nResult & 0x100) ? Z80_FLAG_C : 0);
+    if (nOperation != 7)
+        z->r[7] = (unsigned char)nResult;
+}
+
+static int apultra_z80_step_cb(apultra_z80 *z) {
+    const int nOpcode = apultra_z80_fetch(z);
+    const int nReg = nOpcode & 7;
+    const int nValue = apultra_z80_get_reg(z, nReg);
+    int nResult, nCarry;
+
+    if (nOpcode < 0x20) {
+        /* rlc, rrc, rl, rr */
+        switch (nOpcode >> 3) {
+        case 0: nCarry = nValue >> 7; nResult = (nValue << 1) | nCarry; break;
+        case 1: nCarry = nValue & 1; nResult = (nValue >> 1) | (nCarry << 7); break;
+        case 2: nCarry = nValue >> 7; nResult = (nValue << 1) | (z->f & Z80_FLAG_C); break;
+        default: nCarry = nValue & 1; nResult = (nValue >> 1) | ((z->f & Z80_FLAG_C) << 7); break;
+        }
+        nResult &= 0xff;
+        apultra_z80_set_reg(z, nReg, nResult);
+        z->f = (nResult ? 0 : Z80_FLAG_Z) | (nCarry ? Z80_FLAG_C : 0);
+        z->cycles += (nReg == 6) ? 15 : 8;
+        return 0;
+    }
+
+    if (nOpcode >= 0x40 && nOpcode < 0x80) {
+        /* bit */
+        z->f = (z->f & Z80_FLAG_C) | (((nValue >> ((nOpcode >> 3) & 7)) & 1) ? 0 : Z80_FLAG_Z);
+        z->cycles += (nReg == 6) ? 12 : 8;
+        return 0;
+    }
+
+    return -1;
+}
+
+static int apultra_z80_step_dd(apultra_z80 *z) {
+    const int nOpcode = apultra_z80_fetch(z);
+
+    switch (nOpcode) {
+    case 0x21:  /* ld ix,nn */
+        z->ix = (unsigned short)apultra_z80_fetch16(z);
+        z->cycles += 14;
+        return 0;
+
+    case 0xe1:  /* pop ix */
+        z->ix = (unsigned short)apultra_z80_pop(z);
+        z->cycles += 14;
+        return 0;
+
+    case 0xe5:  /* push ix */
+        apultra_z80_push(z, z->ix);
+        z->cycles += 15;
+        return 0;
+
+    default:
+        if (nOpcode >= 0x60 && nOpcode < 0x70 && (nOpcode & 7) != 4 && (nOpcode & 7) != 5 && (nOpcode & 7) != 6) {
+            /* ld ixh,r and ld ixl,r */
+            const int nValue = z->r[nOpcode & 7];
+
+            if (nOpcode & 8)
+                z->ix = (unsigned short)((z->ix & 0xff00) | nValue);
+            else
+                z->ix = (unsigned short)((z->ix & 0x00ff) | (nValue << 8));
+            z->cycles += 8;
+            return 0;
+        }
+        return -1;
+    }
+}
+
+static int apultra_z80_step_ed(apultra_z80 *z) {
+    const int nOpcode = apultra_z80_fetch(z);
+
+    switch (nOpcode) {
+    case 0x42: case 0x52: case 0x62: case 0x72: {
+        /* sbc hl,rr */
+        const int nResult = apultra_z80_get_hl(z) - apultra_z80_get_pair(z, (nOpcode >> 4) & 3) - (z->f & Z80_FLAG_C);
+
+        apultra_z80_set_pair(z, 2, nResult);
+        z->f = ((nResult & 0xffff) ? 0 : Z80_FLAG_Z) | ((nResult < 0) ? Z80_FLAG_C : 0);
+        z->cycles += 15;
+        return 0;
+    }
+
+    case 0xa0: case 0xa8: case 0xb0: case 0xb8: {
+        /* ldi, ldd, ldir, lddr */
+        const int nStep = (nOpcode & 8) ? -1 : 1;
+        const int nSrc = apultra_z80_get_hl(z);
+        const int nDst = apultra_z80_get_pair(z, 1);
+        const int nCount = (apultra_z80_get_pair(z, 0) - 1) & 0xffff;
+
+        z->mem[nDst] = z->mem[nSrc];
+        apultra_z80_set_pair(z, 2, nSrc + nStep);
+        apultra_z80_set_pair(z, 1, nDst + nStep);
+        apultra_z80_set_pair(z, 0, nCount);
+        z->cycles += 16;
+
+        if ((nOpcode & 0x10) && nCount) {
+            /* Repeat the instruction */
+            z->pc -= 2;
+            z->cycles += 5;
+        }
+        return 0;
+    }
+
+    default:
+        return -1;
+    }
+}
+
+/**
+ * Run one Z80 instruction
+ *
+ * @param z Z80 state
+ *
+ * @return 0 for success, -1 for an unsupported instruction
+ */
+static int apultra_z80_step(apultra_z80 *z) {
+    const int nOpcode = apultra_z80_fetch(z);
+    int nValue, nCondition;
+
+    if (nOpcode >= 0x40 && nOpcode < 0x80) {
+        /* ld r,r' */
+        const int nDstReg = (nOpcode >> 3) & 7;
+        const int nSrcReg = nOpcode & 7;
+
+        if (nOpcode == 0x76) return -1;   /* halt */
+        apultra_z80_set_reg(z, nDstReg, apultra_z80_get_reg(z, nSrcReg));
+        z->cycles += (nDstReg == 6 || nSrcReg == 6) ? 7 : 4;
+        return 0;
+    }
+
+    if (nOpcode >= 0x80 && nOpcode < 0xc0) {
+        /* alu a,r */
+        apultra_z80_alu(z, (nOpcode >> 3) & 7, apultra_z80_get_reg(z, nOpcode & 7));
+        z->cycles += ((nOpcode & 7) == 6) ? 7 : 4;
+        return 0;
+    }
+
+    switch (nOpcode) {
+    case 0x01: case 0x11: case 0x21: case 0x31:  /* ld rr,nn */
+        apultra_z80_set_pair(z, nOpcode >> 4, apultra_z80_fetch16(z));
+        z->cycles += 10;
+        return 0;
+
+    case 0x03: case 0x13: case 0x23: case 0x33:  /* inc rr */
+        apultra_z80_set_pair(z, nOpcode >> 4, apultra_z80_get_pair(z, nOpcode >> 4) + 1);
+        z->cycles += 6;
+        return 0;
+
+    case 0x0b: case 0x1b: case 0x2b: case 0x3b:  /* dec rr */
+        apultra_z80_set_pair(z, nOpcode >> 4, apultra_z80_get_pair(z, nOpcode >> 4) - 1);
+        z->cycles += 6;
+        return 0;
+
+    case 0x04: case 0x0c: case 0x14: case 0x1c: case 0x24: case 0x2c: case 0x34: case 0x3c:  /* inc r */
+    case 0x05: case 0x0d: case 0x15: case 0x1d: case 0x25: case 0x2d: case 0x35: case 0x3d:  /* dec r */
+        nValue = (apultra_z80_get_reg(z, (nOpcode >> 3) & 7) + ((nOpcode & 1) ? -1 : 1)) & 0xff;
+        apultra_z80_set_reg(z, (nOpcode >> 3) & 7, nValue);
+        z->f = (z->f & Z80_FLAG_C) | (nValue ? 0 : Z80_FLAG_Z);
+        z->cycles += (((nOpcode >> 3) & 7) == 6) ? 11 : 4;
+        return 0;
+
+    case 0x06: case 0x0e: case 0x16: case 0x1e: case 0x26: case 0x2e: case 0x36: case 0x3e:  /* ld r,n */
+        apultra_z80_set_reg(z, (nOpcode >> 3) & 7, apultra_z80_fetch(z));
+        z->cycles += (((nOpcode >> 3) & 7) == 6) ? 10 : 7;
+        return 0;
+
+    case 0x08: {   /* ex af,af' */
+        const unsigned char a = z->r[7], f = z->f;
+
+        z->r[7] = z->a_alt;
+        z->f = z->f_alt;
+        z->a_alt = a;
+        z->f_alt = f;
+        z->cycles += 4;
+        return 0;
+    }
+
+    case 0x09: case 0x19: case 0x29: case 0x39:  /* add hl,rr */
+        nValue = apultra_z80_get_hl(z) + apultra_z80_get_pair(z, nOpcode >> 4);
+        apultra_z80_set_pair(z, 2, nValue);
+        z->f = (z->f & Z80_FLAG_Z) | ((nValue & 0x10000) ? Z80_FLAG_C : 0);
+        z->cycles += 11;
+        return 0;
+
+    case 0x17:  /* rla */
+        nValue = (z->r[7] << 1) | (z->f & Z80_FLAG_C);
+        z->r[7] = (unsigned char)nValue;
+        z->f = (z->f & Z80_FLAG_Z) | ((nValue & 0x100) ? Z80_FLAG_C : 0);
+        z->cycles += 4;
+        return 0;
+
+    case 0x37:  /* scf */
+        z->f |= Z80_FLAG_C;
+        z->cycles += 4;
+        return 0;
+
+    case 0x18:  /* jr e */
+        nValue = (signed char)apultra_z80_fetch(z);
+        z->pc += nValue;
+        z->cycles += 12;
+        return 0;
+
+    case 0x20: case 0x28: case 0x30: case 0x38:  /* jr cc,e */
+        nValue = (signed char)apultra_z80_fetch(z);
+        if (apultra_z80_condition(z, (nOpcode >> 3) & 3)) {
+            z->pc += nValue;
+            z->cycles += 12;
+        } else {
+            z->cycles += 7;
+        }
+        return 0;
+
+    case 0xc3:  /* jp nn */
+        z->pc = (unsigned short)apultra_z80_fetch16(z);
+        z->cycles += 10;
+        return 0;
+
+    case 0xcd:  /* call nn */
+        nValue = apultra_z80_fetch16(z);
+        apultra_z80_push(z, z->pc);
+        z->pc = (unsigned short)nValue;
+        z->cycles += 17;
+        return 0;
+
+    case 0xc9:  /* ret */
+        z->pc = (unsigned short)apultra_z80_pop(z);
+        z->cycles += 10;
+        return 0;
+
+    case 0xc1: case 0xd1: case 0xe1:  /* pop rr */
+        apultra_z80_set_pair(z, (nOpcode >> 4) & 3, apultra_z80_pop(z));
+        z->cycles += 10;
+        return 0;
+
+    case 0xf1:  /* pop af */
+        nValue = apultra_z80_pop(z);
+        z->r[7] = (unsigned char)(nValue >> 8);
+        z->f = (unsigned char)(nValue & (Z80_FLAG_Z | Z80_FLAG_C));
+        z->cycles += 10;
+        return 0;
+
+    case 0xc5: case 0xd5: case 0xe5:  /* push rr */
+        apultra_z80_push(z, apultra_z80_get_pair(z, (nOpcode >> 4) & 3));
+        z->cycles += 11;
+        return 0;
+
+    case 0xf5:  /* push af */
+        apultra_z80_push(z, (z->r[7] << 8) | z->f);
+        z->cycles += 11;
+        return 0;
+
+    case 0xc6: case 0xce: case 0xd6: case 0xde: case 0xe6: case 0xee: case 0xf6: case 0xfe:  /* alu a,n */
+        apultra_z80_alu(z, (nOpcode >> 3) & 7, apultra_z80_fetch(z));
+        z->cycles += 7;
+        return 0;
+
+    case 0xe3:  /* ex (sp),hl */
+        nValue = apultra_z80_pop(z);
+        apultra_z80_push(z, apultra_z80_get_hl(z));
+        apultra_z80_set_pair(z, 2, nValue);
+        z->cycles += 19;
+        return 0;
+
+    case 0xeb:  /* ex de,hl */
+        nValue = apultra_z80_get_pair(z, 1);
+        apultra_z80_set_pair(z, 1, apultra_z80_get_hl(z));
+        apultra_z80_set_pair(z, 2, nValue);
+        z->cycles += 4;
+        return 0;
+
+    case 0xcb:
+        return apultra_z80_step_cb(z);
+
+    case 0xdd:
+        return apultra_z80_step_dd(z);
+
+    case 0xed:
+        return apultra_z80_step_ed(z);
+
+    default:
+        break;
+    }
+
+    nCondition = apultra_z80_condition(z, (nOpcode >> 3) & 7);
+    if (nCondition < 0)
+        return -1;
+
+    switch (nOpcode & 0xc7) {
+    case 0xc0:  /* ret cc */
+        if (nCondition) {
+            z->pc = (unsigned short)apultra_z80_pop(z);
+            z->cycles += 11;
+        } else {
+            z->cycles += 5;
+        }
+        return 0;
+
+    case 0xc2:  /* jp cc,nn */
+        nValue = apultra_z80_fetch16(z);
+        if (nCondition)
+            z->pc = (unsigned short)nValue;
+        z->cycles += 10;
+        return 0;
+
+    case 0xc4:  /* call cc,nn */
+        nValue = apultra_z80_fetch16(z);
+        if (nCondition) {
+            apultra_z80_push(z, z->pc);
+            z->pc = (unsigned short)nValue;
+            z->cycles += 17;
+        } else {
+            z->cycles += 10;
+        }
+        return 0;
+
+    default:
+        return -1;
+    }
+}
+
+/**
+ * Call a Z80 decompressor, with HL pointing to the compressed data and DE to the output
+ *
+ * @param pMemory 64 KB memory, with the decompressor and the compressed data
+ * @param nEntry address of the decompressor
+ * @param nSrcAddress address of the compressed data
+ * @param nDstAddress address of the output
+ * @param nMaxCycles number of T-states after which to give up
+ * @param pEndAddress pointer to returned address of the end of the output (DE on return)
+ *
+ * @return number of T-states, or -1 for error
+ */
+static long long apultra_run_z80(unsigned char *pMemory, const int nEntry, const int nSrcAddress, const int nDstAddress, const long long nMaxCycles, int *pEndAddress) {
+    apultra_z80 z;
+
+    memset(&z, 0, sizeof(z));
+    z.mem = pMemory;
+    apultra_z80_set_pair(&z, 2, nSrcAddress);
+    apultra_z80_set_pair(&z, 1, nDstAddress);
+
+    /* call nEntry, from address 0 */
+    z.sp = 0;
+    apultra_z80_push(&z, 0x0000);
+    z.pc = (unsigned short)nEntry;
+    z.cycles = 17;
+
+    while (z.pc != 0x0000) {
+        if (apultra_z80_step(&z) < 0 || z.cycles > nMaxCycles)
+            return -1;
+    }
+
+    *pEndAddress = apultra_z80_get_pair(&z, 1);
+    return z.cycles;
+}
+
+static inline int apultra_6502_fetch(apultra_6502 *m) {
+    return m->mem[m->pc++];
+}
+
+static inline int apultra_6502_fetch16(apultra_6502 *m) {
+    int nValue = apultra_6502_fetch(m);
+    return nValue | (apultra_6502_fetch(m) << 8);
+}
+
+static inline int apultra_6502_set_nz(apultra_6502 *m, const int nValue) {
+    m->p = (unsigned char)((m->p & ~(M6502_FLAG_N | M6502_FLAG_Z)) | (nValue & 0x80) | ((nValue & 0xff) ? 0 : M6502_FLAG_Z));
+    return nValue & 0xff;
+}
+
+static inline void apultra_6502_set_c(apultra_6502 *m, const int nCarry) {
+    m->p = (unsigned char)((m->p & ~M6502_FLAG_C) | (nCarry ? M6502_FLAG_C : 0));
+}
+
+static inline void apultra_6502_push(apultra_6502 *m, const int nValue) {
+    m->mem[0x100 + m->s] = (unsigned char)nValue;
+    m->s--;
+}
+
+static inline int apultra_6502_pull(apultra_6502 *m) {
+    m->s++;
+    return m->mem[0x100 + m->s];
+}
+
+/**
+ * Shift or rotate a 6502 value and set the flags
+ *
+ * @param m 6502 state
+ * @param nOpcode opcode of the instruction, the operation is in bits 5..6
+ * @param nValue value to shift
+ *
+ * @return shifted value
+ */
+static int apultra_6502_shift(apultra_6502 *m, const int nOpcode, const int nValue) {
+    const int nCarry = m->p & M6502_FLAG_C;
+    int nResult;
+
+    switch ((nOpcode >> 5) & 3) {
+    case 0: nResult = nValue << 1; apultra_6502_set_c(m, nValue & 0x80); break;                 /* asl */
+    case 1: nResult = (nValue << 1) | nCarry; apultra_6502_set_c(m, nValue & 0x80); break;      /* rol */
+    case 2: nResult = nValue >> 1; apultra_6502_set_c(m, nValue & 1); break;                    /* lsr */
+    default: nResult = (nValue >> 1) | (nCarry << 7); apultra_6502_set_c(m, nValue & 1); break; /* ror */
+    }
+
+    return apultra_6502_set_nz(m, nResult);
+}
+
+static void apultra_6502_add(apultra_6502 *m, const int nValue) {
+    const int nResult = m->a + nValue + (m->p & M6502_FLAG_C);
+
+    apultra_6502_set_c(m, nResult & 0x100);
+    m->a = (unsigned char)apultra_6502_set_nz(m, nResult);
+}
+
+static void apultra_6502_compare(apultra_6502 *m, const int nReg, const int nValue) {
+    apultra_6502_set_c(m, nReg >= nValue);
+    apultra_6502_set_nz(m, nReg - nValue);
+}
+
+/**
+ * Run one 6502 instruction
+ *
+ * @param m 6502 state
+ *
+ * @return 0 for success, -1 for an unsupported instruction
+ */
+static int apultra_6502_step(apultra_6502 *m) {
+    const int nOpcode = apultra_6502_fetch(m);
+    int nAddress, nValue;
+
+    switch (nOpcode) {
+    case 0xa9: m->a = (unsigned char)apultra_6502_set_nz(m, apultra_6502_fetch(m)); m->cycles += 2; return 0;   /* lda #n */
+    case 0xa2: m->x = (unsigned char)apultra_6502_set_nz(m, apultra_6502_fetch(m)); m->cycles += 2; return 0;   /* ldx #n */
+    case 0xa0: m->y = (unsigned char)apultra_6502_set_nz(m, apultra_6502_fetch(m)); m->cycles += 2; return 0;   /* ldy #n */
+    case 0xa5: m->a = (unsigned char)apultra_6502_set_nz(m, m->mem[apultra_6502_fetch(m)]); m->cycles += 3; return 0;   /* lda zp */
+    case 0xa6: m->x = (unsigned char)apultra_6502_set_nz(m, m->mem[apultra_6502_fetch(m)]); m->cycles += 3; return 0;   /* ldx zp */
+    case 0xa4: m->y = (unsigned char)apultra_6502_set_nz(m, m->mem[apultra_6502_fetch(m)]); m->cycles += 3; return 0;   /* ldy zp */
+    case 0x85: m->mem[apultra_6502_fetch(m)] = m->a; m->cycles += 3; return 0;   /* sta zp */
+    case 0x86: m->mem[apultra_6502_fetch(m)] = m->x; m->cycles += 3; return 0;   /* stx zp */
+    case 0x84: m->mem[apultra_6502_fetch(m)] = m->y; m->cycles += 3; return 0;   /* sty zp */
+
+    case 0xb1: case 0x91: {   /* lda (zp),y and sta (zp),y */
+        const int nZeroPage = apultra_6502_fetch(m);
+        const int nBase = m->mem[nZeroPage] | (m->mem[(nZeroPage + 1) & 0xff] << 8);
+
+        nAddress = (nBase + m->y) & 0xffff;
+        if (nOpcode == 0xb1) {
+            m->a = (unsigned char)apultra_6502_set_nz(m, m->mem[nAddress]);
+            m->cycles += ((nBase & 0xff00) != (nAddress & 0xff00)) ? 6 : 5;
+        } else {
+            m->mem[nAddress] = m->a;
+            m->cycles += 6;
+        }
+        return 0;
+    }
+
+    case 0xe6: case 0xc6:   /* inc zp, dec zp */
+        nAddress = apultra_6502_fetch(m);
+        m->mem[nAddress] = (unsigned char)apultra_6502_set_nz(m, m->mem[nAddress] + ((nOpcode == 0xe6) ? 1 : -1));
+        m->cycles += 5;
+        return 0;
+
+    case 0x06: case 0x26: case 0x46: case 0x66:   /* asl zp, rol zp, lsr zp, ror zp */
+        nAddress = apultra_6502_fetch(m);
+        m->mem[nAddress] = (unsigned char)apultra_6502_shift(m, nOpcode, m->mem[nAddress]);
+        m->cycles += 5;
+        return 0;
+
+    case 0x0a: case 0x2a: case 0x4a: case 0x6a:   /* asl, rol, lsr, ror */
+        m->a = (unsigned char)apultra_6502_shift(m, nOpcode, m->a);
+        m->cycles += 2;
+        return 0;
+
+    case 0x09: case 0x29: case 0x49:   /* ora #n, and #n, eor #n */
+        nValue = apultra_6502_fetch(m);
+        if (nOpcode == 0x09) nValue |= m->a; else if (nOpcode == 0x29) nValue &= m->a; else nValue ^= m->a;
+        m->a = (unsigned char)apultra_6502_set_nz(m, nValue);
+        m->cycles += 2;
+        return 0;
+
+    case 0x45:   /* eor zp */
+        m->a = (unsigned char)apultra_6502_set_nz(m, m->a ^ m->mem[apultra_6502_fetch(m)]);
+        m->cycles += 3;
+        return 0;
+
+    case 0x69: apultra_6502_add(m, apultra_6502_fetch(m)); m->cycles += 2; return 0;                  /* adc #n */
+    case 0x65: apultra_6502_add(m, m->mem[apultra_6502_fetch(m)]); m->cycles += 3; return 0;          /* adc zp */
+    case 0xe9: apultra_6502_add(m, apultra_6502_fetch(m) ^ 0xff); m->cycles += 2; return 0;           /* sbc #n */
+    case 0xe5: apultra_6502_add(m, m->mem[apultra_6502_fetch(m)] ^ 0xff); m->cycles += 3; return 0;   /* sbc zp */
+
+    case 0xc9: apultra_6502_compare(m, m->a, apultra_6502_fetch(m)); m->cycles += 2; return 0;           /* cmp #n */
+    case 0xc5: apultra_6502_compare(m, m->a, m->mem[apultra_6502_fetch(m)]); m->cycles += 3; return 0;   /* cmp zp */
+    case 0xe0: apultra_6502_compare(m, m->x, apultra_6502_fetch(m)); m->cycles += 2; return 0;           /* cpx #n */
+    case 0xc0: apultra_6502_compare(m, m->y, apultra_6502_fetch(m)); m->cycles += 2; return 0;           /* cpy #n */
+
+    case 0xa8: m->y = (unsigned char)apultra_6502_set_nz(m, m->a); m->cycles += 2; return 0;       /* tay */
+    case 0xaa: m->x = (unsigned char)apultra_6502_set_nz(m, m->a); m->cycles += 2; return 0;       /* tax */
+    case 0x98: m->a = (unsigned char)apultra_6502_set_nz(m, m->y); m->cycles += 2; return 0;       /* tya */
+    case 0x8a: m->a = (unsigned char)apultra_6502_set_nz(m, m->x); m->cycles += 2; return 0;       /* txa */
+    case 0xc8: m->y = (unsigned char)apultra_6502_set_nz(m, m->y + 1); m->cycles += 2; return 0;   /* iny */
+    case 0xe8: m->x = (unsigned char)apultra_6502_set_nz(m, m->x + 1); m->cycles += 2; return 0;   /* inx */
+    case 0x88: m->y = (unsigned char)apultra_6502_set_nz(m, m->y - 1); m->cycles += 2; return 0;   /* dey */
+    case 0xca: m->x = (unsigned char)apultra_6502_set_nz(m, m->x - 1); m->cycles += 2; return 0;   /* dex */
+    case 0x38: apultra_6502_set_c(m, 1); m->cycles += 2; return 0;   /* sec */
+    case 0x18: apultra_6502_set_c(m, 0); m->cycles += 2; return 0;   /* clc */
+
+    case 0x48: apultra_6502_push(m, m->a); m->cycles += 3; return 0;   /* pha */
+    case 0x68: m->a = (unsigned char)apultra_6502_set_nz(m, apultra_6502_pull(m)); m->cycles += 4; return 0;   /* pla */
+
+    case 0x20:   /* jsr nn */
+        nAddress = apultra_6502_fetch16(m);
+        apultra_6502_push(m, (m->pc - 1) >> 8);
+        apultra_6502_push(m, m->pc - 1);
+        m->pc = (unsigned short)nAddress;
+        m->cycles += 6;
+        return 0;
+
+    case 0x60:   /* rts */
+        nAddress = apultra_6502_pull(m);
+        nAddress |= apultra_6502_pull(m) << 8;
+        m->pc = (unsigned short)(nAddress + 1);
+        m->cycles += 6;
+        return 0;
+
+    case 0x4c:   /* jmp nn */
+        m->pc = (unsigned short)apultra_6502_fetch16(m);
+        m->cycles += 3;
+        return 0;
+
+    case 0x10: case 0x30: case 0x90: case 0xb0: case 0xd0: case 0xf0: {   /* bpl, bmi, bcc, bcs, bne, beq */
+        static const int nBranchFlag[4] = { M6502_FLAG_N, 0, M6502_FLAG_C, M6502_FLAG_Z };
+        const int nFlag = nBranchFlag[nOpcode >> 6];
+        const int nOffset = (signed char)apultra_6502_fetch(m);
+
+        m->cycles += 2;
+        if (((m->p & nFlag) ? 1 : 0) == ((nOpcode >> 5) & 1)) {
+            nAddress = (m->pc + nOffset) & 0xffff;
+            m->cycles += ((nAddress & 0xff00) != (m->pc & 0xff00)) ? 2 : 1;
+            m->pc = (unsigned short)nAddress;
+        }
+        return 0;
+    }
+
+    default:
+        return -1;
+    }
+}
+
+/**
+ * Call the 6502 decompressor, with apl_srcptr pointing to the compressed data and apl_dstptr to the output
+ *
+ * @param pMemory 64 KB memory, with the decompressor and the compressed data
+ * @param nEntry address of the decompressor
+ * @param nSrcAddress address of the compressed data
+ * @param nDstAddress address of the output
+ * @param nMaxCycles number of cycles after which to give up
+ * @param pEndAddress pointer to returned address of the end of the output (apl_dstptr on return)
+ *
+ * @return number of cycles, or -1 for error
+ */
+static long long apultra_run_6502(unsigned char *pMemory, const int nEntry, const int nSrcAddress, const int nDstAddress, const long long nMaxCycles, int *pEndAddress) {
+    apultra_6502 m;
+
+    memset(&m, 0, sizeof(m));
+    m.mem = pMemory;
+    pMemory[M6502_SRCPTR] = (unsigned char)nSrcAddress;
+    pMemory[M6502_SRCPTR + 1] = (unsigned char)(nSrcAddress >> 8);
+    pMemory[M6502_DSTPTR] = (unsigned char)nDstAddress;
+    pMemory[M6502_DSTPTR + 1] = (unsigned char)(nDstAddress >> 8);
+
+    /* jsr nEntry, from address $fffd */
+    m.s = 0xff;
+    apultra_6502_push(&m, 0xff);
+    apultra_6502_push(&m, 0xfe);
+    m.pc = (unsigned short)nEntry;
+    m.cycles = 6;
+
+    while (m.pc != 0xffff) {
+        if (apultra_6502_step(&m) < 0 || m.cycles > nMaxCycles)
+            return -1;
+    }
+
+    *pEndAddress = pMemory[M6502_DSTPTR] | (pMemory[M6502_DSTPTR + 1] << 8);
+    return m.cycles;
+}
+
+/**
+ * Decompress data by running one of the asm decompressors on an emulated CPU, and count the cycles it takes
+ *
+ * The compressed and the decompressed data must both fit in the 64 KB of memory of the CPU, next to the decompressor.
+ *
+ * @param pDecompressor decompressor to run
+ * @param pInputData compressed data
+ * @param pOutData buffer for decompressed data
+ * @param nInputSize compressed size in bytes
+ * @param nMaxOutBufferSize maximum capacity of decompression buffer
+ * @param pCycles pointer to returned number of cycles, including the call to the decompressor and the return from it
+ *
+ * @return decompressed size, or -1 for error (data that doesn't fit in memory, or an instruction that the emulator
+ * doesn't support)
+ */
+size_t apultra_emulate_decompression(const apultra_emulated_decompressor *pDecompressor,
+    const unsigned char *pInputData,
+    unsigned char *pOutData,
+    size_t nInputSize,
+    size_t nMaxOutBufferSize,
+    long long *pCycles) {
+    const int nDstAddress = EMULATED_DATA_ADDRESS + (int)nInputSize;
+    /* The decompressors take well under 1000 cycles per byte; stop runaway code */
+    const long long nMaxCycles = 1000LL * (long long)(nInputSize + nMaxOutBufferSize) + 100000LL;
+    unsigned char *pMemory;
+    long long nCycles;
+    int nEndAddress = 0;
+
+    if (pDecompressor->origin + pDecompressor->code_size > EMULATED_DATA_ADDRESS ||
+        nInputSize > (size_t)(EMULATED_DATA_END - EMULATED_DATA_ADDRESS) ||
+        nMaxOutBufferSize > (size_t)(EMULATED_DATA_END - nDstAddress))
+        return -1;
+
+    pMemory = (unsigned char *)calloc(EMULATED_MEMORY_SIZE, 1);
+    if (!pMemory)
+        return -1;
+
+    memcpy(pMemory + pDecompressor->origin, pDecompressor->code, pDecompressor->code_size);
+    memcpy(pMemory + EMULATED_DATA_ADDRESS, pInputData, nInputSize);
+
+    if (pDecompressor->cpu == APULTRA_CPU_Z80)
+        nCycles = apultra_run_z80(pMemory, pDecompressor->origin, EMULATED_DATA_ADDRESS, nDstAddress, nMaxCycles, &nEndAddress);
+    else
+        nCycles = apultra_run_6502(pMemory, pDecompressor->origin, EMULATED_DATA_ADDRESS, nDstAddress, nMaxCycles, &nEndAddress);
+
+    if (nCycles < 0 || nEndAddress < nDstAddress || (size_t)(nEndAddress - nDstAddress) > nMaxOutBufferSize) {
+        free(pMemory);
+        return -1;
+    }
+
+    memcpy(pOutData, pMemory + nDstAddress, nEndAddress - nDstAddress);
+    free(pMemory);
+
+    *pCycles = nCycles;
+    return (size_t)(nEndAddress - nDstAddress);
+}
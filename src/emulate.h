@@ -0,0 +1,88 @@
+/*
+ * emulate.h - emulated CPU definitions
+ *
+ * Copyright (C) 2019 Emmanuel Marty
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef _EMULATE_H
+#define _EMULATE_H
+
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** CPUs that the decompressors from asm/ can be run on */
+#define APULTRA_CPU_Z80 0
+#define APULTRA_CPU_6502 1
+
+/** Decompressor from asm/, assembled, that can be run on an emulated CPU */
+typedef struct {
+    const char *name;          /* decompressor name, as for the cost models */
+    const char *unit;          /* name of the cycle unit */
+    int cpu;                   /* APULTRA_CPU_xxx */
+    const unsigned char *code; /* machine code */
+    int code_size;             /* size of the machine code, in bytes */
+    int origin;                /* address that the code is assembled at, which is also its entry point */
+} apultra_emulated_decompressor;
+
+/**
+ * Get the number of decompressors that can be run on an emulated CPU
+ *
+ * @return number of emulated decompressors
+ */
+int apultra_get_emulated_decompressor_count(void);
+
+/**
+ * Get a decompressor that can be run on an emulated CPU
+ *
+ * @param nIndex index of decompressor, 0..apultra_get_emulated_decompressor_count()-1
+ *
+ * @return decompressor, or NULL for an invalid index
+ */
+const apultra_emulated_decompressor *apultra_get_emulated_decompressor(const int nIndex);
+
+/**
+ * Decompress data by running one of the asm decompressors on an emulated CPU, and count the cycles it takes
+ *
+ * The compressed and the decompressed data must both fit in the 64 KB of memory of the CPU, next to the decompressor.
+ *
+ * @param pDecompressor decompressor to run
+ * @param pInputData compressed data
+ * @param pOutData buffer for decompressed data
+ * @param nInputSize compressed size in bytes
+ * @param nMaxOutBufferSize maximum capacity of decompression buffer
+ * @param pCycles pointer to returned number of cycles, including the call to the decompressor and the return from it
+ *
+ * @return decompressed size, or -1 for error (data that doesn't fit in memory, or an instruction that the emulator
+ * doesn't support)
+ */
+size_t apultra_emulate_decompression(const apultra_emulated_decompressor *pDecompressor,
+    const unsigned char *pInputData,
+    unsigned char *pOutData,
+    size_t nInputSize,
+    size_t nMaxOutBufferSize,
+    long long *pCycles);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _EMULATE_H */
@@ -34,6 +34,7 @@
 #include <string.h>
 #include "format.h"
 #include "expand.h"
+#include "cycles.h"
 #include "libapultra.h"
 
 #ifdef _MSC_VER
@@ -45,7 +46,8 @@
 static inline FORCE_INLINE int apultra_read_bit(const unsigned char **ppInBlock,
     const unsigned char *pDataEnd,
     int *nCurBitMask,
-    unsigned char *bits) {
+    unsigned char *bits,
+    apultra_decode_profile *pProfile) {
     const unsigned char *pInBlock = *ppInBlock;
     int nBit;
 
@@ -53,6 +55,7 @@ static inline FORCE_INLINE int apultra_read_bit(const unsigned char **ppInBlock,
         if (pInBlock >= pDataEnd) return -1;
         (*bits) = *pInBlock++;
         (*nCurBitMask) = 128;
+        if (pProfile) pProfile->num_tag_bytes++;
     }
 
     nBit = ((*bits) & 128) ? 1 : 0;
@@ -67,14 +70,18 @@ static inline FORCE_INLINE int apultra_read_bit(const unsigned char **ppInBlock,
 static inline FORCE_INLINE int apultra_read_gamma2(const unsigned char **ppInBlock,
     const unsigned char *pDataEnd,
     int *nCurBitMask,
-    unsigned char *bits) {
+    unsigned char *bits,
+    apultra_decode_profile *pProfile) {
     int bit;
     unsigned int v = 1;
 
+    if (pProfile) pProfile->num_gamma2_values++;
+
     do {
-        v = (v << 1) + apultra_read_bit(ppInBlock, pDataEnd, nCurBitMask, bits);
-        bit = apultra_read_bit(ppInBlock, pDataEnd, nCurBitMask, bits);
+        v = (v << 1) + apultra_read_bit(ppInBlock, pDataEnd, nCurBitMask, bits, pProfile);
+        bit = apultra_read_bit(ppInBlock, pDataEnd, nCurBitMask, bits, pProfile);
         if (bit < 0) return bit;
+        if (pProfile) pProfile->num_gamma2_pairs++;
     } while (bit);
 
     return v;
@@ -105,7 +112,7 @@ size_t
     while (1) {
         unsigned int nResult;
 
-        nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits);
+        nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits, NULL);
         if (nResult < 0) return -1;
 
         if (!nResult) {
@@ -118,20 +125,20 @@ size_t
                 return -1;
             }
         } else {
-            nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits);
+            nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits, NULL);
             if (nResult < 0) return -1;
 
             if (nResult == 0) {
                 unsigned int nMatchLen;
 
                 /* '10': 8+n bits offset */
-                int nMatchOffsetHi = apultra_read_gamma2(&pInputData, pInputDataEnd, &nCurBitMask, &bits);
+                int nMatchOffsetHi = apultra_read_gamma2(&pInputData, pInputDataEnd, &nCurBitMask, &bits, NULL);
                 nMatchOffsetHi -= nFollowsLiteral;
                 if (nMatchOffsetHi >= 0) {
                     nMatchOffset = ((unsigned int)nMatchOffsetHi) << 8;
                     nMatchOffset |= (unsigned int)(*pInputData++);
 
-                    nMatchLen = apultra_read_gamma2(&pInputData, pInputDataEnd, &nCurBitMask, &bits);
+                    nMatchLen = apultra_read_gamma2(&pInputData, pInputDataEnd, &nCurBitMask, &bits, NULL);
 
                     if (nMatchOffset < 128 || nMatchOffset >= MINMATCH4_OFFSET)
                         nMatchLen += 2;
@@ -139,14 +146,14 @@ size_t
                         nMatchLen++;
                 } else {
                     /* else rep-match */
-                    nMatchLen = apultra_read_gamma2(&pInputData, pInputDataEnd, &nCurBitMask, &bits);
+                    nMatchLen = apultra_read_gamma2(&pInputData, pInputDataEnd, &nCurBitMask, &bits, NULL);
                 }
 
                 nFollowsLiteral = 2;
 
                 nDecompressedSize += nMatchLen;
             } else {
-                nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits);
+                nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits, NULL);
                 if (nResult < 0) return -1;
 
                 if (nResult == 0) {
@@ -170,19 +177,19 @@ size_t
                     unsigned int nShortMatchOffset;
 
                     /* '111': 4 bit offset */
-                    nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits);
+                    nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits, NULL);
                     if (nResult < 0) return -1;
                     nShortMatchOffset = nResult << 3;
 
-                    nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits);
+                    nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits, NULL);
                     if (nResult < 0) return -1;
                     nShortMatchOffset |= nResult << 2;
 
-                    nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits);
+                    nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits, NULL);
                     if (nResult < 0) return -1;
                     nShortMatchOffset |= nResult << 1;
 
-                    nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits);
+                    nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits, NULL);
                     if (nResult < 0) return -1;
                     nShortMatchOffset |= nResult << 0;
 
@@ -197,23 +204,25 @@ size_t
 }
 
 /**
- * Decompress data in memory
+ * Decompress data in memory, optionally counting the commands and bits read
+ *
+ * This is inlined with a NULL profile into apultra_decompress(), where the counting goes away.
  *
  * @param pInputData compressed data
  * @param pOutBuffer buffer for decompressed data
  * @param nInputSize compressed size in bytes
  * @param nMaxOutBufferSize maximum capacity of decompression buffer
  * @param nDictionarySize size of dictionary in front of input data (0 for none)
- * @param nFlags compression flags (set to 0)
+ * @param pProfile token counts to add to, or NULL for none
  *
  * @return actual decompressed size, or -1 for error
  */
-size_t apultra_decompress(const unsigned char *pInputData,
+static inline FORCE_INLINE size_t apultra_expand_data(const unsigned char *pInputData,
     unsigned char *pOutData,
     size_t nInputSize,
     size_t nMaxOutBufferSize,
     size_t nDictionarySize,
-    const unsigned int nFlags) {
+    apultra_decode_profile *pProfile) {
     const unsigned char *pInputDataEnd = pInputData + nInputSize;
     unsigned char *pCurOutData = pOutData + nDictionarySize;
     const unsigned char *pOutDataEnd = pCurOutData + nMaxOutBufferSize;
@@ -225,11 +234,12 @@ size_t apultra_decompress(const unsigned char *pInputData,
 
     if (pInputData >= pInputDataEnd && pCurOutData < pOutDataEnd) return -1;
     *pCurOutData++ = *pInputData++;
+    if (pProfile) pProfile->num_literals++;
 
     while (1) {
         unsigned int nResult;
 
-        nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits);
+        nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits, pProfile);
         if (nResult < 0) return -1;
 
         if (!nResult) {
@@ -237,35 +247,39 @@ size_t apultra_decompress(const unsigned char *pInputData,
             if (pInputData < pInputDataEnd && pCurOutData < pOutDataEnd) {
                 *pCurOutData++ = *pInputData++;
                 nFollowsLiteral = 3;
+                if (pProfile) pProfile->num_literals++;
             } else {
                 return -1;
             }
         } else {
-            nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits);
+            nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits, pProfile);
             if (nResult < 0) return -1;
 
             if (nResult == 0) {
                 unsigned int nMatchLen;
 
                 /* '10': 8+n bits offset */
-                int nMatchOffsetHi = apultra_read_gamma2(&pInputData, pInputDataEnd, &nCurBitMask, &bits);
+                int nMatchOffsetHi = apultra_read_gamma2(&pInputData, pInputDataEnd, &nCurBitMask, &bits, pProfile);
                 nMatchOffsetHi -= nFollowsLiteral;
                 if (nMatchOffsetHi >= 0) {
                     nMatchOffset = ((unsigned int)nMatchOffsetHi) << 8;
                     nMatchOffset |= (unsigned int)(*pInputData++);
 
-                    nMatchLen = apultra_read_gamma2(&pInputData, pInputDataEnd, &nCurBitMask, &bits);
+                    nMatchLen = apultra_read_gamma2(&pInputData, pInputDataEnd, &nCurBitMask, &bits, pProfile);
 
                     if (nMatchOffset < 128 || nMatchOffset >= MINMATCH4_OFFSET)
                         nMatchLen += 2;
                     else if (nMatchOffset >= MINMATCH3_OFFSET)
                         nMatchLen++;
+                    if (pProfile) pProfile->num_large_matches++;
                 } else {
                     /* else rep-match */
-                    nMatchLen = apultra_read_gamma2(&pInputData, pInputDataEnd, &nCurBitMask, &bits);
+                    nMatchLen = apultra_read_gamma2(&pInputData, pInputDataEnd, &nCurBitMask, &bits, pProfile);
+                    if (pProfile) pProfile->num_rep_matches++;
                 }
 
                 nFollowsLiteral = 2;
+                if (pProfile) pProfile->num_match_bytes += nMatchLen;
                 const unsigned char *pSrc = pCurOutData - nMatchOffset;
                 if (pSrc >= pOutData && (pSrc + nMatchLen) <= pOutDataEnd) {
                     if (nMatchLen < 11 && nMatchOffset >= 8 && pCurOutData < pOutDataFastEnd) {
@@ -303,7 +317,7 @@ size_t apultra_decompress(const unsigned char *pInputData,
                     return -1;
                 }
             } else {
-                nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits);
+                nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits, pProfile);
                 if (nResult < 0) return -1;
 
                 if (nResult == 0) {
@@ -314,6 +328,7 @@ size_t apultra_decompress(const unsigned char *pInputData,
                     nCommand = (unsigned int)(*pInputData++);
                     if (nCommand == 0x00) {
                         /* EOD. No match len follows. */
+                        if (pProfile) pProfile->num_eod++;
                         break;
                     }
 
@@ -322,6 +337,10 @@ size_t apultra_decompress(const unsigned char *pInputData,
                     nMatchLen = (nCommand & 1) + 2;
 
                     nFollowsLiteral = 2;
+                    if (pProfile) {
+                        pProfile->num_7bit_matches++;
+                        pProfile->num_match_bytes += nMatchLen;
+                    }
                     const unsigned char *pSrc = pCurOutData - nMatchOffset;
                     if (pSrc >= pOutData && (pSrc + nMatchLen) <= pOutDataEnd) {
                         if (nMatchOffset >= 8 && pCurOutData < pOutDataFastEnd) {
@@ -345,23 +364,29 @@ size_t apultra_decompress(const unsigned char *pInputData,
                     unsigned int nShortMatchOffset;
 
                     /* '111': 4 bit offset */
-                    nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits);
+                    nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits, pProfile);
                     if (nResult < 0) return -1;
                     nShortMatchOffset = nResult << 3;
 
-                    nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits);
+                    nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits, pProfile);
                     if (nResult < 0) return -1;
                     nShortMatchOffset |= nResult << 2;
 
-                    nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits);
+                    nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits, pProfile);
                     if (nResult < 0) return -1;
                     nShortMatchOffset |= nResult << 1;
 
-                    nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits);
+                    nResult = apultra_read_bit(&pInputData, pInputDataEnd, &nCurBitMask, &bits, pProfile);
                     if (nResult < 0) return -1;
                     nShortMatchOffset |= nResult << 0;
 
                     nFollowsLiteral = 3;
+                    if (pProfile) {
+                        if (nShortMatchOffset)
+                            pProfile->num_4bit_matches++;
+                        else
+                            pProfile->num_4bit_zeroes++;
+                    }
                     if (nShortMatchOffset) {
                         /* Short offset, 1-15 */
                         const unsigned char *pSrc = pCurOutData - nShortMatchOffset;
@@ -385,3 +410,51 @@ size_t apultra_decompress(const unsigned char *pInputData,
 
     return (size_t)(pCurOutData - pOutData) - nDictionarySize;
 }
+
+/**
+ * Decompress data in memory
+ *
+ * @param pInputData compressed data
+ * @param pOutBuffer buffer for decompressed data
+ * @param nInputSize compressed size in bytes
+ * @param nMaxOutBufferSize maximum capacity of decompression buffer
+ * @param nDictionarySize size of dictionary in front of input data (0 for none)
+ * @param nFlags compression flags (set to 0)
+ *
+ * @return actual decompressed size, or -1 for error
+ */
+size_t apultra_decompress(const unsigned char *pInputData,
+    unsigned char *pOutData,
+    size_t nInputSize,
+    size_t nMaxOutBufferSize,
+    size_t nDictionarySize,
+    const unsigned int nFlags) {
+    return apultra_expand_data(pInputData, pOutData, nInputSize, nMaxOutBufferSize, nDictionarySize, NULL);
+}
+
+/**
+ * Decompress data in memory and count the commands and bits that a decompressor reads
+ *
+ * @param pInputData compressed data
+ * @param pOutData buffer for decompressed data
+ * @param nInputSize compressed size in bytes
+ * @param nMaxOutBufferSize maximum capacity of decompression buffer
+ * @param nFlags compression flags (set to 0)
+ * @param pProfile pointer to returned token counts
+ *
+ * @return decompressed size, or -1 for error
+ */
+size_t apultra_profile_decompression(const unsigned char *pInputData,
+    unsigned char *pOutData,
+    size_t nInputSize,
+    size_t nMaxOutBufferSize,
+    const unsigned int nFlags,
+    apultra_decode_profile *pProfile) {
+    size_t nDecompressedSize;
+
+    memset(pProfile, 0, sizeof(apultra_decode_profile));
+
+    nDecompressedSize = apultra_expand_data(pInputData, pOutData, nInputSize, nMaxOutBufferSize, 0, pProfile);
+    if (nDecompressedSize != -1) pProfile->decompressed_size = (long long)nDecompressedSize;
+    return nDecompressedSize;
+}
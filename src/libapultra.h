@@ -35,6 +35,9 @@
 
 #include "format.h"
 #include "shrink.h"
+#include "dictindex.h"
+#include "cache.h"
 #include "expand.h"
+#include "cycles.h"
 
 #endif /* _LIB_APULTRA_H */
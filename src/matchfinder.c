@@ -32,6 +32,24 @@
 #include <stdlib.h>
 #include <string.h>
 #include "matchfinder.h"
+#include "timer.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define APULTRA_MATCH1_SSE2
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <xmmintrin.h>
+#define APULTRA_PREFETCH(__ptr) _mm_prefetch((const char *)(__ptr), _MM_HINT_T0)
+#elif defined(__GNUC__) || defined(__clang__)
+#define APULTRA_PREFETCH(__ptr) __builtin_prefetch(__ptr)
+#else
+#define APULTRA_PREFETCH(__ptr)
+#endif
+
+/** Number of positions ahead of the current one whose deepest lcp-interval is fetched early */
+#define MATCHES_PREFETCH_DISTANCE 32
 
 /**
  * Hash index into TAG_BITS
@@ -57,6 +75,7 @@ int apultra_build_suffix_array(apultra_matchfinder *pCompressor,
     const unsigned char *pInWindow,
     const int nInWindowSize) {
     unsigned long long *intervals = pCompressor->intervals;
+    long long nStartTime = apultra_get_time_ns();
 
     /* Build suffix array from input data */
     saidx_t *suffixArray = (saidx_t *)intervals;
@@ -64,6 +83,12 @@ int apultra_build_suffix_array(apultra_matchfinder *pCompressor,
         return 100;
     }
 
+    if (pCompressor->phase_time) {
+        long long nCurTime = apultra_get_time_ns();
+        pCompressor->phase_time[APULTRA_PHASE_SUFFIX_ARRAY] += nCurTime - nStartTime;
+        nStartTime = nCurTime;
+    }
+
     int i, r;
 
     for (i = nInWindowSize - 1; i >= 0; i--) { intervals[i] = suffixArray[i]; }
@@ -98,7 +123,9 @@ int apultra_build_suffix_array(apultra_matchfinder *pCompressor,
         if (nLen > LCP_MAX) nLen = LCP_MAX;
         int nTaggedLen = 0;
         if (nLen)
-            nTaggedLen = (nLen << TAG_BITS) | (apultra_get_index_tag((unsigned int)nIndex) & ((1 << TAG_BITS) - 1));
+            nTaggedLen = (nLen << TAG_BITS)
+                         | (apultra_get_index_tag((unsigned int)(nIndex + pCompressor->window_start))
+                             & ((1 << TAG_BITS) - 1));
         intervals[i] = ((unsigned long long)nIndex) | (((unsigned long long)nTaggedLen) << LCP_SHIFT);
     }
 
@@ -162,6 +189,9 @@ int apultra_build_suffix_array(apultra_matchfinder *pCompressor,
     pos_data[prev_pos] = *top;
     for (; top > pCompressor->open_intervals; top--) intervals[*top & POS_MASK] = *(top - 1);
 
+    if (pCompressor->phase_time)
+        pCompressor->phase_time[APULTRA_PHASE_INTERVALS] += apultra_get_time_ns() - nStartTime;
+
     /* Success */
     return 0;
 }
@@ -173,7 +203,6 @@ int apultra_build_suffix_array(apultra_matchfinder *pCompressor,
  * @param nOffset offset to find matches at, in the input window
  * @param pMatches pointer to returned matches
  * @param pMatchDepth pointer to returned match depths
- * @param pMatch1 pointer to 1-byte length, 4 bit offset match
  * @param nMaxMatches maximum number of matches to return (0 for none)
  * @param nBlockFlags bit 0: 1 for first block, 0 otherwise; bit 1: 1 for last block, 0 otherwise
  *
@@ -183,7 +212,6 @@ int apultra_find_matches_at(apultra_matchfinder *pCompressor,
     const int nOffset,
     apultra_match *pMatches,
     unsigned short *pMatchDepth,
-    unsigned char *pMatch1,
     const int nMaxMatches,
     const int nBlockFlags) {
     unsigned long long *intervals = pCompressor->intervals;
@@ -195,8 +223,6 @@ int apultra_find_matches_at(apultra_matchfinder *pCompressor,
     unsigned short *depthptr;
     const int nMaxOffset = pCompressor->max_offset;
 
-    *pMatch1 = 0;
-
     /**
      * Find matches using intervals
      *
@@ -355,8 +381,6 @@ int apultra_find_matches_at(apultra_matchfinder *pCompressor,
             }
         }
 
-        if (nMatchOffset && nMatchOffset < 16 && nMatchLen) *pMatch1 = nMatchOffset;
-
         if (super_ref == 0) break;
         ref = super_ref;
         match_pos = intervals[ref & POS_MASK] & EXCL_VISITED_MASK;
@@ -392,6 +416,27 @@ int apultra_find_matches_at(apultra_matchfinder *pCompressor,
     return (int)(matchptr - pMatches);
 }
 
+/**
+ * Start loading the lcp-interval that finding matches further ahead in the input window will start walking from
+ *
+ * The deepest lcp-interval containing each suffix is known well in advance, but it is a random load at the start of a
+ * chain of dependent ones. Fetching it early hides some of that latency.
+ *
+ * @param pCompressor compression context
+ * @param nOffset offset that matches are being found at, in the input window
+ * @param nEndOffset offset to end finding matches at
+ */
+static inline void apultra_prefetch_matches_ahead(const apultra_matchfinder *pCompressor,
+    const int nOffset,
+    const int nEndOffset) {
+    const unsigned long long *intervals = pCompressor->intervals;
+    const unsigned long long *pos_data = pCompressor->pos_data;
+
+    if ((nOffset + MATCHES_PREFETCH_DISTANCE) < nEndOffset) {
+        APULTRA_PREFETCH(&intervals[pos_data[nOffset + MATCHES_PREFETCH_DISTANCE] & POS_MASK]);
+    }
+}
+
 /**
  * Skip previously compressed bytes
  *
@@ -402,38 +447,238 @@ int apultra_find_matches_at(apultra_matchfinder *pCompressor,
 void apultra_skip_matches(apultra_matchfinder *pCompressor, const int nStartOffset, const int nEndOffset) {
     apultra_match match;
     unsigned short depth;
-    unsigned char match1;
     int i;
 
     /* Skipping still requires scanning for matches, as this also performs a lazy update of the intervals. However,
      * we don't store the matches. */
     for (i = nStartOffset; i < nEndOffset; i++) {
-        apultra_find_matches_at(pCompressor, i, &match, &depth, &match1, 0, 0);
+        apultra_prefetch_matches_ahead(pCompressor, i, nEndOffset);
+        apultra_find_matches_at(pCompressor, i, &match, &depth, 0, 0);
     }
 }
 
 /**
- * Find all matches for the data to be compressed
+ * Get the full length of a match whose lcp value was clamped to LCP_MAX, by comparing the bytes
+ *
+ * @param pInWindow pointer to input data window (previously compressed bytes + bytes to compress)
+ * @param nOffset offset of the match in the input window
+ * @param nMaxMatchEndOffset offset that the match can't extend past
+ * @param pMatch match to extend
+ */
+static void apultra_extend_match(const unsigned char *pInWindow,
+    const int nOffset,
+    const int nMaxMatchEndOffset,
+    apultra_match *pMatch) {
+    const unsigned char *pInWindowAtPos = pInWindow + nOffset + pMatch->length;
+    const unsigned char *pInWindowMax = pInWindow + nMaxMatchEndOffset;
+    const int nMatchOffset = (int)pMatch->offset;
+
+    while ((pInWindowAtPos + 8) < pInWindowMax && !memcmp(pInWindowAtPos, pInWindowAtPos - nMatchOffset, 8))
+        pInWindowAtPos += 8;
+    while ((pInWindowAtPos + 4) < pInWindowMax && !memcmp(pInWindowAtPos, pInWindowAtPos - nMatchOffset, 4))
+        pInWindowAtPos += 4;
+    while (pInWindowAtPos < pInWindowMax && pInWindowAtPos[0] == pInWindowAtPos[-nMatchOffset]) pInWindowAtPos++;
+
+    pMatch->length = (unsigned int)(pInWindowAtPos - (pInWindow + nOffset));
+}
+
+/**
+ * Find matches into an indexed dictionary at the specified offset, and put them in front of the matches found in the
+ * current suffix array
+ *
+ * Only the dictionary matches that are longer than all the matches found in the input are kept, as the input's own
+ * matches are closer: that is what one suffix array of the dictionary and the input together would return. The
+ * current position is looked up with a binary search among the sorted dictionary suffixes. Going up from the suffix
+ * that shares the most with it, each lcp-interval whose most recent dictionary offset is more recent than that of the
+ * deeper ones gives one more match, of the interval's length.
+ *
+ * @param pDictionaryIndex dictionary index, whose dictionary is at the start of the input window
+ * @param pInWindow pointer to input data window (dictionary + bytes to compress)
+ * @param nOffset offset to find matches at, in the input window
+ * @param nMaxMatchEndOffset offset that matches can't extend past
+ * @param nMaxOffset maximum match offset
+ * @param pMatches matches found in the current suffix array, updated
+ * @param pMatchDepth depths of the matches found in the current suffix array, updated
+ * @param nMatches number of matches found in the current suffix array
+ * @param nMaxMatches maximum number of matches to return
+ *
+ * @return number of matches
+ */
+static int apultra_find_dictionary_matches_at(const apultra_dictionary_index *pDictionaryIndex,
+    const unsigned char *pInWindow,
+    const int nOffset,
+    const int nMaxMatchEndOffset,
+    const int nMaxOffset,
+    apultra_match *pMatches,
+    unsigned short *pMatchDepth,
+    int nMatches,
+    const int nMaxMatches) {
+    const int *pSuffixArray = pDictionaryIndex->suffix_array;
+    const int *pIntervalParent = pDictionaryIndex->interval_parent;
+    const int *pIntervalLcp = pDictionaryIndex->interval_lcp;
+    const int *pIntervalMaxPos = pDictionaryIndex->interval_max_pos;
+    const int nSize = pDictionaryIndex->size;
+    const unsigned char *pQuery = pInWindow + nOffset;
+    apultra_match dictionary_match[DICTIONARY_MATCHES_MAX];
+    int nNumDictionaryMatches = 0;
+    int nQueryLen = nMaxMatchEndOffset - nOffset;
+    int nMinLen = 1;
+    int nLow = -1, nHigh = nSize;
+    int nLowLen = 0, nHighLen = 0;
+    int nRank, nLen, nPos, nInterval;
+    int i;
+
+    if (nQueryLen > LCP_MAX) nQueryLen = LCP_MAX;
+    for (i = 0; i < nMatches; i++) {
+        if (nMinLen < (int)pMatches[i].length) nMinLen = (int)pMatches[i].length;
+    }
+    if (nQueryLen <= nMinLen) return nMatches;
+
+    /* All the suffixes between the bounds share at least the shortest of the bounds' lengths with the current
+     * position, so these bytes aren't compared again */
+    while ((nHigh - nLow) > 1) {
+        const int nMid = (nLow + nHigh) >> 1;
+        const int nSuffixPos = pSuffixArray[nMid];
+        const int nMaxLen = (nQueryLen < (nSize - nSuffixPos)) ? nQueryLen : (nSize - nSuffixPos);
+
+        nLen = (nLowLen < nHighLen) ? nLowLen : nHighLen;
+        while (nLen < nMaxLen && pInWindow[nSuffixPos + nLen] == pQuery[nLen]) nLen++;
+
+        if (nLen < nQueryLen && (nLen == (nSize - nSuffixPos) || pInWindow[nSuffixPos + nLen] < pQuery[nLen])) {
+            nLow = nMid;
+            nLowLen = nLen;
+        } else {
+            nHigh = nMid;
+            nHighLen = nLen;
+        }
+    }
+
+    if (nHigh < nSize && nHighLen >= nLowLen) {
+        nRank = nHigh;
+        nLen = nHighLen;
+    } else {
+        nRank = nLow;
+        nLen = nLowLen;
+    }
+    if (nRank < 0 || nLen <= nMinLen) return nMatches;
+
+    /* A suffix that runs to the end of the dictionary can keep matching into the input */
+    nPos = pSuffixArray[nRank];
+    if (nLen == (nSize - nPos)) {
+        while (nLen < nQueryLen && pInWindow[nPos + nLen] == pQuery[nLen]) nLen++;
+    }
+
+    /* Every suffix of the intervals that share at least as much with the suffix also matches for that length */
+    nInterval = pDictionaryIndex->leaf_interval[nRank];
+    while (nInterval > 0 && pIntervalLcp[nInterval] >= nLen) {
+        if (nPos < pIntervalMaxPos[nInterval]) nPos = pIntervalMaxPos[nInterval];
+        nInterval = pIntervalParent[nInterval];
+    }
+
+    for (;;) {
+        if ((nOffset - nPos) <= nMaxOffset && nNumDictionaryMatches < DICTIONARY_MATCHES_MAX) {
+            dictionary_match[nNumDictionaryMatches].length = nLen;
+            dictionary_match[nNumDictionaryMatches].offset = nOffset - nPos;
+            nNumDictionaryMatches++;
+        }
+
+        while (nInterval > 0 && pIntervalMaxPos[nInterval] <= nPos) nInterval = pIntervalParent[nInterval];
+        if (nInterval <= 0 || pIntervalLcp[nInterval] <= nMinLen) break;
+
+        nLen = pIntervalLcp[nInterval];
+        nPos = pIntervalMaxPos[nInterval];
+        nInterval = pIntervalParent[nInterval];
+    }
+
+    /* Longest first, as the suffix array walk returns them; the shortest matches in the input are dropped if needed */
+    if (nNumDictionaryMatches > nMaxMatches) nNumDictionaryMatches = nMaxMatches;
+    if (nMatches > (nMaxMatches - nNumDictionaryMatches)) nMatches = nMaxMatches - nNumDictionaryMatches;
+
+    memmove(pMatches + nNumDictionaryMatches, pMatches, nMatches * sizeof(apultra_match));
+    memmove(pMatchDepth + nNumDictionaryMatches, pMatchDepth, nMatches * sizeof(unsigned short));
+    for (i = 0; i < nNumDictionaryMatches; i++) {
+        pMatches[i] = dictionary_match[i];
+        pMatchDepth[i] = 0;
+    }
+
+    return nNumDictionaryMatches + nMatches;
+}
+
+/**
+ * Find all matches for a range of positions in the input window, whose suffixes are in the current suffix array
  *
  * @param pCompressor compression context
+ * @param pInWindow pointer to input data window (previously compressed bytes + bytes to compress)
+ * @param pMatch pointer to returned matches, nMatchesPerOffset for each position from nStartOffset on
+ * @param pMatchDepth pointer to returned match depths, nMatchesPerOffset for each position from nStartOffset on
  * @param nMatchesPerOffset maximum number of matches to store for each offset
- * @param nStartOffset current offset in input window (typically the number of previously compressed bytes)
- * @param nEndOffset offset to end finding matches at (typically the size of the total input window in bytes
+ * @param nStartOffset offset to start finding matches at, in the input window
+ * @param nEndOffset offset to end finding matches at, in the input window
+ * @param nBlockStartOffset offset of the first byte of the block, in the input window
+ * @param nMaxMatchEndOffset offset that matches can't extend past (typically the size of the total input window)
  * @param nBlockFlags bit 0: 1 for first block, 0 otherwise; bit 1: 1 for last block, 0 otherwise
+ * @param nLongRepeatEnd pointer to the end offset of the last very long repeat found, updated
+ * @param nLongRepeatOffset pointer to the match offset of the last very long repeat found, updated
+ * @param pDictionaryIndex index of the dictionary at the start of the input window, whose suffixes are not in the
+ * current suffix array, or NULL
  */
-void apultra_find_all_matches(apultra_matchfinder *pCompressor,
+static void apultra_find_matches_in_range(apultra_matchfinder *pCompressor,
+    const unsigned char *pInWindow,
+    apultra_match *pMatch,
+    unsigned short *pMatchDepth,
     const int nMatchesPerOffset,
     const int nStartOffset,
     const int nEndOffset,
-    const int nBlockFlags) {
-    apultra_match *pMatch = pCompressor->match;
-    unsigned short *pMatchDepth = pCompressor->match_depth;
-    unsigned char *pMatch1 = pCompressor->match1;
+    const int nBlockStartOffset,
+    const int nMaxMatchEndOffset,
+    const int nBlockFlags,
+    int *nLongRepeatEnd,
+    int *nLongRepeatOffset,
+    const apultra_dictionary_index *pDictionaryIndex) {
+    const int nWindowStart = pCompressor->window_start;
     int i;
 
     for (i = nStartOffset; i < nEndOffset; i++) {
+        apultra_prefetch_matches_ahead(pCompressor, i - nWindowStart, nEndOffset - nWindowStart);
+
+        /* Positions inside a very long repeat are skipped by the optimizer, when it is allowed to; only keep the
+         * intervals up to date there. The first byte of the first block is always a literal, so a repeat found there
+         * (from a dictionary) can't be taken, and must not make the positions after it be skipped */
+        const int nInLongRepeat = (i < *nLongRepeatEnd);
+        const int nSkipPosition = nInLongRepeat && pCompressor->skip_long_repeats
+                                  && *nLongRepeatOffset <= pCompressor->long_repeat_max_offset;
+        const int nMaxMatches =
+            (nSkipPosition || (i == nBlockStartOffset && (nBlockFlags & 1)))
+                ? 0
+                : nMatchesPerOffset;
         int nMatches =
-            apultra_find_matches_at(pCompressor, i, pMatch, pMatchDepth, pMatch1, nMatchesPerOffset, nBlockFlags);
+            apultra_find_matches_at(pCompressor, i - nWindowStart, pMatch, pMatchDepth, nMaxMatches, nBlockFlags);
+
+        if (pDictionaryIndex && nMaxMatches) {
+            nMatches = apultra_find_dictionary_matches_at(pDictionaryIndex,
+                pInWindow,
+                i,
+                nMaxMatchEndOffset,
+                pCompressor->max_offset,
+                pMatch,
+                pMatchDepth,
+                nMatches,
+                nMaxMatches);
+        }
+
+        if (nMatches && nInLongRepeat && (int)pMatch[0].offset == *nLongRepeatOffset) {
+            /* Still inside a very long repeat that is too far back to be skipped: it ends where it was found to end */
+            if (pMatch[0].length < (unsigned int)(*nLongRepeatEnd - i))
+                pMatch[0].length = (unsigned int)(*nLongRepeatEnd - i);
+        } else if (nMatches && pMatch[0].length >= LCP_MAX && (pMatchDepth[0] & 0x3fff) == 0
+                   && pCompressor->skip_long_repeats) {
+            apultra_extend_match(pInWindow, i, nMaxMatchEndOffset, pMatch);
+        }
+
+        if (nMatches && pMatch[0].length >= LONG_REPEAT_MATCH_SIZE) {
+            *nLongRepeatEnd = i + pMatch[0].length;
+            *nLongRepeatOffset = (int)pMatch[0].offset;
+        }
 
         while (nMatches < nMatchesPerOffset) {
             pMatch[nMatches].length = 0;
@@ -444,10 +689,169 @@ void apultra_find_all_matches(apultra_matchfinder *pCompressor,
 
         pMatch += nMatchesPerOffset;
         pMatchDepth += nMatchesPerOffset;
-        pMatch1++;
     }
 }
 
+/**
+ * Find all matches for the data to be compressed
+ *
+ * @param pCompressor compression context
+ * @param pInWindow pointer to input data window (previously compressed bytes + bytes to compress)
+ * @param nMatchesPerOffset maximum number of matches to store for each offset
+ * @param nStartOffset current offset in input window (typically the number of previously compressed bytes)
+ * @param nEndOffset offset to end finding matches at (typically the size of the total input window in bytes
+ * @param nBlockFlags bit 0: 1 for first block, 0 otherwise; bit 1: 1 for last block, 0 otherwise
+ */
+void apultra_find_all_matches(apultra_matchfinder *pCompressor,
+    const unsigned char *pInWindow,
+    const int nMatchesPerOffset,
+    const int nStartOffset,
+    const int nEndOffset,
+    const int nBlockFlags) {
+    int nLongRepeatEnd = nStartOffset, nLongRepeatOffset = 0;
+
+    apultra_find_matches_in_range(pCompressor,
+        pInWindow,
+        pCompressor->match,
+        pCompressor->match_depth,
+        nMatchesPerOffset,
+        nStartOffset,
+        nEndOffset,
+        nStartOffset,
+        nEndOffset,
+        nBlockFlags,
+        &nLongRepeatEnd,
+        &nLongRepeatOffset,
+        NULL);
+}
+
+/**
+ * Find all matches for one block of data, when the maximum offset is much smaller than the block
+ *
+ * Instead of sorting all the suffixes of the previous and current blocks, the block is split into chunks, and a
+ * suffix array is built for each chunk with just the max_offset bytes before it, and the bytes that its matches can
+ * still reach after it. The work and the memory touched then depend on the window, not on the block size.
+ *
+ * This is not equivalent to sorting the whole input window. Each chunk's lcp-intervals are built from fewer suffixes,
+ * so the intervals that exist and the ones already visited differ. The few matches kept at each position, and their
+ * depths, can then differ as well. All of them are valid and within the window, but the output can be a few bytes
+ * larger or smaller than without chunks.
+ *
+ * @param pMatchfinder matchfinder context
+ * @param pInWindow pointer to input data window (previously compressed bytes + bytes to compress)
+ * @param nPreviousBlockSize number of previously compressed bytes (or 0 for none)
+ * @param nInDataSize number of input bytes to compress
+ * @param nBlockFlags bit 0: 1 for first block, 0 otherwise; bit 1: 1 for last block, 0 otherwise
+ * @param nMatchesPerIndex maximum number of matches to store for each offset
+ * @param nChunkSize number of positions to find matches at for each suffix array
+ *
+ * @return 0 for success, non-zero for failure
+ */
+static int apultra_find_all_windowed_matches(apultra_matchfinder *pMatchfinder,
+    const unsigned char *pInWindow,
+    const int nPreviousBlockSize,
+    const int nInDataSize,
+    const int nBlockFlags,
+    const int nMatchesPerIndex,
+    const int nChunkSize) {
+    const int nEndOffset = nPreviousBlockSize + nInDataSize;
+    int nLongRepeatEnd = nPreviousBlockSize, nLongRepeatOffset = 0;
+    int nChunkStart;
+
+    for (nChunkStart = nPreviousBlockSize; nChunkStart < nEndOffset; nChunkStart += nChunkSize) {
+        const int nChunkEnd = (nChunkSize < (nEndOffset - nChunkStart)) ? (nChunkStart + nChunkSize) : nEndOffset;
+        const int nSegmentStart =
+            (nChunkStart > pMatchfinder->max_offset) ? (nChunkStart - pMatchfinder->max_offset) : 0;
+        const int nSegmentEnd = (LCP_MAX < (nEndOffset - nChunkEnd)) ? (nChunkEnd + LCP_MAX) : nEndOffset;
+
+        pMatchfinder->window_start = nSegmentStart;
+        if (apultra_build_suffix_array(pMatchfinder, pInWindow + nSegmentStart, nSegmentEnd - nSegmentStart)) {
+            pMatchfinder->window_start = 0;
+            return -1;
+        }
+
+        long long nStartTime = apultra_get_time_ns();
+
+        apultra_skip_matches(pMatchfinder, 0, nChunkStart - nSegmentStart);
+        apultra_find_matches_in_range(pMatchfinder,
+            pInWindow,
+            pMatchfinder->match + (nChunkStart - nPreviousBlockSize) * nMatchesPerIndex,
+            pMatchfinder->match_depth + (nChunkStart - nPreviousBlockSize) * nMatchesPerIndex,
+            nMatchesPerIndex,
+            nChunkStart,
+            nChunkEnd,
+            nPreviousBlockSize,
+            nEndOffset,
+            nBlockFlags,
+            &nLongRepeatEnd,
+            &nLongRepeatOffset,
+            NULL);
+
+        if (pMatchfinder->phase_time)
+            pMatchfinder->phase_time[APULTRA_PHASE_FIND_MATCHES] += apultra_get_time_ns() - nStartTime;
+    }
+
+    pMatchfinder->window_start = 0;
+    return 0;
+}
+
+/**
+ * Find the 4 bits offset match at one position
+ *
+ * @param pInWindow pointer to input data window (previously compressed bytes + bytes to compress)
+ * @param nOffset offset to find the match at, in the input window
+ *
+ * @return offset of the nearest previous byte that is equal, if it is 15 bytes back or less, 0 otherwise
+ */
+static inline unsigned char apultra_find_match1_at(const unsigned char *pInWindow, const int nOffset) {
+    int nMatchOffset;
+
+    for (nMatchOffset = 1; nMatchOffset < 16 && nMatchOffset <= nOffset; nMatchOffset++) {
+        if (pInWindow[nOffset - nMatchOffset] == pInWindow[nOffset]) return (unsigned char)nMatchOffset;
+    }
+
+    return 0;
+}
+
+/**
+ * Find the 4 bits offset (1-byte length) matches for the data to be compressed
+ *
+ * This only needs the input bytes, not the suffix array: each byte is compared with the 15 bytes before it, 16
+ * positions at a time when SSE2 is available.
+ *
+ * @param pInWindow pointer to input data window (previously compressed bytes + bytes to compress)
+ * @param pMatch1 pointer to returned offsets, one per position from nStartOffset on (0 for no match)
+ * @param nStartOffset current offset in input window (typically the number of previously compressed bytes)
+ * @param nEndOffset offset to end finding matches at (typically the size of the total input window in bytes
+ */
+static void apultra_find_all_match1(const unsigned char *pInWindow,
+    unsigned char *pMatch1,
+    const int nStartOffset,
+    const int nEndOffset) {
+    int i = nStartOffset;
+
+#ifdef APULTRA_MATCH1_SSE2
+    for (; i < 15 && i < nEndOffset; i++) { pMatch1[i - nStartOffset] = apultra_find_match1_at(pInWindow, i); }
+
+    for (; (i + 16) <= nEndOffset; i += 16) {
+        const __m128i cur = _mm_loadu_si128((const __m128i *)(pInWindow + i));
+        __m128i offset = _mm_setzero_si128();
+        int nMatchOffset;
+
+        /* Go from the furthest offset to the nearest, so that the nearest equal byte wins */
+        for (nMatchOffset = 15; nMatchOffset >= 1; nMatchOffset--) {
+            const __m128i eq = _mm_cmpeq_epi8(cur, _mm_loadu_si128((const __m128i *)(pInWindow + i - nMatchOffset)));
+
+            offset = _mm_or_si128(_mm_andnot_si128(eq, offset), _mm_and_si128(eq, _mm_set1_epi8((char)nMatchOffset)));
+        }
+
+        _mm_storeu_si128((__m128i *)(pMatch1 + (i - nStartOffset)), offset);
+    }
+#endif
+
+    for (; i < nEndOffset; i++) { pMatch1[i - nStartOffset] = apultra_find_match1_at(pInWindow, i); }
+}
+
 
 /**
  * Find all matches for one block of data
@@ -458,6 +862,7 @@ void apultra_find_all_matches(apultra_matchfinder *pCompressor,
  * @param nInDataSize number of input bytes to compress
  * @param nBlockFlags bit 0: 1 for first block, 0 otherwise; bit 1: 1 for last block, 0 otherwise
  * @param nMatchesPerIndex
+ * @param pDictionaryIndex index of the previously compressed bytes, if they are an indexed dictionary, or NULL
  *
  * @return size of compressed data in output buffer, or -1 if the data is uncompressible
  */
@@ -466,15 +871,292 @@ int apultra_find_all_block_matches(apultra_matchfinder *pMatchfinder,
     const int nPreviousBlockSize,
     const int nInDataSize,
     const int nBlockFlags,
+    const int nMatchesPerIndex,
+    const apultra_dictionary_index *pDictionaryIndex) {
+    const int nChunkSize = (pMatchfinder->max_offset < (WINDOWED_MIN_CHUNK_SIZE / 4))
+                               ? WINDOWED_MIN_CHUNK_SIZE
+                               : (pMatchfinder->max_offset * 4);
+    long long nStartTime;
+
+    if ((pMatchfinder->max_offset + nChunkSize + LCP_MAX) < (nPreviousBlockSize + nInDataSize)) {
+        /* Small window: only sort the suffixes that each chunk of the block can reach */
+        if (apultra_find_all_windowed_matches(
+                pMatchfinder, pInWindow, nPreviousBlockSize, nInDataSize, nBlockFlags, nMatchesPerIndex, nChunkSize))
+            return -1;
+
+        nStartTime = apultra_get_time_ns();
+    } else if (pDictionaryIndex && pDictionaryIndex->size == nPreviousBlockSize) {
+        /* Indexed dictionary: only sort the block's own suffixes, and look the dictionary matches up in the index */
+        int nLongRepeatEnd = nPreviousBlockSize, nLongRepeatOffset = 0;
+
+        pMatchfinder->window_start = nPreviousBlockSize;
+        if (apultra_build_suffix_array(pMatchfinder, pInWindow + nPreviousBlockSize, nInDataSize)) {
+            pMatchfinder->window_start = 0;
+            return -1;
+        }
+
+        nStartTime = apultra_get_time_ns();
+
+        apultra_find_matches_in_range(pMatchfinder,
+            pInWindow,
+            pMatchfinder->match,
+            pMatchfinder->match_depth,
+            nMatchesPerIndex,
+            nPreviousBlockSize,
+            nPreviousBlockSize + nInDataSize,
+            nPreviousBlockSize,
+            nPreviousBlockSize + nInDataSize,
+            nBlockFlags,
+            &nLongRepeatEnd,
+            &nLongRepeatOffset,
+            pDictionaryIndex);
+
+        pMatchfinder->window_start = 0;
+    } else {
+        if (apultra_build_suffix_array(pMatchfinder, pInWindow, nPreviousBlockSize + nInDataSize)) return -1;
+
+        nStartTime = apultra_get_time_ns();
+
+        if (nPreviousBlockSize) { apultra_skip_matches(pMatchfinder, 0, nPreviousBlockSize); }
+        apultra_find_all_matches(pMatchfinder,
+            pInWindow,
+            nMatchesPerIndex,
+            nPreviousBlockSize,
+            nPreviousBlockSize + nInDataSize,
+            nBlockFlags);
+    }
+
+    apultra_find_all_match1(pInWindow, pMatchfinder->match1, nPreviousBlockSize, nPreviousBlockSize + nInDataSize);
+
+    if (pMatchfinder->phase_time)
+        pMatchfinder->phase_time[APULTRA_PHASE_FIND_MATCHES] += apultra_get_time_ns() - nStartTime;
+    return 0;
+}
+
+
+/**
+ * Find the matches for some ranges of positions of one block only
+ *
+ * The suffix array is built for the whole input window, as for apultra_find_all_block_matches(), but the intervals
+ * are only brought up to date in between the ranges, and matches are only stored for the positions in them, at the
+ * same place as for the whole block. Used to compress parts of a block again.
+ *
+ * @param pMatchfinder matchfinder context
+ * @param pInWindow pointer to input data window (previously compressed bytes + bytes to compress)
+ * @param nPreviousBlockSize number of previously compressed bytes (or 0 for none)
+ * @param nInDataSize number of input bytes to compress
+ * @param nBlockFlags bit 0: 1 for first block, 0 otherwise; bit 1: 1 for last block, 0 otherwise
+ * @param nMatchesPerIndex maximum number of matches to store for each offset
+ * @param pRangeStart offset of the start of each range in the input window, in increasing order
+ * @param pRangeEnd offset of the end of each range in the input window
+ * @param nNumRanges number of ranges
+ *
+ * @return 0 for success, non-zero for failure
+ */
+int apultra_find_block_matches_in_ranges(apultra_matchfinder *pMatchfinder,
+    const unsigned char *pInWindow,
+    const int nPreviousBlockSize,
+    const int nInDataSize,
+    const int nBlockFlags,
+    const int nMatchesPerIndex,
+    const int *pRangeStart,
+    const int *pRangeEnd,
+    const int nNumRanges) {
+    const int nEndOffset = nPreviousBlockSize + nInDataSize;
+    int nCurOffset = 0;
+    int r;
+
+    if (apultra_build_suffix_array(pMatchfinder, pInWindow, nEndOffset)) return -1;
+
+    long long nStartTime = apultra_get_time_ns();
+
+    for (r = 0; r < nNumRanges; r++) {
+        const int nRangeStart = pRangeStart[r];
+        const int nRangeEnd = pRangeEnd[r];
+        int nLongRepeatEnd = nRangeStart, nLongRepeatOffset = 0;
+
+        if (nRangeStart < nCurOffset || nRangeStart < nPreviousBlockSize || nRangeEnd > nEndOffset) return -1;
+
+        apultra_skip_matches(pMatchfinder, nCurOffset, nRangeStart);
+        apultra_find_matches_in_range(pMatchfinder,
+            pInWindow,
+            pMatchfinder->match + (nRangeStart - nPreviousBlockSize) * nMatchesPerIndex,
+            pMatchfinder->match_depth + (nRangeStart - nPreviousBlockSize) * nMatchesPerIndex,
+            nMatchesPerIndex,
+            nRangeStart,
+            nRangeEnd,
+            nPreviousBlockSize,
+            nEndOffset,
+            nBlockFlags,
+            &nLongRepeatEnd,
+            &nLongRepeatOffset,
+            NULL);
+        apultra_find_all_match1(
+            pInWindow, pMatchfinder->match1 + (nRangeStart - nPreviousBlockSize), nRangeStart, nRangeEnd);
+
+        nCurOffset = nRangeEnd;
+    }
+
+    if (pMatchfinder->phase_time)
+        pMatchfinder->phase_time[APULTRA_PHASE_FIND_MATCHES] += apultra_get_time_ns() - nStartTime;
+    return 0;
+}
+
+
+/**
+ * Save the matches found for one block
+ *
+ * @param pSaved saved matches to fill
+ * @param pMatchfinder matchfinder context, with the matches of the block
+ * @param nInDataSize number of input bytes to compress in the block
+ * @param nMatchesPerIndex maximum number of matches stored for each offset
+ *
+ * @return 0 for success, non-zero for failure
+ */
+int apultra_save_block_matches(apultra_saved_matches *pSaved,
+    const apultra_matchfinder *pMatchfinder,
+    const int nInDataSize,
     const int nMatchesPerIndex) {
-    if (apultra_build_suffix_array(pMatchfinder, pInWindow, nPreviousBlockSize + nInDataSize)) return -1;
+    const apultra_match *pMatch = pMatchfinder->match;
+    const unsigned short *pMatchDepth = pMatchfinder->match_depth;
+    int nTotalMatches = 0;
+    int i, m;
+
+    /* Matches are packed at the start of the slots of each position, and only a few are used for most positions */
+    for (i = 0; i < nInDataSize; i++) {
+        const apultra_match *match = pMatch + i * nMatchesPerIndex;
+
+        m = 0;
+        while (m < nMatchesPerIndex && match[m].length) m++;
+
+        pSaved->num_matches[i] = (unsigned char)m;
+        nTotalMatches += m;
+    }
+
+    if (nTotalMatches > pSaved->capacity) {
+        apultra_match *pNewMatch = (apultra_match *)realloc(pSaved->match, nTotalMatches * sizeof(apultra_match));
+        if (!pNewMatch) return -1;
+        pSaved->match = pNewMatch;
+
+        unsigned short *pNewMatchDepth =
+            (unsigned short *)realloc(pSaved->match_depth, nTotalMatches * sizeof(unsigned short));
+        if (!pNewMatchDepth) return -1;
+        pSaved->match_depth = pNewMatchDepth;
+
+        pSaved->capacity = nTotalMatches;
+    }
+
+    nTotalMatches = 0;
+    for (i = 0; i < nInDataSize; i++) {
+        const int nMatches = pSaved->num_matches[i];
+
+        memcpy(pSaved->match + nTotalMatches, pMatch + i * nMatchesPerIndex, nMatches * sizeof(apultra_match));
+        memcpy(pSaved->match_depth + nTotalMatches,
+            pMatchDepth + i * nMatchesPerIndex,
+            nMatches * sizeof(unsigned short));
+        nTotalMatches += nMatches;
+    }
 
-    if (nPreviousBlockSize) { apultra_skip_matches(pMatchfinder, 0, nPreviousBlockSize); }
-    apultra_find_all_matches(
-        pMatchfinder, nMatchesPerIndex, nPreviousBlockSize, nPreviousBlockSize + nInDataSize, nBlockFlags);
     return 0;
 }
 
+/**
+ * Put saved matches back into the matchfinder context, keeping only those within a maximum offset
+ *
+ * The longest match left at a position is then treated the way apultra_find_all_matches() treats the longest match
+ * that it finds: when skip_long_repeats is set, it is extended past LCP_MAX, and if it is a very long repeat, the
+ * positions inside it are left without matches.
+ *
+ * @param pMatchfinder matchfinder context to restore the matches of the block into
+ * @param pSaved saved matches
+ * @param pInWindow pointer to input data window (previously compressed bytes + bytes to compress)
+ * @param nStartOffset current offset in input window (typically the number of previously compressed bytes)
+ * @param nEndOffset offset to end finding matches at (typically the size of the total input window in bytes
+ * @param nMatchesPerIndex maximum number of matches stored for each offset
+ * @param nMaxOffset maximum offset of the restored matches
+ */
+void apultra_restore_block_matches(apultra_matchfinder *pMatchfinder,
+    const apultra_saved_matches *pSaved,
+    const unsigned char *pInWindow,
+    const int nStartOffset,
+    const int nEndOffset,
+    const int nMatchesPerIndex,
+    const int nMaxOffset) {
+    const apultra_match *pSavedMatch = pSaved->match;
+    const unsigned short *pSavedMatchDepth = pSaved->match_depth;
+    int nLongRepeatEnd = nStartOffset;
+    int i, j;
+
+    for (i = 0; i < (nEndOffset - nStartOffset); i++) {
+        apultra_match *match = pMatchfinder->match + i * nMatchesPerIndex;
+        unsigned short *match_depth = pMatchfinder->match_depth + i * nMatchesPerIndex;
+        const int nSavedMatches = pSaved->num_matches[i];
+        int m = 0;
+
+        if ((nStartOffset + i) >= nLongRepeatEnd) {
+            for (j = 0; j < nSavedMatches; j++) {
+                if ((int)pSavedMatch[j].offset <= nMaxOffset) {
+                    match[m] = pSavedMatch[j];
+                    match_depth[m] = pSavedMatchDepth[j];
+                    m++;
+                }
+            }
+
+            if (m && match[0].length >= LCP_MAX && (match_depth[0] & 0x3fff) == 0 && pMatchfinder->skip_long_repeats)
+                apultra_extend_match(pInWindow, nStartOffset + i, nEndOffset, &match[0]);
+            if (m && match[0].length >= LONG_REPEAT_MATCH_SIZE && pMatchfinder->skip_long_repeats)
+                nLongRepeatEnd = nStartOffset + i + match[0].length;
+        }
+
+        if (m < nMatchesPerIndex) {
+            memset(match + m, 0, (nMatchesPerIndex - m) * sizeof(apultra_match));
+            memset(match_depth + m, 0, (nMatchesPerIndex - m) * sizeof(unsigned short));
+        }
+
+        pSavedMatch += nSavedMatches;
+        pSavedMatchDepth += nSavedMatches;
+    }
+}
+
+/**
+ * Clean up saved matches and free up any associated resources
+ *
+ * @param pSaved saved matches to clean up
+ */
+void apultra_saved_matches_destroy(apultra_saved_matches *pSaved) {
+    if (pSaved->num_matches) {
+        free(pSaved->num_matches);
+        pSaved->num_matches = NULL;
+    }
+
+    if (pSaved->match_depth) {
+        free(pSaved->match_depth);
+        pSaved->match_depth = NULL;
+    }
+
+    if (pSaved->match) {
+        free(pSaved->match);
+        pSaved->match = NULL;
+    }
+
+    pSaved->capacity = 0;
+}
+
+/**
+ * Initialize saved matches
+ *
+ * @param pSaved saved matches to initialize
+ * @param nBlockSize maximum size of input data (bytes to compress only)
+ *
+ * @return 0 for success, non-zero for failure
+ */
+int apultra_saved_matches_init(apultra_saved_matches *pSaved, const int nBlockSize) {
+    pSaved->match = NULL;
+    pSaved->match_depth = NULL;
+    pSaved->capacity = 0;
+    pSaved->num_matches = (unsigned char *)malloc(nBlockSize * sizeof(unsigned char));
+    return pSaved->num_matches ? 0 : -1;
+}
 
 /**
  * Clean up matchfinder context and free up any associated resources
@@ -487,6 +1169,7 @@ void apultra_matchfinder_destroy(apultra_matchfinder *pMatchfinder) {
     if (pMatchfinder->match1) {
         free(pMatchfinder->match1);
         pMatchfinder->match1 = NULL;
+    pMatchfinder->phase_time = NULL;
     }
 
     if (pMatchfinder->match_depth) {
@@ -537,6 +1220,9 @@ int apultra_matchfinder_init(apultra_matchfinder *pMatchfinder,
     pMatchfinder->match = NULL;
     pMatchfinder->match_depth = NULL;
     pMatchfinder->match1 = NULL;
+    pMatchfinder->long_repeat_max_offset = MAX_OFFSET;
+    pMatchfinder->skip_long_repeats = 0;
+    pMatchfinder->window_start = 0;
 
     if (!nResult) {
         pMatchfinder->intervals = (unsigned long long *)malloc(nMaxWindowSize * sizeof(unsigned long long));
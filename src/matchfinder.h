@@ -36,6 +36,7 @@
 
 #include "divsufsort.h"
 #include "format.h"
+#include "dictindex.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -50,6 +51,20 @@ extern "C" {
 #define VISITED_FLAG 0x8000000000000000ULL
 #define LCP_AND_TAG_MAX ((1U << LCP_BITS) - 1)
 #define EXCL_VISITED_MASK 0x7fffffffffffffffULL
+#define LONG_REPEAT_MATCH_SIZE 1024 /* matches from this length on are taken as a whole, their inner positions skipped */
+#define WINDOWED_MIN_CHUNK_SIZE 65536 /* minimum number of positions per suffix array, with a small max_offset */
+#define DICTIONARY_MATCHES_MAX 64 /* matches into an indexed dictionary kept for one position */
+
+/* Compression phases, for timing */
+#define APULTRA_PHASE_SUFFIX_ARRAY 0
+#define APULTRA_PHASE_INTERVALS 1
+#define APULTRA_PHASE_FIND_MATCHES 2
+#define APULTRA_PHASE_SUPPLEMENT 3
+#define APULTRA_PHASE_FORWARD_PASS1 4
+#define APULTRA_PHASE_FORWARD_PASS2 5
+#define APULTRA_PHASE_REDUCE 6
+#define APULTRA_PHASE_WRITE 7
+#define APULTRA_NUM_PHASES 8
 
 /** One match option */
 typedef struct _apultra_match {
@@ -70,8 +85,21 @@ typedef struct _apultra_matchfinder {
     unsigned short *match_depth;
     unsigned char *match1;
     int max_offset;
+    int long_repeat_max_offset; /* very long repeats from further back than this don't make positions be skipped */
+    int skip_long_repeats;      /* non-zero to extend matches past LCP_MAX, and leave the positions inside very long
+                                 * repeats without matches */
+    int window_start; /* offset in the input window of the data that the suffix array was built for */
+    long long *phase_time;
 } apultra_matchfinder;
 
+/** Compact copy of the matches found for one block, to optimize the block more than once */
+typedef struct _apultra_saved_matches {
+    apultra_match *match;
+    unsigned short *match_depth;
+    unsigned char *num_matches; /* number of matches saved for each position */
+    int capacity;               /* number of matches that match and match_depth can hold */
+} apultra_saved_matches;
+
 // /**
 //  * Parse input data, build suffix array and overlaid data structures to speed up
 //  * match finding
@@ -95,7 +123,6 @@ typedef struct _apultra_matchfinder {
 //  * @param nOffset offset to find matches at, in the input window
 //  * @param pMatches pointer to returned matches
 //  * @param pMatchDepth pointer to returned match depths
-//  * @param pMatch1 pointer to 1-byte length, 4 bit offset match
 //  * @param nMaxMatches maximum number of matches to return (0 for none)
 //  * @param nBlockFlags bit 0: 1 for first block, 0 otherwise; bit 1: 1 for last
 //  * block, 0 otherwise
@@ -104,7 +131,7 @@ typedef struct _apultra_matchfinder {
 //  */
 // int apultra_find_matches_at(apultra_matchfinder *pCompressor, const int nOffset,
 //                             apultra_match *pMatches,
-//                             unsigned short *pMatchDepth, unsigned char *pMatch1,
+//                             unsigned short *pMatchDepth,
 //                             const int nMaxMatches, const int nBlockFlags);
 
 // /**
@@ -128,6 +155,7 @@ typedef struct _apultra_matchfinder {
  * @param nInDataSize number of input bytes to compress
  * @param nBlockFlags bit 0: 1 for first block, 0 otherwise; bit 1: 1 for last block, 0 otherwise
  * @param nMatchesPerIndex
+ * @param pDictionaryIndex index of the previously compressed bytes, if they are an indexed dictionary, or NULL
  * @return size of compressed data in output buffer, or -1 if the data is uncompressible
  */
 int apultra_find_all_block_matches(apultra_matchfinder *pMatchfinder,
@@ -135,13 +163,41 @@ int apultra_find_all_block_matches(apultra_matchfinder *pMatchfinder,
     const int nPreviousBlockSize,
     const int nInDataSize,
     const int nBlockFlags,
-    const int nMatchesPerIndex);
+    const int nMatchesPerIndex,
+    const apultra_dictionary_index *pDictionaryIndex);
+
+/**
+ * Find the matches for some ranges of positions of one block only
+ *
+ * @param pMatchfinder matchfinder context
+ * @param pInWindow pointer to input data window (previously compressed bytes + bytes to compress)
+ * @param nPreviousBlockSize number of previously compressed bytes (or 0 for none)
+ * @param nInDataSize number of input bytes to compress
+ * @param nBlockFlags bit 0: 1 for first block, 0 otherwise; bit 1: 1 for last block, 0 otherwise
+ * @param nMatchesPerIndex maximum number of matches to store for each offset
+ * @param pRangeStart offset of the start of each range in the input window, in increasing order
+ * @param pRangeEnd offset of the end of each range in the input window
+ * @param nNumRanges number of ranges
+ *
+ * @return 0 for success, non-zero for failure
+ */
+int apultra_find_block_matches_in_ranges(apultra_matchfinder *pMatchfinder,
+    const unsigned char *pInWindow,
+    const int nPreviousBlockSize,
+    const int nInDataSize,
+    const int nBlockFlags,
+    const int nMatchesPerIndex,
+    const int *pRangeStart,
+    const int *pRangeEnd,
+    const int nNumRanges);
 
 
 /**
  * Find all matches for the data to be compressed
  *
  * @param pCompressor compression context
+ * @param pInWindow pointer to input data window (previously compressed bytes +
+ * bytes to compress)
  * @param nMatchesPerOffset maximum number of matches to store for each offset
  * @param nStartOffset current offset in input window (typically the number of
  * previously compressed bytes)
@@ -151,11 +207,63 @@ int apultra_find_all_block_matches(apultra_matchfinder *pMatchfinder,
  * block, 0 otherwise
  */
 void apultra_find_all_matches(apultra_matchfinder *pCompressor,
+    const unsigned char *pInWindow,
     const int nMatchesPerOffset,
     const int nStartOffset,
     const int nEndOffset,
     const int nBlockFlags);
 
+/**
+ * Save the matches found for one block
+ *
+ * @param pSaved saved matches to fill
+ * @param pMatchfinder matchfinder context, with the matches of the block
+ * @param nInDataSize number of input bytes to compress in the block
+ * @param nMatchesPerIndex maximum number of matches stored for each offset
+ *
+ * @return 0 for success, non-zero for failure
+ */
+int apultra_save_block_matches(apultra_saved_matches *pSaved,
+    const apultra_matchfinder *pMatchfinder,
+    const int nInDataSize,
+    const int nMatchesPerIndex);
+
+/**
+ * Put saved matches back into the matchfinder context, keeping only those within a maximum offset
+ *
+ * @param pMatchfinder matchfinder context to restore the matches of the block into
+ * @param pSaved saved matches
+ * @param pInWindow pointer to input data window (previously compressed bytes + bytes to compress)
+ * @param nStartOffset current offset in input window (typically the number of previously compressed bytes)
+ * @param nEndOffset offset to end finding matches at (typically the size of the total input window in bytes
+ * @param nMatchesPerIndex maximum number of matches stored for each offset
+ * @param nMaxOffset maximum offset of the restored matches
+ */
+void apultra_restore_block_matches(apultra_matchfinder *pMatchfinder,
+    const apultra_saved_matches *pSaved,
+    const unsigned char *pInWindow,
+    const int nStartOffset,
+    const int nEndOffset,
+    const int nMatchesPerIndex,
+    const int nMaxOffset);
+
+/**
+ * Clean up saved matches and free up any associated resources
+ *
+ * @param pSaved saved matches to clean up
+ */
+void apultra_saved_matches_destroy(apultra_saved_matches *pSaved);
+
+/**
+ * Initialize saved matches
+ *
+ * @param pSaved saved matches to initialize
+ * @param nBlockSize maximum size of input data (bytes to compress only)
+ *
+ * @return 0 for success, non-zero for failure
+ */
+int apultra_saved_matches_init(apultra_saved_matches *pSaved, const int nBlockSize);
+
 /**
  * Clean up matchfinder context and free up any associated resources
  *
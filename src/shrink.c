@@ -37,6 +37,8 @@
 #include "matchfinder.h"
 #include "format.h"
 #include "shrink.h"
+#include "timer.h"
+#include "thread.h"
 
 #define TOKEN_CODE_LARGE_MATCH 2 /* 10 */
 #define TOKEN_SIZE_LARGE_MATCH 2
@@ -71,11 +73,13 @@ static char _gamma2_size[256] = {
 /**
  * Write bitpacked value to output (compressed) buffer
  *
+ * Bits are packed into the current tag byte as many at a time as it has room for, rather than one by one.
+ *
  * @param pOutData pointer to output buffer
  * @param nOutOffset current write index into output buffer
  * @param nMaxOutDataSize maximum size of output buffer, in bytes
  * @param nValue value to write
- * @param nBits number of least significant bits to write in value
+ * @param nBits number of least significant bits to write in value (0..64)
  * @param nCurBitsOffset write index into output buffer, of current byte being filled with bits
  * @param nCurBitShift bit shift count
  *
@@ -84,35 +88,88 @@ static char _gamma2_size[256] = {
 static int apultra_write_bits(unsigned char *pOutData,
     int nOutOffset,
     const int nMaxOutDataSize,
-    const int nValue,
-    const int nBits,
+    const unsigned long long nValue,
+    int nBits,
     int *nCurBitsOffset,
     int *nCurBitShift) {
-    int i;
+    int nBitsOffset = *nCurBitsOffset;
+    int nBitShift = *nCurBitShift;
 
     if (nOutOffset < 0) return -1;
 
-    for (i = nBits - 1; i >= 0; i--) {
-        if ((*nCurBitsOffset) == INT_MIN) {
+    while (nBits > 0) {
+        int nChunkBits;
+
+        if (nBitsOffset == INT_MIN) {
             /* Allocate a new byte in the stream to pack bits in */
             if (nOutOffset >= nMaxOutDataSize) return -1;
-            (*nCurBitsOffset) = nOutOffset;
-            (*nCurBitShift) = 7;
+            nBitsOffset = nOutOffset;
+            nBitShift = 7;
             pOutData[nOutOffset++] = 0;
         }
 
-        pOutData[(*nCurBitsOffset)] |= ((nValue >> i) & 1) << (*nCurBitShift);
+        /* Write as many of the most significant remaining bits as fit in the current byte */
+        nChunkBits = nBitShift + 1;
+        if (nChunkBits > nBits) nChunkBits = nBits;
+        nBits -= nChunkBits;
+        nBitShift -= nChunkBits;
+
+        pOutData[nBitsOffset] |= (unsigned char)(((nValue >> nBits) & ((1U << nChunkBits) - 1)) << (nBitShift + 1));
 
-        (*nCurBitShift)--;
-        if ((*nCurBitShift) == -1) {
+        if (nBitShift == -1) {
             /* Current byte is full */
-            (*nCurBitsOffset) = INT_MIN;
+            nBitsOffset = INT_MIN;
         }
     }
 
+    *nCurBitsOffset = nBitsOffset;
+    *nCurBitShift = nBitShift;
     return nOutOffset;
 }
 
+/**
+ * Get index of the highest set bit in a non-zero value
+ *
+ * @param nValue value to evaluate (must be non-zero)
+ *
+ * @return index of highest set bit (0..31)
+ */
+static inline int apultra_get_highest_bit(const unsigned int nValue) {
+#if defined(_MSC_VER)
+    unsigned long nIndex;
+    _BitScanReverse(&nIndex, nValue);
+    return (int)nIndex;
+#elif defined(__GNUC__) || defined(__clang__)
+    return 31 - __builtin_clz(nValue);
+#else
+    unsigned int nShiftedValue = nValue;
+    int n = 0;
+    CountShift(nShiftedValue, 16);
+    CountShift(nShiftedValue, 8);
+    CountShift(nShiftedValue, 4);
+    CountShift(nShiftedValue, 2);
+    CountShift(nShiftedValue, 1);
+    return n;
+#endif
+}
+
+/**
+ * Spread the low 32 bits of a value so that bit n moves to bit 2n
+ *
+ * @param nValue value to spread
+ *
+ * @return spread value
+ */
+static inline unsigned long long apultra_spread_bits(unsigned long long nValue) {
+    nValue &= 0xffffffffULL;
+    nValue = (nValue | (nValue << 16)) & 0x0000ffff0000ffffULL;
+    nValue = (nValue | (nValue << 8)) & 0x00ff00ff00ff00ffULL;
+    nValue = (nValue | (nValue << 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    nValue = (nValue | (nValue << 2)) & 0x3333333333333333ULL;
+    nValue = (nValue | (nValue << 1)) & 0x5555555555555555ULL;
+    return nValue;
+}
+
 /**
  * Get size of gamma2 encoded value
  *
@@ -138,6 +195,9 @@ static int apultra_get_gamma2_size(int nValue) {
 /**
  * Write gamma2 encoded value to output (compressed) buffer
  *
+ * The code is built in one go: each data bit below the most significant one is followed by a continuation bit, which
+ * is 1 for all pairs but the last one.
+ *
  * @param pOutData pointer to output buffer
  * @param nOutOffset current write index into output buffer
  * @param nMaxOutDataSize maximum size of output buffer, in bytes
@@ -153,21 +213,13 @@ static int apultra_write_gamma2_value(unsigned char *pOutData,
     int nValue,
     int *nCurBitsOffset,
     int *nCurBitShift) {
-    int msb = 30;
-    while ((nValue >> msb--) == 0)
-        ;
-
-    while (msb > 0) {
-        int bit = (nValue >> msb) & 1;
-
-        nOutOffset = apultra_write_bits(pOutData, nOutOffset, nMaxOutDataSize, bit, 1, nCurBitsOffset, nCurBitShift);
-        msb--;
-        nOutOffset = apultra_write_bits(pOutData, nOutOffset, nMaxOutDataSize, 1, 1, nCurBitsOffset, nCurBitShift);
-    }
+    const int nDataBits = apultra_get_highest_bit((unsigned int)nValue);
+    const unsigned int nDataMask = (1U << nDataBits) - 1;
+    const unsigned long long nCode =
+        (apultra_spread_bits(nValue & nDataMask) << 1) | apultra_spread_bits(nDataMask & ~1U);
 
-    nOutOffset = apultra_write_bits(pOutData, nOutOffset, nMaxOutDataSize, nValue & 1, 1, nCurBitsOffset, nCurBitShift);
-    nOutOffset = apultra_write_bits(pOutData, nOutOffset, nMaxOutDataSize, 0, 1, nCurBitsOffset, nCurBitShift);
-    return nOutOffset;
+    return apultra_write_bits(
+        pOutData, nOutOffset, nMaxOutDataSize, nCode, nDataBits << 1, nCurBitsOffset, nCurBitShift);
 }
 
 /**
@@ -211,641 +263,132 @@ static inline int apultra_get_match_varlen_size(int nLength, const int nMatchOff
     }
 }
 
-/**
- * Insert forward rep candidate
- *
- * @param pCompressor compression context
- * @param pInWindow pointer to input data window (previously compressed bytes + bytes to compress)
- * @param i input data window position whose matches are being considered
- * @param nMatchOffset match offset to use as rep candidate
- * @param nStartOffset current offset in input window (typically the number of previously compressed bytes)
- * @param nEndOffset offset to end finding matches at (typically the size of the total input window in bytes
- * @param nArrivalsPerPosition maximum number of arrivals per input buffer position
- * @param nDepth current insertion depth
- */
-static void apultra_insert_forward_match(apultra_compressor *pCompressor,
-    const unsigned char *pInWindow,
-    const int i,
-    const int nMatchOffset,
-    const int nStartOffset,
-    const int nEndOffset,
-    const int nArrivalsPerPosition,
-    int nDepth) {
-    const apultra_arrival *arrival = pCompressor->arrival + ((i - nStartOffset) * nArrivalsPerPosition);
-    const apultra_matchfinder matchfinder = pCompressor->matchfinder;
-    const int *rle_len = (int *)matchfinder.intervals /* reuse */;
-    int *visited = ((int *)matchfinder.pos_data) - nStartOffset /* reuse */;
-    int j;
-
-    for (j = 0; j < nArrivalsPerPosition && arrival[j].from_slot; j++) {
-        if (arrival[j].follows_literal) {
-            int nRepOffset = arrival[j].rep_offset;
-
-            if (nMatchOffset != nRepOffset && nRepOffset) {
-                int nRepPos = arrival[j].rep_pos;
-
-                if (nRepPos >= nStartOffset && nRepPos < nEndOffset && visited[nRepPos] != nMatchOffset) {
-
-                    visited[nRepPos] = nMatchOffset;
-
-                    if (nRepPos >= nMatchOffset
-                        && matchfinder
-                                   .match[((nRepPos - nStartOffset) << MATCHES_PER_INDEX_SHIFT) + NMATCHES_PER_INDEX
-                                          - 1]
-                                   .length
-                               == 0) {
-                        const unsigned char *pInWindowAtRepOffset = pInWindow + nRepPos;
-
-                        if (pInWindowAtRepOffset[0] == pInWindowAtRepOffset[-nMatchOffset]) {
-                            int nLen0 = rle_len[nRepPos - nMatchOffset];
-                            int nLen1 = rle_len[nRepPos];
-                            int nMinLen = (nLen0 < nLen1) ? nLen0 : nLen1;
-
-                            int nMaxRepLen = nEndOffset - nRepPos;
-                            if (nMaxRepLen > LCP_MAX) nMaxRepLen = LCP_MAX;
-
-                            if (nMinLen > nMaxRepLen) nMinLen = nMaxRepLen;
-
-                            const unsigned char *pInWindowMax = pInWindowAtRepOffset + nMaxRepLen;
-                            pInWindowAtRepOffset += nMinLen;
-
-                            while ((pInWindowAtRepOffset + 8) < pInWindowMax
-                                   && !memcmp(pInWindowAtRepOffset, pInWindowAtRepOffset - nMatchOffset, 8))
-                                pInWindowAtRepOffset += 8;
-                            while ((pInWindowAtRepOffset + 4) < pInWindowMax
-                                   && !memcmp(pInWindowAtRepOffset, pInWindowAtRepOffset - nMatchOffset, 4))
-                                pInWindowAtRepOffset += 4;
-                            while (pInWindowAtRepOffset < pInWindowMax
-                                   && pInWindowAtRepOffset[0] == pInWindowAtRepOffset[-nMatchOffset])
-                                pInWindowAtRepOffset++;
-
-                            int nCurRepLen = (int)(pInWindowAtRepOffset - (pInWindow + nRepPos));
-
-                            if (nCurRepLen >= 2) {
-                                apultra_match *fwd_match =
-                                    matchfinder.match + ((nRepPos - nStartOffset) << MATCHES_PER_INDEX_SHIFT);
-                                unsigned short *fwd_depth =
-                                    matchfinder.match_depth + ((nRepPos - nStartOffset) << MATCHES_PER_INDEX_SHIFT);
-                                int r;
-
-                                for (r = 0; fwd_match[r].length >= MIN_MATCH_SIZE; r++) {
-                                    if (fwd_match[r].offset == nMatchOffset && (fwd_depth[r] & 0x3fff) == 0) {
-                                        if ((int)fwd_match[r].length < nCurRepLen) {
-                                            fwd_match[r].length = nCurRepLen;
-                                            fwd_depth[r] = 0;
-                                        }
-                                        r = NMATCHES_PER_INDEX;
-                                        break;
-                                    }
-                                }
+#if ARRIVALS_RING_SIZE <= (LCP_MAX + ARRIVALS_CLEAR_ROWS + 1)
+#error "ARRIVALS_RING_SIZE must hold the rows reachable by the longest match, plus the rows reset ahead"
+#endif
 
-                                if (r < NMATCHES_PER_INDEX) {
-                                    fwd_match[r].offset = nMatchOffset;
-                                    fwd_match[r].length = nCurRepLen;
-                                    fwd_depth[r] = 0;
-
-                                    if (nDepth < 9)
-                                        apultra_insert_forward_match(pCompressor,
-                                            pInWindow,
-                                            nRepPos,
-                                            nMatchOffset,
-                                            nStartOffset,
-                                            nEndOffset,
-                                            nArrivalsPerPosition,
-                                            nDepth + 1);
-                                }
-                            }
-                        }
-                    }
-                }
-            }
-        }
-    }
-}
+/* Forward optimizer instances, one per supported number of arrivals; apultra_compressor_init() picks one */
+#define APULTRA_FORWARD_FN_PASTE(name, arrivals) name##_##arrivals
+#define APULTRA_FORWARD_FN_EXPAND(name, arrivals) APULTRA_FORWARD_FN_PASTE(name, arrivals)
+#define APULTRA_FORWARD_FN(name) APULTRA_FORWARD_FN_EXPAND(name, NARRIVALS_PER_POSITION)
+
+#define NARRIVALS_PER_POSITION NARRIVALS_PER_POSITION_SMALL
+#include "shrinkforward.h"
+
+#define NARRIVALS_PER_POSITION NARRIVALS_PER_POSITION_NORMAL
+#include "shrinkforward.h"
+
+#define NARRIVALS_PER_POSITION NARRIVALS_PER_POSITION_MAX
+#include "shrinkforward.h"
 
 /**
- * Attempt to pick optimal matches, so as to produce the smallest possible output that decompresses to the same input
+ * Check whether a token that the reduction pass left alone can be skipped, as nothing it looks at changed since
  *
- * @param pCompressor compression context
- * @param pInWindow pointer to input data window (previously compressed bytes + bytes to compress)
- * @param nStartOffset current offset in input window (typically the number of previously compressed bytes)
+ * @param pBestMatch optimal matches being reduced
+ * @param nModStamp stamp of the last change to each entry of pBestMatch
+ * @param i input data window position of the token
+ * @param nEvalStamp stamp at the time the token was last left alone
  * @param nEndOffset offset to end finding matches at (typically the size of the total input window in bytes
- * @param nInsertForwardReps non-zero to insert forward repmatch candidates, zero to use the previously inserted
- * candidates
- * @param nCurRepMatchOffset starting rep offset for this block
- * @param nBlockFlags bit 0: 1 for first block, 0 otherwise; bit 1: 1 for last block, 0 otherwise
- * @param nArrivalsPerPosition maximum number of arrivals per input buffer position
+ *
+ * @return non-zero if the token and the ones that decide what happens to it are unchanged, 0 if it must be looked at
  */
-static void apultra_optimize_forward(apultra_compressor *pCompressor,
-    const unsigned char *pInWindow,
-    const int nStartOffset,
-    const int nEndOffset,
-    const int nInsertForwardReps,
-    const int *nCurRepMatchOffset,
-    const int nBlockFlags,
-    const int nArrivalsPerPosition) {
-    apultra_arrival *arrival = pCompressor->arrival - (nStartOffset * nArrivalsPerPosition);
-    const apultra_matchfinder matchfinder = pCompressor->matchfinder;
-    const int *rle_len = (int *)matchfinder.intervals /* reuse */;
-    int *visited = ((int *)matchfinder.pos_data) - nStartOffset /* reuse */;
-    int i, j, n;
-
-    if ((nEndOffset - nStartOffset) > pCompressor->block_size) return;
-
-    memset(arrival + (nStartOffset * nArrivalsPerPosition),
-        0,
-        sizeof(apultra_arrival) * ((nEndOffset - nStartOffset + 1) * nArrivalsPerPosition));
+static int apultra_is_token_unchanged(const apultra_final_match *pBestMatch,
+    const int *nModStamp,
+    const int i,
+    const int nEvalStamp,
+    const int nEndOffset) {
+    int nIndex;
 
-    arrival[nStartOffset * nArrivalsPerPosition].from_slot = -1;
-    arrival[nStartOffset * nArrivalsPerPosition].rep_offset = *nCurRepMatchOffset;
+    if (nModStamp[i] > nEvalStamp) return 0;
 
-    for (i = (nStartOffset * nArrivalsPerPosition); i != ((nEndOffset + 1) * nArrivalsPerPosition); i++) {
-        arrival[i].cost = 0x40000000;
+    if (pBestMatch[i].length < 2) {
+        /* Literals and 4 bits matches only look at the next token, to merge with it */
+        return ((i + 1) >= nEndOffset || nModStamp[i + 1] <= nEvalStamp);
     }
 
-    if (nInsertForwardReps) { memset(visited + nStartOffset, 0, (nEndOffset - nStartOffset) * sizeof(int)); }
-
-    for (i = nStartOffset; i != nEndOffset; i++) {
-        apultra_arrival *cur_arrival = &arrival[i * nArrivalsPerPosition];
-        int m;
-
-        const unsigned char nMatch1Offs = matchfinder.match1[i - nStartOffset];
-        int nShortOffset;
-        int nShortLen;
-        int nLiteralScore;
-        int nLiteralCost;
-
-        if ((pInWindow[i] != 0 && nMatch1Offs == 0) || (i == nStartOffset && (nBlockFlags & 1))) {
-            nShortOffset = 0;
-            nShortLen = 0;
-            nLiteralCost = 9 /* literal bit + literal byte */;
-        } else {
-            nShortOffset = (pInWindow[i] == 0) ? 0 : nMatch1Offs;
-            nShortLen = 1;
-            nLiteralCost = 4 + TOKEN_SIZE_4BIT_MATCH /* command and offset cost; no length cost */;
-        }
-
-        nLiteralScore = nShortOffset ? 3 : 1;
-
-        if (cur_arrival[nArrivalsPerPosition].from_slot) {
-            for (j = 0; j < nArrivalsPerPosition && cur_arrival[j].from_slot; j++) {
-                int nPrevCost = cur_arrival[j].cost & 0x3fffffff;
-                int nCodingChoiceCost = nPrevCost + nLiteralCost;
-                int nScore = cur_arrival[j].score + nLiteralScore;
-
-                apultra_arrival *pDestSlots = &cur_arrival[nArrivalsPerPosition];
-                if (nCodingChoiceCost < pDestSlots[nArrivalsPerPosition - 1].cost
-                    || (nCodingChoiceCost == pDestSlots[nArrivalsPerPosition - 1].cost
-                        && nScore < pDestSlots[nArrivalsPerPosition - 1].score)) {
-                    int nRepOffset = cur_arrival[j].rep_offset;
-                    int exists = 0;
-
-                    for (n = 0; n < nArrivalsPerPosition && pDestSlots[n].cost < nCodingChoiceCost; n++) {
-                        if (pDestSlots[n].rep_offset == nRepOffset) {
-                            exists = 1;
-                            break;
-                        }
-                    }
-
-                    if (!exists) {
-                        for (; n < nArrivalsPerPosition && pDestSlots[n].cost == nCodingChoiceCost
-                               && nScore >= pDestSlots[n].score;
-                             n++) {
-                            if (pDestSlots[n].rep_offset == nRepOffset) {
-                                exists = 1;
-                                break;
-                            }
-                        }
-
-                        if (!exists) {
-                            if (n < nArrivalsPerPosition) {
-                                int nn;
-
-                                for (nn = n; nn < nArrivalsPerPosition && pDestSlots[nn].cost == nCodingChoiceCost;
-                                     nn++) {
-                                    if (pDestSlots[nn].rep_offset == nRepOffset) {
-                                        exists = 1;
-                                        break;
-                                    }
-                                }
-
-                                if (!exists) {
-                                    int z;
-
-                                    for (z = n; z < nArrivalsPerPosition - 1 && pDestSlots[z].from_slot; z++) {
-                                        if (pDestSlots[z].rep_offset == nRepOffset) break;
-                                    }
-
-                                    apultra_arrival *pDestArrival = &pDestSlots[n];
-                                    memmove(&pDestSlots[n + 1], &pDestSlots[n], sizeof(apultra_arrival) * (z - n));
-
-                                    pDestArrival->cost = nCodingChoiceCost;
-                                    pDestArrival->from_pos = i;
-                                    pDestArrival->from_slot = j + 1;
-                                    pDestArrival->follows_literal = 1;
-                                    pDestArrival->rep_offset = nRepOffset;
-                                    pDestArrival->short_offset = nShortOffset;
-                                    pDestArrival->rep_pos = cur_arrival[j].rep_pos;
-                                    pDestArrival->match_len = nShortLen;
-                                    pDestArrival->score = nScore;
-                                }
-                            }
-                        }
-                    }
-                }
-            }
-        } else {
-            for (j = 0; j < nArrivalsPerPosition && cur_arrival[j].from_slot; j++) {
-                int nPrevCost = cur_arrival[j].cost & 0x3fffffff;
-                int nCodingChoiceCost = nPrevCost + nLiteralCost;
-                int nScore = cur_arrival[j].score + nLiteralScore;
-
-                apultra_arrival *pDestArrival = &cur_arrival[nArrivalsPerPosition + j];
-
-                pDestArrival->cost = nCodingChoiceCost;
-                pDestArrival->from_pos = i;
-                pDestArrival->from_slot = j + 1;
-                pDestArrival->follows_literal = 1;
-                pDestArrival->rep_offset = cur_arrival[j].rep_offset;
-                pDestArrival->short_offset = nShortOffset;
-                pDestArrival->rep_pos = cur_arrival[j].rep_pos;
-                pDestArrival->match_len = nShortLen;
-                pDestArrival->score = nScore;
-            }
-        }
-
-        if (i == nStartOffset && (nBlockFlags & 1)) continue;
-
-        const apultra_match *match = matchfinder.match + ((i - nStartOffset) << MATCHES_PER_INDEX_SHIFT);
-        const unsigned short *match_depth = matchfinder.match_depth + ((i - nStartOffset) << MATCHES_PER_INDEX_SHIFT);
-        int nNumArrivalsForThisPos = j, nOverallMinRepLen = 0, nOverallMaxRepLen = 0;
-
-        int nRepLenForArrival[NARRIVALS_PER_POSITION_MAX];
-        memset(nRepLenForArrival, 0, nArrivalsPerPosition * sizeof(int));
-
-        int nRepMatchArrivalIdx[NARRIVALS_PER_POSITION_MAX + 1];
-        int nNumRepMatchArrivals = 0;
-
-        int nMaxRepLenForPos = nEndOffset - i;
-        if (nMaxRepLenForPos > LCP_MAX) nMaxRepLenForPos = LCP_MAX;
-        const unsigned char *pInWindowStart = pInWindow + i;
-        const unsigned char *pInWindowMax = pInWindowStart + nMaxRepLenForPos;
-        const int nLen1 = rle_len[i];
-
-        for (j = 0; j < nNumArrivalsForThisPos && (i + 2) <= nEndOffset; j++) {
-            if (cur_arrival[j].follows_literal) {
-                int nRepOffset = cur_arrival[j].rep_offset;
-
-                if (nRepOffset && i >= nRepOffset) {
-                    if (pInWindowStart[0] == pInWindowStart[-nRepOffset]) {
-                        int nLen0 = rle_len[i - nRepOffset];
-                        int nMinLen = (nLen0 < nLen1) ? nLen0 : nLen1;
-
-                        if (nMinLen > nMaxRepLenForPos) nMinLen = nMaxRepLenForPos;
-
-                        const unsigned char *pInWindowAtRepOffset = pInWindowStart + nMinLen;
-                        while ((pInWindowAtRepOffset + 8) < pInWindowMax
-                               && !memcmp(pInWindowAtRepOffset, pInWindowAtRepOffset - nRepOffset, 8))
-                            pInWindowAtRepOffset += 8;
-                        while ((pInWindowAtRepOffset + 4) < pInWindowMax
-                               && !memcmp(pInWindowAtRepOffset, pInWindowAtRepOffset - nRepOffset, 4))
-                            pInWindowAtRepOffset += 4;
-                        while (pInWindowAtRepOffset < pInWindowMax
-                               && pInWindowAtRepOffset[0] == pInWindowAtRepOffset[-nRepOffset])
-                            pInWindowAtRepOffset++;
-
-                        int nCurMaxLen = (int)(pInWindowAtRepOffset - pInWindowStart);
-
-                        if (nCurMaxLen >= 2) {
-                            nRepLenForArrival[j] = nCurMaxLen;
-                            nRepMatchArrivalIdx[nNumRepMatchArrivals++] = j;
-
-                            if (nOverallMaxRepLen < nCurMaxLen) nOverallMaxRepLen = nCurMaxLen;
-                        }
-                    }
-                }
-            }
-        }
-        nRepMatchArrivalIdx[nNumRepMatchArrivals] = -1;
-
-        for (m = 0; m < NMATCHES_PER_INDEX && match[m].length; m++) {
-            const int nOrigMatchLen = match[m].length;
-            const int nOrigMatchOffset = match[m].offset;
-            const unsigned int nOrigMatchDepth = match_depth[m] & 0x3fff;
-            const int nScorePenalty = 3 + ((match_depth[m] & 0x8000) >> 15);
-            unsigned int d;
-
-            for (d = 0; d <= nOrigMatchDepth; d += (nOrigMatchDepth ? nOrigMatchDepth : 1)) {
-                const int nMatchOffset = nOrigMatchOffset - d;
-                int nMatchLen = nOrigMatchLen - d;
-
-                if ((i + nMatchLen) > nEndOffset) nMatchLen = nEndOffset - i;
-
-                if (nInsertForwardReps) {
-                    apultra_insert_forward_match(
-                        pCompressor, pInWindow, i, nMatchOffset, nStartOffset, nEndOffset, nArrivalsPerPosition, 0);
-                }
-
-                if (nMatchLen >= 2) {
-                    int nStartingMatchLen, nJumpMatchLen, k;
-                    int nNoRepMatchOffsetCostForLit[2], nNoRepMatchOffsetCostDelta;
-                    int nMinMatchLenForOffset;
-                    int nNoRepCostAdjusment = (nMatchLen >= LCP_MAX) ? 1 : 0;
-
-                    if (nMatchOffset < MINMATCH3_OFFSET)
-                        nMinMatchLenForOffset = 2;
-                    else {
-                        if (nMatchOffset < MINMATCH4_OFFSET)
-                            nMinMatchLenForOffset = 3;
-                        else
-                            nMinMatchLenForOffset = 4;
-                    }
-
-                    if (nMatchLen >= LEAVE_ALONE_MATCH_SIZE && i >= nMatchLen)
-                        nStartingMatchLen = nMatchLen;
-                    else
-                        nStartingMatchLen = 2;
-
-                    if ((nBlockFlags & 3) == 3 && nMatchLen > 90 && i >= 90)
-                        nJumpMatchLen = 90;
-                    else
-                        nJumpMatchLen = nMatchLen + 1;
-
-                    if (nStartingMatchLen <= 3 && nMatchOffset < 128) {
-                        nNoRepMatchOffsetCostForLit[0] = 8 + TOKEN_SIZE_7BIT_MATCH;
-                        nNoRepMatchOffsetCostForLit[1] = 8 + TOKEN_SIZE_7BIT_MATCH;
-                    } else {
-                        nNoRepMatchOffsetCostForLit[0] =
-                            8 + TOKEN_SIZE_LARGE_MATCH + apultra_get_gamma2_size((nMatchOffset >> 8) + 2);
-                        nNoRepMatchOffsetCostForLit[1] =
-                            8 + TOKEN_SIZE_LARGE_MATCH + apultra_get_gamma2_size((nMatchOffset >> 8) + 3);
-                    }
-                    nNoRepMatchOffsetCostDelta = nNoRepMatchOffsetCostForLit[1] - nNoRepMatchOffsetCostForLit[0];
-
-                    for (k = nStartingMatchLen; k <= nMatchLen; k++) {
-                        int nRepMatchMatchLenCost = apultra_get_gamma2_size(k);
-                        apultra_arrival *pDestSlots = &cur_arrival[k * nArrivalsPerPosition];
-
-                        /* Insert non-repmatch candidate */
-
-                        if (k >= nMinMatchLenForOffset) {
-                            int nNoRepMatchMatchLenCost;
-
-                            if (k <= 3 && nMatchOffset < 128)
-                                nNoRepMatchMatchLenCost = 0;
-                            else {
-                                if (nMatchOffset < 128 || nMatchOffset >= MINMATCH4_OFFSET)
-                                    nNoRepMatchMatchLenCost = apultra_get_gamma2_size(k - 2);
-                                else if (nMatchOffset < MINMATCH3_OFFSET)
-                                    nNoRepMatchMatchLenCost = nRepMatchMatchLenCost;
-                                else
-                                    nNoRepMatchMatchLenCost = apultra_get_gamma2_size(k - 1);
-                            }
-
-                            for (j = 0; j < nNumArrivalsForThisPos; j++) {
-                                if (nMatchOffset != cur_arrival[j].rep_offset || cur_arrival[j].follows_literal == 0) {
-                                    int nPrevCost = cur_arrival[j].cost & 0x3fffffff;
-                                    int nMatchCmdCost = nNoRepMatchMatchLenCost
-                                                        + nNoRepMatchOffsetCostForLit[cur_arrival[j].follows_literal];
-                                    int nCodingChoiceCost = nPrevCost + nMatchCmdCost;
-
-                                    if (nCodingChoiceCost <= (pDestSlots[nArrivalsPerPosition - 1].cost + 1)) {
-                                        int nScore = cur_arrival[j].score + nScorePenalty;
-
-                                        if (nCodingChoiceCost < pDestSlots[nArrivalsPerPosition - 2].cost
-                                            || (nCodingChoiceCost == pDestSlots[nArrivalsPerPosition - 2].cost
-                                                && nScore < pDestSlots[nArrivalsPerPosition - 2].score)) {
-                                            int exists = 0;
-
-                                            for (n = 0;
-                                                 n < nArrivalsPerPosition && pDestSlots[n].cost < nCodingChoiceCost;
-                                                 n++) {
-                                                if (pDestSlots[n].rep_offset == nMatchOffset) {
-                                                    exists = 1;
-                                                    break;
-                                                }
-                                            }
-
-                                            if (!exists) {
-                                                int nRevisedCodingChoiceCost = nCodingChoiceCost - nNoRepCostAdjusment;
-
-                                                for (; n < nArrivalsPerPosition - 1
-                                                       && pDestSlots[n].cost == nRevisedCodingChoiceCost
-                                                       && nScore >= pDestSlots[n].score;
-                                                     n++) {
-                                                    if (pDestSlots[n].rep_offset == nMatchOffset) {
-                                                        exists = 1;
-                                                        break;
-                                                    }
-                                                }
-
-                                                if (!exists) {
-                                                    if (n < nArrivalsPerPosition - 1) {
-                                                        int nn;
-
-                                                        for (nn = n; nn < nArrivalsPerPosition
-                                                                     && pDestSlots[nn].cost == nCodingChoiceCost;
-                                                             nn++) {
-                                                            if (pDestSlots[nn].rep_offset == nMatchOffset) {
-                                                                exists = 1;
-                                                                break;
-                                                            }
-                                                        }
-
-                                                        if (!exists) {
-                                                            int z;
-
-                                                            for (z = n; z < nArrivalsPerPosition - 1
-                                                                        && pDestSlots[z].from_slot;
-                                                                 z++) {
-                                                                if (pDestSlots[z].rep_offset == nMatchOffset) break;
-                                                            }
-
-                                                            apultra_arrival *pDestArrival = &pDestSlots[n];
-                                                            memmove(&pDestSlots[n + 1],
-                                                                &pDestSlots[n],
-                                                                sizeof(apultra_arrival) * (z - n));
-
-                                                            pDestArrival->cost = nRevisedCodingChoiceCost;
-                                                            pDestArrival->from_pos = i;
-                                                            pDestArrival->from_slot = j + 1;
-                                                            pDestArrival->follows_literal = 0;
-                                                            pDestArrival->rep_offset = nMatchOffset;
-                                                            pDestArrival->short_offset = 0;
-                                                            pDestArrival->rep_pos = i;
-                                                            pDestArrival->match_len = k;
-                                                            pDestArrival->score = nScore;
-                                                        }
-                                                    }
-                                                }
-                                            } else {
-                                                if ((nCodingChoiceCost - pDestSlots[n].cost)
-                                                    >= nNoRepMatchOffsetCostDelta)
-                                                    break;
-                                            }
-                                        }
-                                        if (cur_arrival[j].follows_literal == 0 || nNoRepMatchOffsetCostDelta == 0)
-                                            break;
-                                    } else {
-                                        break;
-                                    }
-                                }
-                            }
-                        }
-
-                        /* Insert repmatch candidate */
-
-                        if (k > nOverallMinRepLen && k <= nOverallMaxRepLen) {
-                            int nRepMatchCmdCost =
-                                TOKEN_SIZE_LARGE_MATCH + 2 /* apultra_get_gamma2_size(2) */ + nRepMatchMatchLenCost;
-                            int nCurRepMatchArrival;
-
-                            if (k <= 90)
-                                nOverallMinRepLen = k;
-                            else if (nOverallMaxRepLen == k)
-                                nOverallMaxRepLen--;
-
-                            for (nCurRepMatchArrival = 0; (j = nRepMatchArrivalIdx[nCurRepMatchArrival]) >= 0;
-                                 nCurRepMatchArrival++) {
-                                if (nRepLenForArrival[j] >= k) {
-                                    int nPrevCost = cur_arrival[j].cost & 0x3fffffff;
-                                    int nRepCodingChoiceCost = nPrevCost + nRepMatchCmdCost;
-                                    int nScore = cur_arrival[j].score + 2;
-
-                                    if (nRepCodingChoiceCost < pDestSlots[nArrivalsPerPosition - 1].cost
-                                        || (nRepCodingChoiceCost == pDestSlots[nArrivalsPerPosition - 1].cost
-                                            && nScore < pDestSlots[nArrivalsPerPosition - 1].score)) {
-                                        int nRepOffset = cur_arrival[j].rep_offset;
-                                        int exists = 0;
-
-                                        for (n = 0;
-                                             n < nArrivalsPerPosition && pDestSlots[n].cost < nRepCodingChoiceCost;
-                                             n++) {
-                                            if (pDestSlots[n].rep_offset == nRepOffset) {
-                                                exists = 1;
-                                                break;
-                                            }
-                                        }
-
-                                        if (!exists) {
-                                            for (;
-                                                 n < nArrivalsPerPosition && pDestSlots[n].cost == nRepCodingChoiceCost
-                                                 && nScore >= pDestSlots[n].score;
-                                                 n++) {
-                                                if (pDestSlots[n].rep_offset == nRepOffset) {
-                                                    exists = 1;
-                                                    break;
-                                                }
-                                            }
-
-                                            if (!exists) {
-                                                if (n < nArrivalsPerPosition) {
-                                                    int nn;
-
-                                                    for (nn = n; nn < nArrivalsPerPosition
-                                                                 && pDestSlots[nn].cost == nRepCodingChoiceCost;
-                                                         nn++) {
-                                                        if (pDestSlots[nn].rep_offset == nRepOffset) {
-                                                            exists = 1;
-                                                            break;
-                                                        }
-                                                    }
-
-                                                    if (!exists) {
-                                                        int z;
-
-                                                        for (z = n;
-                                                             z < nArrivalsPerPosition - 1 && pDestSlots[z].from_slot;
-                                                             z++) {
-                                                            if (pDestSlots[z].rep_offset == nRepOffset) break;
-                                                        }
-
-                                                        apultra_arrival *pDestArrival = &pDestSlots[n];
-                                                        memmove(&pDestSlots[n + 1],
-                                                            &pDestSlots[n],
-                                                            sizeof(apultra_arrival) * (z - n));
-
-                                                        pDestArrival->cost = nRepCodingChoiceCost;
-                                                        pDestArrival->from_pos = i;
-                                                        pDestArrival->from_slot = j + 1;
-                                                        pDestArrival->follows_literal = 0;
-                                                        pDestArrival->rep_offset = nRepOffset;
-                                                        pDestArrival->short_offset = 0;
-                                                        pDestArrival->rep_pos = i;
-                                                        pDestArrival->match_len = k;
-                                                        pDestArrival->score = nScore;
-                                                    }
-                                                }
-                                            }
-                                        }
-                                    } else {
-                                        break;
-                                    }
-                                }
-                            }
-                        }
-
-                        if (k == 3 && nMatchOffset < 128) {
-                            nNoRepMatchOffsetCostForLit[0] =
-                                8 + TOKEN_SIZE_LARGE_MATCH + 2 /* apultra_get_gamma2_size((nMatchOffset >> 8) + 2) */;
-                            nNoRepMatchOffsetCostForLit[1] =
-                                8 + TOKEN_SIZE_LARGE_MATCH + 2 /* apultra_get_gamma2_size((nMatchOffset >> 8) + 3) */;
-                        }
-
-                        if (k == nJumpMatchLen) k = nMatchLen - 1;
-                    }
-                }
-
-                if (nOrigMatchLen >= 512) break;
-            }
-        }
+    /* Matches look at the literals and match that follow, and at the ones after that match if it may be joined */
+    nIndex = i + pBestMatch[i].length;
+    while (nIndex < nEndOffset) {
+        if (nModStamp[nIndex] > nEvalStamp) return 0;
+        if (pBestMatch[nIndex].length >= 2) break;
+        nIndex++;
     }
 
-    if (!nInsertForwardReps) {
-        const apultra_arrival *end_arrival = &arrival[(i * nArrivalsPerPosition) + 0];
-        apultra_final_match *pBestMatch = pCompressor->best_match - nStartOffset;
-
-        while (end_arrival->from_slot > 0 && end_arrival->from_pos >= 0 && (int)end_arrival->from_pos < nEndOffset) {
-            pBestMatch[end_arrival->from_pos].length = end_arrival->match_len;
-            if (end_arrival->match_len >= 2)
-                pBestMatch[end_arrival->from_pos].offset = end_arrival->rep_offset;
-            else
-                pBestMatch[end_arrival->from_pos].offset = end_arrival->short_offset;
-
-            end_arrival = &arrival[(end_arrival->from_pos * nArrivalsPerPosition) + (end_arrival->from_slot - 1)];
+    if (nIndex < nEndOffset && nIndex == (i + pBestMatch[i].length)) {
+        nIndex += pBestMatch[nIndex].length;
+        while (nIndex < nEndOffset) {
+            if (nModStamp[nIndex] > nEvalStamp) return 0;
+            if (pBestMatch[nIndex].length >= 2) break;
+            nIndex++;
         }
     }
+
+    return 1;
 }
 
 /**
  * Attempt to replace matches by literals when it makes the final bitstream smaller, and merge large matches
  *
+ * Tokens that were left alone by a previous pass are only looked at again if their state or one of the tokens that
+ * decide what happens to them has changed since, so that passes after the first one only revisit the changed regions.
+ *
+ * @param pStats compression statistics
  * @param pMatchfinder matchfinder context
  * @param pInWindow pointer to input data window (previously compressed bytes + bytes to compress)
  * @param pBestMatch optimal matches to evaluate and update
  * @param nStartOffset current offset in input window (typically the number of previously compressed bytes)
  * @param nEndOffset offset to end finding matches at (typically the size of the total input window in bytes
  * @param nCurRepMatchOffset starting rep offset for this block
- * @param nBlockFlags bit 0: 1 for first block, 0 otherwise; bit 1: 1 for last block, 0 otherwise
+ * @param nBlockFlags bit 0: 1 for first block, 0 otherwise; bit 1: 1 for last block, 0 otherwise; bit 2: 1 if the
+ * tokens resume after previous ones of the block, 0 otherwise
+ * @param nPass index of this pass over the block, starting at 0
+ * @param nStamp stamp of the last change made to the block's tokens, updated by this pass
  *
  * @return non-zero if the number of tokens was reduced, 0 if it wasn't
  */
-static int apultra_reduce_commands(apultra_matchfinder *pMatchfinder,
+static int apultra_reduce_commands(apultra_stats *pStats,
+    apultra_matchfinder *pMatchfinder,
     const unsigned char *pInWindow,
     apultra_final_match *pBestMatch,
     const int nStartOffset,
     const int nEndOffset,
     const int *nCurRepMatchOffset,
-    const int nBlockFlags) {
+    const int nBlockFlags,
+    const int nPass,
+    int *nStamp) {
     int i;
     int nRepMatchOffset = *nCurRepMatchOffset;
     int nFollowsLiteral = 0;
     int nDidReduce = 0;
     int nLastMatchLen = 0;
+    int nCurStamp = *nStamp;
     const unsigned char *match1 = pMatchfinder->match1 - nStartOffset;
+    int *nModStamp = (int *)pMatchfinder->intervals /* reuse */;
+    int *nEvalStamp = (int *)pMatchfinder->pos_data /* reuse */;
+    int *nEvalState = ((int *)pMatchfinder->pos_data) + nEndOffset /* reuse */;
 
-    for (i = nStartOffset + ((nBlockFlags & 1) ? 1 : 0); i < nEndOffset;) {
+    for (i = nStartOffset + (((nBlockFlags & 5) == 1) ? 1 : 0); i < nEndOffset;) {
         apultra_final_match *pMatch = pBestMatch + i;
+        const int nTokenState = (nRepMatchOffset << 2) | (nFollowsLiteral << 1) | ((nLastMatchLen >= LCP_MAX) ? 1 : 0);
+        int nLeftAlone = 1;
+
+        if (nEvalState[i] == nTokenState
+            && apultra_is_token_unchanged(pBestMatch, nModStamp, i, nEvalStamp[i], nEndOffset)) {
+            /* This token would be left alone again */
+            if (pMatch->length >= 2) {
+                nRepMatchOffset = pMatch->offset;
+                nFollowsLiteral = 0;
+                nLastMatchLen = pMatch->length;
+                i += pMatch->length;
+            } else {
+                i++;
+                nFollowsLiteral = 1;
+                nLastMatchLen = 0;
+            }
+            continue;
+        }
+
+        if (nPass) pStats->num_reduce_revisits++;
 
         if (pMatch->length <= 1 && (i + 1) < nEndOffset && pBestMatch[i + 1].length >= 2
             && pBestMatch[i + 1].length < MAX_VARLEN && pBestMatch[i + 1].offset && i >= pBestMatch[i + 1].offset
@@ -888,6 +431,8 @@ static int apultra_reduce_commands(apultra_matchfinder *pMatchfinder,
                     pBestMatch[i].offset = pBestMatch[i + 1].offset;
                     pBestMatch[i + 1].length = 0;
                     pBestMatch[i + 1].offset = 0;
+                    nCurStamp++;
+                    nModStamp[i] = nModStamp[i + 1] = nCurStamp;
                     nDidReduce = 1;
                     continue;
                 }
@@ -924,6 +469,9 @@ static int apultra_reduce_commands(apultra_matchfinder *pMatchfinder,
                                 if (nMaxLen >= pMatch->length) {
                                     /* Replace */
                                     pMatch->offset = pBestMatch[nNextIndex].offset;
+                                    nCurStamp++;
+                                    nModStamp[i] = nCurStamp;
+                                    nLeftAlone = 0;
                                     nDidReduce = 1;
                                 } else if (nMaxLen >= 2) {
                                     if ((nFollowsLiteral && nRepMatchOffset == pBestMatch[nNextIndex].offset)
@@ -971,11 +519,14 @@ static int apultra_reduce_commands(apultra_matchfinder *pMatchfinder,
 
                                             pMatch->offset = pBestMatch[nNextIndex].offset;
                                             pMatch->length = nMaxLen;
+                                            nCurStamp++;
+                                            nModStamp[i] = nCurStamp;
 
                                             for (j = nMaxLen; j < nOrigLen; j++) {
                                                 pBestMatch[i + j].offset = match1[i + j];
                                                 pBestMatch[i + j].length =
                                                     (pInWindow[i + j] && match1[i + j] == 0) ? 0 : 1;
+                                                nModStamp[i + j] = nCurStamp;
                                             }
 
                                             nDidReduce = 1;
@@ -1053,9 +604,11 @@ static int apultra_reduce_commands(apultra_matchfinder *pMatchfinder,
                         int nMatchLen = pMatch->length;
                         int j;
 
+                        nCurStamp++;
                         for (j = 0; j < nMatchLen; j++) {
                             pBestMatch[i + j].offset = match1[i + j];
                             pBestMatch[i + j].length = (pInWindow[i + j] && match1[i + j] == 0) ? 0 : 1;
+                            nModStamp[i + j] = nCurStamp;
                         }
 
                         nDidReduce = 1;
@@ -1099,11 +652,16 @@ static int apultra_reduce_commands(apultra_matchfinder *pMatchfinder,
                     pMatch->length += pBestMatch[i + nMatchLen].length;
                     pBestMatch[i + nMatchLen].offset = 0;
                     pBestMatch[i + nMatchLen].length = -1;
+                    nCurStamp++;
+                    nModStamp[i] = nModStamp[i + nMatchLen] = nCurStamp;
                     nDidReduce = 1;
                     continue;
                 }
             }
 
+            nEvalState[i] = nLeftAlone ? nTokenState : -1;
+            nEvalStamp[i] = nCurStamp;
+
             nRepMatchOffset = pMatch->offset;
             nFollowsLiteral = 0;
             nLastMatchLen = pMatch->length;
@@ -1111,12 +669,16 @@ static int apultra_reduce_commands(apultra_matchfinder *pMatchfinder,
             i += pMatch->length;
         } else {
             /* 4 bits offset (1 byte match) or literal */
+            nEvalState[i] = nTokenState;
+            nEvalStamp[i] = nCurStamp;
+
             i++;
             nFollowsLiteral = 1;
             nLastMatchLen = 0;
         }
     }
 
+    *nStamp = nCurStamp;
     return nDidReduce;
 }
 
@@ -1134,7 +696,8 @@ static int apultra_reduce_commands(apultra_matchfinder *pMatchfinder,
  * @param nCurBitShift bit shift count
  * @param nFollowsLiteral non-zero if the next command to be issued follows a literal, 0 if not
  * @param nCurRepMatchOffset starting rep offset for this block, updated after the block is compressed successfully
- * @param nBlockFlags bit 0: 1 for first block, 0 otherwise; bit 1: 1 for last block, 0 otherwise
+ * @param nBlockFlags bit 0: 1 for first block, 0 otherwise; bit 1: 1 for last block, 0 otherwise; bit 2: 1 if the
+ * parse resumes after previous commands of the block, 0 otherwise
  *
  * @return size of compressed data in output buffer, or -1 if the data is uncompressible
  */
@@ -1351,70 +914,294 @@ static int apultra_write_block(apultra_stats *pStats,
 }
 
 /**
- * Select the most optimal matches, reduce the token count if possible, and then emit a block of compressed data
+ * Add time spent in a compression phase to the statistics
  *
  * @param pCompressor compression context
- * @param pInWindow pointer to input data window (previously compressed bytes + bytes to compress)
- * @param nPreviousBlockSize number of previously compressed bytes (or 0 for none)
- * @param nInDataSize number of input bytes to compress
- * @param nCurRepMatchOffset starting rep offset for this block, updated after the block is compressed successfully
- * @param nBlockFlags bit 0: 1 for first block, 0 otherwise; bit 1: 1 for last block, 0 otherwise
+ * @param nPhase phase to add time to (APULTRA_PHASE_xxx)
+ * @param nStartTime time at which the phase started, in nanoseconds
  *
- * @return size of compressed data in output buffer, or -1 if the data is uncompressible
+ * @return current time, in nanoseconds, to be used as the start time of the next phase
  */
-static void apultra_optimize_block(apultra_compressor *pCompressor,
-    const unsigned char *pInWindow,
-    const int nPreviousBlockSize,
-    const int nInDataSize,
-    int *nCurRepMatchOffset,
-    const int nBlockFlags) {
-    const int nEndOffset = nPreviousBlockSize + nInDataSize;
-    const int nArrivalsPerPosition = pCompressor->max_arrivals;
-    const apultra_matchfinder matchfinder = pCompressor->matchfinder;
-    int *rle_len = (int *)matchfinder.intervals /* reuse */;
-    int i, nPosition;
+static long long apultra_add_phase_time(apultra_compressor *pCompressor, const int nPhase, const long long nStartTime) {
+    long long nCurTime = apultra_get_time_ns();
 
-    memset(pCompressor->best_match, 0, pCompressor->block_size * sizeof(apultra_final_match));
+    pCompressor->stats->phase_time[nPhase] += nCurTime - nStartTime;
+    return nCurTime;
+}
 
-    if ((nBlockFlags & 3) == 3) {
-        int *first_offset_for_byte = pCompressor->first_offset_for_byte;
-        int *next_offset_for_pos = pCompressor->next_offset_for_pos;
+/**
+ * Get the state that the next command is written in, after one command
+ *
+ * @param nState rep offset shifted left by one, with bit 0 set if the command follows a literal
+ * @param pMatch command
+ *
+ * @return state for the next command
+ */
+static inline int apultra_get_next_parse_state(const int nState, const apultra_final_match *pMatch) {
+    if (pMatch->length >= 2)
+        return pMatch->offset << 1;
+    else
+        return nState | 1;
+}
 
-        /* Supplement 2 and 3-byte matches */
+/**
+ * Write literals instead of the matches that can only be encoded as rep-matches, where the command before them
+ * changed so that they no longer can be
+ *
+ * @param pParse commands, indexed by offset in the data
+ * @param nStartOffset offset of the first command to check
+ * @param nEndOffset offset to stop checking at
+ * @param nStartState state that the first command is written in (as for apultra_get_next_parse_state())
+ *
+ * @return number of matches that were replaced
+ */
+static int apultra_fix_parse_rep_matches(apultra_final_match *pParse,
+    const int nStartOffset,
+    const int nEndOffset,
+    const int nStartState) {
+    int nState = nStartState;
+    int nNumFixed = 0;
+    int i = nStartOffset;
 
-        memset(first_offset_for_byte, 0xff, sizeof(int) * 65536);
-        memset(next_offset_for_pos, 0xff, sizeof(int) * nInDataSize);
+    while (i < nEndOffset) {
+        apultra_final_match *pMatch = &pParse[i];
 
-        for (nPosition = nPreviousBlockSize; nPosition < (nEndOffset - 1); nPosition++) {
-            next_offset_for_pos[nPosition - nPreviousBlockSize] =
-                first_offset_for_byte[((unsigned int)pInWindow[nPosition])
-                                      | (((unsigned int)pInWindow[nPosition + 1]) << 8)];
-            first_offset_for_byte[((unsigned int)pInWindow[nPosition])
-                                  | (((unsigned int)pInWindow[nPosition + 1]) << 8)] = nPosition;
+        if (pMatch->length >= 2 && (pMatch->offset != (nState >> 1) || !(nState & 1))) {
+            if ((pMatch->offset >= MINMATCH4_OFFSET && pMatch->length < 4)
+                || (pMatch->offset >= MINMATCH3_OFFSET && pMatch->length < 3)) {
+                const int nMatchLen = pMatch->length;
+                int j;
+
+                for (j = 0; j < nMatchLen; j++) {
+                    pParse[i + j].length = 0;
+                    pParse[i + j].offset = 0;
+                }
+                nNumFixed++;
+            }
         }
 
-        for (nPosition = nPreviousBlockSize + 1; nPosition < (nEndOffset - 1); nPosition++) {
-            apultra_match *match = matchfinder.match + ((nPosition - nPreviousBlockSize) << MATCHES_PER_INDEX_SHIFT);
-            unsigned short *match_depth =
-                matchfinder.match_depth + ((nPosition - nPreviousBlockSize) << MATCHES_PER_INDEX_SHIFT);
-            int m = 0, nInserted = 0;
-            int nMatchPos;
+        nState = apultra_get_next_parse_state(nState, pMatch);
+        i += (pMatch->length >= 1) ? pMatch->length : 1;
+    }
 
-            while (m < 15 && match[m].length) m++;
+    return nNumFixed;
+}
 
-            for (nMatchPos = next_offset_for_pos[nPosition - nPreviousBlockSize]; m < 15 && nMatchPos >= 0;
-                 nMatchPos = next_offset_for_pos[nMatchPos - nPreviousBlockSize]) {
-                int nMatchOffset = nPosition - nMatchPos;
+/**
+ * Split a block into segments that the forward optimizer can parse concurrently
+ *
+ * Each segment after the first one starts right after a match that is long enough for the optimizer to always take
+ * it whole, which is where the parses of the two segments almost always meet. The segment then starts with that
+ * match's offset as the rep offset.
+ *
+ * @param pCompressor compression context
+ * @param nStartOffset current offset in input window (typically the number of previously compressed bytes)
+ * @param nEndOffset offset to end finding matches at (typically the size of the total input window in bytes
+ * @param nCurRepMatchOffset starting rep offset for this block
+ * @param nBlockFlags bit 0: 1 for first block, 0 otherwise; bit 1: 1 for last block, 0 otherwise
+ *
+ * @return number of segments
+ */
+static int apultra_find_parse_segments(apultra_compressor *pCompressor,
+    const int nStartOffset,
+    const int nEndOffset,
+    const int nCurRepMatchOffset,
+    const int nBlockFlags) {
+    apultra_parse_segment *pSegment = pCompressor->segment;
+    const int nSegmentSize = (nEndOffset - nStartOffset) / pCompressor->num_threads;
+    int nNumSegments = 1;
+    int i;
 
-                if (nMatchOffset <= matchfinder.max_offset) {
-                    int nExistingMatchIdx;
-                    int nAlreadyExists = 0;
+    pSegment[0].start_offset = nStartOffset;
+    pSegment[0].rep_match_offset = nCurRepMatchOffset;
+    pSegment[0].block_flags = nBlockFlags;
 
-                    for (nExistingMatchIdx = 0; nExistingMatchIdx < m; nExistingMatchIdx++) {
-                        if (match[nExistingMatchIdx].offset == nMatchOffset
-                            || (match[nExistingMatchIdx].offset - (match_depth[nExistingMatchIdx] & 0x3fff))
-                                   == nMatchOffset) {
-                            nAlreadyExists = 1;
+    if (nSegmentSize >= MIN_PARSE_SEGMENT_SIZE) {
+        i = nStartOffset + nSegmentSize;
+
+        while (nNumSegments < pCompressor->num_threads && i < (nEndOffset - MIN_PARSE_SEGMENT_SIZE)) {
+            const apultra_match *match =
+                pCompressor->matchfinder.match + ((i - nStartOffset) << MATCHES_PER_INDEX_SHIFT);
+            int nLongestMatchIdx = -1;
+            int m;
+
+            for (m = 0; m < NMATCHES_PER_INDEX && match[m].length; m++) {
+                if (match[m].length >= LEAVE_ALONE_MATCH_SIZE && i >= match[m].length
+                    && (nLongestMatchIdx < 0 || match[m].length > match[nLongestMatchIdx].length))
+                    nLongestMatchIdx = m;
+            }
+
+            if (nLongestMatchIdx >= 0) {
+                const int nSplitOffset = i + match[nLongestMatchIdx].length;
+
+                if (nSplitOffset > (nEndOffset - MIN_PARSE_SEGMENT_SIZE)) break;
+
+                pSegment[nNumSegments].start_offset = nSplitOffset;
+                pSegment[nNumSegments].rep_match_offset = match[nLongestMatchIdx].offset;
+                pSegment[nNumSegments].block_flags = nBlockFlags | 4;
+                nNumSegments++;
+
+                i = nSplitOffset + nSegmentSize;
+            } else {
+                i++;
+            }
+        }
+    }
+
+    for (i = 0; i < nNumSegments; i++) {
+        pSegment[i].end_offset = (i < (nNumSegments - 1)) ? pSegment[i + 1].start_offset : nEndOffset;
+    }
+
+    return nNumSegments;
+}
+
+/**
+ * Run one forward optimizer pass over one segment of a block; called on the segment's own thread
+ *
+ * @param pArg segment to parse
+ */
+static void apultra_optimize_segment(void *pArg) {
+    apultra_parse_segment *pSegment = (apultra_parse_segment *)pArg;
+
+    pSegment->compressor.optimize_forward(&pSegment->compressor,
+        pSegment->in_window,
+        pSegment->start_offset,
+        pSegment->end_offset,
+        pSegment->insert_forward_reps,
+        &pSegment->rep_match_offset,
+        pSegment->block_flags);
+}
+
+/**
+ * Run one forward optimizer pass over a block, one thread per segment
+ *
+ * @param pCompressor compression context
+ * @param pInWindow pointer to input data window (previously compressed bytes + bytes to compress)
+ * @param nStartOffset current offset in input window (typically the number of previously compressed bytes)
+ * @param nInsertForwardReps non-zero to insert forward repmatch candidates, zero to use the previously inserted
+ * candidates
+ * @param nNumSegments number of segments found by apultra_find_parse_segments()
+ */
+static void apultra_optimize_forward_segments(apultra_compressor *pCompressor,
+    const unsigned char *pInWindow,
+    const int nStartOffset,
+    const int nInsertForwardReps,
+    const int nNumSegments) {
+    const int nArrivalsPerPosition = pCompressor->max_arrivals;
+    apultra_stats *pStats = pCompressor->stats;
+    int i, j;
+
+    for (i = 0; i < nNumSegments; i++) {
+        apultra_parse_segment *pSegment = &pCompressor->segment[i];
+        apultra_compressor *pSegmentCompressor = &pSegment->compressor;
+        const int nDelta = pSegment->start_offset - nStartOffset;
+
+        /* Rebase the per-position tables so that they are indexed from the start of the segment */
+        *pSegmentCompressor = *pCompressor;
+        pSegmentCompressor->matchfinder.match += (nDelta << MATCHES_PER_INDEX_SHIFT);
+        pSegmentCompressor->matchfinder.match_depth += (nDelta << MATCHES_PER_INDEX_SHIFT);
+        pSegmentCompressor->matchfinder.match1 += nDelta;
+        pSegmentCompressor->matchfinder.pos_data =
+            (unsigned long long *)(((int *)pCompressor->matchfinder.pos_data) + nDelta);
+        pSegmentCompressor->best_match += nDelta;
+        pSegmentCompressor->arrival_link += nDelta * nArrivalsPerPosition;
+        pSegmentCompressor->arrival = pSegment->arrival;
+        pSegmentCompressor->worst_cost_for_pos = pSegment->worst_cost_for_pos;
+        pSegmentCompressor->stats = &pSegment->stats;
+
+        memset(&pSegment->stats, 0, sizeof(apultra_stats));
+        pSegment->in_window = pInWindow;
+        pSegment->insert_forward_reps = nInsertForwardReps;
+    }
+
+    apultra_run_threads(apultra_optimize_segment, pCompressor->segment, sizeof(apultra_parse_segment), nNumSegments);
+
+    for (i = 0; i < nNumSegments; i++) {
+        const apultra_stats *pSegmentStats = &pCompressor->segment[i].stats;
+
+        pStats->num_positions += pSegmentStats->num_positions;
+        pStats->num_insert_attempts += pSegmentStats->num_insert_attempts;
+        pStats->num_insert_accepts += pSegmentStats->num_insert_accepts;
+        pStats->num_pruned_arrivals += pSegmentStats->num_pruned_arrivals;
+        pStats->num_skipped_positions += pSegmentStats->num_skipped_positions;
+        pStats->num_forward_rep_calls += pSegmentStats->num_forward_rep_calls;
+        pStats->num_forward_rep_inserts += pSegmentStats->num_forward_rep_inserts;
+        if (pStats->max_forward_rep_depth < pSegmentStats->max_forward_rep_depth)
+            pStats->max_forward_rep_depth = pSegmentStats->max_forward_rep_depth;
+        for (j = 0; j <= NARRIVALS_PER_POSITION_MAX; j++) {
+            pStats->arrival_histogram[j] += pSegmentStats->arrival_histogram[j];
+        }
+    }
+}
+
+/**
+ * Select the most optimal matches, reduce the token count if possible, and then emit a block of compressed data
+ *
+ * @param pCompressor compression context
+ * @param pInWindow pointer to input data window (previously compressed bytes + bytes to compress)
+ * @param nPreviousBlockSize number of previously compressed bytes (or 0 for none)
+ * @param nInDataSize number of input bytes to compress
+ * @param nCurRepMatchOffset starting rep offset for this block, updated after the block is compressed successfully
+ * @param nBlockFlags bit 0: 1 for first block, 0 otherwise; bit 1: 1 for last block, 0 otherwise
+ *
+ * @return size of compressed data in output buffer, or -1 if the data is uncompressible
+ */
+static void apultra_optimize_block(apultra_compressor *pCompressor,
+    const unsigned char *pInWindow,
+    const int nPreviousBlockSize,
+    const int nInDataSize,
+    int *nCurRepMatchOffset,
+    const int nBlockFlags) {
+    const int nEndOffset = nPreviousBlockSize + nInDataSize;
+    const int nArrivalsPerPosition = pCompressor->max_arrivals;
+    const int nSkipLongRepeats = (pCompressor->flags & APULTRA_FLAG_FAST_PARSE) != 0;
+    const apultra_matchfinder matchfinder = pCompressor->matchfinder;
+    int *rle_len = (int *)matchfinder.intervals /* reuse */;
+    long long nStartTime = apultra_get_time_ns();
+    int nNumSegments = 1;
+    int i, nPosition;
+
+    memset(pCompressor->best_match, 0, pCompressor->block_size * sizeof(apultra_final_match));
+
+    if ((nBlockFlags & 3) == 3) {
+        int *first_offset_for_byte = pCompressor->first_offset_for_byte;
+        int *next_offset_for_pos = pCompressor->next_offset_for_pos;
+
+        /* Supplement 2 and 3-byte matches */
+
+        memset(first_offset_for_byte, 0xff, sizeof(int) * 65536);
+        memset(next_offset_for_pos, 0xff, sizeof(int) * nInDataSize);
+
+        for (nPosition = nPreviousBlockSize; nPosition < (nEndOffset - 1); nPosition++) {
+            next_offset_for_pos[nPosition - nPreviousBlockSize] =
+                first_offset_for_byte[((unsigned int)pInWindow[nPosition])
+                                      | (((unsigned int)pInWindow[nPosition + 1]) << 8)];
+            first_offset_for_byte[((unsigned int)pInWindow[nPosition])
+                                  | (((unsigned int)pInWindow[nPosition + 1]) << 8)] = nPosition;
+        }
+
+        for (nPosition = nPreviousBlockSize + 1; nPosition < (nEndOffset - 1); nPosition++) {
+            apultra_match *match = matchfinder.match + ((nPosition - nPreviousBlockSize) << MATCHES_PER_INDEX_SHIFT);
+            unsigned short *match_depth =
+                matchfinder.match_depth + ((nPosition - nPreviousBlockSize) << MATCHES_PER_INDEX_SHIFT);
+            int m = 0, nInserted = 0;
+            int nMatchPos;
+
+            while (m < 15 && match[m].length) m++;
+
+            for (nMatchPos = next_offset_for_pos[nPosition - nPreviousBlockSize]; m < 15 && nMatchPos >= 0;
+                 nMatchPos = next_offset_for_pos[nMatchPos - nPreviousBlockSize]) {
+                int nMatchOffset = nPosition - nMatchPos;
+
+                if (nMatchOffset <= matchfinder.max_offset) {
+                    int nExistingMatchIdx;
+                    int nAlreadyExists = 0;
+
+                    for (nExistingMatchIdx = 0; nExistingMatchIdx < m; nExistingMatchIdx++) {
+                        if (match[nExistingMatchIdx].offset == nMatchOffset
+                            || (match[nExistingMatchIdx].offset - (match_depth[nExistingMatchIdx] & 0x3fff))
+                                   == nMatchOffset) {
+                            nAlreadyExists = 1;
                             break;
                         }
                     }
@@ -1433,9 +1220,14 @@ static void apultra_optimize_block(apultra_compressor *pCompressor,
                     break;
                 }
             }
+
+            /* The optimizer doesn't visit the inside of very long repeats, don't supplement it */
+            if (nSkipLongRepeats && match[0].length >= LONG_REPEAT_MATCH_SIZE) nPosition += match[0].length - 1;
         }
     }
 
+    nStartTime = apultra_add_phase_time(pCompressor, APULTRA_PHASE_SUPPLEMENT, nStartTime);
+
     i = 0;
     while (i < nEndOffset) {
         int nRangeStartIdx = i;
@@ -1447,14 +1239,29 @@ static void apultra_optimize_block(apultra_compressor *pCompressor,
         }
     }
 
-    apultra_optimize_forward(pCompressor,
-        pInWindow,
-        nPreviousBlockSize,
-        nEndOffset,
-        1 /* nInsertForwardReps */,
-        nCurRepMatchOffset,
-        nBlockFlags,
-        nArrivalsPerPosition);
+    if (pCompressor->num_threads > 1) {
+        nNumSegments = apultra_find_parse_segments(
+            pCompressor, nPreviousBlockSize, nEndOffset, *nCurRepMatchOffset, nBlockFlags);
+    }
+    pCompressor->stats->num_segments += nNumSegments;
+
+    if (nNumSegments > 1) {
+        apultra_optimize_forward_segments(pCompressor,
+            pInWindow,
+            nPreviousBlockSize,
+            1 /* nInsertForwardReps */,
+            nNumSegments);
+    } else {
+        pCompressor->optimize_forward(pCompressor,
+            pInWindow,
+            nPreviousBlockSize,
+            nEndOffset,
+            1 /* nInsertForwardReps */,
+            nCurRepMatchOffset,
+            nBlockFlags);
+    }
+
+    nStartTime = apultra_add_phase_time(pCompressor, APULTRA_PHASE_FORWARD_PASS1, nStartTime);
 
     if ((nBlockFlags & 3) == 3 && nArrivalsPerPosition == NARRIVALS_PER_POSITION_MAX) {
         const int *next_offset_for_pos = pCompressor->next_offset_for_pos;
@@ -1532,13 +1339,12 @@ static void apultra_optimize_block(apultra_compressor *pCompressor,
                                 match_depth[m] = 0;
                                 m++;
 
-                                apultra_insert_forward_match(pCompressor,
+                                pCompressor->insert_forward_match(pCompressor,
                                     pInWindow,
                                     nPosition,
                                     nMatchOffset,
                                     nPreviousBlockSize,
                                     nEndOffset,
-                                    nArrivalsPerPosition,
                                     8);
 
                                 nInserted++;
@@ -1550,32 +1356,77 @@ static void apultra_optimize_block(apultra_compressor *pCompressor,
                     }
                 }
             }
+
+            if (nSkipLongRepeats && match[0].length >= LONG_REPEAT_MATCH_SIZE) nPosition += match[0].length - 1;
         }
     }
 
+    nStartTime = apultra_add_phase_time(pCompressor, APULTRA_PHASE_SUPPLEMENT, nStartTime);
+
     /* Pick optimal matches */
-    apultra_optimize_forward(pCompressor,
-        pInWindow,
-        nPreviousBlockSize,
-        nEndOffset,
-        0 /* nInsertForwardReps */,
-        nCurRepMatchOffset,
-        nBlockFlags,
-        nArrivalsPerPosition);
+    if (nNumSegments > 1) {
+        apultra_optimize_forward_segments(pCompressor,
+            pInWindow,
+            nPreviousBlockSize,
+            0 /* nInsertForwardReps */,
+            nNumSegments);
+    } else {
+        pCompressor->optimize_forward(pCompressor,
+            pInWindow,
+            nPreviousBlockSize,
+            nEndOffset,
+            0 /* nInsertForwardReps */,
+            nCurRepMatchOffset,
+            nBlockFlags);
+    }
+
+    if (nNumSegments > 1) {
+        /* Each segment was parsed as if it followed the long match that the block was split after. Where the parse
+         * of the segment before it ended differently, the matches that can only be written as rep-matches can't be
+         * written anymore: make them literals. The first segment starts in the same state as the reduction pass */
+        apultra_final_match *pBestMatch = pCompressor->best_match - nPreviousBlockSize;
+        const int nBoundary = pCompressor->segment[1].start_offset;
+        int nState = *nCurRepMatchOffset << 1;
+
+        for (i = nPreviousBlockSize; i < nBoundary;) {
+            nState = apultra_get_next_parse_state(nState, &pBestMatch[i]);
+            i += (pBestMatch[i].length >= 1) ? pBestMatch[i].length : 1;
+        }
+
+        pCompressor->stats->num_segment_fixes += apultra_fix_parse_rep_matches(pBestMatch, nBoundary, nEndOffset, nState);
+    }
+
+    nStartTime = apultra_add_phase_time(pCompressor, APULTRA_PHASE_FORWARD_PASS2, nStartTime);
 
     /* Apply reduction and merge pass */
     int nDidReduce;
     int nPasses = 0;
+    int nReduceStamp = 0;
+
+    /* No token was changed yet, and none was left alone yet */
+    memset(((int *)matchfinder.intervals) + nPreviousBlockSize, 0, (nEndOffset - nPreviousBlockSize) * sizeof(int));
+    memset(((int *)matchfinder.pos_data) + nEndOffset + nPreviousBlockSize,
+        0xff,
+        (nEndOffset - nPreviousBlockSize) * sizeof(int));
+
     do {
-        nDidReduce = apultra_reduce_commands(&pCompressor->matchfinder,
+        nDidReduce = apultra_reduce_commands(pCompressor->stats,
+            &pCompressor->matchfinder,
             pInWindow,
             pCompressor->best_match - nPreviousBlockSize,
             nPreviousBlockSize,
             nEndOffset,
             nCurRepMatchOffset,
-            nBlockFlags);
+            nBlockFlags,
+            nPasses,
+            &nReduceStamp);
         nPasses++;
     } while (nDidReduce && nPasses < 20);
+
+    pCompressor->stats->num_reduce_passes += nPasses;
+    if (pCompressor->stats->max_reduce_passes < nPasses) pCompressor->stats->max_reduce_passes = nPasses;
+
+    apultra_add_phase_time(pCompressor, APULTRA_PHASE_REDUCE, nStartTime);
 }
 
 
@@ -1587,6 +1438,24 @@ static void apultra_optimize_block(apultra_compressor *pCompressor,
 static void apultra_compressor_destroy(apultra_compressor *pCompressor) {
     apultra_matchfinder_destroy(&pCompressor->matchfinder);
 
+    if (pCompressor->segment) {
+        int i;
+
+        /* Segment 0 shares the compressor's own buffers */
+        for (i = 1; i < pCompressor->num_threads; i++) {
+            if (pCompressor->segment[i].worst_cost_for_pos) free(pCompressor->segment[i].worst_cost_for_pos);
+            if (pCompressor->segment[i].arrival) free(pCompressor->segment[i].arrival);
+        }
+
+        free(pCompressor->segment);
+        pCompressor->segment = NULL;
+    }
+
+    if (pCompressor->worst_cost_for_pos) {
+        free(pCompressor->worst_cost_for_pos);
+        pCompressor->worst_cost_for_pos = NULL;
+    }
+
     if (pCompressor->offset_cache) {
         free(pCompressor->offset_cache);
         pCompressor->offset_cache = NULL;
@@ -1602,6 +1471,11 @@ static void apultra_compressor_destroy(apultra_compressor *pCompressor) {
         pCompressor->first_offset_for_byte = NULL;
     }
 
+    if (pCompressor->arrival_link) {
+        free(pCompressor->arrival_link);
+        pCompressor->arrival_link = NULL;
+    }
+
     if (pCompressor->arrival) {
         free(pCompressor->arrival);
         pCompressor->arrival = NULL;
@@ -1613,6 +1487,51 @@ static void apultra_compressor_destroy(apultra_compressor *pCompressor) {
     }
 }
 
+/**
+ * Allocate the buffers of each thread of the segmented forward parse
+ *
+ * @param pCompressor compression context, with its own buffers already allocated
+ * @param nRingRows number of rows in each ring of arrivals
+ *
+ * @return 0 for success, non-zero for failure
+ */
+static int apultra_compressor_init_segments(apultra_compressor *pCompressor, const int nRingRows) {
+    int i;
+
+    if (pCompressor->num_threads <= 1) return 0;
+
+    pCompressor->segment =
+        (apultra_parse_segment *)calloc(pCompressor->num_threads, sizeof(apultra_parse_segment));
+    if (!pCompressor->segment) return 100;
+
+    pCompressor->segment[0].arrival = pCompressor->arrival;
+    pCompressor->segment[0].worst_cost_for_pos = pCompressor->worst_cost_for_pos;
+
+    for (i = 1; i < pCompressor->num_threads; i++) {
+        pCompressor->segment[i].arrival =
+            (apultra_arrival *)malloc(nRingRows * pCompressor->max_arrivals * sizeof(apultra_arrival));
+        if (!pCompressor->segment[i].arrival) return 100;
+
+        pCompressor->segment[i].worst_cost_for_pos = (int *)malloc((pCompressor->block_size + 1) * sizeof(int));
+        if (!pCompressor->segment[i].worst_cost_for_pos) return 100;
+    }
+
+    return 0;
+}
+
+/**
+ * Initialize compression stats
+ *
+ * @param pStats compression stats to initialize
+ */
+static void apultra_init_stats(apultra_stats *pStats) {
+    memset(pStats, 0, sizeof(*pStats));
+    pStats->min_match_len = -1;
+    pStats->min_offset = -1;
+    pStats->min_rle1_len = -1;
+    pStats->min_rle2_len = -1;
+}
+
 /**
  * Initialize compression context
  *
@@ -1632,36 +1551,76 @@ static int apultra_compressor_init(apultra_compressor *pCompressor,
     const int nMaxArrivals,
     const int nFlags) {
     int fail = apultra_matchfinder_init(&pCompressor->matchfinder, nBlockSize, nMaxWindowSize, NMATCHES_PER_INDEX);
+    int nRingRows = 1;
+
+    /* Full arrival rows only need to cover the longest match ahead of the current position */
+    while (nRingRows < (nBlockSize + 1) && nRingRows < ARRIVALS_RING_SIZE) nRingRows <<= 1;
 
     pCompressor->best_match = NULL;
     pCompressor->arrival = NULL;
+    pCompressor->arrival_link = NULL;
     pCompressor->first_offset_for_byte = NULL;
     pCompressor->next_offset_for_pos = NULL;
     pCompressor->offset_cache = NULL;
+    pCompressor->worst_cost_for_pos = NULL;
     pCompressor->flags = nFlags;
+    pCompressor->matchfinder.skip_long_repeats = (nFlags & APULTRA_FLAG_FAST_PARSE) != 0;
     pCompressor->block_size = nBlockSize;
     pCompressor->max_arrivals = nMaxArrivals;
+    pCompressor->arrival_ring_mask = nRingRows - 1;
+    pCompressor->num_threads = nFlags & APULTRA_FLAG_THREADS_MASK;
+    if (pCompressor->num_threads < 1) pCompressor->num_threads = 1;
+    if (pCompressor->num_threads > APULTRA_MAX_THREADS) pCompressor->num_threads = APULTRA_MAX_THREADS;
+    pCompressor->segment = NULL;
+
+    switch (nMaxArrivals) {
+    case NARRIVALS_PER_POSITION_SMALL:
+        pCompressor->optimize_forward = apultra_optimize_forward_9;
+        pCompressor->insert_forward_match = apultra_insert_forward_match_9;
+        break;
+    case NARRIVALS_PER_POSITION_NORMAL:
+        pCompressor->optimize_forward = apultra_optimize_forward_46;
+        pCompressor->insert_forward_match = apultra_insert_forward_match_46;
+        break;
+    case NARRIVALS_PER_POSITION_MAX:
+        pCompressor->optimize_forward = apultra_optimize_forward_55;
+        pCompressor->insert_forward_match = apultra_insert_forward_match_55;
+        break;
+    default:
+        pCompressor->optimize_forward = NULL;
+        pCompressor->insert_forward_match = NULL;
+        fail = 1;
+        break;
+    }
 
-    memset(pStats, 0, sizeof(*pStats));
-    pStats->min_match_len = -1;
-    pStats->min_offset = -1;
-    pStats->min_rle1_len = -1;
-    pStats->min_rle2_len = -1;
+    apultra_init_stats(pStats);
+
+    pCompressor->stats = pStats;
+    pCompressor->matchfinder.phase_time = pStats->phase_time;
 
     if (!fail) {
-        pCompressor->arrival = (apultra_arrival *)malloc((nBlockSize + 1) * nMaxArrivals * sizeof(apultra_arrival));
+        pCompressor->arrival = (apultra_arrival *)malloc(nRingRows * nMaxArrivals * sizeof(apultra_arrival));
         if (pCompressor->arrival) {
-            pCompressor->best_match = (apultra_final_match *)malloc(nBlockSize * sizeof(apultra_final_match));
-            if (pCompressor->best_match) {
-                pCompressor->first_offset_for_byte = (int *)malloc(65536 * sizeof(int));
-                if (pCompressor->first_offset_for_byte) {
-                    pCompressor->next_offset_for_pos = (int *)malloc(nBlockSize * sizeof(int));
-                    if (pCompressor->next_offset_for_pos) {
-                        if (nMaxArrivals == NARRIVALS_PER_POSITION_MAX) {
-                            pCompressor->offset_cache = (int *)malloc(2048 * sizeof(int));
-                            if (pCompressor->offset_cache) { return 0; }
-                        } else {
-                            return 0;
+            pCompressor->arrival_link =
+                (apultra_arrival_link *)malloc((nBlockSize + 1) * nMaxArrivals * sizeof(apultra_arrival_link));
+            if (pCompressor->arrival_link) {
+                pCompressor->best_match = (apultra_final_match *)malloc(nBlockSize * sizeof(apultra_final_match));
+                if (pCompressor->best_match) {
+                    pCompressor->first_offset_for_byte = (int *)malloc(65536 * sizeof(int));
+                    if (pCompressor->first_offset_for_byte) {
+                        pCompressor->next_offset_for_pos = (int *)malloc(nBlockSize * sizeof(int));
+                        if (pCompressor->next_offset_for_pos) {
+                            pCompressor->worst_cost_for_pos = (int *)malloc((nBlockSize + 1) * sizeof(int));
+                            if (pCompressor->worst_cost_for_pos) {
+                                if (nMaxArrivals == NARRIVALS_PER_POSITION_MAX) {
+                                    pCompressor->offset_cache = (int *)malloc(2048 * sizeof(int));
+                                    if (pCompressor->offset_cache) {
+                                        if (!apultra_compressor_init_segments(pCompressor, nRingRows)) return 0;
+                                    }
+                                } else {
+                                    if (!apultra_compressor_init_segments(pCompressor, nRingRows)) return 0;
+                                }
+                            }
                         }
                     }
                 }
@@ -1675,54 +1634,87 @@ static int apultra_compressor_init(apultra_compressor *pCompressor,
 
 
 /**
- * Compress one block of data
+ * Compress one block of data into one output, once the matches of the block are found
  *
  * @param pCompressor compression context
  * @param pInWindow pointer to input data window (previously compressed bytes + bytes to compress)
  * @param nPreviousBlockSize number of previously compressed bytes (or 0 for none)
  * @param nInDataSize number of input bytes to compress
- * @param pOutData pointer to output buffer
- * @param nMaxOutDataSize maximum size of output buffer, in bytes
- * @param nCurBitsOffset write index into output buffer, of current byte being filled with bits
- * @param nCurBitShift bit shift count
- * @param nCurFollowsLiteral non-zero if the next command to be issued follows a literal, 0 if not
- * @param nCurRepMatchOffset starting rep offset for this block, updated after the block is compressed successfully
+ * @param pOutput compressed stream to append the block to; its bit writer state and rep offset are updated
+ * @param nMaxOutBlockSize maximum size of the compressed data of one block, in bytes
  * @param nBlockFlags bit 0: 1 for first block, 0 otherwise; bit 1: 1 for last block, 0 otherwise
  *
  * @return size of compressed data in output buffer, or -1 if the data is uncompressible
  */
 static int apultra_compressor_shrink_block(apultra_compressor *pCompressor,
-    apultra_stats *pStats,
     const unsigned char *pInWindow,
     const int nPreviousBlockSize,
     const int nInDataSize,
-    unsigned char *pOutData,
-    const int nMaxOutDataSize,
-    int *nCurBitsOffset,
-    int *nCurBitShift,
-    int *nCurFollowsLiteral,
-    int *nCurRepMatchOffset,
+    apultra_window_output *pOutput,
+    const int nMaxOutBlockSize,
     const int nBlockFlags) {
-    int fail = apultra_find_all_block_matches(
-        &pCompressor->matchfinder, pInWindow, nPreviousBlockSize, nInDataSize, nBlockFlags, NMATCHES_PER_INDEX);
+    apultra_stats *pStats = &pOutput->stats;
+    int nOutDataEnd = (int)(pOutput->max_out_size - pOutput->compressed_size);
+
+    if (nOutDataEnd > nMaxOutBlockSize) nOutDataEnd = nMaxOutBlockSize;
 
-    if (fail) return -1;
+    pCompressor->matchfinder.max_offset = pOutput->max_offset;
+    pCompressor->matchfinder.phase_time = pStats->phase_time;
+    pCompressor->stats = pStats;
 
-    apultra_optimize_block(pCompressor, pInWindow, nPreviousBlockSize, nInDataSize, nCurRepMatchOffset, nBlockFlags);
+    apultra_optimize_block(
+        pCompressor, pInWindow, nPreviousBlockSize, nInDataSize, &pOutput->cur_rep_match_offset, nBlockFlags);
 
-    return apultra_write_block(pStats,
+    long long nStartTime = apultra_get_time_ns();
+    int nOutDataSize = apultra_write_block(pStats,
         pCompressor->best_match - nPreviousBlockSize,
         pInWindow,
         nPreviousBlockSize,
-        pCompressor->matchfinder.max_offset,
+        pOutput->max_offset,
         nPreviousBlockSize + nInDataSize,
-        pOutData,
-        nMaxOutDataSize,
-        nCurBitsOffset,
-        nCurBitShift,
-        nCurFollowsLiteral,
-        nCurRepMatchOffset,
+        pOutput->out_buffer + pOutput->compressed_size,
+        nOutDataEnd,
+        &pOutput->cur_bits_offset,
+        &pOutput->cur_bit_shift,
+        &pOutput->cur_follows_literal,
+        &pOutput->cur_rep_match_offset,
         nBlockFlags);
+
+    apultra_add_phase_time(pCompressor, APULTRA_PHASE_WRITE, nStartTime);
+    pStats->num_blocks++;
+
+    if (nOutDataSize >= 0) {
+        pOutput->compressed_size += nOutDataSize;
+        if (pOutput->cur_bits_offset != INT_MIN) pOutput->cur_bits_offset -= nOutDataSize;
+    }
+
+    return nOutDataSize;
+}
+
+/**
+ * Get the size of the blocks that input data is compressed in
+ *
+ * @param nInputSize input(source) size in bytes, dictionary included
+ *
+ * @return maximum number of bytes to compress in each block
+ */
+static int apultra_get_block_size(const size_t nInputSize) {
+    return (nInputSize < BLOCK_SIZE) ? ((nInputSize < 1024) ? 1024 : (int)nInputSize) : BLOCK_SIZE;
+}
+
+/**
+ * Get the number of arrivals per position to parse input data with; data that fits in a single block gets more
+ *
+ * @param nInputSize input(source) size in bytes, dictionary included
+ * @param nDictionarySize size of dictionary in front of input data (0 for none)
+ * @param nBlockSize maximum number of bytes to compress in each block
+ *
+ * @return maximum number of arrivals per position
+ */
+static int apultra_get_max_arrivals(const size_t nInputSize, const size_t nDictionarySize, const int nBlockSize) {
+    if (nDictionarySize >= nInputSize || (nInputSize - nDictionarySize) > (size_t)nBlockSize)
+        return NARRIVALS_PER_POSITION_SMALL;
+    return (nInputSize <= 65536) ? NARRIVALS_PER_POSITION_MAX : NARRIVALS_PER_POSITION_NORMAL;
 }
 
 /**
@@ -1746,7 +1738,7 @@ size_t apultra_get_max_compressed_size(size_t nInputSize) {
  * @param pOutBuffer buffer for compressed data
  * @param nInputSize input(source) size in bytes
  * @param nMaxOutBufferSize maximum capacity of compression buffer
- * @param nFlags compression flags (set to 0)
+ * @param nFlags compression flags (number of parsing threads in APULTRA_FLAG_THREADS_MASK, APULTRA_FLAG_xxx, or 0)
  * @param nMaxWindowSize maximum window size to use (0 for default)
  * @param nDictionarySize size of dictionary in front of input data (0 for none)
  * @param progress progress function, called after compressing each block, or NULL for none
@@ -1763,97 +1755,1384 @@ size_t apultra_compress(const unsigned char *pInputData,
     size_t nDictionarySize,
     void (*progress)(long long nOriginalSize, long long nCompressedSize),
     apultra_stats *pStats) {
-    apultra_compressor compressor;
-    size_t nOriginalSize = 0;
-    size_t nCompressedSize = 0L;
-    int nResult;
-    int nMaxArrivals = NARRIVALS_PER_POSITION_SMALL;
-    int nError = 0;
-    const int nBlockSize = (nInputSize < BLOCK_SIZE) ? ((nInputSize < 1024) ? 1024 : (int)nInputSize) : BLOCK_SIZE;
-    const int nMaxOutBlockSize = (int)apultra_get_max_compressed_size(nBlockSize);
+    size_t nCompressedSize = 0;
+
+    if (apultra_compress_multi(pInputData,
+            &pOutBuffer,
+            nInputSize,
+            &nMaxOutBufferSize,
+            &nCompressedSize,
+            nFlags,
+            &nMaxWindowSize,
+            1,
+            nDictionarySize,
+            NULL,
+            progress,
+            pStats))
+        return -1;
 
-    if (nDictionarySize < nInputSize) {
-        int nInDataSize = (int)(nInputSize - nDictionarySize);
-        if (nInDataSize > nBlockSize) nInDataSize = nBlockSize;
+    return nCompressedSize;
+}
 
-        if (nInDataSize > 0 && (nDictionarySize + nInDataSize) >= nInputSize) {
-            if (nInputSize <= 65536)
-                nMaxArrivals = NARRIVALS_PER_POSITION_MAX;
-            else
-                nMaxArrivals = NARRIVALS_PER_POSITION_NORMAL;
-        }
-    }
+/**
+ * Compress memory against a dictionary that was indexed beforehand
+ *
+ * @param pInputData pointer to input(source) data to compress, with the indexed dictionary in front of it
+ * @param pOutBuffer buffer for compressed data
+ * @param nInputSize input(source) size in bytes, dictionary included
+ * @param nMaxOutBufferSize maximum capacity of compression buffer
+ * @param nFlags compression flags (number of parsing threads in APULTRA_FLAG_THREADS_MASK, APULTRA_FLAG_xxx, or 0)
+ * @param nMaxWindowSize maximum window size to use (0 for default)
+ * @param pDictionaryIndex index of the dictionary in front of the input data
+ * @param progress progress function, called after compressing each block, or NULL for none
+ * @param pStats pointer to compression stats that are filled if this function is successful, or NULL
+ *
+ * @return actual compressed size, or -1 for error
+ */
+size_t apultra_compress_indexed(const unsigned char *pInputData,
+    unsigned char *pOutBuffer,
+    size_t nInputSize,
+    size_t nMaxOutBufferSize,
+    const unsigned int nFlags,
+    size_t nMaxWindowSize,
+    const apultra_dictionary_index *pDictionaryIndex,
+    void (*progress)(long long nOriginalSize, long long nCompressedSize),
+    apultra_stats *pStats) {
+    size_t nCompressedSize = 0;
+
+    if (apultra_compress_multi(pInputData,
+            &pOutBuffer,
+            nInputSize,
+            &nMaxOutBufferSize,
+            &nCompressedSize,
+            nFlags,
+            &nMaxWindowSize,
+            1,
+            pDictionaryIndex->size,
+            pDictionaryIndex,
+            progress,
+            pStats))
+        return -1;
 
-    nResult = apultra_compressor_init(&compressor, pStats, nBlockSize, nBlockSize * 2, nMaxArrivals, nFlags);
-    if (nResult != 0) { return -1; }
-    compressor.matchfinder.max_offset = nMaxWindowSize ? (int)nMaxWindowSize : MAX_OFFSET;
+    return nCompressedSize;
+}
 
-    int nPreviousBlockSize = 0;
-    int nNumBlocks = 0;
-    int nCurBitsOffset = INT_MIN, nCurBitShift = 0, nCurFollowsLiteral = 0;
-    int nBlockFlags = 1;
-    int nCurRepMatchOffset = 0;
+/**
+ * Get the window of input data that a block is compressed in, stitching it together if it spans several segments
+ *
+ * @param pSegments segments of input data, one after the other
+ * @param nNumSegments number of segments
+ * @param nWindowStart offset of the window in the input data
+ * @param nWindowEnd offset of the end of the window in the input data
+ * @param pStitchBuffer buffer that the window is copied to if needed, of at least nWindowEnd - nWindowStart bytes
+ *
+ * @return pointer to the window, into one of the segments if possible, or pStitchBuffer
+ */
+static const unsigned char *apultra_get_input_window(const apultra_input_segment *pSegments,
+    const int nNumSegments,
+    const size_t nWindowStart,
+    const size_t nWindowEnd,
+    unsigned char *pStitchBuffer) {
+    size_t nSegmentStart = 0;
+    size_t nCopied = 0;
+    int i;
 
-    if (nDictionarySize) {
-        nOriginalSize = (int)nDictionarySize;
-        nPreviousBlockSize = (int)nDictionarySize;
-    }
+    for (i = 0; i < nNumSegments && nSegmentStart < nWindowEnd; i++) {
+        const size_t nSegmentEnd = nSegmentStart + pSegments[i].size;
+
+        if (nSegmentEnd > nWindowStart) {
+            const size_t nFrom = (nWindowStart > nSegmentStart) ? nWindowStart : nSegmentStart;
+            const size_t nTo = (nWindowEnd < nSegmentEnd) ? nWindowEnd : nSegmentEnd;
+
+            /* Most windows are within a single segment, use it in place */
+            if (nFrom == nWindowStart && nTo == nWindowEnd) return pSegments[i].data + (nWindowStart - nSegmentStart);
+
+            memcpy(pStitchBuffer + nCopied, pSegments[i].data + (nFrom - nSegmentStart), nTo - nFrom);
+            nCopied += nTo - nFrom;
+        }
+
+        nSegmentStart = nSegmentEnd;
+    }
+
+    return pStitchBuffer;
+}
+
+/**
+ * Go through input data made of several segments block by block, in the order that it is compressed in
+ *
+ * @param pSegments segments of input(source) data, one after the other
+ * @param nNumSegments number of segments
+ * @param nInputSize input(source) size in bytes, the sum of the sizes of the segments
+ * @param nDictionarySize size of dictionary at the start of the input data (0 for none)
+ * @param nBlockSize maximum number of bytes to compress in each block
+ * @param block function called for each block, with the window made of the previous block (or the dictionary)
+ * followed by the block, the offset of the block in the input data, the sizes of both parts of the window and the
+ * block flags; it returns 0 to go on, or -1 for an error
+ * @param pArg argument passed to the block function
+ *
+ * @return 0 for success, -1 for error
+ */
+static int apultra_compress_blocks(const apultra_input_segment *pSegments,
+    const int nNumSegments,
+    const size_t nInputSize,
+    const size_t nDictionarySize,
+    const int nBlockSize,
+    int (*block)(void *pArg, const unsigned char *pInWindow, const size_t nBlockOffset, const int nPreviousBlockSize,
+        const int nInDataSize, const int nBlockFlags),
+    void *pArg) {
+    unsigned char *pStitchBuffer = NULL;
+    size_t nOriginalSize = nDictionarySize;
+    int nPreviousBlockSize = (int)nDictionarySize;
+    int nBlockFlags = 1;
+    int nError = 0;
 
     while (nOriginalSize < nInputSize && !nError) {
+        const unsigned char *pInWindow;
         int nInDataSize;
 
         nInDataSize = (int)(nInputSize - nOriginalSize);
         if (nInDataSize > nBlockSize) nInDataSize = nBlockSize;
 
-        if (nInDataSize > 0) {
-            int nOutDataSize;
-            int nOutDataEnd = (int)(nMaxOutBufferSize - nCompressedSize);
+        if (nNumSegments > 1 && !pStitchBuffer) {
+            pStitchBuffer = (unsigned char *)malloc(nPreviousBlockSize + 2 * (size_t)nBlockSize);
+            if (!pStitchBuffer) {
+                nError = -1;
+                break;
+            }
+        }
+
+        pInWindow = apultra_get_input_window(
+            pSegments, nNumSegments, nOriginalSize - nPreviousBlockSize, nOriginalSize + nInDataSize, pStitchBuffer);
+
+        if ((nOriginalSize + nInDataSize) >= nInputSize) nBlockFlags |= 2;
+
+        if (block(pArg, pInWindow, nOriginalSize, nPreviousBlockSize, nInDataSize, nBlockFlags)) nError = -1;
+        nBlockFlags &= (~1);
+
+        nOriginalSize += nInDataSize;
+        nPreviousBlockSize = nInDataSize;
+    }
+
+    if (pStitchBuffer) free(pStitchBuffer);
+    return nError;
+}
+
+/**
+ * Find the matches of a block and write it to the compressed stream of each window size
+ *
+ * @param pArg compression for each window size (apultra_window_compression)
+ * @param pInWindow pointer to input data window (previously compressed bytes + bytes to compress)
+ * @param nBlockOffset offset of the block in the input data
+ * @param nPreviousBlockSize number of previously compressed bytes (or 0 for none)
+ * @param nInDataSize number of input bytes to compress
+ * @param nBlockFlags bit 0: 1 for first block, 0 otherwise; bit 1: 1 for last block, 0 otherwise
+ *
+ * @return 0 for success, -1 for error
+ */
+static int apultra_compress_window_block(void *pArg,
+    const unsigned char *pInWindow,
+    const size_t nBlockOffset,
+    const int nPreviousBlockSize,
+    const int nInDataSize,
+    const int nBlockFlags) {
+    apultra_window_compression *pCompression = (apultra_window_compression *)pArg;
+    apultra_compressor *pCompressor = pCompression->compressor;
+    apultra_window_output *pOutputs = pCompression->outputs;
+    int w;
+
+    pCompressor->matchfinder.max_offset = pCompression->largest_max_offset;
+    pCompressor->matchfinder.phase_time = pOutputs[0].stats.phase_time;
+
+    if (apultra_find_all_block_matches(&pCompressor->matchfinder,
+            pInWindow,
+            nPreviousBlockSize,
+            nInDataSize,
+            nBlockFlags,
+            NMATCHES_PER_INDEX,
+            (nBlockFlags & 1) ? pCompression->dictionary_index : NULL))
+        return -1;
+
+    if (pCompression->num_outputs > 1) {
+        if (apultra_save_block_matches(
+                pCompression->saved_matches, &pCompressor->matchfinder, nInDataSize, NMATCHES_PER_INDEX))
+            return -1;
+    }
 
-            if (nOutDataEnd > nMaxOutBlockSize) nOutDataEnd = nMaxOutBlockSize;
+    for (w = 0; w < pCompression->num_outputs; w++) {
+        if (pCompression->num_outputs > 1) {
+            /* The optimizer adds to the matches of the block, start again from the saved ones each time */
+            apultra_restore_block_matches(&pCompressor->matchfinder,
+                pCompression->saved_matches,
+                pInWindow,
+                nPreviousBlockSize,
+                nPreviousBlockSize + nInDataSize,
+                NMATCHES_PER_INDEX,
+                pOutputs[w].max_offset);
+        }
 
-            if ((nOriginalSize + nInDataSize) >= nInputSize) nBlockFlags |= 2;
-            nOutDataSize = apultra_compressor_shrink_block(&compressor,
-                pStats,
-                pInputData + nOriginalSize - nPreviousBlockSize,
+        if (apultra_compressor_shrink_block(pCompressor,
+                pInWindow,
                 nPreviousBlockSize,
                 nInDataSize,
-                pOutBuffer + nCompressedSize,
-                nOutDataEnd,
-                &nCurBitsOffset,
-                &nCurBitShift,
-                &nCurFollowsLiteral,
-                &nCurRepMatchOffset,
-                nBlockFlags);
-            nBlockFlags &= (~1);
-
-            if (nOutDataSize >= 0) {
-                /* Write compressed block */
-
-                if (!nError) {
-                    nOriginalSize += nInDataSize;
-                    nCompressedSize += nOutDataSize;
-                    if (nCurBitsOffset != INT_MIN) nCurBitsOffset -= nOutDataSize;
+                &pOutputs[w],
+                pCompression->max_out_block_size,
+                nBlockFlags)
+            < 0)
+            return -1;
+    }
+
+    if (pCompression->progress && !(nBlockFlags & 2))
+        pCompression->progress(nBlockOffset + nInDataSize, pOutputs[0].compressed_size);
+    return 0;
+}
+
+/**
+ * Compress input data made of several segments once for each of several maximum window sizes
+ *
+ * @param pSegments segments of input(source) data to compress, one after the other
+ * @param nNumSegments number of segments
+ * @param pOutBuffers buffer for the compressed data of each window size
+ * @param nInputSize input(source) size in bytes, the sum of the sizes of the segments
+ * @param nMaxOutBufferSizes maximum capacity of each compression buffer
+ * @param pCompressedSizes returned compressed size for each window size
+ * @param nFlags compression flags (number of parsing threads in APULTRA_FLAG_THREADS_MASK, APULTRA_FLAG_xxx, or 0)
+ * @param nMaxWindowSizes maximum window size of each output (0 for default)
+ * @param nNumWindowSizes number of window sizes, and of outputs
+ * @param nDictionarySize size of dictionary in front of input data (0 for none)
+ * @param pDictionaryIndex index of the dictionary in front of input data, or NULL to sort the dictionary with the
+ * first block
+ * @param progress progress function, called after compressing each block with the size of the first output, or NULL
+ * for none
+ * @param pStats pointer to compression stats for each window size, that are filled if this function is successful, or
+ * NULL; the time spent finding matches is counted for the first window size
+ *
+ * @return 0 for success, -1 for error
+ */
+static int apultra_compress_segments(const apultra_input_segment *pSegments,
+    const int nNumSegments,
+    unsigned char **pOutBuffers,
+    size_t nInputSize,
+    const size_t *nMaxOutBufferSizes,
+    size_t *pCompressedSizes,
+    const unsigned int nFlags,
+    const size_t *nMaxWindowSizes,
+    const int nNumWindowSizes,
+    size_t nDictionarySize,
+    const apultra_dictionary_index *pDictionaryIndex,
+    void (*progress)(long long nOriginalSize, long long nCompressedSize),
+    apultra_stats *pStats) {
+    apultra_compressor compressor;
+    apultra_saved_matches saved_matches;
+    apultra_window_compression compression;
+    apultra_window_output *pOutputs;
+    int nResult;
+    int nError = 0;
+    int nLargestMaxOffset = 0, nSmallestMaxOffset = MAX_OFFSET;
+    int w;
+    const int nBlockSize = apultra_get_block_size(nInputSize);
+    const int nMaxOutBlockSize = (int)apultra_get_max_compressed_size(nBlockSize);
+
+    if (nNumWindowSizes < 1) return -1;
+
+    pOutputs = (apultra_window_output *)malloc(nNumWindowSizes * sizeof(apultra_window_output));
+    if (!pOutputs) return -1;
+
+    for (w = 0; w < nNumWindowSizes; w++) {
+        apultra_window_output *pOutput = &pOutputs[w];
+
+        pOutput->out_buffer = pOutBuffers[w];
+        pOutput->max_out_size = nMaxOutBufferSizes[w];
+        pOutput->compressed_size = 0;
+        pOutput->max_offset = nMaxWindowSizes[w] ? (int)nMaxWindowSizes[w] : MAX_OFFSET;
+        pOutput->cur_bits_offset = INT_MIN;
+        pOutput->cur_bit_shift = 0;
+        pOutput->cur_follows_literal = 0;
+        pOutput->cur_rep_match_offset = 0;
+        apultra_init_stats(&pOutput->stats);
+
+        if (nLargestMaxOffset < pOutput->max_offset) nLargestMaxOffset = pOutput->max_offset;
+        if (nSmallestMaxOffset > pOutput->max_offset) nSmallestMaxOffset = pOutput->max_offset;
+    }
+
+    nResult = apultra_compressor_init(&compressor,
+        &pOutputs[0].stats,
+        nBlockSize,
+        nBlockSize * 2,
+        apultra_get_max_arrivals(nInputSize, nDictionarySize, nBlockSize),
+        nFlags);
+    if (nResult != 0) {
+        free(pOutputs);
+        return -1;
+    }
+
+    /* Matches are found once, for the largest window. Very long repeats only make positions be skipped if every
+     * output can use them */
+    compressor.matchfinder.max_offset = nLargestMaxOffset;
+    compressor.matchfinder.long_repeat_max_offset = nSmallestMaxOffset;
+
+    if (nNumWindowSizes > 1) {
+        if (apultra_saved_matches_init(&saved_matches, nBlockSize)) nError = -1;
+    }
+
+    compression.compressor = &compressor;
+    compression.outputs = pOutputs;
+    compression.num_outputs = nNumWindowSizes;
+    compression.saved_matches = &saved_matches;
+    compression.largest_max_offset = nLargestMaxOffset;
+    compression.max_out_block_size = nMaxOutBlockSize;
+    compression.dictionary_index = pDictionaryIndex;
+    compression.progress = progress;
+
+    if (!nError) {
+        nError = apultra_compress_blocks(
+            pSegments, nNumSegments, nInputSize, nDictionarySize, nBlockSize, apultra_compress_window_block, &compression);
+    }
+
+    if (!nError && progress) progress(nInputSize, pOutputs[0].compressed_size);
+
+    if (nNumWindowSizes > 1) apultra_saved_matches_destroy(&saved_matches);
+    apultra_compressor_destroy(&compressor);
+
+    if (!nError) {
+        for (w = 0; w < nNumWindowSizes; w++) {
+            pCompressedSizes[w] = pOutputs[w].compressed_size;
+            if (pStats) pStats[w] = pOutputs[w].stats;
+        }
+    }
+
+    free(pOutputs);
+    return nError;
+}
+
+/**
+ * Compress memory once for each of several maximum window sizes, finding the matches only once
+ *
+ * The matches of each block are found for the largest window size, then each output drops the matches that are too
+ * far back for it before its own optimizer passes run.
+ *
+ * @param pInputData pointer to input(source) data to compress
+ * @param pOutBuffers buffer for the compressed data of each window size
+ * @param nInputSize input(source) size in bytes
+ * @param nMaxOutBufferSizes maximum capacity of each compression buffer
+ * @param pCompressedSizes returned compressed size for each window size
+ * @param nFlags compression flags (number of parsing threads in APULTRA_FLAG_THREADS_MASK, APULTRA_FLAG_xxx, or 0)
+ * @param nMaxWindowSizes maximum window size of each output (0 for default)
+ * @param nNumWindowSizes number of window sizes, and of outputs
+ * @param nDictionarySize size of dictionary in front of input data (0 for none)
+ * @param pDictionaryIndex index of the dictionary in front of input data, or NULL to sort the dictionary with the
+ * first block
+ * @param progress progress function, called after compressing each block with the size of the first output, or NULL
+ * for none
+ * @param pStats pointer to compression stats for each window size, that are filled if this function is successful, or
+ * NULL; the time spent finding matches is counted for the first window size
+ *
+ * @return 0 for success, -1 for error
+ */
+int apultra_compress_multi(const unsigned char *pInputData,
+    unsigned char **pOutBuffers,
+    size_t nInputSize,
+    const size_t *nMaxOutBufferSizes,
+    size_t *pCompressedSizes,
+    const unsigned int nFlags,
+    const size_t *nMaxWindowSizes,
+    const int nNumWindowSizes,
+    size_t nDictionarySize,
+    const apultra_dictionary_index *pDictionaryIndex,
+    void (*progress)(long long nOriginalSize, long long nCompressedSize),
+    apultra_stats *pStats) {
+    apultra_input_segment segment;
+
+    if (pDictionaryIndex) {
+        /* Matches are taken from the index as offsets into the data in front of the input: it must be the same */
+        if (nDictionarySize != (size_t)pDictionaryIndex->size || nInputSize < nDictionarySize
+            || memcmp(pInputData, pDictionaryIndex->dictionary, nDictionarySize))
+            return -1;
+    }
+
+    segment.data = pInputData;
+    segment.size = nInputSize;
+
+    return apultra_compress_segments(&segment,
+        1,
+        pOutBuffers,
+        nInputSize,
+        nMaxOutBufferSizes,
+        pCompressedSizes,
+        nFlags,
+        nMaxWindowSizes,
+        nNumWindowSizes,
+        nDictionarySize,
+        pDictionaryIndex,
+        progress,
+        pStats);
+}
+
+/**
+ * Compress input data that is made of several segments, without gathering them in one buffer first
+ *
+ * The segments are compressed as if they were one after the other in memory: the dictionary, if any, is the first
+ * nDictionarySize bytes of the segments, and may itself span several of them.
+ *
+ * @param pSegments segments of input(source) data to compress, one after the other
+ * @param nNumSegments number of segments
+ * @param pOutBuffer buffer for compressed data
+ * @param nMaxOutBufferSize maximum capacity of compression buffer
+ * @param nFlags compression flags (number of parsing threads in APULTRA_FLAG_THREADS_MASK, APULTRA_FLAG_xxx, or 0)
+ * @param nMaxWindowSize maximum window size to use (0 for default)
+ * @param nDictionarySize size of dictionary at the start of the input data (0 for none)
+ * @param progress progress function, called after compressing each block, or NULL for none
+ * @param pStats pointer to compression stats that are filled if this function is successful, or NULL
+ *
+ * @return actual compressed size, or -1 for error
+ */
+size_t apultra_compress_iov(const apultra_input_segment *pSegments,
+    const int nNumSegments,
+    unsigned char *pOutBuffer,
+    size_t nMaxOutBufferSize,
+    const unsigned int nFlags,
+    size_t nMaxWindowSize,
+    size_t nDictionarySize,
+    void (*progress)(long long nOriginalSize, long long nCompressedSize),
+    apultra_stats *pStats) {
+    size_t nInputSize = 0;
+    size_t nCompressedSize = 0;
+    int i;
+
+    if (nNumSegments < 1) return -1;
+    for (i = 0; i < nNumSegments; i++) {
+        if (!pSegments[i].data && pSegments[i].size) return -1;
+        nInputSize += pSegments[i].size;
+    }
+
+    if (apultra_compress_segments(pSegments,
+            nNumSegments,
+            &pOutBuffer,
+            nInputSize,
+            &nMaxOutBufferSize,
+            &nCompressedSize,
+            nFlags,
+            &nMaxWindowSize,
+            1,
+            nDictionarySize,
+            NULL,
+            progress,
+            pStats))
+        return -1;
+
+    return nCompressedSize;
+}
+
+/**
+ * Read one bit of a compressed stream
+ *
+ * @param ppInData pointer to the current input position, updated
+ * @param pInDataEnd end of compressed data
+ * @param nCurBitMask mask of the next bit in the current tag byte, updated
+ * @param nBits current tag byte, updated
+ *
+ * @return bit (0 or 1), or -1 for an unexpected end of data
+ */
+static int apultra_read_parse_bit(const unsigned char **ppInData,
+    const unsigned char *pInDataEnd,
+    int *nCurBitMask,
+    unsigned char *nBits) {
+    int nBit;
+
+    if ((*nCurBitMask) == 0) {
+        if ((*ppInData) >= pInDataEnd) return -1;
+        (*nBits) = *(*ppInData)++;
+        (*nCurBitMask) = 128;
+    }
+
+    nBit = ((*nBits) & 128) ? 1 : 0;
+    (*nBits) <<= 1;
+    (*nCurBitMask) >>= 1;
+
+    return nBit;
+}
+
+/**
+ * Read one gamma2 value of a compressed stream
+ *
+ * @param ppInData pointer to the current input position, updated
+ * @param pInDataEnd end of compressed data
+ * @param nCurBitMask mask of the next bit in the current tag byte, updated
+ * @param nBits current tag byte, updated
+ *
+ * @return value, or -1 for an unexpected end of data
+ */
+static int apultra_read_parse_gamma2(const unsigned char **ppInData,
+    const unsigned char *pInDataEnd,
+    int *nCurBitMask,
+    unsigned char *nBits) {
+    int nValue = 1;
+    int nBit;
+
+    do {
+        nBit = apultra_read_parse_bit(ppInData, pInDataEnd, nCurBitMask, nBits);
+        if (nBit < 0 || nValue >= (1 << 24)) return -1;
+        nValue = (nValue << 1) + nBit;
+        nBit = apultra_read_parse_bit(ppInData, pInDataEnd, nCurBitMask, nBits);
+        if (nBit < 0) return -1;
+    } while (nBit);
+
+    return nValue;
+}
+
+/**
+ * Read back the commands of a compressed stream, and keep those that are still at the same place in new data
+ *
+ * The commands that describe the first nPrefixSize bytes are kept at the same position, and the commands that start
+ * in the last nSuffixSize bytes are moved by the difference between the new and the previous size. Matches that span
+ * the changes are cut down to their parts before and after them. The other commands are dropped.
+ *
+ * When the size changed, the offsets of the kept commands at the end that copy from before the changes are moved by
+ * as much as the data, and so are the rep offsets of their states, so that they still copy the same bytes.
+ *
+ * @param pCompressedData compressed data
+ * @param nCompressedSize compressed size in bytes
+ * @param nPreviousSize size of the data that the stream decompresses to
+ * @param nNewSize size of the new data
+ * @param nPrefixSize number of bytes at the start of the data that didn't change
+ * @param nSuffixSize number of bytes at the end of the data that didn't change
+ * @param pParse returned command for each kept position where one starts: length 0 for a literal, 1 for a 4 bits
+ * offset match, 2 or more for a match
+ * @param pParseState returned state that each kept command was written in (as for apultra_get_next_parse_state()),
+ * -1 for the other positions; must be filled with -1 beforehand
+ *
+ * @return 0 for success, -1 if the stream is invalid or doesn't decompress to nPreviousSize bytes
+ */
+static int apultra_read_parse(const unsigned char *pCompressedData,
+    const size_t nCompressedSize,
+    const int nPreviousSize,
+    const int nNewSize,
+    const int nPrefixSize,
+    const int nSuffixSize,
+    apultra_final_match *pParse,
+    int *pParseState) {
+    const unsigned char *pInData = pCompressedData;
+    const unsigned char *pInDataEnd = pCompressedData + nCompressedSize;
+    const int nSuffixStart = nPreviousSize - nSuffixSize;
+    const int nSizeDelta = nNewSize - nPreviousSize;
+    int nCurBitMask = 0;
+    unsigned char nBits = 0;
+    int nState = 0, nSuffixState = -1;
+    int nPos = 0;
+
+    if (nPreviousSize < 1 || pInData >= pInDataEnd) return -1;
+
+    while (1) {
+        apultra_final_match match;
+        int nBit;
+
+        if (nPos == 0) {
+            /* First byte, always a literal */
+            pInData++;
+            match.length = 0;
+            match.offset = 0;
+        } else {
+            nBit = apultra_read_parse_bit(&pInData, pInDataEnd, &nCurBitMask, &nBits);
+            if (nBit < 0) return -1;
+
+            if (!nBit) {
+                /* '0': literal */
+                if (pInData >= pInDataEnd) return -1;
+                pInData++;
+                match.length = 0;
+                match.offset = 0;
+            } else {
+                nBit = apultra_read_parse_bit(&pInData, pInDataEnd, &nCurBitMask, &nBits);
+                if (nBit < 0) return -1;
+
+                if (!nBit) {
+                    /* '10': 8+n bits offset, or rep-match */
+                    int nMatchOffsetHi = apultra_read_parse_gamma2(&pInData, pInDataEnd, &nCurBitMask, &nBits);
+                    int nMatchLen;
+
+                    if (nMatchOffsetHi < 0) return -1;
+                    nMatchOffsetHi -= (nState & 1) ? 3 : 2;
+
+                    if (nMatchOffsetHi >= 0) {
+                        if (pInData >= pInDataEnd) return -1;
+                        match.offset = (nMatchOffsetHi << 8) | (int)(*pInData++);
+
+                        nMatchLen = apultra_read_parse_gamma2(&pInData, pInDataEnd, &nCurBitMask, &nBits);
+                        if (nMatchLen < 0) return -1;
+                        if (match.offset < 128 || match.offset >= MINMATCH4_OFFSET)
+                            nMatchLen += 2;
+                        else if (match.offset >= MINMATCH3_OFFSET)
+                            nMatchLen++;
+                    } else {
+                        match.offset = nState >> 1;
+                        nMatchLen = apultra_read_parse_gamma2(&pInData, pInDataEnd, &nCurBitMask, &nBits);
+                        if (nMatchLen < 0) return -1;
+                    }
+
+                    match.length = nMatchLen;
+                } else {
+                    nBit = apultra_read_parse_bit(&pInData, pInDataEnd, &nCurBitMask, &nBits);
+                    if (nBit < 0) return -1;
+
+                    if (!nBit) {
+                        /* '110': 7 bits offset + 1 bit length, or EOD */
+                        int nCommand;
+
+                        if (pInData >= pInDataEnd) return -1;
+                        nCommand = (int)(*pInData++);
+                        if (nCommand == 0x00) break;
+
+                        match.offset = nCommand >> 1;
+                        match.length = (nCommand & 1) + 2;
+                    } else {
+                        /* '111': 4 bits offset */
+                        int nShortMatchOffset = 0;
+                        int i;
+
+                        for (i = 0; i < 4; i++) {
+                            nBit = apultra_read_parse_bit(&pInData, pInDataEnd, &nCurBitMask, &nBits);
+                            if (nBit < 0) return -1;
+                            nShortMatchOffset = (nShortMatchOffset << 1) | nBit;
+                        }
+
+                        match.offset = nShortMatchOffset;
+                        match.length = 1;
+                    }
                 }
+            }
+        }
+
+        const int nLength = (match.length >= 1) ? match.length : 1;
+        if (nLength > (nPreviousSize - nPos)) return -1;
+
+        if ((nPos + nLength) <= nPrefixSize) {
+            pParse[nPos] = match;
+            pParseState[nPos] = nState;
+        } else if (nPos >= nSuffixStart) {
+            apultra_final_match suffix_match = match;
+
+            if (nSuffixState < 0) {
+                /* First kept command at the end: its rep offset comes from a command that was dropped */
+                nSuffixState = nState;
+                if (nSizeDelta && (nState >> 1) > 0 && (nPos - (nState >> 1)) < nPrefixSize)
+                    nSuffixState += nSizeDelta * 2;
+            }
+            if (nSizeDelta && suffix_match.offset > 0 && (nPos - suffix_match.offset) < nPrefixSize) {
+                /* Copies from before the changes: the distance changed with the size */
+                suffix_match.offset += nSizeDelta;
+                if (suffix_match.length == 1 && suffix_match.offset > 15) suffix_match.offset = match.offset;
+            }
+
+            pParse[nPos + nSizeDelta] = suffix_match;
+            pParseState[nPos + nSizeDelta] = nSuffixState;
+            nSuffixState = apultra_get_next_parse_state(nSuffixState, &suffix_match);
+        } else if (match.length >= 2) {
+            /* Match that spans the changes: keep what it copies on each side of them */
+            if ((nPrefixSize - nPos) >= 2) {
+                pParse[nPos].offset = match.offset;
+                pParse[nPos].length = nPrefixSize - nPos;
+                pParseState[nPos] = nState;
+            }
+            if ((nPos + nLength - nSuffixStart) >= 2) {
+                apultra_final_match suffix_match;
+
+                suffix_match.offset = match.offset;
+                suffix_match.length = nPos + nLength - nSuffixStart;
+                if (nSizeDelta && (nSuffixStart - match.offset) < nPrefixSize) suffix_match.offset += nSizeDelta;
+
+                /* The end of the match follows the same match in the previous data */
+                nSuffixState = suffix_match.offset << 1;
+                pParse[nSuffixStart + nSizeDelta] = suffix_match;
+                pParseState[nSuffixStart + nSizeDelta] = nSuffixState;
+                nSuffixState = apultra_get_next_parse_state(nSuffixState, &suffix_match);
+            }
+        }
+
+        nState = apultra_get_next_parse_state(nState, &match);
+        nPos += nLength;
+    }
+
+    return (nPos == nPreviousSize) ? 0 : -1;
+}
+
+/**
+ * Check that a command that was kept from a previous parse is still valid for the new data
+ *
+ * @param pInWindow pointer to the new data
+ * @param nPos position of the command
+ * @param nEndOffset size of the new data
+ * @param nMaxOffset maximum match offset
+ * @param pMatch command
+ *
+ * @return non-zero if the command still describes the same bytes, 0 if not
+ */
+static int apultra_is_kept_match_valid(const unsigned char *pInWindow,
+    const int nPos,
+    const int nEndOffset,
+    const int nMaxOffset,
+    const apultra_final_match *pMatch) {
+    if (pMatch->length >= 2) {
+        return pMatch->offset >= MIN_OFFSET && pMatch->offset <= nMaxOffset && pMatch->offset <= nPos
+               && pMatch->length <= (nEndOffset - nPos)
+               && !memcmp(pInWindow + nPos, pInWindow + nPos - pMatch->offset, pMatch->length);
+    } else if (pMatch->length == 1) {
+        if (pMatch->offset == 0) return pInWindow[nPos] == 0;
+        return pMatch->offset <= nPos && pInWindow[nPos] == pInWindow[nPos - pMatch->offset];
+    } else {
+        return 1;
+    }
+}
+
+/**
+ * Get the start and the end of a kept match that no longer describes the same bytes, that still copy from the same
+ * offset
+ *
+ * @param pInWindow pointer to the new data
+ * @param nPos position of the match
+ * @param nEndOffset size of the new data
+ * @param nMaxOffset maximum match offset
+ * @param pMatch match
+ * @param pHeadLength pointer to returned number of bytes at the start of the match that it still copies, or 0
+ * @param pTailLength pointer to returned number of bytes at the end of the match that it still copies, or 0
+ */
+static void apultra_get_kept_match_ends(const unsigned char *pInWindow,
+    const int nPos,
+    const int nEndOffset,
+    const int nMaxOffset,
+    const apultra_final_match *pMatch,
+    int *pHeadLength,
+    int *pTailLength) {
+    const int nMatchOffset = pMatch->offset;
+    const int nMatchLen = pMatch->length;
+    int nHead = 0, nTail = 0;
+
+    if (nMatchLen >= 2 && nMatchOffset >= MIN_OFFSET && nMatchOffset <= nMaxOffset && nMatchOffset <= nPos
+        && nMatchLen <= (nEndOffset - nPos)) {
+        const unsigned char *pMatchData = pInWindow + nPos;
+        const unsigned char *pRefData = pMatchData - nMatchOffset;
+
+        while (nHead < nMatchLen && pMatchData[nHead] == pRefData[nHead]) nHead++;
+        while (nTail < (nMatchLen - nHead) && pMatchData[nMatchLen - 1 - nTail] == pRefData[nMatchLen - 1 - nTail])
+            nTail++;
+    }
+
+    *pHeadLength = (nHead >= 2) ? nHead : 0;
+    *pTailLength = (nTail >= 2) ? nTail : 0;
+}
+
+/**
+ * Check if a match of a given length can be written with a given offset, when it isn't a rep match
+ *
+ * @param nMatchOffset match offset
+ * @param nMatchLen match length
+ *
+ * @return non-zero if the length is long enough for the offset, 0 if not
+ */
+static int apultra_is_match_len_allowed(const int nMatchOffset, const int nMatchLen) {
+    return nMatchLen >= 2 && (nMatchOffset < MINMATCH3_OFFSET || nMatchLen >= 3)
+           && (nMatchOffset < MINMATCH4_OFFSET || nMatchLen >= 4);
+}
+
+/**
+ * Find the matches of the ranges of a block that are parsed again, parse them and put their commands in the parse
+ *
+ * @param pArg ranges to parse again (apultra_recompression)
+ * @param pInWindow pointer to input data window (previously compressed bytes + bytes to compress)
+ * @param nBlockOffset offset of the block in the input data
+ * @param nPreviousBlockSize number of previously compressed bytes (or 0 for none)
+ * @param nInDataSize number of input bytes to compress
+ * @param nBlockFlags bit 0: 1 for first block, 0 otherwise; bit 1: 1 for last block, 0 otherwise
+ *
+ * @return 0 for success, -1 for error
+ */
+static int apultra_recompress_block(void *pArg,
+    const unsigned char *pInWindow,
+    const size_t nBlockOffset,
+    const int nPreviousBlockSize,
+    const int nInDataSize,
+    const int nBlockFlags) {
+    apultra_recompression *pRecompression = (apultra_recompression *)pArg;
+    apultra_compressor *pCompressor = pRecompression->compressor;
+    apultra_final_match *pParse = pRecompression->parse;
+    int *pParseState = pRecompression->parse_state;
+    int *pRangeStart = pRecompression->range_start;
+    int *pRangeEnd = pRecompression->range_end;
+    const int nBlockStart = (int)nBlockOffset;
+    const int nBlockEnd = nBlockStart + nInDataSize;
+    int nNumPieces = 0;
+    int i, r;
+
+    for (r = 0; r < pRecompression->num_ranges; r++) {
+        if (pRangeStart[r] < nBlockEnd && pRangeEnd[r] > nBlockStart) {
+            const int nPieceStart = (pRangeStart[r] > nBlockStart) ? pRangeStart[r] : nBlockStart;
+            const int nPieceEnd = (pRangeEnd[r] < nBlockEnd) ? pRangeEnd[r] : nBlockEnd;
+
+            pRecompression->piece_start[nNumPieces] = nPieceStart - nBlockStart + nPreviousBlockSize;
+            pRecompression->piece_end[nNumPieces] = nPieceEnd - nBlockStart + nPreviousBlockSize;
+            nNumPieces++;
+        }
+    }
+
+    if (!nNumPieces) return 0;
+
+    pCompressor->matchfinder.phase_time = pCompressor->stats->phase_time;
+    if (apultra_find_block_matches_in_ranges(&pCompressor->matchfinder,
+            pInWindow,
+            nPreviousBlockSize,
+            nInDataSize,
+            nBlockFlags,
+            NMATCHES_PER_INDEX,
+            pRecompression->piece_start,
+            pRecompression->piece_end,
+            nNumPieces))
+        return -1;
+
+    pCompressor->stats->num_blocks++;
+
+    for (r = 0; r < pRecompression->num_ranges; r++) {
+        const int nPieceStart = (pRangeStart[r] > nBlockStart) ? pRangeStart[r] : nBlockStart;
+        const int nPieceEnd = (pRangeEnd[r] < nBlockEnd) ? pRangeEnd[r] : nBlockEnd;
+        const int nDelta = nPieceStart - nBlockStart;
+        apultra_compressor piece_compressor;
+        const apultra_final_match *pPieceMatch;
+        int nPieceState, nSyncPos, nCurRepMatchOffset;
+
+        if (pRangeStart[r] >= nBlockEnd || pRangeEnd[r] <= nBlockStart) continue;
+
+        /* Get the state that the first command of the piece is written in, from the commands before it */
+        while (pRecompression->walk_offset < nPieceStart) {
+            const apultra_final_match *pMatch = &pParse[pRecompression->walk_offset];
+
+            pRecompression->walk_state = apultra_get_next_parse_state(pRecompression->walk_state, pMatch);
+            pRecompression->walk_offset += (pMatch->length >= 1) ? pMatch->length : 1;
+        }
+        if (pRecompression->walk_offset != nPieceStart) return -1;
+
+        /* Parse the piece, with the per-position tables rebased to start at the piece */
+        piece_compressor = *pCompressor;
+        piece_compressor.matchfinder.match += (nDelta << MATCHES_PER_INDEX_SHIFT);
+        piece_compressor.matchfinder.match_depth += (nDelta << MATCHES_PER_INDEX_SHIFT);
+        piece_compressor.matchfinder.match1 += nDelta;
+        piece_compressor.block_size = nPieceEnd - nPieceStart;
+
+        nCurRepMatchOffset = pRecompression->walk_state >> 1;
+        apultra_optimize_block(&piece_compressor,
+            pInWindow,
+            nPreviousBlockSize + nDelta,
+            nPieceEnd - nPieceStart,
+            &nCurRepMatchOffset,
+            nBlockFlags | ((nPieceStart > nBlockStart) ? 4 : 0));
+
+        /* Past the changes, go back to the previous commands as soon as the new parse meets them in the same
+         * state: they were chosen for what follows, that the new parse doesn't see */
+        pPieceMatch = piece_compressor.best_match - nPieceStart;
+        nPieceState = pRecompression->walk_state;
+        for (nSyncPos = nPieceStart; nSyncPos < nPieceEnd;) {
+            if (nSyncPos >= pRecompression->range_core_end[r] && pParseState[nSyncPos] == nPieceState) break;
+            nPieceState = apultra_get_next_parse_state(nPieceState, &pPieceMatch[nSyncPos]);
+            nSyncPos += (pPieceMatch[nSyncPos].length >= 1) ? pPieceMatch[nSyncPos].length : 1;
+        }
+
+        memcpy(pParse + nPieceStart, pPieceMatch + nPieceStart, (nSyncPos - nPieceStart) * sizeof(apultra_final_match));
+        for (i = nPieceStart; i < nSyncPos; i++) pParseState[i] = -1;
+
+        if (nSyncPos < nPieceEnd) {
+            /* The rest of the range, in this block and the next one, keeps the previous commands */
+            pRangeEnd[r] = nSyncPos;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Compress memory that is a slightly edited version of previously compressed data, by parsing only the changes again
+ *
+ * @param pPreviousInputData previous version of the input data
+ * @param nPreviousInputSize previous input size in bytes
+ * @param pPreviousCompressedData compressed data of the previous version
+ * @param nPreviousCompressedSize size of the previous compressed data in bytes
+ * @param pInputData pointer to input(source) data to compress
+ * @param pOutBuffer buffer for compressed data
+ * @param nInputSize input(source) size in bytes
+ * @param nMaxOutBufferSize maximum capacity of compression buffer
+ * @param nFlags compression flags (number of parsing threads in APULTRA_FLAG_THREADS_MASK, APULTRA_FLAG_xxx, or 0)
+ * @param nMaxWindowSize maximum window size to use (0 for default), as for the previous compressed data
+ * @param pStats pointer to compression stats that are filled if this function is successful, or NULL
+ *
+ * @return actual compressed size, or -1 for error
+ */
+size_t apultra_recompress(const unsigned char *pPreviousInputData,
+    size_t nPreviousInputSize,
+    const unsigned char *pPreviousCompressedData,
+    size_t nPreviousCompressedSize,
+    const unsigned char *pInputData,
+    unsigned char *pOutBuffer,
+    size_t nInputSize,
+    size_t nMaxOutBufferSize,
+    const unsigned int nFlags,
+    size_t nMaxWindowSize,
+    apultra_stats *pStats) {
+    const int nMaxOffset = nMaxWindowSize ? (int)nMaxWindowSize : MAX_OFFSET;
+    const int nNewSize = (int)nInputSize;
+    const int nPreviousSize = (int)nPreviousInputSize;
+    const int nBlockSize = apultra_get_block_size(nInputSize);
+    apultra_compressor compressor;
+    apultra_final_match *pParse;
+    int *pParseState;
+    unsigned char *pReparse;
+    int *pRangeStart, *pRangeEnd, *pRangeCoreEnd;
+    int nNumRanges = 0, nReparseSize = 0;
+    int nPrefixSize = 0, nSuffixSize = 0;
+    int nCurBitsOffset = INT_MIN, nCurBitShift = 0, nFollowsLiteral = 0, nRepMatchOffset = 0;
+    int nCompressorReady = 0;
+    int nError = 0;
+    int i;
+    apultra_stats stats;
+
+    if (nInputSize < 1 || nPreviousInputSize < 1 || nInputSize > (INT_MAX / 4) || nPreviousInputSize > (INT_MAX / 4))
+        return -1;
+
+    /* Find the bytes that didn't change at the start and at the end */
+    while (nPrefixSize < nNewSize && nPrefixSize < nPreviousSize
+           && pInputData[nPrefixSize] == pPreviousInputData[nPrefixSize])
+        nPrefixSize++;
+    while (nSuffixSize < (nNewSize - nPrefixSize) && nSuffixSize < (nPreviousSize - nPrefixSize)
+           && pInputData[nNewSize - 1 - nSuffixSize] == pPreviousInputData[nPreviousSize - 1 - nSuffixSize])
+        nSuffixSize++;
+
+    pParse = (apultra_final_match *)malloc(nNewSize * sizeof(apultra_final_match));
+    pParseState = (int *)malloc(nNewSize * sizeof(int));
+    pReparse = (unsigned char *)malloc(nNewSize);
+    pRangeStart = (int *)malloc(nNewSize * 3 * sizeof(int));
+    if (!pParse || !pParseState || !pReparse || !pRangeStart) {
+        if (pRangeStart) free(pRangeStart);
+        if (pReparse) free(pReparse);
+        if (pParseState) free(pParseState);
+        if (pParse) free(pParse);
+        return -1;
+    }
+    pRangeEnd = pRangeStart + nNewSize;
+    pRangeCoreEnd = pRangeEnd + nNewSize;
+
+    memset(pParse, 0, nNewSize * sizeof(apultra_final_match));
+    memset(pParseState, 0xff, nNewSize * sizeof(int));
+    memset(pReparse, 0, nNewSize);
+
+    if (apultra_read_parse(pPreviousCompressedData,
+            nPreviousCompressedSize,
+            nPreviousSize,
+            nNewSize,
+            nPrefixSize,
+            nSuffixSize,
+            pParse,
+            pParseState))
+        nError = -1;
+
+    if (!nError) {
+        /* Mark what is no longer described by a valid command, and the margin around it, to be parsed again */
+        i = 0;
+        while (i < nNewSize) {
+            if (pParseState[i] >= 0 && apultra_is_kept_match_valid(pInputData, i, nNewSize, nMaxOffset, &pParse[i])) {
+                i += (pParse[i].length >= 1) ? pParse[i].length : 1;
             } else {
-                nError = -1;
+                int nChangeStart, nHeadLength = 0, nTailLength = 0;
+                int j;
+
+                /* A change in the middle of a match leaves its start and its end copying the same bytes: keep them as
+                 * two matches, and only parse the changed bytes again */
+                if (pParseState[i] >= 0)
+                    apultra_get_kept_match_ends(
+                        pInputData, i, nNewSize, nMaxOffset, &pParse[i], &nHeadLength, &nTailLength);
+                if (nTailLength) {
+                    const int nTailPos = i + pParse[i].length - nTailLength;
+
+                    pParse[nTailPos].offset = pParse[i].offset;
+                    pParse[nTailPos].length = nTailLength;
+                    pParseState[nTailPos] = pParse[i].offset << 1;
+                }
+                if (nHeadLength) {
+                    pParse[i].length = nHeadLength;
+                    i += nHeadLength;
+                }
+
+                nChangeStart = i;
+                pParseState[i] = -1;
+                do { pReparse[i++] = 2; } while (i < nNewSize && pParseState[i] < 0);
+
+                for (j = (nChangeStart > RECOMPRESS_MARGIN) ? (nChangeStart - RECOMPRESS_MARGIN) : 0; j < nChangeStart;
+                     j++) {
+                    if (!pReparse[j]) pReparse[j] = 1;
+                }
+                for (j = i; j < nNewSize && j < (i + RECOMPRESS_MARGIN); j++) pReparse[j] = 1;
             }
+        }
 
-            nPreviousBlockSize = nInDataSize;
-            nNumBlocks++;
+        /* Parse again the commands that the margins cut through, except for the part of a match between the margins
+         * when it is still long enough to be kept, and gather the ranges */
+        i = 0;
+        while (i < nNewSize) {
+            if (pParseState[i] >= 0) {
+                const int nLength = (pParse[i].length >= 1) ? pParse[i].length : 1;
+                int j, nKeepStart = 0, nKeepEnd;
+
+                while (nKeepStart < nLength && pReparse[i + nKeepStart]) nKeepStart++;
+                nKeepEnd = nKeepStart;
+                while (nKeepEnd < nLength && !pReparse[i + nKeepEnd]) nKeepEnd++;
+
+                if (nKeepStart > 0 || nKeepEnd < nLength) {
+                    if (nLength < 2 || !apultra_is_match_len_allowed(pParse[i].offset, nKeepEnd - nKeepStart)) {
+                        nKeepStart = 0;
+                        nKeepEnd = 0;
+                    } else if (nKeepStart > 0) {
+                        /* Keep the middle as a match of its own; what the margin covers is still described, for when
+                         * the new parse goes back to the previous commands before it */
+                        pParse[i + nKeepStart].offset = pParse[i].offset;
+                        pParse[i + nKeepStart].length = nKeepEnd - nKeepStart;
+                        pParseState[i + nKeepStart] = pParse[i].offset << 1;
+                        if (nKeepStart >= 2) {
+                            pParse[i].length = nKeepStart;
+                        } else {
+                            pParse[i].offset = 0;
+                            pParse[i].length = 0;
+                        }
+                    } else {
+                        pParse[i].length = nKeepEnd;
+                    }
+
+                    for (j = i; j < (i + nLength); j++) {
+                        if ((j < (i + nKeepStart) || j >= (i + nKeepEnd)) && !pReparse[j]) pReparse[j] = 1;
+                    }
+                }
+                i += nLength;
+            } else {
+                i++;
+            }
+        }
+
+        for (i = 0; i < nNewSize;) {
+            if (pReparse[i]) {
+                pRangeStart[nNumRanges] = i;
+                pRangeCoreEnd[nNumRanges] = i;
+                while (i < nNewSize && pReparse[i]) {
+                    if (pReparse[i] == 2) pRangeCoreEnd[nNumRanges] = i + 1;
+                    i++;
+                }
+                pRangeEnd[nNumRanges] = i;
+                nReparseSize += i - pRangeStart[nNumRanges];
+                nNumRanges++;
+            } else {
+                i++;
+            }
         }
+    }
+
+    if (!nError && nReparseSize > (nNewSize / RECOMPRESS_MAX_FRACTION)) {
+        /* Most of the data has to be parsed again anyway, compress all of it, for the best ratio */
+        free(pRangeStart);
+        free(pReparse);
+        free(pParseState);
+        free(pParse);
+
+        nError = (int)apultra_compress(
+            pInputData, pOutBuffer, nInputSize, nMaxOutBufferSize, nFlags, nMaxWindowSize, 0, NULL, pStats);
+        if (nError >= 0 && pStats) pStats->num_reparsed_bytes = (long long)nInputSize;
+        return nError;
+    }
+
+    if (!nError && nNumRanges) {
+        if (apultra_compressor_init(&compressor,
+                &stats,
+                nBlockSize,
+                nBlockSize * 2,
+                apultra_get_max_arrivals(nInputSize, 0, nBlockSize),
+                nFlags))
+            nError = -1;
+        else
+            nCompressorReady = 1;
 
-        if (!nError && nOriginalSize < nInputSize) {
-            if (progress) progress(nOriginalSize, nCompressedSize);
+        compressor.matchfinder.max_offset = nMaxOffset;
+        compressor.matchfinder.long_repeat_max_offset = nMaxOffset;
+    } else {
+        apultra_init_stats(&stats);
+    }
+    stats.num_reparsed_bytes = nReparseSize;
+
+    if (!nError && nNumRanges) {
+        apultra_input_segment segment;
+        apultra_recompression recompression;
+
+        segment.data = pInputData;
+        segment.size = nInputSize;
+
+        recompression.compressor = &compressor;
+        recompression.parse = pParse;
+        recompression.parse_state = pParseState;
+        recompression.range_start = pRangeStart;
+        recompression.range_end = pRangeEnd;
+        recompression.range_core_end = pRangeCoreEnd;
+        recompression.piece_start = pRangeStart + nNumRanges;
+        recompression.piece_end = pRangeEnd + nNumRanges;
+        recompression.num_ranges = nNumRanges;
+        recompression.walk_offset = 0;
+        recompression.walk_state = 0;
+
+        /* Blocks are the same as when compressing all the data; only find matches and parse where it's needed */
+        nError = apultra_compress_blocks(&segment, 1, nInputSize, 0, nBlockSize, apultra_recompress_block, &recompression);
+    }
+
+    if (nCompressorReady) apultra_compressor_destroy(&compressor);
+
+    if (!nError) {
+        long long nStartTime = apultra_get_time_ns();
+        int nOutDataSize;
+
+        apultra_fix_parse_rep_matches(pParse, 0, nNewSize, 0);
+        nOutDataSize = apultra_write_block(&stats,
+            pParse,
+            pInputData,
+            0,
+            nMaxOffset,
+            nNewSize,
+            pOutBuffer,
+            (nMaxOutBufferSize < INT_MAX) ? (int)nMaxOutBufferSize : INT_MAX,
+            &nCurBitsOffset,
+            &nCurBitShift,
+            &nFollowsLiteral,
+            &nRepMatchOffset,
+            3);
+
+        stats.phase_time[APULTRA_PHASE_WRITE] += apultra_get_time_ns() - nStartTime;
+        if (nOutDataSize < 0) nError = -1;
+        if (!nError) {
+            if (pStats) *pStats = stats;
+            nError = nOutDataSize;
         }
     }
 
-    if (progress) progress(nOriginalSize, nCompressedSize);
+    free(pRangeStart);
+    free(pReparse);
+    free(pParseState);
+    free(pParse);
+
+    return nError;
+}
+
+/**
+ * Find the matches of a block, parse it and gather its commands
+ *
+ * @param pArg commands gathered so far (apultra_parse_tokens)
+ * @param pInWindow pointer to input data window (previously compressed bytes + bytes to compress)
+ * @param nBlockOffset offset of the block in the input data
+ * @param nPreviousBlockSize number of previously compressed bytes (or 0 for none)
+ * @param nInDataSize number of input bytes to compress
+ * @param nBlockFlags bit 0: 1 for first block, 0 otherwise; bit 1: 1 for last block, 0 otherwise
+ *
+ * @return 0 for success, -1 for error
+ */
+static int apultra_parse_block(void *pArg,
+    const unsigned char *pInWindow,
+    const size_t nBlockOffset,
+    const int nPreviousBlockSize,
+    const int nInDataSize,
+    const int nBlockFlags) {
+    apultra_parse_tokens *pParse = (apultra_parse_tokens *)pArg;
+    apultra_compressor *pCompressor = pParse->compressor;
+    int nCurRepMatchOffset = pParse->state >> 1;
+    int i;
+
+    if (apultra_find_all_block_matches(&pCompressor->matchfinder,
+            pInWindow,
+            nPreviousBlockSize,
+            nInDataSize,
+            nBlockFlags,
+            NMATCHES_PER_INDEX,
+            NULL))
+        return -1;
+
+    apultra_optimize_block(pCompressor, pInWindow, nPreviousBlockSize, nInDataSize, &nCurRepMatchOffset, nBlockFlags);
+    pCompressor->stats->num_blocks++;
+
+    /* Gather the commands that start in this block; the first byte of the data is always a literal */
+    if (nBlockFlags & 1) pCompressor->best_match[0].length = 0;
+
+    for (i = 0; i < nInDataSize;) {
+        const apultra_final_match *pMatch = &pCompressor->best_match[i];
+        apultra_token *pToken;
+
+        if (pParse->num_tokens >= pParse->max_tokens) return -1;
+
+        pToken = &pParse->tokens[pParse->num_tokens++];
+        pToken->length = pMatch->length;
+        pToken->offset = (pMatch->length >= 1) ? pMatch->offset : 0;
+
+        pParse->state = apultra_get_next_parse_state(pParse->state, pMatch);
+        i += (pMatch->length >= 1) ? pMatch->length : 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Find the most optimal commands for compressing memory, without encoding them
+ *
+ * @param pInputData pointer to input(source) data to compress
+ * @param pTokens buffer for the commands
+ * @param nInputSize input(source) size in bytes
+ * @param nMaxTokens maximum number of commands in the buffer; there is at most one per byte to compress
+ * @param nFlags compression flags (number of parsing threads in APULTRA_FLAG_THREADS_MASK, APULTRA_FLAG_xxx, or 0)
+ * @param nMaxWindowSize maximum window size to use (0 for default)
+ * @param nDictionarySize size of dictionary in front of input data (0 for none)
+ * @param pStats pointer to compression stats that are filled if this function is successful, or NULL; only the
+ * optimizer's stats are filled, the commands are counted by apultra_encode()
+ *
+ * @return number of commands, or -1 for error
+ */
+size_t apultra_parse(const unsigned char *pInputData,
+    apultra_token *pTokens,
+    size_t nInputSize,
+    size_t nMaxTokens,
+    const unsigned int nFlags,
+    size_t nMaxWindowSize,
+    size_t nDictionarySize,
+    apultra_stats *pStats) {
+    apultra_compressor compressor;
+    apultra_input_segment segment;
+    apultra_parse_tokens parse;
+    const int nBlockSize = apultra_get_block_size(nInputSize);
+    const int nMaxOffset = nMaxWindowSize ? (int)nMaxWindowSize : MAX_OFFSET;
+    int nError;
+    apultra_stats stats;
+
+    if (nDictionarySize >= nInputSize || nInputSize > INT_MAX) return -1;
+
+    if (apultra_compressor_init(&compressor,
+            &stats,
+            nBlockSize,
+            nBlockSize * 2,
+            apultra_get_max_arrivals(nInputSize, nDictionarySize, nBlockSize),
+            nFlags))
+        return -1;
+
+    compressor.matchfinder.max_offset = nMaxOffset;
+    compressor.matchfinder.long_repeat_max_offset = nMaxOffset;
+
+    segment.data = pInputData;
+    segment.size = nInputSize;
+
+    parse.compressor = &compressor;
+    parse.tokens = pTokens;
+    parse.max_tokens = nMaxTokens;
+    parse.num_tokens = 0;
+    parse.state = 0;
+
+    nError = apultra_compress_blocks(&segment, 1, nInputSize, nDictionarySize, nBlockSize, apultra_parse_block, &parse);
 
     apultra_compressor_destroy(&compressor);
 
-    if (nError) {
+    if (nError) return -1;
+    if (pStats) *pStats = stats;
+    return parse.num_tokens;
+}
+
+/**
+ * Encode commands into compressed data
+ *
+ * The commands are checked against the input data: they must describe all of the bytes after the dictionary, starting
+ * with a literal, and each of them must be encodable where it is.
+ *
+ * @param pInputData pointer to input(source) data that the commands describe
+ * @param pTokens commands, as found by apultra_parse()
+ * @param pOutBuffer buffer for compressed data
+ * @param nInputSize input(source) size in bytes
+ * @param nNumTokens number of commands
+ * @param nMaxOutBufferSize maximum capacity of compression buffer
+ * @param nMaxWindowSize maximum window size that the commands may use (0 for default)
+ * @param nDictionarySize size of dictionary in front of input data (0 for none)
+ * @param pStats pointer to compression stats that are filled with the encoded commands' stats if this function is
+ * successful, or NULL
+ *
+ * @return actual compressed size, or -1 for error
+ */
+size_t apultra_encode(const unsigned char *pInputData,
+    const apultra_token *pTokens,
+    unsigned char *pOutBuffer,
+    size_t nInputSize,
+    size_t nNumTokens,
+    size_t nMaxOutBufferSize,
+    size_t nMaxWindowSize,
+    size_t nDictionarySize,
+    apultra_stats *pStats) {
+    const int nMaxOffset = nMaxWindowSize ? (int)nMaxWindowSize : MAX_OFFSET;
+    const int nStartOffset = (int)nDictionarySize;
+    const int nEndOffset = (int)nInputSize;
+    int nCurBitsOffset = INT_MIN, nCurBitShift = 0, nFollowsLiteral = 0, nRepMatchOffset = 0;
+    apultra_final_match *pBestMatch;
+    int nOutDataSize;
+    int nState = 0;
+    int i = nStartOffset;
+    size_t t;
+    apultra_stats stats;
+
+    if (nDictionarySize >= nInputSize || nInputSize > INT_MAX || nNumTokens < 1 || pTokens[0].length != 0) return -1;
+
+    pBestMatch = (apultra_final_match *)malloc((nEndOffset - nStartOffset) * sizeof(apultra_final_match));
+    if (!pBestMatch) return -1;
+
+    /* Lay the commands out by position, as the writer expects them, and check them on the way */
+    for (t = 0; t < nNumTokens; t++) {
+        apultra_final_match *pMatch = &pBestMatch[i - nStartOffset];
+        const int nMatchLen = pTokens[t].length;
+        const int nMatchOffset = pTokens[t].offset;
+
+        if (nMatchLen < 0 || nMatchLen > (nEndOffset - i)) break;
+
+        if (nMatchLen >= 2) {
+            if (nMatchOffset < MIN_OFFSET || nMatchOffset > nMaxOffset || nMatchOffset > i
+                || memcmp(pInputData + i, pInputData + i - nMatchOffset, nMatchLen))
+                break;
+
+            /* Matches that are too short for their offset can only be rep-matches */
+            if (nMatchOffset != (nState >> 1) || !(nState & 1)) {
+                if ((nMatchOffset >= MINMATCH4_OFFSET && nMatchLen < 4)
+                    || (nMatchOffset >= MINMATCH3_OFFSET && nMatchLen < 3))
+                    break;
+            }
+        } else if (nMatchLen == 1) {
+            if (nMatchOffset < 0 || nMatchOffset > 15 || nMatchOffset > i) break;
+            if (nMatchOffset ? (pInputData[i] != pInputData[i - nMatchOffset]) : (pInputData[i] != 0)) break;
+        }
+
+        pMatch->length = nMatchLen;
+        pMatch->offset = nMatchOffset;
+
+        nState = apultra_get_next_parse_state(nState, pMatch);
+        i += (nMatchLen >= 1) ? nMatchLen : 1;
+    }
+
+    if (t != nNumTokens || i != nEndOffset) {
+        free(pBestMatch);
         return -1;
-    } else {
-        return nCompressedSize;
     }
+
+    apultra_init_stats(&stats);
+
+    nOutDataSize = apultra_write_block(&stats,
+        pBestMatch - nStartOffset,
+        pInputData,
+        nStartOffset,
+        nMaxOffset,
+        nEndOffset,
+        pOutBuffer,
+        (nMaxOutBufferSize < INT_MAX) ? (int)nMaxOutBufferSize : INT_MAX,
+        &nCurBitsOffset,
+        &nCurBitShift,
+        &nFollowsLiteral,
+        &nRepMatchOffset,
+        3);
+
+    free(pBestMatch);
+
+    if (nOutDataSize < 0) return -1;
+    if (pStats) *pStats = stats;
+    return nOutDataSize;
 }
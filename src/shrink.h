@@ -40,9 +40,23 @@
 extern "C" {
 #endif
 
+#define APULTRA_VERSION "1.4.0"
+#define APULTRA_PARSER_REVISION 2 /* bump whenever the same input and settings may compress differently */
+
 #define NARRIVALS_PER_POSITION_MAX 55
 #define NARRIVALS_PER_POSITION_NORMAL 46
 #define NARRIVALS_PER_POSITION_SMALL 9
+#define ARRIVALS_CLEAR_ROWS 64 /* rows of arrivals reset at once, ahead of the forward parser */
+#define ARRIVALS_RING_SIZE 4096 /* rows of arrivals kept in full; must exceed LCP_MAX + ARRIVALS_CLEAR_ROWS */
+
+/** Number of threads for the segmented forward parse, in the compression flags (0 or 1 for a sequential parse) */
+#define APULTRA_FLAG_THREADS_MASK 0xff
+/** Compression flag: parse faster, for a slightly larger output, by skipping the positions inside very long repeats */
+#define APULTRA_FLAG_FAST_PARSE 0x100
+#define MIN_PARSE_SEGMENT_SIZE 8192 /* smallest part of a block that is parsed on its own thread */
+
+#define RECOMPRESS_MARGIN 2048 /* bytes parsed again on each side of a change, so that the new parse can settle */
+#define RECOMPRESS_MAX_FRACTION 2 /* compress all the data again if more than 1/N of it would be parsed again */
 
 #define NMATCHES_PER_INDEX 64
 #define MATCHES_PER_INDEX_SHIFT 6
@@ -81,6 +95,16 @@ typedef struct {
     int score;
 } apultra_arrival;
 
+/** Part of an arrival slot that outlives the ring of full arrival rows, for forward reps and for backtracking */
+typedef struct {
+    unsigned int rep_offset : 21;
+    unsigned int match_len : 11; /* LCP_MAX for longer matches; matches always start at rep_pos */
+
+    unsigned int rep_pos : 21;
+    unsigned int short_offset : 4;
+    int from_slot : 7;
+} apultra_arrival_link;
+
 /** Compression statistics */
 typedef struct _apultra_stats {
     int num_literals;
@@ -112,21 +136,128 @@ typedef struct _apultra_stats {
     int match_divisor;
     int rle1_divisor;
     int rle2_divisor;
+
+    int num_blocks;
+    int num_segments; /* parts of blocks parsed separately, for all blocks (one per block for a sequential parse) */
+    int num_segment_fixes; /* rep-only matches made literals because the segment before them ended differently */
+    long long phase_time[APULTRA_NUM_PHASES]; /* nanoseconds spent in each APULTRA_PHASE_xxx, for all blocks */
+
+    long long num_positions;          /* positions visited by the forward optimizer, all passes */
+    long long num_insert_attempts;    /* arrival candidates costed by the forward optimizer, all passes */
+    long long num_insert_accepts;     /* arrival candidates stored in a slot */
+    long long num_pruned_arrivals;    /* arrivals dropped because they can't catch up with the best one */
+    long long num_skipped_positions;  /* positions inside very long repeats that the forward optimizer didn't visit */
+    long long num_forward_rep_calls;  /* calls to apultra_insert_forward_match(), including recursive ones */
+    long long num_forward_rep_inserts; /* rep candidates added or extended by apultra_insert_forward_match() */
+    int max_forward_rep_depth;
+    int num_reduce_passes;
+    int max_reduce_passes;
+    long long num_reduce_revisits; /* tokens looked at again by reduction passes after the first one, all blocks */
+    long long arrival_histogram[NARRIVALS_PER_POSITION_MAX + 1]; /* positions by number of live arrivals, final pass */
+    long long num_reparsed_bytes; /* bytes that apultra_recompress() parsed again, all of them if it compressed anew */
 } apultra_stats;
 
 /** Compression context */
+struct _apultra_parse_segment;
+
 typedef struct _apultra_compressor {
     apultra_matchfinder matchfinder;
     apultra_final_match *best_match;
     apultra_arrival *arrival;
+    apultra_arrival_link *arrival_link;
     int *first_offset_for_byte;
     int *next_offset_for_pos;
     int *offset_cache;
+    int *worst_cost_for_pos;
     int flags;
     int block_size;
     int max_arrivals;
+    int arrival_ring_mask;
+    int num_threads;
+    struct _apultra_parse_segment *segment;
+    apultra_stats *stats;
+    void (*optimize_forward)(struct _apultra_compressor *pCompressor, const unsigned char *pInWindow,
+        const int nStartOffset, const int nEndOffset, const int nInsertForwardReps, const int *nCurRepMatchOffset,
+        const int nBlockFlags);
+    void (*insert_forward_match)(struct _apultra_compressor *pCompressor, const unsigned char *pInWindow, const int i,
+        const int nMatchOffset, const int nStartOffset, const int nEndOffset, int nDepth);
 } apultra_compressor;
 
+/** Part of a block that the forward optimizer parses on its own thread */
+typedef struct _apultra_parse_segment {
+    apultra_compressor compressor; /* copy of the block's context, rebased to start at this segment */
+    apultra_arrival *arrival;      /* ring of arrivals, owned by this segment */
+    int *worst_cost_for_pos;       /* cost of the last slot per position, owned by this segment */
+    apultra_stats stats;           /* optimizer counters, added to the block's stats once the pass is done */
+    const unsigned char *in_window;
+    int start_offset;
+    int end_offset;
+    int insert_forward_reps;
+    int rep_match_offset;
+    int block_flags;
+} apultra_parse_segment;
+
+/** Compressed stream written for one of the window sizes passed to apultra_compress_multi() */
+typedef struct _apultra_window_output {
+    unsigned char *out_buffer;
+    size_t max_out_size;
+    size_t compressed_size;
+    int max_offset;
+    int cur_bits_offset;      /* write index into the output buffer, of the current byte being filled with bits */
+    int cur_bit_shift;
+    int cur_follows_literal;  /* non-zero if the next command follows a literal */
+    int cur_rep_match_offset; /* rep offset at the start of the next block */
+    apultra_stats stats;
+} apultra_window_output;
+
+/** One part of the input data, for apultra_compress_iov() */
+typedef struct _apultra_input_segment {
+    const unsigned char *data;
+    size_t size;
+} apultra_input_segment;
+
+/** One command of a parse, as found by apultra_parse() and encoded by apultra_encode() */
+typedef struct _apultra_token {
+    int length; /* 0 for a literal, 1 for a 4 bits offset match (offset 0 for a zero byte), 2 or more for a match */
+    int offset;
+} apultra_token;
+
+/** Compression of the input data for each of the window sizes, passed to each block by apultra_compress_multi() */
+typedef struct _apultra_window_compression {
+    apultra_compressor *compressor;
+    apultra_window_output *outputs;
+    int num_outputs;
+    apultra_saved_matches *saved_matches; /* matches of the current block, restored for each output if there are several */
+    int largest_max_offset;
+    int max_out_block_size;
+    const apultra_dictionary_index *dictionary_index; /* index used for the first block, or NULL */
+    void (*progress)(long long nOriginalSize, long long nCompressedSize);
+} apultra_window_compression;
+
+/** Commands gathered by apultra_parse(), block by block */
+typedef struct _apultra_parse_tokens {
+    apultra_compressor *compressor;
+    apultra_token *tokens;
+    size_t max_tokens;
+    size_t num_tokens;
+    int state; /* rep offset << 1 | 1 if the next command follows a literal */
+} apultra_parse_tokens;
+
+/** Ranges of the data that apultra_recompress() parses again, block by block */
+typedef struct _apultra_recompression {
+    apultra_compressor *compressor;
+    apultra_final_match *parse; /* commands for the whole data */
+    int *parse_state;           /* state that each kept command is written in, or -1 where the data is parsed again */
+    int *range_start;
+    int *range_end;
+    int *range_core_end; /* end of the changed bytes of each range, past which the new parse may rejoin */
+    int *piece_start;    /* parts of the ranges in the current block, as offsets into its window */
+    int *piece_end;
+    int num_ranges;
+    int walk_offset; /* offset of the next command whose state isn't known yet */
+    int walk_state;  /* state at walk_offset */
+} apultra_recompression;
+
 /**
  * Get maximum compressed size of input(source) data
  *
@@ -143,7 +274,7 @@ size_t apultra_get_max_compressed_size(size_t nInputSize);
  * @param pOutBuffer buffer for compressed data
  * @param nInputSize input(source) size in bytes
  * @param nMaxOutBufferSize maximum capacity of compression buffer
- * @param nFlags compression flags (set to 0)
+ * @param nFlags compression flags (number of parsing threads in APULTRA_FLAG_THREADS_MASK, APULTRA_FLAG_xxx, or 0)
  * @param nMaxWindowSize maximum window size to use (0 for default)
  * @param nDictionarySize size of dictionary in front of input data (0 for none)
  * @param progress progress function, called after compressing each block, or
@@ -163,6 +294,178 @@ size_t apultra_compress(const unsigned char *pInputData,
     void (*progress)(long long nOriginalSize, long long nCompressedSize),
     apultra_stats *pStats);
 
+/**
+ * Compress memory against a dictionary that was indexed beforehand
+ *
+ * The dictionary's suffixes are not sorted again: only the input's are, and the matches into the dictionary are
+ * looked up in the index. The time taken depends on the input size, much more than on the dictionary size.
+ *
+ * @param pInputData pointer to input(source) data to compress, with the indexed dictionary in front of it
+ * @param pOutBuffer buffer for compressed data
+ * @param nInputSize input(source) size in bytes, dictionary included
+ * @param nMaxOutBufferSize maximum capacity of compression buffer
+ * @param nFlags compression flags (number of parsing threads in APULTRA_FLAG_THREADS_MASK, APULTRA_FLAG_xxx, or 0)
+ * @param nMaxWindowSize maximum window size to use (0 for default)
+ * @param pDictionaryIndex index of the dictionary in front of the input data
+ * @param progress progress function, called after compressing each block, or NULL for none
+ * @param pStats pointer to compression stats that are filled if this function is successful, or NULL
+ *
+ * @return actual compressed size, or -1 for error
+ */
+size_t apultra_compress_indexed(const unsigned char *pInputData,
+    unsigned char *pOutBuffer,
+    size_t nInputSize,
+    size_t nMaxOutBufferSize,
+    const unsigned int nFlags,
+    size_t nMaxWindowSize,
+    const apultra_dictionary_index *pDictionaryIndex,
+    void (*progress)(long long nOriginalSize, long long nCompressedSize),
+    apultra_stats *pStats);
+
+/**
+ * Compress input data that is made of several segments, without gathering them in one buffer first
+ *
+ * The segments are compressed as if they were one after the other in memory: the dictionary, if any, is the first
+ * nDictionarySize bytes of the segments, and may itself span several of them.
+ *
+ * @param pSegments segments of input(source) data to compress, one after the other
+ * @param nNumSegments number of segments
+ * @param pOutBuffer buffer for compressed data
+ * @param nMaxOutBufferSize maximum capacity of compression buffer
+ * @param nFlags compression flags (number of parsing threads in APULTRA_FLAG_THREADS_MASK, APULTRA_FLAG_xxx, or 0)
+ * @param nMaxWindowSize maximum window size to use (0 for default)
+ * @param nDictionarySize size of dictionary at the start of the input data (0 for none)
+ * @param progress progress function, called after compressing each block, or NULL for none
+ * @param pStats pointer to compression stats that are filled if this function is successful, or NULL
+ *
+ * @return actual compressed size, or -1 for error
+ */
+size_t apultra_compress_iov(const apultra_input_segment *pSegments,
+    const int nNumSegments,
+    unsigned char *pOutBuffer,
+    size_t nMaxOutBufferSize,
+    const unsigned int nFlags,
+    size_t nMaxWindowSize,
+    size_t nDictionarySize,
+    void (*progress)(long long nOriginalSize, long long nCompressedSize),
+    apultra_stats *pStats);
+
+/**
+ * Compress memory once for each of several maximum window sizes, finding the matches only once
+ *
+ * @param pInputData pointer to input(source) data to compress
+ * @param pOutBuffers buffer for the compressed data of each window size
+ * @param nInputSize input(source) size in bytes
+ * @param nMaxOutBufferSizes maximum capacity of each compression buffer
+ * @param pCompressedSizes returned compressed size for each window size
+ * @param nFlags compression flags (number of parsing threads in APULTRA_FLAG_THREADS_MASK, APULTRA_FLAG_xxx, or 0)
+ * @param nMaxWindowSizes maximum window size of each output (0 for default)
+ * @param nNumWindowSizes number of window sizes, and of outputs
+ * @param nDictionarySize size of dictionary in front of input data (0 for none)
+ * @param pDictionaryIndex index of the dictionary in front of input data, or NULL to sort the dictionary with the
+ * first block
+ * @param progress progress function, called after compressing each block with the size of the first output, or
+ * NULL for none
+ * @param pStats pointer to compression stats for each window size, that are filled if this function is successful,
+ * or NULL
+ *
+ * @return 0 for success, -1 for error
+ */
+int apultra_compress_multi(const unsigned char *pInputData,
+    unsigned char **pOutBuffers,
+    size_t nInputSize,
+    const size_t *nMaxOutBufferSizes,
+    size_t *pCompressedSizes,
+    const unsigned int nFlags,
+    const size_t *nMaxWindowSizes,
+    const int nNumWindowSizes,
+    size_t nDictionarySize,
+    const apultra_dictionary_index *pDictionaryIndex,
+    void (*progress)(long long nOriginalSize, long long nCompressedSize),
+    apultra_stats *pStats);
+
+/**
+ * Compress memory that is a slightly edited version of previously compressed data, by parsing only the changes again
+ *
+ * @param pPreviousInputData previous version of the input data
+ * @param nPreviousInputSize previous input size in bytes
+ * @param pPreviousCompressedData compressed data of the previous version
+ * @param nPreviousCompressedSize size of the previous compressed data in bytes
+ * @param pInputData pointer to input(source) data to compress
+ * @param pOutBuffer buffer for compressed data
+ * @param nInputSize input(source) size in bytes
+ * @param nMaxOutBufferSize maximum capacity of compression buffer
+ * @param nFlags compression flags (number of parsing threads in APULTRA_FLAG_THREADS_MASK, APULTRA_FLAG_xxx, or 0)
+ * @param nMaxWindowSize maximum window size to use (0 for default), as for the previous compressed data
+ * @param pStats pointer to compression stats that are filled if this function is successful, or NULL
+ *
+ * @return actual compressed size, or -1 for error
+ */
+size_t apultra_recompress(const unsigned char *pPreviousInputData,
+    size_t nPreviousInputSize,
+    const unsigned char *pPreviousCompressedData,
+    size_t nPreviousCompressedSize,
+    const unsigned char *pInputData,
+    unsigned char *pOutBuffer,
+    size_t nInputSize,
+    size_t nMaxOutBufferSize,
+    const unsigned int nFlags,
+    size_t nMaxWindowSize,
+    apultra_stats *pStats);
+
+/**
+ * Find the most optimal commands for compressing memory, without encoding them
+ *
+ * @param pInputData pointer to input(source) data to compress
+ * @param pTokens buffer for the commands
+ * @param nInputSize input(source) size in bytes
+ * @param nMaxTokens maximum number of commands in the buffer; there is at most one per byte to compress
+ * @param nFlags compression flags (number of parsing threads in APULTRA_FLAG_THREADS_MASK, APULTRA_FLAG_xxx, or 0)
+ * @param nMaxWindowSize maximum window size to use (0 for default)
+ * @param nDictionarySize size of dictionary in front of input data (0 for none)
+ * @param pStats pointer to compression stats that are filled if this function is successful, or NULL; only the
+ * optimizer's stats are filled, the commands are counted by apultra_encode()
+ *
+ * @return number of commands, or -1 for error
+ */
+size_t apultra_parse(const unsigned char *pInputData,
+    apultra_token *pTokens,
+    size_t nInputSize,
+    size_t nMaxTokens,
+    const unsigned int nFlags,
+    size_t nMaxWindowSize,
+    size_t nDictionarySize,
+    apultra_stats *pStats);
+
+/**
+ * Encode commands into compressed data
+ *
+ * The commands are checked against the input data: they must describe all of the bytes after the dictionary, starting
+ * with a literal, and each of them must be encodable where it is.
+ *
+ * @param pInputData pointer to input(source) data that the commands describe
+ * @param pTokens commands, as found by apultra_parse()
+ * @param pOutBuffer buffer for compressed data
+ * @param nInputSize input(source) size in bytes
+ * @param nNumTokens number of commands
+ * @param nMaxOutBufferSize maximum capacity of compression buffer
+ * @param nMaxWindowSize maximum window size that the commands may use (0 for default)
+ * @param nDictionarySize size of dictionary in front of input data (0 for none)
+ * @param pStats pointer to compression stats that are filled with the encoded commands' stats if this function is
+ * successful, or NULL
+ *
+ * @return actual compressed size, or -1 for error
+ */
+size_t apultra_encode(const unsigned char *pInputData,
+    const apultra_token *pTokens,
+    unsigned char *pOutBuffer,
+    size_t nInputSize,
+    size_t nNumTokens,
+    size_t nMaxOutBufferSize,
+    size_t nMaxWindowSize,
+    size_t nDictionarySize,
+    apultra_stats *pStats);
+
 #ifdef __cplusplus
 }
 #endif
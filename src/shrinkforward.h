@@ -0,0 +1,917 @@
+/*
+ * shrinkforward.h - forward optimizer, instantiated once per number of arrivals
+ *
+ * Copyright (C) 2019 Emmanuel Marty
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+/*
+ * Uses the libdivsufsort library Copyright (c) 2003-2008 Yuta Mori
+ *
+ * Inspired by cap by Sven-�ke Dahl. https://github.com/svendahl/cap
+ * Also inspired by Charles Bloom's compression blog. http://cbloomrants.blogspot.com/
+ * With ideas from LZ4 by Yann Collet. https://github.com/lz4/lz4
+ * With help and support from spke <zxintrospec@gmail.com>
+ *
+ */
+
+/*
+ * This file is included by shrink.c once for each supported number of arrivals per position, with
+ * NARRIVALS_PER_POSITION defined to that number. Making it a compile-time constant lets the compiler fold the
+ * arrival stride and unroll the slot loops in each copy.
+ */
+
+#ifndef NARRIVALS_PER_POSITION
+#error "NARRIVALS_PER_POSITION must be defined before including shrinkforward.h"
+#endif
+
+/**
+ * Insert forward rep candidate
+ *
+ * @param pCompressor compression context
+ * @param pInWindow pointer to input data window (previously compressed bytes + bytes to compress)
+ * @param i input data window position whose matches are being considered
+ * @param nMatchOffset match offset to use as rep candidate
+ * @param nStartOffset current offset in input window (typically the number of previously compressed bytes)
+ * @param nEndOffset offset to end finding matches at (typically the size of the total input window in bytes
+ * @param nDepth current insertion depth
+ */
+static void APULTRA_FORWARD_FN(apultra_insert_forward_match)(apultra_compressor *pCompressor,
+    const unsigned char *pInWindow,
+    const int i,
+    const int nMatchOffset,
+    const int nStartOffset,
+    const int nEndOffset,
+    int nDepth) {
+    const int nArrivalsPerPosition = NARRIVALS_PER_POSITION;
+    const apultra_arrival_link *link = pCompressor->arrival_link + ((i - nStartOffset) * nArrivalsPerPosition);
+    const apultra_matchfinder matchfinder = pCompressor->matchfinder;
+    const int *rle_len = (int *)matchfinder.intervals /* reuse */;
+    int *visited = ((int *)matchfinder.pos_data) - nStartOffset /* reuse */;
+    apultra_stats *pStats = pCompressor->stats;
+    int j;
+
+    pStats->num_forward_rep_calls++;
+    if (pStats->max_forward_rep_depth < nDepth) pStats->max_forward_rep_depth = nDepth;
+
+    for (j = 0; j < nArrivalsPerPosition && link[j].from_slot; j++) {
+        if (link[j].from_slot > 0 && link[j].match_len < 2 /* follows literal */) {
+            int nRepOffset = link[j].rep_offset;
+
+            if (nMatchOffset != nRepOffset && nRepOffset) {
+                int nRepPos = link[j].rep_pos;
+
+                if (nRepPos >= nStartOffset && nRepPos < nEndOffset && visited[nRepPos] != nMatchOffset) {
+
+                    visited[nRepPos] = nMatchOffset;
+
+                    if (nRepPos >= nMatchOffset
+                        && matchfinder
+                                   .match[((nRepPos - nStartOffset) << MATCHES_PER_INDEX_SHIFT) + NMATCHES_PER_INDEX
+                                          - 1]
+                                   .length
+                               == 0) {
+                        const unsigned char *pInWindowAtRepOffset = pInWindow + nRepPos;
+
+                        if (pInWindowAtRepOffset[0] == pInWindowAtRepOffset[-nMatchOffset]) {
+                            int nLen0 = rle_len[nRepPos - nMatchOffset];
+                            int nLen1 = rle_len[nRepPos];
+                            int nMinLen = (nLen0 < nLen1) ? nLen0 : nLen1;
+
+                            int nMaxRepLen = nEndOffset - nRepPos;
+                            if (nMaxRepLen > LCP_MAX) nMaxRepLen = LCP_MAX;
+
+                            if (nMinLen > nMaxRepLen) nMinLen = nMaxRepLen;
+
+                            const unsigned char *pInWindowMax = pInWindowAtRepOffset + nMaxRepLen;
+                            pInWindowAtRepOffset += nMinLen;
+
+                            while ((pInWindowAtRepOffset + 8) < pInWindowMax
+                                   && !memcmp(pInWindowAtRepOffset, pInWindowAtRepOffset - nMatchOffset, 8))
+                                pInWindowAtRepOffset += 8;
+                            while ((pInWindowAtRepOffset + 4) < pInWindowMax
+                                   && !memcmp(pInWindowAtRepOffset, pInWindowAtRepOffset - nMatchOffset, 4))
+                                pInWindowAtRepOffset += 4;
+                            while (pInWindowAtRepOffset < pInWindowMax
+                                   && pInWindowAtRepOffset[0] == pInWindowAtRepOffset[-nMatchOffset])
+                                pInWindowAtRepOffset++;
+
+                            int nCurRepLen = (int)(pInWindowAtRepOffset - (pInWindow + nRepPos));
+
+                            if (nCurRepLen >= 2) {
+                                apultra_match *fwd_match =
+                                    matchfinder.match + ((nRepPos - nStartOffset) << MATCHES_PER_INDEX_SHIFT);
+                                unsigned short *fwd_depth =
+                                    matchfinder.match_depth + ((nRepPos - nStartOffset) << MATCHES_PER_INDEX_SHIFT);
+                                int r;
+
+                                for (r = 0; fwd_match[r].length >= MIN_MATCH_SIZE; r++) {
+                                    if (fwd_match[r].offset == nMatchOffset && (fwd_depth[r] & 0x3fff) == 0) {
+                                        if ((int)fwd_match[r].length < nCurRepLen) {
+                                            fwd_match[r].length = nCurRepLen;
+                                            fwd_depth[r] = 0;
+                                            pStats->num_forward_rep_inserts++;
+                                        }
+                                        r = NMATCHES_PER_INDEX;
+                                        break;
+                                    }
+                                }
+
+                                if (r < NMATCHES_PER_INDEX) {
+                                    fwd_match[r].offset = nMatchOffset;
+                                    fwd_match[r].length = nCurRepLen;
+                                    fwd_depth[r] = 0;
+                                    pStats->num_forward_rep_inserts++;
+
+                                    if (nDepth < 9)
+                                        APULTRA_FORWARD_FN(apultra_insert_forward_match)(pCompressor,
+                                            pInWindow,
+                                            nRepPos,
+                                            nMatchOffset,
+                                            nStartOffset,
+                                            nEndOffset,
+                                            nDepth + 1);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Reset rows of arrivals to empty slots
+ *
+ * @param arrival ring of arrival rows
+ * @param nRingMask number of rows in the ring, minus one
+ * @param nFromPos first input window position to reset
+ * @param nToPos input window position to stop resetting at (exclusive)
+ */
+static void APULTRA_FORWARD_FN(apultra_clear_arrivals)(apultra_arrival *arrival,
+    const int nRingMask,
+    int nFromPos,
+    const int nToPos) {
+    const int nArrivalsPerPosition = NARRIVALS_PER_POSITION;
+
+    while (nFromPos < nToPos) {
+        int nRows = (nRingMask + 1) - (nFromPos & nRingMask);
+        if (nRows > (nToPos - nFromPos)) nRows = nToPos - nFromPos;
+
+        apultra_arrival *pArrival = arrival + ((nFromPos & nRingMask) * nArrivalsPerPosition);
+        apultra_arrival *pArrivalEnd = pArrival + (nRows * nArrivalsPerPosition);
+
+        memset(pArrival, 0, sizeof(apultra_arrival) * (pArrivalEnd - pArrival));
+        for (; pArrival != pArrivalEnd; pArrival++) {
+            pArrival->cost = 0x40000000;
+        }
+
+        nFromPos += nRows;
+    }
+}
+
+/**
+ * Keep the part of a final row of arrivals that is needed after it leaves the ring
+ *
+ * @param pLink links to fill for this position
+ * @param cur_arrival arrivals for this position
+ */
+static void APULTRA_FORWARD_FN(apultra_store_arrival_links)(apultra_arrival_link *pLink,
+    const apultra_arrival *cur_arrival) {
+    const int nArrivalsPerPosition = NARRIVALS_PER_POSITION;
+    int j;
+
+    for (j = 0; j < nArrivalsPerPosition && cur_arrival[j].from_slot; j++) {
+        pLink[j].rep_offset = cur_arrival[j].rep_offset;
+        pLink[j].match_len = cur_arrival[j].match_len;
+        pLink[j].rep_pos = cur_arrival[j].rep_pos;
+        pLink[j].short_offset = cur_arrival[j].short_offset;
+        pLink[j].from_slot = cur_arrival[j].from_slot;
+    }
+
+    if (j < nArrivalsPerPosition) pLink[j].from_slot = 0;
+}
+
+/**
+ * Attempt to pick optimal matches, so as to produce the smallest possible output that decompresses to the same input
+ *
+ * @param pCompressor compression context
+ * @param pInWindow pointer to input data window (previously compressed bytes + bytes to compress)
+ * @param nStartOffset current offset in input window (typically the number of previously compressed bytes)
+ * @param nEndOffset offset to end finding matches at (typically the size of the total input window in bytes
+ * @param nInsertForwardReps non-zero to insert forward repmatch candidates, zero to use the previously inserted
+ * candidates
+ * @param nCurRepMatchOffset starting rep offset for this block
+ * @param nBlockFlags bit 0: 1 for first block, 0 otherwise; bit 1: 1 for last block, 0 otherwise; bit 2: 1 if the
+ * parse resumes after a previous segment of the block, 0 otherwise
+ */
+static void APULTRA_FORWARD_FN(apultra_optimize_forward)(apultra_compressor *pCompressor,
+    const unsigned char *pInWindow,
+    const int nStartOffset,
+    const int nEndOffset,
+    const int nInsertForwardReps,
+    const int *nCurRepMatchOffset,
+    const int nBlockFlags) {
+    const int nArrivalsPerPosition = NARRIVALS_PER_POSITION;
+    apultra_arrival *arrival = pCompressor->arrival;
+    const int nRingMask = pCompressor->arrival_ring_mask;
+    apultra_arrival_link *link = pCompressor->arrival_link - (nStartOffset * nArrivalsPerPosition);
+    const apultra_matchfinder matchfinder = pCompressor->matchfinder;
+    const int *rle_len = (int *)matchfinder.intervals /* reuse */;
+    int *visited = ((int *)matchfinder.pos_data) - nStartOffset /* reuse */;
+    int *worst_cost_for_pos = pCompressor->worst_cost_for_pos - nStartOffset;
+    const int nSkipLongRepeats = (pCompressor->flags & APULTRA_FLAG_FAST_PARSE) != 0;
+    long long nInsertAttempts = 0, nInsertAccepts = 0, nPrunedArrivals = 0, nSkippedPositions = 0;
+    int nClearedEnd;
+    int i, j, n;
+
+    if ((nEndOffset - nStartOffset) > pCompressor->block_size) return;
+
+    /* Rows of arrivals are reset just before the parser first writes to them, rather than all upfront, so that
+     * they are still in cache when they get filled. Rows from nClearedEnd onwards hold stale data */
+    nClearedEnd = nStartOffset + ARRIVALS_CLEAR_ROWS;
+    if (nClearedEnd > (nEndOffset + 1)) nClearedEnd = nEndOffset + 1;
+    APULTRA_FORWARD_FN(apultra_clear_arrivals)(arrival, nRingMask, nStartOffset, nClearedEnd);
+
+    arrival[(nStartOffset & nRingMask) * nArrivalsPerPosition].from_slot = -1;
+    arrival[(nStartOffset & nRingMask) * nArrivalsPerPosition].rep_offset = *nCurRepMatchOffset;
+
+    /* Cost of the last slot of each position, kept in a compact array so that match lengths that can't enter a
+     * position are skipped without touching its slots */
+    for (i = nStartOffset; i <= nEndOffset; i++) {
+        worst_cost_for_pos[i] = 0x40000000;
+    }
+
+    if (nInsertForwardReps) { memset(visited + nStartOffset, 0, (nEndOffset - nStartOffset) * sizeof(int)); }
+
+    for (i = nStartOffset; i != nEndOffset; i++) {
+        apultra_arrival *cur_arrival = &arrival[(i & nRingMask) * nArrivalsPerPosition];
+        apultra_arrival *next_arrival = &arrival[((i + 1) & nRingMask) * nArrivalsPerPosition];
+        int m;
+
+        const unsigned char nMatch1Offs = matchfinder.match1[i - nStartOffset];
+        int nShortOffset;
+        int nShortLen;
+        int nLiteralScore;
+        int nLiteralCost;
+
+        if ((pInWindow[i] != 0 && nMatch1Offs == 0) || (i == nStartOffset && (nBlockFlags & 5) == 1)) {
+            nShortOffset = 0;
+            nShortLen = 0;
+            nLiteralCost = 9 /* literal bit + literal byte */;
+        } else {
+            nShortOffset = (pInWindow[i] == 0) ? 0 : nMatch1Offs;
+            nShortLen = 1;
+            nLiteralCost = 4 + TOKEN_SIZE_4BIT_MATCH /* command and offset cost; no length cost */;
+        }
+
+        nLiteralScore = nShortOffset ? 3 : 1;
+
+        if (nClearedEnd <= (i + 1)) {
+            int nNewClearedEnd = i + 1 + ARRIVALS_CLEAR_ROWS;
+
+            if (nNewClearedEnd > (nEndOffset + 1)) nNewClearedEnd = nEndOffset + 1;
+            APULTRA_FORWARD_FN(apultra_clear_arrivals)(arrival, nRingMask, nClearedEnd, nNewClearedEnd);
+            nClearedEnd = nNewClearedEnd;
+        }
+
+        if (cur_arrival[1].from_slot) {
+            /* An arrival can only do better than the best one thanks to its rep offset. Until its next rep match, the
+             * best arrival can take the same steps, and then write that match with an explicit offset instead, for
+             * at most 6 + gamma2((offset >> 8) + 3) more bits; both are in the same state after it. Below
+             * MINMATCH3_OFFSET, every rep match can be written that way, so an arrival that costs more than that
+             * over the best one can't catch up and is dropped. From MINMATCH3_OFFSET on, 2-byte rep matches (and
+             * 3-byte ones from MINMATCH4_OFFSET on) have no explicit form: each of them can save up to 12 or 21
+             * bits over literals, as many times as the offset is reused, so there is no bound and these arrivals
+             * are kept */
+            const int nBestCost = cur_arrival[0].cost;
+            int nNumLiveArrivals = 1;
+
+            for (j = 1; j < nArrivalsPerPosition && cur_arrival[j].from_slot; j++) {
+                const int nRepOffset = cur_arrival[j].rep_offset;
+                const int nMaxRepSaving = 6 + apultra_get_gamma2_size((nRepOffset >> 8) + 3);
+
+                if (nRepOffset >= MINMATCH3_OFFSET || (cur_arrival[j].cost - nBestCost) <= nMaxRepSaving) {
+                    if (nNumLiveArrivals != j) cur_arrival[nNumLiveArrivals] = cur_arrival[j];
+                    nNumLiveArrivals++;
+                }
+            }
+
+            for (n = nNumLiveArrivals; n < j; n++) {
+                cur_arrival[n].cost = 0x40000000;
+                cur_arrival[n].from_slot = 0;
+            }
+            nPrunedArrivals += j - nNumLiveArrivals;
+        }
+
+        /* This row is final now; only its links are looked at once the ring wraps around */
+        APULTRA_FORWARD_FN(apultra_store_arrival_links)(&link[i * nArrivalsPerPosition], cur_arrival);
+
+        if (next_arrival[0].from_slot) {
+            for (j = 0; j < nArrivalsPerPosition && cur_arrival[j].from_slot; j++) {
+                int nPrevCost = cur_arrival[j].cost & 0x3fffffff;
+                int nCodingChoiceCost = nPrevCost + nLiteralCost;
+                int nScore = cur_arrival[j].score + nLiteralScore;
+
+                nInsertAttempts++;
+
+                apultra_arrival *pDestSlots = next_arrival;
+                if (nCodingChoiceCost < pDestSlots[nArrivalsPerPosition - 1].cost
+                    || (nCodingChoiceCost == pDestSlots[nArrivalsPerPosition - 1].cost
+                        && nScore < pDestSlots[nArrivalsPerPosition - 1].score)) {
+                    int nRepOffset = cur_arrival[j].rep_offset;
+                    int exists = 0;
+
+                    for (n = 0; n < nArrivalsPerPosition && pDestSlots[n].cost < nCodingChoiceCost; n++) {
+                        if (pDestSlots[n].rep_offset == nRepOffset) {
+                            exists = 1;
+                            break;
+                        }
+                    }
+
+                    if (!exists) {
+                        for (; n < nArrivalsPerPosition && pDestSlots[n].cost == nCodingChoiceCost
+                               && nScore >= pDestSlots[n].score;
+                             n++) {
+                            if (pDestSlots[n].rep_offset == nRepOffset) {
+                                exists = 1;
+                                break;
+                            }
+                        }
+
+                        if (!exists) {
+                            if (n < nArrivalsPerPosition) {
+                                int nn;
+
+                                for (nn = n; nn < nArrivalsPerPosition && pDestSlots[nn].cost == nCodingChoiceCost;
+                                     nn++) {
+                                    if (pDestSlots[nn].rep_offset == nRepOffset) {
+                                        exists = 1;
+                                        break;
+                                    }
+                                }
+
+                                if (!exists) {
+                                    int z;
+
+                                    for (z = n; z < nArrivalsPerPosition - 1 && pDestSlots[z].from_slot; z++) {
+                                        if (pDestSlots[z].rep_offset == nRepOffset) break;
+                                    }
+
+                                    apultra_arrival *pDestArrival = &pDestSlots[n];
+                                    memmove(&pDestSlots[n + 1], &pDestSlots[n], sizeof(apultra_arrival) * (z - n));
+
+                                    pDestArrival->cost = nCodingChoiceCost;
+                                    pDestArrival->from_pos = i;
+                                    pDestArrival->from_slot = j + 1;
+                                    pDestArrival->follows_literal = 1;
+                                    pDestArrival->rep_offset = nRepOffset;
+                                    pDestArrival->short_offset = nShortOffset;
+                                    pDestArrival->rep_pos = cur_arrival[j].rep_pos;
+                                    pDestArrival->match_len = nShortLen;
+                                    pDestArrival->score = nScore;
+                                    nInsertAccepts++;
+
+                                    worst_cost_for_pos[i + 1] = pDestSlots[nArrivalsPerPosition - 1].cost;
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        } else {
+            for (j = 0; j < nArrivalsPerPosition && cur_arrival[j].from_slot; j++) {
+                int nPrevCost = cur_arrival[j].cost & 0x3fffffff;
+                int nCodingChoiceCost = nPrevCost + nLiteralCost;
+                int nScore = cur_arrival[j].score + nLiteralScore;
+
+                apultra_arrival *pDestArrival = &next_arrival[j];
+
+                pDestArrival->cost = nCodingChoiceCost;
+                pDestArrival->from_pos = i;
+                pDestArrival->from_slot = j + 1;
+                pDestArrival->follows_literal = 1;
+                pDestArrival->rep_offset = cur_arrival[j].rep_offset;
+                pDestArrival->short_offset = nShortOffset;
+                pDestArrival->rep_pos = cur_arrival[j].rep_pos;
+                pDestArrival->match_len = nShortLen;
+                pDestArrival->score = nScore;
+            }
+
+            nInsertAttempts += j;
+            nInsertAccepts += j;
+
+            worst_cost_for_pos[i + 1] = next_arrival[nArrivalsPerPosition - 1].cost;
+        }
+
+        if (!nInsertForwardReps) pCompressor->stats->arrival_histogram[j]++;
+
+        if (i == nStartOffset && (nBlockFlags & 5) == 1) continue;
+
+        const apultra_match *match = matchfinder.match + ((i - nStartOffset) << MATCHES_PER_INDEX_SHIFT);
+        const unsigned short *match_depth = matchfinder.match_depth + ((i - nStartOffset) << MATCHES_PER_INDEX_SHIFT);
+        int nNumArrivalsForThisPos = j, nOverallMinRepLen = 0, nOverallMaxRepLen = 0;
+        int nMinPrevCost = 0x40000000, nMinRepPrevCost = 0x40000000;
+
+        int nRepLenForArrival[NARRIVALS_PER_POSITION_MAX];
+        memset(nRepLenForArrival, 0, nArrivalsPerPosition * sizeof(int));
+
+        int nRepMatchArrivalIdx[NARRIVALS_PER_POSITION_MAX + 1];
+        int nNumRepMatchArrivals = 0;
+
+        int nMaxRepLenForPos = nEndOffset - i;
+        if (nMaxRepLenForPos > LCP_MAX) nMaxRepLenForPos = LCP_MAX;
+        const unsigned char *pInWindowStart = pInWindow + i;
+        const unsigned char *pInWindowMax = pInWindowStart + nMaxRepLenForPos;
+        const int nLen1 = rle_len[i];
+
+        for (j = 0; j < nNumArrivalsForThisPos && (i + 2) <= nEndOffset; j++) {
+            if (nMinPrevCost > (cur_arrival[j].cost & 0x3fffffff)) nMinPrevCost = cur_arrival[j].cost & 0x3fffffff;
+
+            if (cur_arrival[j].follows_literal) {
+                int nRepOffset = cur_arrival[j].rep_offset;
+
+                if (nRepOffset && i >= nRepOffset) {
+                    if (pInWindowStart[0] == pInWindowStart[-nRepOffset]) {
+                        int nLen0 = rle_len[i - nRepOffset];
+                        int nMinLen = (nLen0 < nLen1) ? nLen0 : nLen1;
+
+                        if (nMinLen > nMaxRepLenForPos) nMinLen = nMaxRepLenForPos;
+
+                        const unsigned char *pInWindowAtRepOffset = pInWindowStart + nMinLen;
+                        while ((pInWindowAtRepOffset + 8) < pInWindowMax
+                               && !memcmp(pInWindowAtRepOffset, pInWindowAtRepOffset - nRepOffset, 8))
+                            pInWindowAtRepOffset += 8;
+                        while ((pInWindowAtRepOffset + 4) < pInWindowMax
+                               && !memcmp(pInWindowAtRepOffset, pInWindowAtRepOffset - nRepOffset, 4))
+                            pInWindowAtRepOffset += 4;
+                        while (pInWindowAtRepOffset < pInWindowMax
+                               && pInWindowAtRepOffset[0] == pInWindowAtRepOffset[-nRepOffset])
+                            pInWindowAtRepOffset++;
+
+                        int nCurMaxLen = (int)(pInWindowAtRepOffset - pInWindowStart);
+
+                        if (nCurMaxLen >= 2) {
+                            nRepLenForArrival[j] = nCurMaxLen;
+                            nRepMatchArrivalIdx[nNumRepMatchArrivals++] = j;
+
+                            if (nMinRepPrevCost > (cur_arrival[j].cost & 0x3fffffff))
+                                nMinRepPrevCost = cur_arrival[j].cost & 0x3fffffff;
+
+                            if (nOverallMaxRepLen < nCurMaxLen) nOverallMaxRepLen = nCurMaxLen;
+                        }
+                    }
+                }
+            }
+        }
+        nRepMatchArrivalIdx[nNumRepMatchArrivals] = -1;
+
+        if (match[0].length > LCP_MAX && (i + LCP_MAX) < nEndOffset) {
+            /* The longest match goes further than the ring of arrivals can span. It is a very long repeat, so only
+             * taken whole, and the positions it covers are skipped: just give the row at its end the single
+             * cheapest arrival that the match leads to */
+            const int nMatchOffset = match[0].offset;
+            const int nScorePenalty = 3 + ((match_depth[0] & 0x8000) >> 15);
+            int nMatchLen = match[0].length;
+            int nNoRepMatchMatchLenCost;
+            int nBestCost = 0x40000000, nBestScore = 0, nBestSlot = -1;
+
+            if ((i + nMatchLen) > nEndOffset) nMatchLen = nEndOffset - i;
+
+            if (nInsertForwardReps) {
+                APULTRA_FORWARD_FN(apultra_insert_forward_match)(
+                    pCompressor, pInWindow, i, nMatchOffset, nStartOffset, nEndOffset, 0);
+            }
+
+            if (nMatchOffset < 128 || nMatchOffset >= MINMATCH4_OFFSET)
+                nNoRepMatchMatchLenCost = apultra_get_gamma2_size(nMatchLen - 2);
+            else if (nMatchOffset < MINMATCH3_OFFSET)
+                nNoRepMatchMatchLenCost = apultra_get_gamma2_size(nMatchLen);
+            else
+                nNoRepMatchMatchLenCost = apultra_get_gamma2_size(nMatchLen - 1);
+
+            for (j = 0; j < nNumArrivalsForThisPos; j++) {
+                const int nPrevCost = cur_arrival[j].cost & 0x3fffffff;
+                int nCodingChoiceCost, nScore;
+
+                if (cur_arrival[j].follows_literal && cur_arrival[j].rep_offset == nMatchOffset) {
+                    nCodingChoiceCost = nPrevCost + TOKEN_SIZE_LARGE_MATCH + 2 /* apultra_get_gamma2_size(2) */
+                                        + apultra_get_gamma2_size(nMatchLen);
+                    nScore = cur_arrival[j].score + 2;
+                } else {
+                    /* Same adjustment as for other non-rep matches of LCP_MAX bytes or more */
+                    nCodingChoiceCost =
+                        nPrevCost + 8 + TOKEN_SIZE_LARGE_MATCH
+                        + apultra_get_gamma2_size((nMatchOffset >> 8) + 2 + cur_arrival[j].follows_literal)
+                        + nNoRepMatchMatchLenCost - 1;
+                    nScore = cur_arrival[j].score + nScorePenalty;
+                }
+
+                nInsertAttempts++;
+
+                if (nCodingChoiceCost < nBestCost || (nCodingChoiceCost == nBestCost && nScore < nBestScore)) {
+                    nBestCost = nCodingChoiceCost;
+                    nBestScore = nScore;
+                    nBestSlot = j;
+                }
+            }
+
+            /* Nothing before this position reaches past LCP_MAX bytes from it, so the rows from the end of the match
+             * on are all free; reset them, even if they share ring rows with the skipped positions */
+            const int nMatchEnd = i + nMatchLen;
+            int nNewClearedEnd = nMatchEnd + ARRIVALS_CLEAR_ROWS;
+
+            if (nNewClearedEnd > (nEndOffset + 1)) nNewClearedEnd = nEndOffset + 1;
+            APULTRA_FORWARD_FN(apultra_clear_arrivals)(arrival, nRingMask, nMatchEnd, nNewClearedEnd);
+            nClearedEnd = nNewClearedEnd;
+
+            if (nBestSlot >= 0) {
+                apultra_arrival *pDestArrival = &arrival[(nMatchEnd & nRingMask) * nArrivalsPerPosition];
+
+                pDestArrival->cost = nBestCost;
+                pDestArrival->from_pos = i;
+                pDestArrival->from_slot = nBestSlot + 1;
+                pDestArrival->follows_literal = 0;
+                pDestArrival->rep_offset = nMatchOffset;
+                pDestArrival->short_offset = 0;
+                pDestArrival->rep_pos = i;
+                pDestArrival->match_len = LCP_MAX /* the actual length is the distance from rep_pos */;
+                pDestArrival->score = nBestScore;
+                nInsertAccepts++;
+
+                worst_cost_for_pos[nMatchEnd] = pDestArrival[nArrivalsPerPosition - 1].cost;
+            }
+
+            nSkippedPositions += nMatchEnd - (i + 1);
+            i = nMatchEnd - 1;
+            continue;
+        }
+
+        /* Reset the rows that the matches at this position can reach, rep candidates included */
+        for (m = 0; m < NMATCHES_PER_INDEX && match[m].length; m++) {
+            int nMatchEnd = i + match[m].length;
+
+            if (nMatchEnd > nEndOffset) nMatchEnd = nEndOffset;
+            if (nClearedEnd <= nMatchEnd) {
+                int nNewClearedEnd = nMatchEnd + ARRIVALS_CLEAR_ROWS;
+
+                if (nNewClearedEnd > (nEndOffset + 1)) nNewClearedEnd = nEndOffset + 1;
+                APULTRA_FORWARD_FN(apultra_clear_arrivals)(arrival, nRingMask, nClearedEnd, nNewClearedEnd);
+                nClearedEnd = nNewClearedEnd;
+            }
+        }
+
+        for (m = 0; m < NMATCHES_PER_INDEX && match[m].length; m++) {
+            const int nOrigMatchLen = match[m].length;
+            const int nOrigMatchOffset = match[m].offset;
+            const unsigned int nOrigMatchDepth = match_depth[m] & 0x3fff;
+            const int nScorePenalty = 3 + ((match_depth[m] & 0x8000) >> 15);
+            unsigned int d;
+
+            for (d = 0; d <= nOrigMatchDepth; d += (nOrigMatchDepth ? nOrigMatchDepth : 1)) {
+                const int nMatchOffset = nOrigMatchOffset - d;
+                int nMatchLen = nOrigMatchLen - d;
+
+                if ((i + nMatchLen) > nEndOffset) nMatchLen = nEndOffset - i;
+
+                if (nInsertForwardReps) {
+                    APULTRA_FORWARD_FN(apultra_insert_forward_match)(
+                        pCompressor, pInWindow, i, nMatchOffset, nStartOffset, nEndOffset, 0);
+                }
+
+                if (nMatchLen >= 2) {
+                    int nStartingMatchLen, nJumpMatchLen, k;
+                    int nNoRepMatchOffsetCostForLit[2], nNoRepMatchOffsetCostDelta;
+                    int nMinMatchLenForOffset;
+                    int nNoRepCostAdjusment = (nMatchLen >= LCP_MAX) ? 1 : 0;
+
+                    if (nMatchOffset < MINMATCH3_OFFSET)
+                        nMinMatchLenForOffset = 2;
+                    else {
+                        if (nMatchOffset < MINMATCH4_OFFSET)
+                            nMinMatchLenForOffset = 3;
+                        else
+                            nMinMatchLenForOffset = 4;
+                    }
+
+                    if (nMatchLen >= LEAVE_ALONE_MATCH_SIZE && i >= nMatchLen)
+                        nStartingMatchLen = nMatchLen;
+                    else
+                        nStartingMatchLen = 2;
+
+                    if ((nBlockFlags & 3) == 3 && nMatchLen > 90 && i >= 90)
+                        nJumpMatchLen = 90;
+                    else
+                        nJumpMatchLen = nMatchLen + 1;
+
+                    if (nStartingMatchLen <= 3 && nMatchOffset < 128) {
+                        nNoRepMatchOffsetCostForLit[0] = 8 + TOKEN_SIZE_7BIT_MATCH;
+                        nNoRepMatchOffsetCostForLit[1] = 8 + TOKEN_SIZE_7BIT_MATCH;
+                    } else {
+                        nNoRepMatchOffsetCostForLit[0] =
+                            8 + TOKEN_SIZE_LARGE_MATCH + apultra_get_gamma2_size((nMatchOffset >> 8) + 2);
+                        nNoRepMatchOffsetCostForLit[1] =
+                            8 + TOKEN_SIZE_LARGE_MATCH + apultra_get_gamma2_size((nMatchOffset >> 8) + 3);
+                    }
+                    nNoRepMatchOffsetCostDelta = nNoRepMatchOffsetCostForLit[1] - nNoRepMatchOffsetCostForLit[0];
+
+                    for (k = nStartingMatchLen; k <= nMatchLen; k++) {
+                        int nRepMatchMatchLenCost = apultra_get_gamma2_size(k);
+                        apultra_arrival *pDestSlots = &arrival[((i + k) & nRingMask) * nArrivalsPerPosition];
+
+                        /* Insert non-repmatch candidate */
+
+                        if (k >= nMinMatchLenForOffset) {
+                            int nNoRepMatchMatchLenCost;
+
+                            if (k <= 3 && nMatchOffset < 128)
+                                nNoRepMatchMatchLenCost = 0;
+                            else {
+                                if (nMatchOffset < 128 || nMatchOffset >= MINMATCH4_OFFSET)
+                                    nNoRepMatchMatchLenCost = apultra_get_gamma2_size(k - 2);
+                                else if (nMatchOffset < MINMATCH3_OFFSET)
+                                    nNoRepMatchMatchLenCost = nRepMatchMatchLenCost;
+                                else
+                                    nNoRepMatchMatchLenCost = apultra_get_gamma2_size(k - 1);
+                            }
+
+                            /* The cheapest arrival can't get into the last slot: no candidate can */
+                            if ((nMinPrevCost + nNoRepMatchOffsetCostForLit[0] + nNoRepMatchMatchLenCost)
+                                > (worst_cost_for_pos[i + k] + 1))
+                                j = nNumArrivalsForThisPos;
+                            else
+                                j = 0;
+
+                            for (; j < nNumArrivalsForThisPos; j++) {
+                                if (nMatchOffset != cur_arrival[j].rep_offset || cur_arrival[j].follows_literal == 0) {
+                                    int nPrevCost = cur_arrival[j].cost & 0x3fffffff;
+                                    int nMatchCmdCost = nNoRepMatchMatchLenCost
+                                                        + nNoRepMatchOffsetCostForLit[cur_arrival[j].follows_literal];
+                                    int nCodingChoiceCost = nPrevCost + nMatchCmdCost;
+
+                                    nInsertAttempts++;
+
+                                    if (nCodingChoiceCost <= (pDestSlots[nArrivalsPerPosition - 1].cost + 1)) {
+                                        int nScore = cur_arrival[j].score + nScorePenalty;
+
+                                        if (nCodingChoiceCost < pDestSlots[nArrivalsPerPosition - 2].cost
+                                            || (nCodingChoiceCost == pDestSlots[nArrivalsPerPosition - 2].cost
+                                                && nScore < pDestSlots[nArrivalsPerPosition - 2].score)) {
+                                            int exists = 0;
+
+                                            for (n = 0;
+                                                 n < nArrivalsPerPosition && pDestSlots[n].cost < nCodingChoiceCost;
+                                                 n++) {
+                                                if (pDestSlots[n].rep_offset == nMatchOffset) {
+                                                    exists = 1;
+                                                    break;
+                                                }
+                                            }
+
+                                            if (!exists) {
+                                                int nRevisedCodingChoiceCost = nCodingChoiceCost - nNoRepCostAdjusment;
+
+                                                for (; n < nArrivalsPerPosition - 1
+                                                       && pDestSlots[n].cost == nRevisedCodingChoiceCost
+                                                       && nScore >= pDestSlots[n].score;
+                                                     n++) {
+                                                    if (pDestSlots[n].rep_offset == nMatchOffset) {
+                                                        exists = 1;
+                                                        break;
+                                                    }
+                                                }
+
+                                                if (!exists) {
+                                                    if (n < nArrivalsPerPosition - 1) {
+                                                        int nn;
+
+                                                        for (nn = n; nn < nArrivalsPerPosition
+                                                                     && pDestSlots[nn].cost == nCodingChoiceCost;
+                                                             nn++) {
+                                                            if (pDestSlots[nn].rep_offset == nMatchOffset) {
+                                                                exists = 1;
+                                                                break;
+                                                            }
+                                                        }
+
+                                                        if (!exists) {
+                                                            int z;
+
+                                                            for (z = n; z < nArrivalsPerPosition - 1
+                                                                        && pDestSlots[z].from_slot;
+                                                                 z++) {
+                                                                if (pDestSlots[z].rep_offset == nMatchOffset) break;
+                                                            }
+
+                                                            apultra_arrival *pDestArrival = &pDestSlots[n];
+                                                            memmove(&pDestSlots[n + 1],
+                                                                &pDestSlots[n],
+                                                                sizeof(apultra_arrival) * (z - n));
+
+                                                            pDestArrival->cost = nRevisedCodingChoiceCost;
+                                                            pDestArrival->from_pos = i;
+                                                            pDestArrival->from_slot = j + 1;
+                                                            pDestArrival->follows_literal = 0;
+                                                            pDestArrival->rep_offset = nMatchOffset;
+                                                            pDestArrival->short_offset = 0;
+                                                            pDestArrival->rep_pos = i;
+                                                            pDestArrival->match_len = k;
+                                                            pDestArrival->score = nScore;
+                                                            nInsertAccepts++;
+
+                                                            worst_cost_for_pos[i + k] =
+                                                                pDestSlots[nArrivalsPerPosition - 1].cost;
+                                                        }
+                                                    }
+                                                }
+                                            } else {
+                                                if ((nCodingChoiceCost - pDestSlots[n].cost)
+                                                    >= nNoRepMatchOffsetCostDelta)
+                                                    break;
+                                            }
+                                        }
+                                        if (cur_arrival[j].follows_literal == 0 || nNoRepMatchOffsetCostDelta == 0)
+                                            break;
+                                    } else {
+                                        break;
+                                    }
+                                }
+                            }
+                        }
+
+                        /* Insert repmatch candidate */
+
+                        if (k > nOverallMinRepLen && k <= nOverallMaxRepLen) {
+                            int nRepMatchCmdCost =
+                                TOKEN_SIZE_LARGE_MATCH + 2 /* apultra_get_gamma2_size(2) */ + nRepMatchMatchLenCost;
+                            int nCurRepMatchArrival;
+
+                            if (k <= 90)
+                                nOverallMinRepLen = k;
+                            else if (nOverallMaxRepLen == k)
+                                nOverallMaxRepLen--;
+
+                            /* Skip all rep candidates if the cheapest one can't get into the last slot */
+                            nCurRepMatchArrival = ((nMinRepPrevCost + nRepMatchCmdCost) > worst_cost_for_pos[i + k])
+                                                      ? nNumRepMatchArrivals
+                                                      : 0;
+
+                            for (; (j = nRepMatchArrivalIdx[nCurRepMatchArrival]) >= 0; nCurRepMatchArrival++) {
+                                if (nRepLenForArrival[j] >= k) {
+                                    int nPrevCost = cur_arrival[j].cost & 0x3fffffff;
+                                    int nRepCodingChoiceCost = nPrevCost + nRepMatchCmdCost;
+                                    int nScore = cur_arrival[j].score + 2;
+
+                                    nInsertAttempts++;
+
+                                    if (nRepCodingChoiceCost < pDestSlots[nArrivalsPerPosition - 1].cost
+                                        || (nRepCodingChoiceCost == pDestSlots[nArrivalsPerPosition - 1].cost
+                                            && nScore < pDestSlots[nArrivalsPerPosition - 1].score)) {
+                                        int nRepOffset = cur_arrival[j].rep_offset;
+                                        int exists = 0;
+
+                                        for (n = 0;
+                                             n < nArrivalsPerPosition && pDestSlots[n].cost < nRepCodingChoiceCost;
+                                             n++) {
+                                            if (pDestSlots[n].rep_offset == nRepOffset) {
+                                                exists = 1;
+                                                break;
+                                            }
+                                        }
+
+                                        if (!exists) {
+                                            for (;
+                                                 n < nArrivalsPerPosition && pDestSlots[n].cost == nRepCodingChoiceCost
+                                                 && nScore >= pDestSlots[n].score;
+                                                 n++) {
+                                                if (pDestSlots[n].rep_offset == nRepOffset) {
+                                                    exists = 1;
+                                                    break;
+                                                }
+                                            }
+
+                                            if (!exists) {
+                                                if (n < nArrivalsPerPosition) {
+                                                    int nn;
+
+                                                    for (nn = n; nn < nArrivalsPerPosition
+                                                                 && pDestSlots[nn].cost == nRepCodingChoiceCost;
+                                                         nn++) {
+                                                        if (pDestSlots[nn].rep_offset == nRepOffset) {
+                                                            exists = 1;
+                                                            break;
+                                                        }
+                                                    }
+
+                                                    if (!exists) {
+                                                        int z;
+
+                                                        for (z = n;
+                                                             z < nArrivalsPerPosition - 1 && pDestSlots[z].from_slot;
+                                                             z++) {
+                                                            if (pDestSlots[z].rep_offset == nRepOffset) break;
+                                                        }
+
+                                                        apultra_arrival *pDestArrival = &pDestSlots[n];
+                                                        memmove(&pDestSlots[n + 1],
+                                                            &pDestSlots[n],
+                                                            sizeof(apultra_arrival) * (z - n));
+
+                                                        pDestArrival->cost = nRepCodingChoiceCost;
+                                                        pDestArrival->from_pos = i;
+                                                        pDestArrival->from_slot = j + 1;
+                                                        pDestArrival->follows_literal = 0;
+                                                        pDestArrival->rep_offset = nRepOffset;
+                                                        pDestArrival->short_offset = 0;
+                                                        pDestArrival->rep_pos = i;
+                                                        pDestArrival->match_len = k;
+                                                        pDestArrival->score = nScore;
+                                                        nInsertAccepts++;
+
+                                                        worst_cost_for_pos[i + k] =
+                                                            pDestSlots[nArrivalsPerPosition - 1].cost;
+                                                    }
+                                                }
+                                            }
+                                        }
+                                    } else {
+                                        break;
+                                    }
+                                }
+                            }
+                        }
+
+                        if (k == 3 && nMatchOffset < 128) {
+                            nNoRepMatchOffsetCostForLit[0] =
+                                8 + TOKEN_SIZE_LARGE_MATCH + 2 /* apultra_get_gamma2_size((nMatchOffset >> 8) + 2) */;
+                            nNoRepMatchOffsetCostForLit[1] =
+                                8 + TOKEN_SIZE_LARGE_MATCH + 2 /* apultra_get_gamma2_size((nMatchOffset >> 8) + 3) */;
+                        }
+
+                        if (k == nJumpMatchLen) k = nMatchLen - 1;
+                    }
+                }
+
+                if (nOrigMatchLen >= 512) break;
+            }
+        }
+
+        if (nSkipLongRepeats && match[0].length >= LONG_REPEAT_MATCH_SIZE) {
+            /* Very long repeat: the match is almost always taken whole, so don't parse the positions inside it */
+            int nRepeatEnd = i + match[0].length;
+
+            if (nRepeatEnd > nEndOffset) nRepeatEnd = nEndOffset;
+            nSkippedPositions += nRepeatEnd - (i + 1);
+            i = nRepeatEnd - 1;
+        }
+    }
+
+    pCompressor->stats->num_positions += nEndOffset - nStartOffset;
+    pCompressor->stats->num_insert_attempts += nInsertAttempts;
+    pCompressor->stats->num_insert_accepts += nInsertAccepts;
+    pCompressor->stats->num_pruned_arrivals += nPrunedArrivals;
+    pCompressor->stats->num_skipped_positions += nSkippedPositions;
+
+    if (!nInsertForwardReps) {
+        /* The last row isn't stored in the links, as it belongs to the next segment when the block is split */
+        apultra_arrival_link end_links[NARRIVALS_PER_POSITION];
+        const apultra_arrival_link *end_link = end_links;
+        apultra_final_match *pBestMatch = pCompressor->best_match - nStartOffset;
+        int nEndPos = i;
+
+        APULTRA_FORWARD_FN(apultra_store_arrival_links)(end_links, &arrival[(i & nRingMask) * nArrivalsPerPosition]);
+
+        while (end_link->from_slot > 0) {
+            /* Matches start at their rep_pos, literals are 1 byte back */
+            const int nFromPos = (end_link->match_len >= 2) ? (int)end_link->rep_pos : (nEndPos - 1);
+            if (nFromPos < nStartOffset) break;
+
+            pBestMatch[nFromPos].length = (end_link->match_len >= 2) ? (nEndPos - nFromPos) : end_link->match_len;
+            if (end_link->match_len >= 2)
+                pBestMatch[nFromPos].offset = end_link->rep_offset;
+            else
+                pBestMatch[nFromPos].offset = end_link->short_offset;
+
+            end_link = &link[(nFromPos * nArrivalsPerPosition) + (end_link->from_slot - 1)];
+            nEndPos = nFromPos;
+        }
+    }
+}
+
+#undef NARRIVALS_PER_POSITION
@@ -0,0 +1,105 @@
+/*
+ * thread.c - worker thread implementation
+ *
+ * Copyright (C) 2019 Emmanuel Marty
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+/*
+ * Uses the libdivsufsort library Copyright (c) 2003-2008 Yuta Mori
+ *
+ * Inspired by cap by Sven-�ke Dahl. https://github.com/svendahl/cap
+ * Also inspired by Charles Bloom's compression blog. http://cbloomrants.blogspot.com/
+ * With ideas from LZ4 by Yann Collet. https://github.com/lz4/lz4
+ * With help and support from spke <zxintrospec@gmail.com>
+ *
+ */
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#include "thread.h"
+
+/** Function and argument for one worker thread */
+typedef struct {
+    void (*func)(void *pArg);
+    void *pArg;
+} apultra_thread_job;
+
+#ifdef _WIN32
+static DWORD WINAPI apultra_thread_entry(LPVOID pParam) {
+    apultra_thread_job *pJob = (apultra_thread_job *)pParam;
+
+    pJob->func(pJob->pArg);
+    return 0;
+}
+#else
+static void *apultra_thread_entry(void *pParam) {
+    apultra_thread_job *pJob = (apultra_thread_job *)pParam;
+
+    pJob->func(pJob->pArg);
+    return NULL;
+}
+#endif
+
+/**
+ * Run a function for each element of an array of arguments, concurrently, and wait for all of them to finish
+ *
+ * @param func function to run
+ * @param pArgs array of arguments, one per thread
+ * @param nArgSize size of each argument, in bytes
+ * @param nThreads number of elements in pArgs (1..APULTRA_MAX_THREADS)
+ */
+void apultra_run_threads(void (*func)(void *pArg), void *pArgs, const int nArgSize, const int nThreads) {
+    apultra_thread_job jobs[APULTRA_MAX_THREADS];
+#ifdef _WIN32
+    HANDLE threads[APULTRA_MAX_THREADS];
+#else
+    pthread_t threads[APULTRA_MAX_THREADS];
+#endif
+    int nStarted[APULTRA_MAX_THREADS];
+    int i;
+
+    for (i = 0; i < (nThreads - 1); i++) {
+        jobs[i].func = func;
+        jobs[i].pArg = (unsigned char *)pArgs + (i * nArgSize);
+
+#ifdef _WIN32
+        threads[i] = CreateThread(NULL, 0, apultra_thread_entry, &jobs[i], 0, NULL);
+        nStarted[i] = (threads[i] != NULL) ? 1 : 0;
+#else
+        nStarted[i] = (pthread_create(&threads[i], NULL, apultra_thread_entry, &jobs[i]) == 0) ? 1 : 0;
+#endif
+        if (!nStarted[i]) func(jobs[i].pArg);
+    }
+
+    if (nThreads > 0) func((unsigned char *)pArgs + ((nThreads - 1) * nArgSize));
+
+    for (i = 0; i < (nThreads - 1); i++) {
+        if (nStarted[i]) {
+#ifdef _WIN32
+            WaitForSingleObject(threads[i], INFINITE);
+            CloseHandle(threads[i]);
+#else
+            pthread_join(threads[i], NULL);
+#endif
+        }
+    }
+}
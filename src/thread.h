@@ -0,0 +1,60 @@
+/*
+ * thread.h - worker thread definitions
+ *
+ * Copyright (C) 2019 Emmanuel Marty
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+/*
+ * Uses the libdivsufsort library Copyright (c) 2003-2008 Yuta Mori
+ *
+ * Inspired by cap by Sven-�ke Dahl. https://github.com/svendahl/cap
+ * Also inspired by Charles Bloom's compression blog. http://cbloomrants.blogspot.com/
+ * With ideas from LZ4 by Yann Collet. https://github.com/lz4/lz4
+ * With help and support from spke <zxintrospec@gmail.com>
+ *
+ */
+
+#ifndef _THREAD_H
+#define _THREAD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Maximum number of threads that apultra_run_threads() can run at once */
+#define APULTRA_MAX_THREADS 64
+
+/**
+ * Run a function for each element of an array of arguments, concurrently, and wait for all of them to finish
+ *
+ * The last element is processed by the calling thread. If a thread can't be started, its element is processed by
+ * the calling thread as well, so that all elements are always processed.
+ *
+ * @param func function to run
+ * @param pArgs array of arguments, one per thread
+ * @param nArgSize size of each argument, in bytes
+ * @param nThreads number of elements in pArgs (1..APULTRA_MAX_THREADS)
+ */
+void apultra_run_threads(void (*func)(void *pArg), void *pArgs, const int nArgSize, const int nThreads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _THREAD_H */
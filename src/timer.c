@@ -0,0 +1,62 @@
+/*
+ * timer.c - high resolution timer implementation
+ *
+ * Copyright (C) 2019 Emmanuel Marty
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+/*
+ * Uses the libdivsufsort library Copyright (c) 2003-2008 Yuta Mori
+ *
+ * Inspired by cap by Sven-�ke Dahl. https://github.com/svendahl/cap
+ * Also inspired by Charles Bloom's compression blog. http://cbloomrants.blogspot.com/
+ * With ideas from LZ4 by Yann Collet. https://github.com/lz4/lz4
+ * With help and support from spke <zxintrospec@gmail.com>
+ *
+ */
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include "timer.h"
+
+/**
+ * Get the current value of a monotonic, high resolution clock
+ *
+ * @return current time, in nanoseconds, from an arbitrary starting point
+ */
+long long apultra_get_time_ns(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER hpc_frequency;
+    LARGE_INTEGER nCurTime;
+
+    if (!hpc_frequency.QuadPart) {
+        if (!QueryPerformanceFrequency(&hpc_frequency)) return 0;
+    }
+
+    QueryPerformanceCounter(&nCurTime);
+    return (long long)((double)nCurTime.QuadPart * 1000000000.0 / (double)hpc_frequency.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + (long long)ts.tv_nsec;
+#endif
+}